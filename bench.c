@@ -0,0 +1,541 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "lib_tar.h"
+
+/**
+ * Benchmarks for lib_tar. Run with `make bench`.
+ *
+ * Every archive shape is generated deterministically, then each public
+ * function is timed on it. Results are printed as a JSON array, one object per
+ * measurement, with the number of syscalls lib_tar issued per operation.
+ *
+ * Usage: ./bench [shape...]
+ *
+ * The "stream" bench only runs when named: ./bench stream
+ *
+ * The "many" and "bigfiles" shapes (100k small files, 4 files of 256 MiB)
+ * are only extracted, with tar_extract() and with GNU tar.
+ */
+
+#define BENCH_ARCHIVE "bench.tar"
+#define BENCH_OUT "bench_out"
+#define SAMPLES 64
+#define MIN_NS 100e6              /* run each measurement for at least 100 ms... */
+#define MIN_OPS 3                 /* ... and at least this many operations */
+#define MAX_OPS 2000000
+#define STREAM_MIB 10240          /* size of each member of the stream bench */
+#define STREAM_CHUNK (64 * 1024)
+
+/*
+ * Syscall accounting. The bench is linked with --wrap for these functions, so
+ * every call lib_tar makes to them goes through a counter.
+ */
+static uint64_t syscalls;
+
+ssize_t __real_read(int fd, void *buf, size_t count);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+off_t __real_lseek(int fd, off_t offset, int whence);
+ssize_t __real_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags);
+
+ssize_t __wrap_read(int fd, void *buf, size_t count) {
+    syscalls++;
+    return __real_read(fd, buf, count);
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    syscalls++;
+    return __real_pread(fd, buf, count, offset);
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence) {
+    syscalls++;
+    return __real_lseek(fd, offset, whence);
+}
+
+ssize_t __wrap_copy_file_range(int fd_in, off_t *off_in, int fd_out, off_t *off_out, size_t len, unsigned int flags) {
+    syscalls++;
+    return __real_copy_file_range(fd_in, off_in, fd_out, off_out, len, flags);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The generator, and a reservoir sample of the paths it wrote for each kind of entry. */
+typedef struct generator {
+    int fd;
+    uint64_t rng;
+    size_t entries;
+    int nfiles, ndirs, nlinks;
+    char files[SAMPLES][257];
+    char dirs[SAMPLES][257];
+    char links[SAMPLES][257];
+} generator_t;
+
+/* xorshift64*, so that every run generates the same archives. */
+static uint64_t next_random(generator_t *g) {
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+    return g->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static void sample(generator_t *g, char samples[][257], int *seen, const char *path) {
+    int slot = (*seen)++;
+    if (slot >= SAMPLES) slot = next_random(g) % *seen;
+    if (slot < SAMPLES) snprintf(samples[slot], 257, "%s", path);
+}
+
+/**
+ * Writes a ustar header followed by `size` bytes of data and its padding.
+ * Paths longer than 100 bytes are split between the prefix and name fields.
+ */
+static void write_member(generator_t *g, const char *path, char typeflag, size_t size, const char *linkname) {
+    tar_header_t header;
+    size_t len = strlen(path);
+
+    memset(&header, 0, sizeof(header));
+    if (len <= sizeof(header.name)) {
+        memcpy(header.name, path, len);
+    } else {
+        // Split at the first slash that leaves at most 100 bytes for the name.
+        const char *split = strchr(path + len - sizeof(header.name) - 1, '/');
+        memcpy(header.prefix, path, split - path);
+        memcpy(header.name, split + 1, len - (split - path) - 1);
+    }
+    if (linkname) snprintf(header.linkname, sizeof(header.linkname), "%s", linkname);
+    snprintf(header.mode, sizeof(header.mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    snprintf(header.size, sizeof(header.size), "%011lo", (unsigned long) size);
+    snprintf(header.mtime, sizeof(header.mtime), "%011o", 1700000000);
+    header.typeflag = typeflag;
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+
+    unsigned int sum = 0;
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    for (size_t i = 0; i < sizeof(header); i++) sum += ((unsigned char *) &header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    write(g->fd, &header, sizeof(header));
+
+    static uint8_t block[1 << 20];
+    memset(block, 'x', sizeof(block));
+    size_t padded = (size + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    for (size_t done = 0; done < padded; ) {
+        size_t n = padded - done < sizeof(block) ? padded - done : sizeof(block);
+        write(g->fd, block, n);
+        done += n;
+    }
+
+    g->entries++;
+    if (typeflag == DIRTYPE) sample(g, g->dirs, &g->ndirs, path);
+    else if (typeflag == SYMTYPE) sample(g, g->links, &g->nlinks, path);
+    else sample(g, g->files, &g->nfiles, path);
+}
+
+/* Many tiny files (0 to 1 KiB) spread over 200 directories. */
+static void gen_tiny(generator_t *g) {
+    char path[64];
+    for (int d = 0; d < 200; d++) {
+        snprintf(path, sizeof(path), "tiny%03d/", d);
+        write_member(g, path, DIRTYPE, 0, NULL);
+        for (int f = 0; f < 100; f++) {
+            snprintf(path, sizeof(path), "tiny%03d/file%04d.txt", d, f);
+            write_member(g, path, REGTYPE, next_random(g) % 1024, NULL);
+        }
+    }
+}
+
+/* A few huge files. */
+static void gen_huge(generator_t *g) {
+    char path[64];
+    write_member(g, "huge/", DIRTYPE, 0, NULL);
+    for (int f = 0; f < 4; f++) {
+        snprintf(path, sizeof(path), "huge/file%d.bin", f);
+        write_member(g, path, REGTYPE, 64 << 20, NULL);
+    }
+}
+
+/* Deep trees: 50 chains of 40 nested directories, with a file at each level. */
+static void gen_deep(generator_t *g) {
+    char path[257], file[264];
+    for (int t = 0; t < 50; t++) {
+        int len = snprintf(path, sizeof(path), "deep%02d/", t);
+        write_member(g, path, DIRTYPE, 0, NULL);
+        for (int level = 0; level < 40; level++) {
+            snprintf(file, sizeof(file), "%sf.txt", path);
+            write_member(g, file, REGTYPE, 10, NULL);
+            len += snprintf(path + len, sizeof(path) - len, "d%d/", level % 10);
+            write_member(g, path, DIRTYPE, 0, NULL);
+        }
+    }
+}
+
+/* A single directory with 20000 children. */
+static void gen_wide(generator_t *g) {
+    char path[64];
+    write_member(g, "wide/", DIRTYPE, 0, NULL);
+    for (int f = 0; f < 20000; f++) {
+        snprintf(path, sizeof(path), "wide/entry%06d", f);
+        write_member(g, path, REGTYPE, 0, NULL);
+    }
+}
+
+/* Paths of 150 to 250 bytes, which need the ustar prefix field. */
+static void gen_longnames(generator_t *g) {
+    char dir[160], path[257];
+    for (int d = 0; d < 10; d++) {
+        int dir_len = 100 + d * 5;
+        memset(dir, 'p', dir_len);
+        snprintf(dir + dir_len - 4, 5, "%02d_/", d);
+        write_member(g, dir, DIRTYPE, 0, NULL);
+        for (int f = 0; f < 500; f++) {
+            int name_len = 40 + next_random(g) % 50;
+            memcpy(path, dir, dir_len);
+            memset(path + dir_len, 'n', name_len);
+            snprintf(path + dir_len + name_len, sizeof(path) - dir_len - name_len, "%04d", f);
+            write_member(g, path, REGTYPE, 100, NULL);
+        }
+    }
+}
+
+/* Chains of 5 symlinks ending at a file. */
+static void gen_symlinks(generator_t *g) {
+    char path[64], target[64];
+    write_member(g, "links/", DIRTYPE, 0, NULL);
+    for (int c = 0; c < 1000; c++) {
+        snprintf(path, sizeof(path), "links/target%04d", c);
+        write_member(g, path, REGTYPE, 100, NULL);
+        for (int l = 0; l < 5; l++) {
+            if (l == 0) snprintf(target, sizeof(target), "target%04d", c);
+            else snprintf(target, sizeof(target), "link%04d_%d", c, l - 1);
+            snprintf(path, sizeof(path), "links/link%04d_%d", c, l);
+            write_member(g, path, SYMTYPE, 0, target);
+        }
+    }
+}
+
+typedef struct shape {
+    const char *name;
+    void (*generate)(generator_t *g);
+} shape_t;
+
+static const shape_t shapes[] = {
+    { "tiny", gen_tiny },
+    { "huge", gen_huge },
+    { "deep", gen_deep },
+    { "wide", gen_wide },
+    { "longnames", gen_longnames },
+    { "symlinks", gen_symlinks },
+};
+
+/* 100000 small files (0 to 4 KiB) over 1000 directories. */
+static void gen_many(generator_t *g) {
+    char path[64];
+    for (int d = 0; d < 1000; d++) {
+        snprintf(path, sizeof(path), "many%04d/", d);
+        write_member(g, path, DIRTYPE, 0, NULL);
+        for (int f = 0; f < 100; f++) {
+            snprintf(path, sizeof(path), "many%04d/file%04d.bin", d, f);
+            write_member(g, path, REGTYPE, next_random(g) % 4096, NULL);
+        }
+    }
+}
+
+/* 4 files of 256 MiB. */
+static void gen_bigfiles(generator_t *g) {
+    char path[64];
+    for (int f = 0; f < 4; f++) {
+        snprintf(path, sizeof(path), "big%d.bin", f);
+        write_member(g, path, REGTYPE, (size_t) 256 << 20, NULL);
+    }
+}
+
+/* Shapes that are only extracted. */
+static const shape_t extract_shapes[] = {
+    { "many", gen_many },
+    { "bigfiles", gen_bigfiles },
+};
+
+/* Everything an operation needs. `i` rotates through the samples. */
+typedef struct bench_ctx {
+    int fd;
+    tar_handle_t *h;
+    generator_t *g;
+    char **entries;                /* buffers for list() */
+    size_t no_entries;
+    uint8_t *buf;
+    size_t buf_len;
+} bench_ctx_t;
+
+typedef int (*bench_op_t)(bench_ctx_t *ctx, int i);
+
+/* The fd API expects the descriptor at the start of the archive. Not counted. */
+static void rewind_fd(bench_ctx_t *ctx) {
+    __real_lseek(ctx->fd, 0, SEEK_SET);
+}
+
+static char *pick(char samples[][257], int seen, int i) {
+    int n = seen < SAMPLES ? seen : SAMPLES;
+    return n ? samples[i % n] : "";
+}
+
+#define FILE_SAMPLE(ctx, i) pick((ctx)->g->files, (ctx)->g->nfiles, i)
+#define DIR_SAMPLE(ctx, i) pick((ctx)->g->dirs, (ctx)->g->ndirs, i)
+#define LINK_SAMPLE(ctx, i) pick((ctx)->g->links, (ctx)->g->nlinks, i)
+
+static int op_check_archive(bench_ctx_t *ctx, int i) { rewind_fd(ctx); return check_archive(ctx->fd) >= 0; }
+static int op_exists(bench_ctx_t *ctx, int i) { rewind_fd(ctx); return exists(ctx->fd, FILE_SAMPLE(ctx, i)); }
+static int op_exists_miss(bench_ctx_t *ctx, int i) { rewind_fd(ctx); return exists(ctx->fd, "no/such/entry"); }
+static int op_is_dir(bench_ctx_t *ctx, int i) { rewind_fd(ctx); return is_dir(ctx->fd, DIR_SAMPLE(ctx, i)); }
+static int op_is_file(bench_ctx_t *ctx, int i) { rewind_fd(ctx); return is_file(ctx->fd, FILE_SAMPLE(ctx, i)); }
+static int op_is_symlink(bench_ctx_t *ctx, int i) { rewind_fd(ctx); return is_symlink(ctx->fd, LINK_SAMPLE(ctx, i)); }
+
+static int op_list(bench_ctx_t *ctx, int i) {
+    size_t no_entries = ctx->no_entries;
+    rewind_fd(ctx);
+    return list(ctx->fd, DIR_SAMPLE(ctx, i), ctx->entries, &no_entries);
+}
+
+static int op_read_file(bench_ctx_t *ctx, int i) {
+    size_t len = ctx->buf_len;
+    rewind_fd(ctx);
+    return read_file(ctx->fd, FILE_SAMPLE(ctx, i), 0, ctx->buf, &len) >= 0;
+}
+
+static int op_tar_exists(bench_ctx_t *ctx, int i) { return tar_exists(ctx->h, FILE_SAMPLE(ctx, i)); }
+static int op_tar_exists_miss(bench_ctx_t *ctx, int i) { return tar_exists(ctx->h, "no/such/entry"); }
+static int op_tar_is_dir(bench_ctx_t *ctx, int i) { return tar_is_dir(ctx->h, DIR_SAMPLE(ctx, i)); }
+static int op_tar_is_file(bench_ctx_t *ctx, int i) { return tar_is_file(ctx->h, FILE_SAMPLE(ctx, i)); }
+static int op_tar_is_symlink(bench_ctx_t *ctx, int i) { return tar_is_symlink(ctx->h, LINK_SAMPLE(ctx, i)); }
+
+static int op_tar_list(bench_ctx_t *ctx, int i) {
+    tar_list_t result;
+    int ret = tar_list_arena(ctx->h, DIR_SAMPLE(ctx, i), &result);
+    tar_list_free(&result);
+    return ret;
+}
+
+static int op_tar_read_file(bench_ctx_t *ctx, int i) {
+    size_t len = ctx->buf_len;
+    return tar_read_file(ctx->h, FILE_SAMPLE(ctx, i), 0, ctx->buf, &len) >= 0;
+}
+
+static int first_result = 1;
+
+/* Prints one JSON object of the result array. */
+static void emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char *fmt, ...) {
+    va_list args;
+    printf("%s\n  {", first_result ? "[" : ",");
+    first_result = 0;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("}");
+    fflush(stdout);
+}
+
+static void run(bench_ctx_t *ctx, const char *shape, const char *api, const char *name, bench_op_t op) {
+    uint64_t ops = 0, hits = 0;
+    uint64_t start_syscalls = syscalls;
+    double start = now_ns(), elapsed;
+
+    do {
+        hits += op(ctx, ops) > 0;
+        ops++;
+        elapsed = now_ns() - start;
+    } while ((elapsed < MIN_NS || ops < MIN_OPS) && ops < MAX_OPS);
+
+    emit("\"bench\": \"%s\", \"shape\": \"%s\", \"api\": \"%s\", \"ops\": %lu, \"hits\": %lu, "
+         "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, \"syscalls_per_op\": %.2f",
+         name, shape, api, (unsigned long) ops, (unsigned long) hits, elapsed / ops, ops * 1e9 / elapsed,
+         (double) (syscalls - start_syscalls) / ops);
+}
+
+/* Extracts the archive with tar_extract() and with GNU tar. */
+static void run_extract(bench_ctx_t *ctx, const char *shape) {
+    system("rm -rf " BENCH_OUT);
+    uint64_t start_syscalls = syscalls;
+    double start = now_ns();
+    int failures = tar_extract(ctx->h, BENCH_OUT, NULL);
+    double lib_ns = now_ns() - start;
+    uint64_t lib_syscalls = syscalls - start_syscalls;
+
+    system("rm -rf " BENCH_OUT " && mkdir " BENCH_OUT);
+    start = now_ns();
+    int status = system("tar -xf " BENCH_ARCHIVE " -C " BENCH_OUT);
+    double gnu_ns = now_ns() - start;
+    system("rm -rf " BENCH_OUT);
+
+    emit("\"bench\": \"extract\", \"shape\": \"%s\", \"api\": \"handle\", \"ns\": %.0f, \"syscalls\": %lu, "
+         "\"failures\": %d, \"gnu_tar_ns\": %.0f, \"gnu_tar_status\": %d",
+         shape, lib_ns, (unsigned long) lib_syscalls, failures, gnu_ns, status);
+}
+
+/* Writes the archive of `shape` to BENCH_ARCHIVE. */
+static void generate(const shape_t *shape, generator_t *g) {
+    g->fd = open(BENCH_ARCHIVE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (g->fd == -1) {
+        perror("open(" BENCH_ARCHIVE ")");
+        exit(1);
+    }
+    shape->generate(g);
+    uint8_t zero[2 * BLOCK_SIZE] = {0};
+    write(g->fd, zero, sizeof(zero));
+    close(g->fd);
+}
+
+static void bench_extract_shape(const shape_t *shape) {
+    generator_t g = { .rng = 0x9e3779b97f4a7c15ULL };
+    bench_ctx_t ctx = { .g = &g };
+
+    generate(shape, &g);
+    ctx.fd = open(BENCH_ARCHIVE, O_RDONLY);
+    ctx.h = tar_open(ctx.fd, NULL);
+    run_extract(&ctx, shape->name);
+    tar_close(ctx.h);
+    close(ctx.fd);
+    unlink(BENCH_ARCHIVE);
+}
+
+static void bench_shape(const shape_t *shape) {
+    generator_t g = { .rng = 0x9e3779b97f4a7c15ULL };
+    bench_ctx_t ctx = { .g = &g, .no_entries = 20000, .buf_len = 1 << 20 };
+
+    generate(shape, &g);
+
+    ctx.fd = open(BENCH_ARCHIVE, O_RDONLY);
+    ctx.buf = malloc(ctx.buf_len);
+    ctx.entries = malloc(ctx.no_entries * sizeof(char *));
+    for (size_t i = 0; i < ctx.no_entries; i++) ctx.entries[i] = calloc(1, 257);
+
+    run(&ctx, shape->name, "fd", "check_archive", op_check_archive);
+    run(&ctx, shape->name, "fd", "exists", op_exists);
+    run(&ctx, shape->name, "fd", "exists_miss", op_exists_miss);
+    run(&ctx, shape->name, "fd", "is_dir", op_is_dir);
+    run(&ctx, shape->name, "fd", "is_file", op_is_file);
+    run(&ctx, shape->name, "fd", "is_symlink", op_is_symlink);
+    run(&ctx, shape->name, "fd", "list", op_list);
+    run(&ctx, shape->name, "fd", "read_file", op_read_file);
+
+    uint64_t start_syscalls = syscalls;
+    double start = now_ns();
+    ctx.h = tar_open(ctx.fd, NULL);
+    double open_ns = now_ns() - start;
+    tar_index_info_t info;
+    tar_get_index_info(ctx.h, &info);
+    emit("\"bench\": \"tar_open\", \"shape\": \"%s\", \"api\": \"handle\", \"entries\": %zu, \"ns\": %.0f, "
+         "\"syscalls\": %lu, \"index_bytes_per_entry\": %.1f, \"path_bytes_per_entry\": %.1f",
+         shape->name, info.entries, open_ns, (unsigned long) (syscalls - start_syscalls),
+         (double) (info.index_bytes - info.arena_bytes) / info.entries, (double) info.arena_bytes / info.entries);
+
+    run(&ctx, shape->name, "handle", "exists", op_tar_exists);
+    run(&ctx, shape->name, "handle", "exists_miss", op_tar_exists_miss);
+    run(&ctx, shape->name, "handle", "is_dir", op_tar_is_dir);
+    run(&ctx, shape->name, "handle", "is_file", op_tar_is_file);
+    run(&ctx, shape->name, "handle", "is_symlink", op_tar_is_symlink);
+    run(&ctx, shape->name, "handle", "list", op_tar_list);
+    run(&ctx, shape->name, "handle", "read_file", op_tar_read_file);
+    run_extract(&ctx, shape->name);
+
+    tar_close(ctx.h);
+    for (size_t i = 0; i < ctx.no_entries; i++) free(ctx.entries[i]);
+    free(ctx.entries);
+    free(ctx.buf);
+    close(ctx.fd);
+    unlink(BENCH_ARCHIVE);
+}
+
+/* Reads the members of the stream archive in chunks, each from the start to the end. */
+static void run_stream(int fd, const char *pattern, int flags, size_t size, uint8_t *buf) {
+    char *members[] = { "stream/a.bin", "stream/b.bin" };
+    int interleaved = strcmp(pattern, "interleaved") == 0;
+    uint64_t chunks = 0, bytes = 0;
+
+    // Start from a cold page cache, or there is nothing to read ahead of.
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    tar_options_t opts = { .flags = flags };
+    tar_handle_t *h = tar_open(fd, &opts);
+    uint64_t start_syscalls = syscalls;
+    double start = now_ns();
+
+    for (int m = 0; m < 2; m += interleaved ? 2 : 1) {
+        for (size_t offset = 0; offset < size; offset += STREAM_CHUNK) {
+            for (int k = m; k < (interleaved ? 2 : m + 1); k++) {
+                size_t len = STREAM_CHUNK;
+                if (tar_read_file(h, members[k], offset, buf, &len) < 0) break;
+                chunks++;
+                bytes += len;
+            }
+        }
+    }
+    double elapsed = now_ns() - start;
+    tar_close(h);
+
+    emit("\"bench\": \"read_chunks\", \"shape\": \"stream\", \"api\": \"handle\", \"pattern\": \"%s\", "
+         "\"readahead\": %d, \"member_mib\": %zu, \"chunk_kib\": %d, \"mib_per_sec\": %.1f, \"syscalls_per_op\": %.2f",
+         pattern, !(flags & TAR_OPEN_NO_READAHEAD), size >> 20, STREAM_CHUNK >> 10,
+         bytes / (elapsed / 1e9) / (1 << 20), (double) (syscalls - start_syscalls) / chunks);
+}
+
+/*
+ * Chunked sequential reads of two huge members, one after the other and then
+ * both at once, with and without readahead. Only run when named, as the
+ * members take BENCH_STREAM_MIB MiB each (10 GiB by default).
+ */
+static void bench_stream(void) {
+    const char *env = getenv("BENCH_STREAM_MIB");
+    size_t size = (env ? strtoull(env, NULL, 10) : STREAM_MIB) << 20;
+    generator_t g = { .rng = 0x9e3779b97f4a7c15ULL };
+
+    g.fd = open(BENCH_ARCHIVE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (g.fd == -1) {
+        perror("open(" BENCH_ARCHIVE ")");
+        exit(1);
+    }
+    write_member(&g, "stream/", DIRTYPE, 0, NULL);
+    write_member(&g, "stream/a.bin", REGTYPE, size, NULL);
+    write_member(&g, "stream/b.bin", REGTYPE, size, NULL);
+    uint8_t zero[2 * BLOCK_SIZE] = {0};
+    write(g.fd, zero, sizeof(zero));
+    fsync(g.fd);
+    close(g.fd);
+
+    int fd = open(BENCH_ARCHIVE, O_RDONLY);
+    uint8_t *buf = malloc(STREAM_CHUNK);
+    const char *patterns[] = { "sequential", "interleaved" };
+    for (int p = 0; p < 2; p++) {
+        run_stream(fd, patterns[p], TAR_OPEN_NO_READAHEAD, size, buf);
+        run_stream(fd, patterns[p], 0, size, buf);
+    }
+    free(buf);
+    close(fd);
+    unlink(BENCH_ARCHIVE);
+}
+
+int main(int argc, char **argv) {
+    for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) selected |= strcmp(argv[a], shapes[s].name) == 0;
+        if (selected) bench_shape(&shapes[s]);
+    }
+    for (size_t s = 0; s < sizeof(extract_shapes) / sizeof(extract_shapes[0]); s++) {
+        int selected = argc < 2;
+        for (int a = 1; a < argc; a++) selected |= strcmp(argv[a], extract_shapes[s].name) == 0;
+        if (selected) bench_extract_shape(&extract_shapes[s]);
+    }
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "stream") == 0) bench_stream();
+    }
+    printf("%s\n", first_result ? "[]" : "\n]");
+    return 0;
+}
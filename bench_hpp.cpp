@@ -0,0 +1,109 @@
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "lib_tar.hpp"
+
+/**
+ * Compares lib_tar.hpp with the C functions it wraps. Run with `make bench_hpp`.
+ *
+ * Every operation is run on every entry of the archive, once through the C
+ * API with NUL-terminated paths and once through tar::archive with string
+ * views. Results are printed as a JSON array like bench.c.
+ *
+ * Usage: ./bench_hpp tar_file
+ */
+
+#define MIN_NS 100e6              /* run each measurement for at least 100 ms */
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Keeps the compiler from dropping the results. */
+static volatile uint64_t sink;
+
+static bool first_result = true;
+
+/* Runs `op` on every path until MIN_NS have passed, and prints the time per call. */
+template <typename Op>
+static void run(const char *api, const char *name, size_t npaths, Op op) {
+    uint64_t ops = 0, acc = 0;
+    double start = now_ns(), elapsed;
+
+    do {
+        for (size_t i = 0; i < npaths; i++) acc += op(i);
+        ops += npaths;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_NS);
+    sink = acc;
+
+    std::printf("%s\n  {\"bench\": \"%s\", \"api\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.1f}",
+                first_result ? "[" : ",", name, api, (unsigned long) ops, elapsed / ops);
+    first_result = false;
+    std::fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::printf("Usage: %s tar_file\n", argv[0]);
+        return -1;
+    }
+
+    tar::archive ar(argv[1], TAR_OPEN_MMAP);
+    tar_handle_t *h = ar.handle();
+    std::vector<std::string> paths;
+    for (const tar::entry &e : ar.entries()) paths.emplace_back(e.path());
+    std::vector<std::string_view> views(paths.begin(), paths.end());
+    size_t n = paths.size();
+    static uint8_t buf[4096];
+
+    run("c", "exists", n, [&](size_t i) { return tar_exists(h, paths[i].data()); });
+    run("cpp", "exists", n, [&](size_t i) { return ar.exists(views[i]); });
+
+    run("c", "stat", n, [&](size_t i) {
+        tar_stat_t st;
+        return tar_stat(h, paths[i].data(), &st) ? st.size : 0;
+    });
+    run("cpp", "stat", n, [&](size_t i) {
+        auto st = ar.stat(views[i]);
+        return st ? st->size : 0;
+    });
+
+    run("c", "read", n, [&](size_t i) {
+        size_t len = sizeof(buf);
+        return tar_read_file(h, paths[i].data(), 0, buf, &len) >= 0 ? len : 0;
+    });
+    run("cpp", "read", n, [&](size_t i) {
+        auto len = ar.read(views[i], std::as_writable_bytes(std::span(buf)));
+        return len ? *len : 0;
+    });
+
+    run("c", "view", n, [&](size_t i) {
+        const uint8_t *data;
+        uint64_t size;
+        return tar_view_file(h, paths[i].data(), &data, &size) == 0 ? size : 0;
+    });
+    run("cpp", "view", n, [&](size_t i) {
+        auto data = ar.view(views[i]);
+        return data ? data->size() : 0;
+    });
+
+    // One op is a walk over the whole archive.
+    run("c", "walk", 1, [&](size_t) {
+        tar_walk_t w;
+        uint64_t len = 0;
+        for (int more = tar_walk_first(h, &w); more; more = tar_walk_next(&w)) len += w.len;
+        return len;
+    });
+    run("cpp", "walk", 1, [&](size_t) {
+        uint64_t len = 0;
+        for (const tar::entry &e : ar.entries()) len += e.path().size();
+        return len;
+    });
+    std::printf("\n]\n");
+    return 0;
+}
@@ -1,4 +1,27 @@
-#include "lib_tar.h"
+#include "tar_internal.h"
+
+/*
+ * pread() and lseek() on the archive, accounted in the statistics of the
+ * file descriptor API and traced by its probes. Reads of a whole header
+ * count as parsed headers. Header scans read through tar_header_scan_t.
+ */
+static ssize_t stats_pread(int fd, void *buf, size_t len, off_t offset) {
+  TAR_PROBE3(io_submit, fd, offset, len);
+  ssize_t n = pread(fd, buf, len, offset);
+  TAR_PROBE3(io_complete, fd, offset, n);
+  TAR_STATS_ADD(&tar_global_stats, syscalls, 1);
+  if (n > 0) TAR_STATS_ADD(&tar_global_stats, bytes_read, n);
+  if (n == BLOCK_SIZE && len == BLOCK_SIZE) {
+    TAR_STATS_ADD(&tar_global_stats, headers_parsed, 1);
+    TAR_PROBE3(header_parsed, fd, offset, ((tar_header_t *) buf)->name);
+  }
+  return n;
+}
+
+static off_t stats_lseek(int fd, off_t offset, int whence) {
+  TAR_STATS_ADD(&tar_global_stats, syscalls, 1);
+  return lseek(fd, offset, whence);
+}
 
 /**
  * Cheks whether the archive is valid.
@@ -16,12 +39,12 @@
  *         -3 if the archive contains a header with an invalid checksum size
  */
 
-int check_chksum(tar_header_t header) {
+int check_chksum(const tar_header_t *header) {
   int i;
   int checksum = 0;
 
   for (i = 0; i < 512; i++) {
-    char c = ((char*)&header)[i];
+    char c = ((const char*)header)[i];
     if (i < 148 || i > 155) {
       // On prend en compte tous les octets de l'en-tête sauf les 8 octets
       // du champ checksum
@@ -34,34 +57,77 @@ int check_chksum(tar_header_t header) {
 
   // On convertit le checksum en octal et on le compare au checksum stocké
   // dans l'en-tête
-  int stored_chksum = TAR_INT(header.chksum);
+  int stored_chksum = TAR_INT(header->chksum);
   return (checksum == stored_chksum);
 }
 
+/* Pax extended headers describe the member after them, or the whole archive: they are not members. */
+static int is_member(const tar_header_t *header) {
+  return header->typeflag != XHDTYPE && header->typeflag != XGLTYPE;
+}
+
 int check_archive(int tar_fd) {
-  tar_header_t header;
+  tar_header_scan_t scan;
+  const tar_header_t *header;
+  off_t off;
+  TAR_STATS_TIME(&tar_global_stats, TAR_OP_CHECK_ARCHIVE);
 
-  int size = read(tar_fd, &header, sizeof(tar_header_t));
-  if (size < 0)
-  {
-    perror("Error");
-    return -1;
-  }
+  // Headers are checked from the current offset, a window of the archive at a time.
+  off_t start = stats_lseek(tar_fd, 0, SEEK_CUR);
+  if (start < 0) return -1;
+  tar_header_scan_open(&scan, NULL, tar_fd, start);
 
   int num_headers = 0;
-  while (size > 0) {
-    if (strncmp(header.magic, TMAGIC, TMAGLEN) != 0) return -1;
-    if (strncmp(header.version, TVERSION, TVERSLEN) != 0) return -2;
-    if (!check_chksum(header)) return -3;
-    num_headers++;
-    size = read(tar_fd, &header, sizeof(tar_header_t));
+  while ((header = tar_header_scan_next(&scan, &off))) {
+    if (strncmp(header->magic, TMAGIC, TMAGLEN) != 0) break;
+    if (strncmp(header->version, TVERSION, TVERSLEN) != 0) {
+      num_headers = -2;
+      break;
+    }
+    if (!check_chksum(header)) {
+      num_headers = -3;
+      break;
+    }
+    if (is_member(header)) num_headers++;
   }
-  if (size == 0) return num_headers;
+  // Stopping early on a bad magic value, or on a read error, gives -1
+  if (header && num_headers >= 0) num_headers = -1;
+  if (scan.error) num_headers = -1;
+  tar_header_scan_close(&scan);
+  return num_headers;
+}
 
-  // Return -1 if an error occurred while reading the tar archive
-  return -1;
+/* Compares a name field, which has no null when it is full, with `path`. */
+static int name_is(const tar_header_t *header, const char *path) {
+  size_t len = strnlen(header->name, sizeof(header->name));
+  return strncmp(header->name, path, len) == 0 && path[len] == '\0';
 }
 
+/**
+ * Looks for the first header named `path`, from `start`. The headers are read
+ * a window at a time and the member data are skipped without being read.
+ * Fires the lookup probes, as lookups on a handle do.
+ *
+ * @return 1 and copies the header to `found` and its offset to `found_off` if found,
+ *         0 otherwise.
+ */
+static int find_header(int tar_fd, off_t start, const char *path, tar_header_t *found, off_t *found_off) {
+  tar_header_scan_t scan;
+  const tar_header_t *header;
+  int ret = 0;
+
+  TAR_PROBE2(lookup_begin, path, strlen(path));
+  tar_header_scan_open(&scan, NULL, tar_fd, start);
+  while (!ret && (header = tar_header_scan_next(&scan, found_off))) {
+    if (is_member(header) && name_is(header, path)) {
+      memcpy(found, header, sizeof(*found));
+      ret = 1;
+    }
+  }
+  tar_header_scan_close(&scan);
+  TAR_PROBE2(lookup_end, path, ret);
+  return ret;
+}
 
 /**
  * Checks whether an entry exists in the archive and is a directory.
@@ -75,21 +141,11 @@ int check_archive(int tar_fd) {
 
 int exists(int tar_fd, char *path) {
     tar_header_t header;
-    // Read through the tar archive, one header at a time.
-    while (read(tar_fd, &header, sizeof(header)) > 0) {
-        // If the current header's name field matches the given path, return 1.
-        if (strcmp(header.name, path) == 0) {
-            return 1;
-        }
-        if (header.typeflag == REGTYPE || header.typeflag == AREGTYPE) {
-            off_t file_size = TAR_INT(header.size);
-            // Compute the number of padding blocks.
-            off_t blocks = (BLOCK_SIZE - (file_size % BLOCK_SIZE)) % BLOCK_SIZE;
-            // Seek past the data blocks and the padding blocks.
-            lseek(tar_fd, file_size + blocks, SEEK_CUR);
-        }
-    }
-    return 0;
+    off_t off;
+    TAR_STATS_TIME(&tar_global_stats, TAR_OP_EXISTS);
+    // Read through the tar archive from the current offset.
+    off_t start = stats_lseek(tar_fd, 0, SEEK_CUR);
+    return start >= 0 && find_header(tar_fd, start, path, &header, &off);
 }
 
 
@@ -103,49 +159,11 @@ int exists(int tar_fd, char *path) {
  *         any other size otherwise.
  */
 int is_dir(int tar_fd, char *path) {
-  // Check if the entry exists in the archive
-  if (!exists(tar_fd, path)) {
-    return 0;
-  }
-
-  // Reset file pointer to start of archive
-  lseek(tar_fd, 0, 0);
-
   tar_header_t header;
-  while (1) {
-    // Read in the header
-    size_t bytes_read = read(tar_fd, &header, sizeof(tar_header_t));
-    if (bytes_read == 0) {
-      // End of file reached, entry not found
-      return 0;
-    } else if (bytes_read < 0) {
-      // Error reading from file
-      return 0;
-    }
-
-    // Check if the header is null (all fields are set to null characters)
-    int null_header = 1;
-    for (size_t i = 0; i < sizeof(tar_header_t); i++) {
-      if (((char*)&header)[i] != '\0') {
-        null_header = 0;
-        break;
-      }
-    }
-    if (null_header) {
-      // Null header found, skip over it and continue
-      continue;
-    }
-
-    // Check if the header's path matches the given path and the typeflag is set to '5' for a directory
-    if (strcmp(header.name, path) == 0 && header.typeflag == '5') {
-      // Entry found and it is a directory
-      return 1;
-	}
-	// Skip over the file data
-	off_t file_size = TAR_INT(header.size);
-	off_t padding_size = (file_size % BLOCK_SIZE == 0) ? 0 : BLOCK_SIZE - (file_size % BLOCK_SIZE);
-	lseek(tar_fd, file_size + padding_size, 1);
-     }
+  off_t off;
+  TAR_STATS_TIME(&tar_global_stats, TAR_OP_IS_DIR);
+  // Check if the header's path matches the given path and the typeflag is set to '5' for a directory
+  return find_header(tar_fd, 0, path, &header, &off) && header.typeflag == DIRTYPE;
 }
 
 /**
@@ -158,35 +176,10 @@ int is_dir(int tar_fd, char *path) {
  *         any other size otherwise.
  */
 int is_symlink(int tar_fd, char *path) {
-  // Check if the entry exists in the tar archive
-  if (exists(tar_fd, path) == 0) {
-    return 0;
-  }
-
-  // Read the tar header for the entry
   tar_header_t header;
-  lseek(tar_fd, 0, SEEK_SET);
-  while (read(tar_fd, &header, BLOCK_SIZE) > 0) {
-    // Check if the name field of the header matches the given path
-    if (strcmp(header.name, path) == 0) {
-      // Check if the typeflag field is set to 'L'
-      if (header.typeflag == SYMTYPE) {
-        return 1;
-      } else {
-        return 0;
-      }
-    }
-
-    // Calculate the size of the entry in blocks
-    int size = TAR_INT(header.size);
-    int blocks = (size / BLOCK_SIZE) + ((size % BLOCK_SIZE) ? 1 : 0);
-
-    // Seek to the next entry in the tar archive
-    lseek(tar_fd, blocks * BLOCK_SIZE, SEEK_CUR);
-  }
-
-  // Return 0 if the entry was not found
-  return 0;
+  off_t off;
+  TAR_STATS_TIME(&tar_global_stats, TAR_OP_IS_SYMLINK);
+  return find_header(tar_fd, 0, path, &header, &off) && header.typeflag == SYMTYPE;
 }
 
 /**
@@ -198,29 +191,12 @@ int is_symlink(int tar_fd, char *path) {
  * @return zero if no entry at the given path exists in the archive or the entry is not a file,
  *         any other size otherwise.
  */
- int is_file(int tar_fd, char *path) {
+int is_file(int tar_fd, char *path) {
   tar_header_t header;
-
-  // seek to the start of the tar archive
-  lseek(tar_fd, 0, SEEK_SET);
-
-  // read through the archive, one block at a time
-  while (read(tar_fd, &header, BLOCK_SIZE) == BLOCK_SIZE) {
-    // check if the current entry is the one we're looking for
-    if (strcmp(header.name, path) == 0) {
-      // check if the entry is a file (typeflag '0' or '\0')
-      if (header.typeflag == '0' || header.typeflag == '\0') {
-        return 1;
-      } else {
-        return 0;
-      }
-    }
-
-    lseek(tar_fd, TAR_INT(header.size), 1);
-  }
-
-  // if we reach this point, it means the entry was not found
-  return 0;
+  off_t off;
+  TAR_STATS_TIME(&tar_global_stats, TAR_OP_IS_FILE);
+  // check if the entry is a file (typeflag '0' or '\0')
+  return find_header(tar_fd, 0, path, &header, &off) && (header.typeflag == REGTYPE || header.typeflag == AREGTYPE);
 }
 
 /**
@@ -246,6 +222,7 @@ int is_symlink(int tar_fd, char *path) {
  *         any other size otherwise.
  */
 int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
+  TAR_STATS_TIME(&tar_global_stats, TAR_OP_LIST);
   int count = 0;
   int index = 0; // Index for entries array
 
@@ -255,32 +232,37 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
     return 0;
   }
 
-  // Allocate memory for record
-  char *record = malloc(100);
-  if (!record) return -1;
+  // The last entry listed, a name field at most
+  char record[sizeof(((tar_header_t *) 0)->name) + 1];
   strcpy(record, "/"); // Initialize record to a value that cannot be the name of an entry
 
   while (1) {
     tar_header_t header;
-    if (pread(tar_fd, &header, sizeof(tar_header_t), count*sizeof(tar_header_t)) < 0) return -1;
+    if (stats_pread(tar_fd, &header, sizeof(tar_header_t), count*sizeof(tar_header_t)) < 0) return -1;
 
     // Check if header.name is equal to path
-    if (!strcmp(header.name, path)) {
+    if (is_member(&header) && !strcmp(header.name, path)) {
       // If header is a directory, list its entries
       if (header.typeflag == DIRTYPE) {
         int counter = count + 1; // Start with next header
         while (1) {
           tar_header_t entry;
-          if (pread(tar_fd, &entry, sizeof(tar_header_t), counter*sizeof(tar_header_t)) < 0) return -1;
+          if (stats_pread(tar_fd, &entry, sizeof(tar_header_t), counter*sizeof(tar_header_t)) < 0) return -1;
 
+          if (!is_member(&entry)) {
+            // Pax extended headers are skipped like member data
+          }
           // Check if entry is a sub-entry of the directory
-          if (!strncmp(entry.name, path, strlen(path))) {
+          else if (!strncmp(entry.name, path, strlen(path))) {
             // Check if entry has already been listed
             if (strncmp(entry.name, record, strlen(record))) {
               // If entry is not a sub-entry and has not been listed, copy it to entries array
               memcpy(entries[index], entry.name, strlen(entry.name));
               index++;
-              strcpy(record, entry.name); // Update record to the last listed entry
+              // Update record to the last listed entry, names fill their field without a null
+              size_t name_len = strnlen(entry.name, sizeof(entry.name));
+              memcpy(record, entry.name, name_len);
+              record[name_len] = '\0';
             }
           }
           // If header is not a symlink or a directory, return 1
@@ -311,7 +293,7 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
     // Check if end of tar archive has been reached
     if (!strlen((char *) &header)) {
       tar_header_t header2;
-      if (pread(tar_fd, &header2, sizeof(tar_header_t), (count+1)*sizeof(tar_header_t)) < 0) return -1;
+      if (stats_pread(tar_fd, &header2, sizeof(tar_header_t), (count+1)*sizeof(tar_header_t)) < 0) return -1;
       
       if (!strlen((char *) &header2)) {
         *no_entries = 0;
@@ -332,48 +314,23 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries) {
 
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len) {
   tar_header_t header;
+  off_t off;
+  TAR_STATS_TIME(&tar_global_stats, TAR_OP_READ_FILE);
 
-  // seek to the start of the tar archive
-  lseek(tar_fd, 0, SEEK_SET);
-
-  // read through the archive, one block at a time
-  while (read(tar_fd, &header, BLOCK_SIZE) == BLOCK_SIZE) {
-    // check if the current entry is the one we're looking for
-    if (strcmp(header.name, path) == 0) {
-      // check if the entry is a file (typeflag '0' or '\0') or a symlink (typeflag 'L')
-      if (header.typeflag == '0' || header.typeflag == '\0' || header.typeflag == SYMTYPE) {
-        // check if the offset is within the file bounds
-        int file_size = TAR_INT(header.size);
-        if (offset > file_size) {
-          return -2;
-        }
-
-        // Seek to the correct position in the file.
-        if (lseek(tar_fd, offset, SEEK_CUR) < 0) {
-          return -1;
-        }
-
-        // Read the file into the destination buffer.
-        ssize_t bytes_read = read(tar_fd, dest, *len);
-        if (bytes_read < 0) {
-          return -1;
-        }
-        *len = bytes_read;
+  if (!find_header(tar_fd, 0, path, &header, &off)) return -1;
+  // check if the entry is a file (typeflag '0' or '\0') or a symlink
+  if (!(header.typeflag == REGTYPE || header.typeflag == AREGTYPE || header.typeflag == SYMTYPE)) return -1;
 
-        // Check if we have read the entire file.
-        if (bytes_read < file_size - offset) {
-          return file_size - offset - bytes_read;
-        } else {
-          return 0;
-        }
-      } else {
-        return -1;
-      }
-    }
+  // check if the offset is within the file bounds
+  uint64_t file_size = tar_parse_num(header.size, sizeof(header.size));
+  if (offset > file_size) return -2;
 
-    lseek(tar_fd, TAR_INT(header.size), 1);
-  }
+  // Read the file into the destination buffer, without going past its end.
+  size_t want = *len < file_size - offset ? *len : file_size - offset;
+  ssize_t bytes_read = want ? stats_pread(tar_fd, dest, want, off + BLOCK_SIZE + offset) : 0;
+  if (bytes_read < 0) return -1;
+  *len = bytes_read;
 
-  // if we reach this point, it means the entry was not found
-  return -1;
+  // The bytes left to reach the end of the file, zero once it was read entirely.
+  return file_size - offset - bytes_read;
 }
@@ -12,6 +12,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct posix_header
 {                              /* byte offset */
     char name[100];               /*   0 */
@@ -43,7 +47,13 @@ typedef struct posix_header
 #define AREGTYPE '\0'           /* regular file */
 #define LNKTYPE  '1'            /* link */
 #define SYMTYPE  '2'            /* reserved */
+#define CHRTYPE  '3'            /* character special */
+#define BLKTYPE  '4'            /* block special */
 #define DIRTYPE  '5'            /* directory */
+#define FIFOTYPE '6'            /* FIFO special */
+#define CONTTYPE '7'            /* contiguous file, a regular file */
+#define XHDTYPE  'x'            /* pax extended header for the next member */
+#define XGLTYPE  'g'            /* pax global extended header */
 
 #define BLOCK_SIZE 512
 /* Converts an ASCII-encoded octal-based number into a regular integer */
@@ -53,7 +63,7 @@ typedef struct posix_header
 * Vérifie si le chksum d'une archive tar est correct.
 */
 
-int check_chksum(tar_header_t header);
+int check_chksum(const tar_header_t *header);
 
 /**
  * Checks whether the archive is valid.
@@ -63,6 +73,13 @@ int check_chksum(tar_header_t header);
  *  - a version value of "00" and no null,
  *  - a correct checksum
  *
+ * Headers are found from the size of the member before them: member data
+ * are skipped, never checked as headers. The first null block ends the
+ * archive, whatever follows it.
+ *
+ * Pax extended headers are checked like the others, but describe the member
+ * after them: they are not counted, nor seen by the functions below.
+ *
  * @param tar_fd A file descriptor pointing to the start of a file supposed to contain a tar archive.
  *
  * @return a zero or positive value if the archive is valid, representing the number of non-null headers in the archive,
@@ -161,4 +178,717 @@ int list(int tar_fd, char *path, char **entries, size_t *no_entries);
  */
 ssize_t read_file(int tar_fd, char *path, size_t offset, uint8_t *dest, size_t *len);
 
+/*
+ * Handle API.
+ *
+ * The functions above take a raw file descriptor and rescan the archive on
+ * every call. A handle wraps the descriptor together with state that can be
+ * kept between calls, such as an optional block cache shared with other
+ * handles. The handle never moves the file offset of the descriptor.
+ *
+ * Concurrency. Every function taking a handle may be called from several
+ * threads at once on the same handle, except tar_close(), which must not
+ * overlap any other call and must come after every result borrowed from the
+ * handle (listings, walks, tar_view_file() data) is released or no longer
+ * used. Callbacks are called from the thread of the caller or from worker
+ * threads, one at a time. Caches may be shared by handles used in different
+ * threads. A writer, a list cursor and a walk belong to one thread at a time;
+ * an overlay may be read from several threads once its layers are added.
+ *
+ * The functions above that take a raw descriptor read it with pread() and do
+ * not move its file offset, so they may run concurrently on one descriptor.
+ * check_archive() and exists() start at that offset, though: a thread moving
+ * it (lseek(), read()) while they run changes what they see.
+ */
+
+typedef struct tar_cache tar_cache_t;
+typedef struct tar_handle tar_handle_t;
+
+/* Size of the slabs the block cache stores. */
+#define TAR_CACHE_SLAB_SIZE (64 * 1024)
+
+typedef struct tar_cache_stats {
+    uint64_t hits;                /* slab lookups served from memory */
+    uint64_t misses;              /* slab lookups that went to the kernel */
+    uint64_t evictions;           /* slabs recycled to make room */
+    size_t bytes_used;            /* memory currently held by slabs */
+    size_t budget;                /* configured memory budget */
+} tar_cache_stats_t;
+
+/* Flags of tar_options_t. */
+#define TAR_OPEN_NO_INDEX 0x1     /* scan the archive on every lookup instead of indexing it */
+#define TAR_OPEN_MMAP 0x2         /* map the archive and read from the mapping, bypassing the cache */
+#define TAR_OPEN_HASH 0x4         /* hash every regular file up front, see tar_member_hash() */
+#define TAR_OPEN_NO_READAHEAD 0x8 /* never ask the kernel to read ahead of sequential tar_read_file() calls */
+#define TAR_OPEN_SCAN_DIRECT 0x10 /* hash, grep and diff read with O_DIRECT, leaving the page cache alone */
+#define TAR_OPEN_SCAN_DONTNEED 0x20 /* same, but read through the page cache and drop what was read */
+#define TAR_OPEN_LAZY_INDEX 0x40  /* index the archive only as far as lookups need, see tar_open() */
+#define TAR_OPEN_BACKGROUND_INDEX 0x80 /* index the archive on a thread of the handle, see tar_open() */
+
+typedef struct tar_options {
+    tar_cache_t *cache;           /* block cache to read through, or NULL */
+    int flags;                    /* TAR_OPEN_* flags */
+} tar_options_t;
+
+/**
+ * Creates a block cache holding at most `budget` bytes of archive data.
+ *
+ * The cache is keyed by (archive, 64 KiB block), so one cache can be shared
+ * by every handle of a process, including several handles on the same file.
+ * Slabs are evicted with a CLOCK policy. The cache is thread-safe; its locks
+ * are sharded so that concurrent readers rarely contend.
+ *
+ * Archives are assumed not to change while they are cached.
+ *
+ * @param budget The memory budget in bytes. Rounded down to a whole number of
+ *               slabs, with a minimum of one slab per shard.
+ *
+ * @return the cache, or NULL if it could not be allocated.
+ */
+tar_cache_t *tar_cache_new(size_t budget);
+
+/**
+ * Frees a cache. No handle may use it anymore.
+ */
+void tar_cache_free(tar_cache_t *cache);
+
+/**
+ * Copies the hit/miss counters and memory usage of a cache into `stats`.
+ */
+void tar_cache_get_stats(tar_cache_t *cache, tar_cache_stats_t *stats);
+
+/**
+ * Reads `len` bytes at `offset` of the archive open on `fd`, through the cache.
+ *
+ * @param archive_id Identifies the archive in the cache, see tar_archive_id().
+ *
+ * @return the number of bytes read, which is only short at the end of the file,
+ *         -1 if the archive could not be read.
+ */
+ssize_t tar_cache_pread(tar_cache_t *cache, uint64_t archive_id, int fd, void *buf, size_t len, off_t offset);
+
+/**
+ * Computes the identifier of the file open on `fd`, from its device and inode.
+ * Two descriptors on the same file get the same identifier.
+ *
+ * @param id Where the identifier is stored.
+ *
+ * @return 0 on success, -1 if the file could not be stat'ed (errno is set).
+ */
+int tar_archive_id(int fd, uint64_t *id);
+
+typedef struct tar_stat {
+    char typeflag;                /* one of the *TYPE values */
+    uint32_t mode;                /* permission bits */
+    uint64_t size;                /* size of the member data */
+    int64_t mtime;                /* modification time, in seconds since the epoch */
+    off_t data_offset;            /* offset of the member data in the archive */
+} tar_stat_t;
+
+typedef struct tar_index_info {
+    size_t entries;               /* distinct paths in the index */
+    size_t path_bytes;            /* sum of the lengths of those paths */
+    size_t arena_bytes;           /* size of the paths once front-coded */
+    size_t index_bytes;           /* heap memory held by the index, arena included */
+} tar_index_info_t;
+
+/**
+ * Opens a handle on a valid tar archive.
+ *
+ * Unless TAR_OPEN_NO_INDEX is given, the archive is scanned once and every
+ * path is indexed. Lookups then never touch the file, and lookups of absent
+ * paths are usually rejected by a Bloom filter alone. The index is sorted by
+ * path and packed into parallel arrays, front-coded paths included, so that
+ * it takes about 24 bytes per entry on top of the path bytes.
+ *
+ * With TAR_OPEN_LAZY_INDEX, tar_open() reads nothing. Each lookup of a path
+ * not indexed yet resumes the scan where the previous one stopped, so the
+ * first lookup of a member costs a scan up to it and later ones are served
+ * from memory. The index is completed by the first lookup of an absent path
+ * and by the functions that need all the entries: listings, tar_find(),
+ * tar_grep(), tar_extract(), hashes, diffs and overlays.
+ *
+ * With TAR_OPEN_BACKGROUND_INDEX, tar_open() reads nothing either and starts
+ * a thread that indexes the whole archive. Lookups of paths the thread has
+ * passed are served from memory at once; lookups past it, absent paths and
+ * the functions that need all the entries wait for it. tar_close() stops the
+ * thread. TAR_OPEN_NO_INDEX takes precedence over both flags.
+ *
+ * TAR_OPEN_HASH needs every member at open, which would complete the index
+ * there: it cannot be combined with TAR_OPEN_LAZY_INDEX nor with
+ * TAR_OPEN_BACKGROUND_INDEX. Hash such handles with tar_find_duplicates()
+ * once they are open instead.
+ *
+ * TAR_OPEN_SCAN_DIRECT and TAR_OPEN_SCAN_DONTNEED are meant for archives
+ * that are hashed, searched or compared once and are larger than the memory
+ * the machine can spare: the data of members are then read in chunks of
+ * 4 MiB, the next one in the background, without the block cache of the
+ * handle and without leaving them in the page cache. On file systems that
+ * refuse O_DIRECT (tmpfs), TAR_OPEN_SCAN_DIRECT behaves as
+ * TAR_OPEN_SCAN_DONTNEED. Headers and tar_read_file() are not affected.
+ *
+ * @param tar_fd A file descriptor on the archive. It stays owned by the caller
+ *               and must remain open until tar_close().
+ * @param opts Options, or NULL for the defaults.
+ *
+ * @return the handle, or NULL on error (EINVAL if TAR_OPEN_HASH comes with a
+ *         lazy or background index).
+ */
+tar_handle_t *tar_open(int tar_fd, const tar_options_t *opts);
+
+/**
+ * Closes a handle. The file descriptor is not closed.
+ *
+ * Every listing of the handle must have been released with tar_list_free()
+ * before: its buffer goes back to the handle.
+ */
+void tar_close(tar_handle_t *h);
+
+/* Same as exists(), on a handle. */
+int tar_exists(tar_handle_t *h, char *path);
+
+/* Same as is_dir(), on a handle. */
+int tar_is_dir(tar_handle_t *h, char *path);
+
+/* Same as is_file(), on a handle. */
+int tar_is_file(tar_handle_t *h, char *path);
+
+/* Same as is_symlink(), on a handle. */
+int tar_is_symlink(tar_handle_t *h, char *path);
+
+/**
+ * Gets the metadata of an entry. Links are not followed.
+ *
+ * @return zero if no entry at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_stat(tar_handle_t *h, char *path, tar_stat_t *st);
+
+/* Same as tar_stat(), but symlinks are resolved to their linked-to entry. */
+int tar_stat_resolved(tar_handle_t *h, char *path, tar_stat_t *st);
+
+/**
+ * Copies the target of a symlink into `buf`, NUL-terminated and truncated to `size` bytes.
+ *
+ * @return the length of the target, -1 if no symlink exists at the given path.
+ */
+ssize_t tar_readlink(tar_handle_t *h, char *path, char *buf, size_t size);
+
+/**
+ * Reports the size of the index of a handle.
+ *
+ * @return zero on success, -1 if the handle has no index.
+ */
+int tar_get_index_info(tar_handle_t *h, tar_index_info_t *info);
+
+/**
+ * Tells whether lookups on a handle are served from memory, without reading
+ * anything: tar_get_index_info() completes a lazy index, this does not.
+ *
+ * @return 1 if the index of the handle is complete, 0 otherwise.
+ */
+int tar_index_ready(tar_handle_t *h);
+
+/* A string that is not owned by the view. The data is also NUL-terminated. */
+typedef struct tar_strview {
+    const char *data;
+    size_t len;
+} tar_strview_t;
+
+/**
+ * The result of a listing. Views and strings live in a single buffer,
+ * released with tar_list_free(). Listings of a handle take their buffer from
+ * the handle and give it back to be reused, so they must be released before
+ * the handle is closed.
+ */
+typedef struct tar_list {
+    tar_strview_t *entries;
+    size_t count;
+    void *memory;
+    size_t capacity;              /* bytes asked for `memory` */
+    struct tar_bufpool *pool;     /* where `memory` goes back, or NULL to free it */
+} tar_list_t;
+
+/**
+ * Position of a listing in progress, so that large directories can be listed
+ * a batch at a time. The cursor does not hold any resource.
+ */
+typedef struct tar_list_cursor {
+    size_t pos;                   /* next index position to examine */
+    size_t end;                   /* first index position past the directory */
+    size_t dir_len;
+    char dir[257];                /* the directory, with its trailing slash */
+} tar_list_cursor_t;
+
+/**
+ * Lists the entries at a given path in the archive, like list(), but returns
+ * the exact number of entries in one allocation instead of copying them into
+ * caller buffers.
+ *
+ * Children that only exist through deeper entries (a "dir/c/d" without a
+ * "dir/c/" header) are listed as "dir/c/".
+ *
+ * @param h A handle with an index.
+ * @param path A path to a directory in the archive, with or without its trailing slash.
+ *             If the entry is a symlink, it is resolved to its linked-to entry.
+ * @param out Receives the entries. Always safe to pass to tar_list_free().
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         -1 if memory ran out (errno is ENOMEM), 1 otherwise.
+ */
+int tar_list_arena(tar_handle_t *h, char *path, tar_list_t *out);
+
+/**
+ * Starts listing a directory a batch at a time. The empty path is the root of
+ * the archive, and directories without an entry of their own (a "dir/c/"
+ * implied by "dir/c/d") can be listed too.
+ *
+ * @return zero if no directory at the given path exists in the archive,
+ *         any other value otherwise.
+ */
+int tar_list_open(tar_handle_t *h, char *path, tar_list_cursor_t *cursor);
+
+/**
+ * Lists the next (at most) `max` entries of the directory of `cursor`.
+ *
+ * @return the number of entries stored in `out`, zero once the directory is exhausted,
+ *         -1 if memory ran out (errno is ENOMEM). The cursor then stays where it was.
+ */
+ssize_t tar_list_next(tar_handle_t *h, tar_list_cursor_t *cursor, size_t max, tar_list_t *out);
+
+/* Releases the result of tar_list_arena() or tar_list_next(), before tar_close() of its handle. */
+void tar_list_free(tar_list_t *list);
+
+/**
+ * Position of a walk over every entry of a handle, in path order. The walk
+ * does not allocate and does not hold any resource. Only `pos`, `len` and
+ * `path` are meant to be read.
+ */
+typedef struct tar_walk {
+    const struct tar_index *index;
+    size_t pos;                   /* position of the entry in the index */
+    size_t next_byte;
+    size_t len;                   /* length of `path` */
+    char path[257];
+} tar_walk_t;
+
+/**
+ * Positions `w` on the first entry of a handle.
+ *
+ * @return 1 if the archive has an entry, 0 if it is empty or the handle has no index.
+ */
+int tar_walk_first(tar_handle_t *h, tar_walk_t *w);
+
+/**
+ * Moves `w` to the next entry.
+ *
+ * @return 1 if there is one, 0 at the end of the archive.
+ */
+int tar_walk_next(tar_walk_t *w);
+
+/* Gets the metadata of the entry `w` is on. */
+void tar_walk_stat(const tar_walk_t *w, tar_stat_t *st);
+
+/* Flags of tar_find(). */
+#define TAR_FIND_PREFIX 0x1       /* match the paths starting with the pattern, taken literally */
+
+/**
+ * Called by tar_find() for each match. `path` is NUL-terminated and only
+ * valid during the call.
+ *
+ * @return zero to continue, any other value to stop the search.
+ */
+typedef int (*tar_find_cb_t)(void *arg, const char *path, size_t len);
+
+/**
+ * Calls `cb` on every path of the archive matching `pattern`, in sorted order.
+ *
+ * Patterns are globs: `*` matches any run of characters but '/', `?` any one
+ * character but '/', `[a-z]` and `[!a-z]` a character class, `\` escapes the next
+ * character, and a `**` component matches any number of directories, none
+ * included. Directories match without their trailing slash, and a pattern
+ * with a trailing slash only matches directories.
+ *
+ * Only the part of the index starting with the literal prefix of the pattern
+ * is visited, and subtrees that cannot match are skipped, so that a prefix
+ * query costs O(log n + matches).
+ *
+ * @param h A handle with an index.
+ * @param flags TAR_FIND_* flags.
+ *
+ * @return the number of matches passed to `cb`,
+ *         -1 if the handle has no index or the pattern is longer than a path.
+ */
+ssize_t tar_find(tar_handle_t *h, const char *pattern, int flags, tar_find_cb_t cb, void *arg);
+
+/* Flags of tar_grep_options_t. */
+#define TAR_GREP_FIRST 0x1        /* report only the first match of each member */
+
+typedef struct tar_grep_options {
+    int threads;                  /* members searched in parallel, 0 for one per CPU */
+    int flags;                    /* TAR_GREP_* flags */
+} tar_grep_options_t;
+
+/**
+ * Called by tar_grep() for each match, with the offset of the match in the
+ * member data. Calls are serialised, but members come in no particular order.
+ *
+ * @return zero to continue, any other value to stop the search.
+ */
+typedef int (*tar_grep_cb_t)(void *arg, const char *path, uint64_t offset);
+
+/**
+ * Searches the data of the regular files of the archive for a byte string,
+ * without extracting them. Members are searched in parallel, straight from
+ * the mapping of a handle opened with TAR_OPEN_MMAP, through the chunks of
+ * a scan mode (see tar_open()), or in 1 MiB reads otherwise. Every
+ * occurrence is reported, overlapping ones included.
+ *
+ * @param h A handle with an index.
+ * @param needle The bytes to look for.
+ * @param path_filter A tar_find() pattern selecting the members to search, or NULL for all of them.
+ * @param opts Options, or NULL for the defaults.
+ *
+ * @return the number of matches passed to `cb`,
+ *         -1 if the handle has no index, the needle is empty or a member could not be read.
+ */
+ssize_t tar_grep(tar_handle_t *h, const char *needle, size_t needle_len, const char *path_filter,
+                 const tar_grep_options_t *opts, tar_grep_cb_t cb, void *arg);
+
+/* Flags of tar_extract_options_t. */
+#define TAR_EXTRACT_SYNC 0x1      /* flush the destination file system once, at the end */
+#define TAR_EXTRACT_KEEP_SETID 0x2 /* keep the setuid and setgid bits of the archive, see tar_extract() */
+
+typedef struct tar_extract_options {
+    int threads;                  /* worker threads writing files, 0 for one per CPU */
+    int flags;                    /* TAR_EXTRACT_* flags */
+    uint64_t fallocate_min;       /* preallocate files at least this large, 0 for 1 MiB */
+} tar_extract_options_t;
+
+/**
+ * Extracts the archive under `dest_dir`, which is created if needed.
+ *
+ * Directories are created first, then regular files are written in parallel,
+ * with copy_file_range() from the archive when the file systems allow it.
+ * Hard links, symlinks, FIFOs, and the modes and mtimes of directories are
+ * applied in a final pass.
+ *
+ * Members whose path is absolute or contains "..", character and block
+ * devices, and members of unknown types are not extracted, and are counted
+ * in the return value. When a path appears several times in the archive, the
+ * first member is extracted, as every lookup of lib_tar would find it,
+ * whereas GNU tar leaves the last one.
+ *
+ * The setuid and setgid bits of members are dropped, so that an archive from
+ * elsewhere cannot leave programs that run as the extracting user, or as
+ * its groups. TAR_EXTRACT_KEEP_SETID keeps them.
+ *
+ * @param h A handle with an index.
+ * @param opts Options, or NULL for the defaults.
+ *
+ * @return zero if every member was extracted,
+ *         -1 if the destination could not be opened,
+ *         a positive value otherwise, representing the number of members that could not be extracted.
+ */
+int tar_extract(tar_handle_t *h, const char *dest_dir, const tar_extract_options_t *opts);
+
+/**
+ * Same as read_file(), on a handle.
+ *
+ * Members read in chunks at increasing offsets are followed one by one:
+ * while the reads of a member stay sequential, the kernel is asked to read
+ * ahead of them in the background, over a window that widens up to 8 MiB.
+ * Handles opened with TAR_OPEN_NO_READAHEAD leave this to the kernel alone.
+ */
+ssize_t tar_read_file(tar_handle_t *h, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/**
+ * Copies (at most) `len` bytes of a regular file, starting at `offset`, to
+ * the current position of `out_fd`, as write() would.
+ *
+ * The data do not go through userspace when the kernel can move them:
+ * copy_file_range() to regular files, which shares the extents on file
+ * systems with reflinks, splice() to pipes and sendfile() to sockets and
+ * other descriptors. Otherwise they are read and written, from the mapping
+ * of a handle opened with TAR_OPEN_MMAP when there is one. `out_fd` should
+ * be in blocking mode. Symlinks are resolved.
+ *
+ * @return the number of bytes copied,
+ *         -1 if no regular file exists at the given path,
+ *         -2 if the offset is outside the file total length,
+ *         -3 if the copy failed, with errno set; part of the data may have been written.
+ */
+ssize_t tar_copy_to_fd(tar_handle_t *h, char *path, size_t offset, size_t len, int out_fd);
+
+/**
+ * Points at the data of a regular file in the mapping of a handle opened with
+ * TAR_OPEN_MMAP, without copying them. Symlinks are resolved. The data stay
+ * valid until tar_close().
+ *
+ * @return zero on success,
+ *         -1 if the handle is not mapped or no regular file exists at the given path.
+ */
+int tar_view_file(tar_handle_t *h, char *path, const uint8_t **data, uint64_t *size);
+
+/**
+ * Gets the xxh64 hash (seed 0) of the data of a regular file. Links are followed.
+ *
+ * Handles opened with TAR_OPEN_HASH, or on which tar_find_duplicates() ran,
+ * answer from the hashes computed then. Others hash the member on each call.
+ *
+ * @return zero on success,
+ *         -1 if no regular file exists at the given path or it could not be read.
+ */
+int tar_member_hash(tar_handle_t *h, char *path, uint64_t *hash);
+
+/**
+ * Called by tar_find_duplicates() for each group of identical members, with
+ * their paths in sorted order. The views are only valid during the call.
+ *
+ * @return zero to continue, any other value to stop.
+ */
+typedef int (*tar_dup_cb_t)(void *arg, uint64_t hash, uint64_t size, const tar_strview_t *paths, size_t count);
+
+/**
+ * Finds the regular files whose data are identical, by size and xxh64 hash.
+ * Every member is hashed once, in parallel, and the hashes are kept in the
+ * handle. Empty files are not reported.
+ *
+ * @param h A handle with an index.
+ * @param threads Threads hashing members, 0 for one per CPU.
+ *
+ * @return the number of groups passed to `cb`,
+ *         -1 if the handle has no index or a member could not be read.
+ */
+ssize_t tar_find_duplicates(tar_handle_t *h, int threads, tar_dup_cb_t cb, void *arg);
+
+typedef enum tar_diff_kind {
+    TAR_DIFF_ADDED,               /* only in the new archive */
+    TAR_DIFF_REMOVED,             /* only in the old archive */
+    TAR_DIFF_TYPE_CHANGED,        /* a file became a directory, a link, ... */
+    TAR_DIFF_CONTENT_CHANGED,     /* different data, or a different link target */
+    TAR_DIFF_METADATA_CHANGED     /* same content, different mode or mtime */
+} tar_diff_kind_t;
+
+/* Flags of tar_diff_options_t. */
+#define TAR_DIFF_CONTENT 0x1      /* compare the data of files even when their size and mtime match */
+
+typedef struct tar_diff_options {
+    int threads;                  /* threads comparing data, 0 for one per CPU */
+    int flags;                    /* TAR_DIFF_* flags */
+} tar_diff_options_t;
+
+/**
+ * Called by tar_diff() for each difference, in path order. `before` and
+ * `after` describe the member in each archive, and are NULL where it is absent.
+ *
+ * @return zero to continue, any other value to stop.
+ */
+typedef int (*tar_diff_cb_t)(void *arg, tar_diff_kind_t kind, const char *path,
+                             const tar_stat_t *before, const tar_stat_t *after);
+
+/**
+ * Compares two archives member by member, without extracting them.
+ *
+ * Both indexes are walked together in path order. Files of the same size are
+ * taken as identical when their mtimes match too, unless TAR_DIFF_CONTENT is
+ * given. Otherwise their data are compared: by hash when both handles have
+ * hashed their members (see TAR_OPEN_HASH), byte for byte in parallel chunks
+ * otherwise.
+ *
+ * @param a The old archive, a handle with an index.
+ * @param b The new archive, a handle with an index.
+ * @param opts Options, or NULL for the defaults.
+ *
+ * @return the number of differences passed to `cb`,
+ *         -1 if a handle has no index or a member could not be read.
+ */
+ssize_t tar_diff(tar_handle_t *a, tar_handle_t *b, const tar_diff_options_t *opts, tar_diff_cb_t cb, void *arg);
+
+/*
+ * Overlays.
+ *
+ * An overlay is a read-only union of several archives, stacked as the layers
+ * of a container image: a path in an upper layer hides the same path in the
+ * layers below. An upper layer also deletes paths of the layers below with
+ * whiteouts, empty members named ".wh.<name>" next to the deleted <name>, and
+ * hides whole directories below with an opaque marker "<dir>/.wh..wh..opq".
+ * Whiteouts are not part of the view.
+ *
+ * The layers are merged into a single sorted index when they are added, so
+ * that a lookup in the overlay costs one hash probe whatever the number of
+ * layers.
+ */
+typedef struct tar_overlay tar_overlay_t;
+
+/* Creates an empty overlay, or returns NULL if out of memory. */
+tar_overlay_t *tar_overlay_new(void);
+
+/**
+ * Stacks a layer on top of the overlay. Only the paths of the new layer and
+ * the current view are merged, the lower layers are not scanned again.
+ *
+ * @param layer A handle with an index. It is not owned by the overlay and
+ *              must stay open until tar_overlay_free().
+ *
+ * @return zero on success, -1 if the handle has no index or out of memory.
+ */
+int tar_overlay_add(tar_overlay_t *ov, tar_handle_t *layer);
+
+/* Releases an overlay. Its layers are not closed. */
+void tar_overlay_free(tar_overlay_t *ov);
+
+/* Same as tar_exists(), tar_is_dir(), tar_is_file() and tar_is_symlink(), on an overlay. */
+int tar_overlay_exists(tar_overlay_t *ov, char *path);
+int tar_overlay_is_dir(tar_overlay_t *ov, char *path);
+int tar_overlay_is_file(tar_overlay_t *ov, char *path);
+int tar_overlay_is_symlink(tar_overlay_t *ov, char *path);
+
+/* Same as tar_stat(), on an overlay. */
+int tar_overlay_stat(tar_overlay_t *ov, char *path, tar_stat_t *st);
+
+/**
+ * Same as tar_list_arena(), on an overlay. Each entry comes from the topmost layer holding it.
+ *
+ * @return zero if no directory at the given path exists in the overlay,
+ *         -1 if memory ran out (errno is ENOMEM), 1 otherwise.
+ */
+int tar_overlay_list(tar_overlay_t *ov, char *path, tar_list_t *out);
+
+/* Same as tar_read_file(), on an overlay. Symlinks are resolved across layers. */
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, char *path, size_t offset, uint8_t *dest, size_t *len);
+
+/*
+ * Writing archives.
+ */
+
+typedef struct tar_writer tar_writer_t;
+
+/* Flags of tar_writer_new(). */
+#define TAR_WRITE_ALIGN 0x1       /* start the data of every regular file on a TAR_WRITE_ALIGNMENT boundary */
+
+/* Alignment of TAR_WRITE_ALIGN, the block size of common file systems with reflinks (XFS, btrfs). */
+#define TAR_WRITE_ALIGNMENT 4096
+
+/**
+ * Starts writing a ustar archive at the current position of `fd`.
+ *
+ * With TAR_WRITE_ALIGN, members are preceded by as much padding as needed
+ * for their data to start on a multiple of TAR_WRITE_ALIGNMENT from the
+ * start of the archive. The padding is a pax extended header that other
+ * readers ignore. Extracting such an archive (or copying its members with
+ * tar_copy_to_fd()) on a file system with reflinks then shares the blocks
+ * of the archive instead of copying them.
+ *
+ * @param flags TAR_WRITE_* flags.
+ *
+ * @return the writer, or NULL if `fd` is not seekable or memory ran out.
+ */
+tar_writer_t *tar_writer_new(int fd, int flags);
+
+/**
+ * Appends a member. Only `typeflag`, `mode`, `mtime` and, for regular files,
+ * `size` of `st` are used.
+ *
+ * @param linkname The target of a link, or NULL.
+ * @param data_fd For a regular file, a descriptor from whose start `st->size` bytes are copied.
+ *
+ * @return zero on success, -1 with errno set otherwise (ENAMETOOLONG if a path does not fit in ustar).
+ */
+int tar_writer_add(tar_writer_t *w, const char *path, const tar_stat_t *st, const char *linkname, int data_fd);
+
+/**
+ * Ends the archive and frees the writer. Does not close its descriptor.
+ *
+ * @return zero on success, -1 if the end of the archive could not be written.
+ */
+int tar_writer_close(tar_writer_t *w);
+
+/*
+ * Statistics.
+ *
+ * When lib_tar is built with -DTAR_STATS (make STATS=1), every handle counts
+ * the work it does and keeps a latency histogram per public function. Calls
+ * to the file descriptor API are accounted in a process-wide set of counters.
+ * Without TAR_STATS, the accounting is compiled out entirely.
+ */
+
+/* Public functions with a latency histogram. Handle functions share the entry of their fd counterpart. */
+typedef enum tar_op {
+    TAR_OP_CHECK_ARCHIVE,
+    TAR_OP_EXISTS,
+    TAR_OP_IS_DIR,
+    TAR_OP_IS_FILE,
+    TAR_OP_IS_SYMLINK,
+    TAR_OP_LIST,
+    TAR_OP_READ_FILE,
+    TAR_OP_OPEN,
+    TAR_OP_STAT,
+    TAR_OP_EXTRACT,
+    TAR_OP_FIND,
+    TAR_OP_GREP,
+    TAR_OP_HASH,
+    TAR_OP_FIND_DUPLICATES,
+    TAR_OP_DIFF,
+    TAR_OP_COPY,
+    TAR_OP_COUNT
+} tar_op_t;
+
+/*
+ * Histograms are log-linear, like HdrHistogram: each power of two is split in
+ * 2^TAR_HIST_SUB_BITS buckets, so a bucket is within 12.5% of its values.
+ * Latencies of 2^TAR_HIST_MAX_BITS ns (about 18 minutes) or more share the last bucket.
+ */
+#define TAR_HIST_SUB_BITS 3
+#define TAR_HIST_MAX_BITS 40
+#define TAR_HIST_BUCKETS ((TAR_HIST_MAX_BITS - TAR_HIST_SUB_BITS + 1) << TAR_HIST_SUB_BITS)
+
+typedef struct tar_hist {
+    uint64_t count;               /* calls recorded */
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TAR_HIST_BUCKETS];
+} tar_hist_t;
+
+typedef struct tar_stats {
+    uint64_t headers_parsed;      /* headers decoded while scanning the archive */
+    uint64_t bytes_read;          /* bytes read from the archive by syscalls */
+    uint64_t syscalls;            /* reads, seeks and copies issued on the archive */
+    uint64_t cache_hits;          /* block cache lookups served from memory */
+    uint64_t cache_misses;        /* block cache lookups that went to the kernel */
+    uint64_t index_probes;        /* lookups answered by the index */
+    uint64_t readahead_bytes;     /* bytes the kernel was asked to read ahead, see tar_read_file() */
+    tar_hist_t latency[TAR_OP_COUNT];
+} tar_stats_t;
+
+/**
+ * Copies the statistics of a handle, or those of the file descriptor API when
+ * `h` is NULL, into `stats`. Calls made from inside another public function
+ * (is_dir() calling exists(), for instance) only count towards the outer one.
+ *
+ * @return zero on success,
+ *         -1 if lib_tar was built without TAR_STATS, in which case `stats` is zeroed.
+ */
+int tar_get_stats(tar_handle_t *h, tar_stats_t *stats);
+
+/* Zeroes the statistics of a handle, or those of the file descriptor API when `h` is NULL. */
+void tar_reset_stats(tar_handle_t *h);
+
+/**
+ * Estimates a quantile of a histogram.
+ *
+ * @param q The quantile, between 0 and 1 (0.99 for the 99th percentile).
+ *
+ * @return the largest latency of the bucket holding the quantile, in nanoseconds,
+ *         or zero if the histogram is empty.
+ */
+uint64_t tar_hist_quantile(const tar_hist_t *hist, double q);
+
+/* Returns the name of a function of tar_op_t, such as "exists". */
+const char *tar_op_name(int op);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
@@ -0,0 +1,624 @@
+#ifndef LIB_TAR_HPP
+#define LIB_TAR_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "lib_tar.h"
+
+/*
+ * C++20 layer over lib_tar.h, header-only. Every member forwards to the C
+ * function of the same name. Paths are copied into a buffer on the stack to
+ * be NUL-terminated, so that lookups never allocate.
+ *
+ * The *_async members are awaitable from coroutines. The blocking call runs
+ * on an io_pool thread, and the coroutine is resumed by the executor of the
+ * thread that awaited, see io_context. Operations live in the frame of the
+ * awaiting coroutine, so starting one does not allocate either.
+ */
+namespace tar {
+
+using file_stat = tar_stat_t;
+
+namespace detail {
+
+/* A path NUL-terminated on the stack. Paths longer than an archive can hold are never found. */
+class c_path {
+public:
+    explicit c_path(std::string_view path) noexcept : ok_(path.size() < sizeof(buf_)) {
+        if (!ok_) return;
+        path.copy(buf_, path.size());
+        buf_[path.size()] = '\0';
+    }
+
+    explicit operator bool() const noexcept { return ok_; }
+    char *get() noexcept { return buf_; }
+
+private:
+    char buf_[257];
+    bool ok_;
+};
+
+} // namespace detail
+
+/* An entry met by archive::entries(). Only valid until its iterator moves. */
+class entry {
+public:
+    std::string_view path() const noexcept { return {walk_.path, walk_.len}; }
+
+    file_stat stat() const noexcept {
+        file_stat st;
+        tar_walk_stat(&walk_, &st);
+        return st;
+    }
+
+private:
+    friend class entry_iterator;
+    tar_walk_t walk_;
+};
+
+/* Input iterator over the entries of an archive, in path order. */
+class entry_iterator {
+public:
+    using value_type = entry;
+    using difference_type = std::ptrdiff_t;
+
+    entry_iterator() noexcept = default;
+    explicit entry_iterator(tar_handle_t *h) noexcept : done_(!tar_walk_first(h, &entry_.walk_)) {}
+
+    const entry &operator*() const noexcept { return entry_; }
+    const entry *operator->() const noexcept { return &entry_; }
+
+    entry_iterator &operator++() noexcept {
+        done_ = !tar_walk_next(&entry_.walk_);
+        return *this;
+    }
+    void operator++(int) noexcept { ++*this; }
+
+    friend bool operator==(const entry_iterator &it, std::default_sentinel_t) noexcept { return it.done_; }
+
+private:
+    entry entry_{};
+    bool done_ = true;
+};
+
+/* The entries of an archive. Lazy: each begin() walks the index again, nothing is copied. */
+class entry_range : public std::ranges::view_interface<entry_range> {
+public:
+    entry_range() noexcept = default;
+    explicit entry_range(tar_handle_t *h) noexcept : h_(h) {}
+
+    entry_iterator begin() const noexcept { return entry_iterator(h_); }
+    std::default_sentinel_t end() const noexcept { return {}; }
+
+private:
+    tar_handle_t *h_ = nullptr;
+};
+
+/*
+ * Asynchronous operations.
+ */
+
+/**
+ * Resumes coroutines on an event loop. post() is called from io_pool threads
+ * once an operation completes, and must arrange for `h` to be resumed on the
+ * loop thread.
+ */
+class executor {
+public:
+    virtual void post(std::coroutine_handle<> h) = 0;
+
+protected:
+    ~executor() = default;
+};
+
+namespace detail {
+
+/* An operation waiting for an I/O thread, queued without allocating. */
+struct io_op {
+    io_op *next = nullptr;
+    void (*run)(io_op *op) noexcept = nullptr;
+    executor *exec = nullptr;
+    std::coroutine_handle<> waiter;
+};
+
+} // namespace detail
+
+/* Threads running the blocking calls of asynchronous operations. */
+class io_pool {
+public:
+    /* Starts `threads` threads, 0 for one per CPU. */
+    explicit io_pool(unsigned threads = 0) {
+        if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < threads; i++) workers_.emplace_back([this] { work(); });
+    }
+
+    io_pool(const io_pool &) = delete;
+    io_pool &operator=(const io_pool &) = delete;
+
+    /* Completes the queued operations, then stops the threads. */
+    ~io_pool() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread &t : workers_) t.join();
+    }
+
+    void submit(detail::io_op *op) {
+        {
+            std::lock_guard lock(mutex_);
+            op->next = nullptr;
+            if (tail_) tail_->next = op;
+            else head_ = op;
+            tail_ = op;
+        }
+        cv_.notify_one();
+    }
+
+private:
+    void work() {
+        for (;;) {
+            detail::io_op *op;
+            {
+                std::unique_lock lock(mutex_);
+                cv_.wait(lock, [this] { return stop_ || head_; });
+                if (!head_) return;
+                op = head_;
+                head_ = op->next;
+                if (!head_) tail_ = nullptr;
+            }
+            op->run(op);
+            // Once posted, the operation may be destroyed with the frame holding it.
+            executor *exec = op->exec;
+            exec->post(op->waiter);
+        }
+    }
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    detail::io_op *head_ = nullptr;
+    detail::io_op *tail_ = nullptr;
+    bool stop_ = false;
+    std::vector<std::thread> workers_;
+};
+
+/**
+ * Where the asynchronous operations started on a thread run and resume. An
+ * event loop installs its context on its thread with install(); event_loop
+ * below does so while it runs.
+ */
+struct io_context {
+    executor *exec;
+    io_pool *pool;
+
+    /* The context of the calling thread, or nullptr. */
+    static io_context *&current() noexcept {
+        static thread_local io_context *ctx = nullptr;
+        return ctx;
+    }
+
+    /* Installs `ctx` on the calling thread, returns the previous context. */
+    static io_context *install(io_context *ctx) noexcept { return std::exchange(current(), ctx); }
+};
+
+namespace detail {
+
+/**
+ * Base of the awaitable operations. `Op` provides call(), the blocking call.
+ * Without an io_context on the awaiting thread, the call is made inline.
+ */
+template <typename Op>
+class async_op : protected io_op {
+public:
+    bool await_suspend(std::coroutine_handle<> h) {
+        io_context *ctx = io_context::current();
+        if (!ctx) {
+            static_cast<Op *>(this)->call();
+            return false;
+        }
+        run = [](io_op *op) noexcept { static_cast<Op *>(static_cast<async_op *>(op))->call(); };
+        exec = ctx->exec;
+        waiter = h;
+        ctx->pool->submit(this);
+        return true;
+    }
+};
+
+} // namespace detail
+
+/* Awaitable result of archive::read_async(). */
+class read_op : public detail::async_op<read_op> {
+public:
+    read_op(tar_handle_t *h, std::string_view path, std::span<std::byte> dest, std::uint64_t offset) noexcept
+        : h_(h), path_(path), dest_(dest), offset_(offset) {}
+
+    bool await_ready() const noexcept { return !path_; }
+    std::optional<std::size_t> await_resume() noexcept { return result_; }
+
+private:
+    friend class detail::async_op<read_op>;
+
+    void call() noexcept {
+        std::size_t len = dest_.size();
+        if (tar_read_file(h_, path_.get(), offset_, reinterpret_cast<uint8_t *>(dest_.data()), &len) >= 0) result_ = len;
+    }
+
+    tar_handle_t *h_;
+    detail::c_path path_;
+    std::span<std::byte> dest_;
+    std::uint64_t offset_;
+    std::optional<std::size_t> result_;
+};
+
+/* Awaitable result of archive::stat_async(). Completes without suspending on handles whose index is complete. */
+class stat_op : public detail::async_op<stat_op> {
+public:
+    stat_op(tar_handle_t *h, std::string_view path) noexcept : h_(h), path_(path) {}
+
+    bool await_ready() noexcept {
+        if (!path_) return true;
+        // A lazy index is completed by the threads of the pool, not by the loop.
+        if (!tar_index_ready(h_)) return false;
+        // The index is in memory, the lookup does not block.
+        call();
+        return true;
+    }
+
+    std::optional<file_stat> await_resume() noexcept { return result_; }
+
+private:
+    friend class detail::async_op<stat_op>;
+
+    void call() noexcept {
+        file_stat st;
+        if (tar_stat(h_, path_.get(), &st)) result_ = st;
+    }
+
+    tar_handle_t *h_;
+    detail::c_path path_;
+    std::optional<file_stat> result_;
+};
+
+/**
+ * An open archive: a handle, and the descriptor it reads when the archive was
+ * opened by path. Move-only; both are released by the destructor.
+ */
+class archive {
+public:
+    /**
+     * Opens the archive at `path`.
+     *
+     * @param flags TAR_OPEN_* flags.
+     * @param cache Block cache to read through, or nullptr.
+     *
+     * @throws std::system_error if the archive cannot be opened.
+     */
+    explicit archive(const char *path, int flags = 0, tar_cache_t *cache = nullptr) {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) throw std::system_error(errno, std::generic_category(), path);
+        try {
+            h_ = open_handle(fd, flags, cache);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        fd_ = fd;
+    }
+
+    /* Same as above, on a descriptor that stays owned by the caller. */
+    static archive from_fd(int fd, int flags = 0, tar_cache_t *cache = nullptr) {
+        return archive(open_handle(fd, flags, cache));
+    }
+
+    archive(archive &&other) noexcept : h_(std::exchange(other.h_, nullptr)), fd_(std::exchange(other.fd_, -1)) {}
+
+    archive &operator=(archive &&other) noexcept {
+        if (this != &other) {
+            reset();
+            h_ = std::exchange(other.h_, nullptr);
+            fd_ = std::exchange(other.fd_, -1);
+        }
+        return *this;
+    }
+
+    archive(const archive &) = delete;
+    archive &operator=(const archive &) = delete;
+
+    ~archive() { reset(); }
+
+    /* The underlying handle, for the parts of lib_tar.h not wrapped here. */
+    tar_handle_t *handle() const noexcept { return h_; }
+
+    bool exists(std::string_view path) const noexcept {
+        detail::c_path p(path);
+        return p && tar_exists(h_, p.get());
+    }
+
+    bool is_dir(std::string_view path) const noexcept {
+        detail::c_path p(path);
+        return p && tar_is_dir(h_, p.get());
+    }
+
+    bool is_file(std::string_view path) const noexcept {
+        detail::c_path p(path);
+        return p && tar_is_file(h_, p.get());
+    }
+
+    bool is_symlink(std::string_view path) const noexcept {
+        detail::c_path p(path);
+        return p && tar_is_symlink(h_, p.get());
+    }
+
+    /* The metadata of an entry, links not followed, or std::nullopt if there is none. */
+    std::optional<file_stat> stat(std::string_view path) const noexcept {
+        detail::c_path p(path);
+        file_stat st;
+        if (!p || !tar_stat(h_, p.get(), &st)) return std::nullopt;
+        return st;
+    }
+
+    /**
+     * Reads a file from `offset` into `dest`, like tar_read_file().
+     *
+     * @return the number of bytes read, which is only short at the end of the file,
+     *         std::nullopt if there is no regular file at `path` or `offset` is past its end.
+     */
+    std::optional<std::size_t> read(std::string_view path, std::span<std::byte> dest,
+                                    std::uint64_t offset = 0) const noexcept {
+        detail::c_path p(path);
+        std::size_t len = dest.size();
+        if (!p || tar_read_file(h_, p.get(), offset, reinterpret_cast<uint8_t *>(dest.data()), &len) < 0) {
+            return std::nullopt;
+        }
+        return len;
+    }
+
+    /**
+     * The data of a file in the mapping of an archive opened with TAR_OPEN_MMAP,
+     * valid as long as the archive, like tar_view_file().
+     *
+     * @return the data, or std::nullopt if the archive is not mapped or there is no regular file at `path`.
+     */
+    std::optional<std::span<const std::byte>> view(std::string_view path) const noexcept {
+        detail::c_path p(path);
+        const uint8_t *data;
+        uint64_t size;
+        if (!p || tar_view_file(h_, p.get(), &data, &size) < 0) return std::nullopt;
+        return std::span<const std::byte>(reinterpret_cast<const std::byte *>(data), size);
+    }
+
+    /**
+     * Same as read(), awaitable. `dest` must stay valid until the read completes.
+     *
+     *     auto n = co_await ar.read_async("dir/file", buf);
+     */
+    read_op read_async(std::string_view path, std::span<std::byte> dest, std::uint64_t offset = 0) const noexcept {
+        return read_op(h_, path, dest, offset);
+    }
+
+    /* Same as stat(), awaitable. */
+    stat_op stat_async(std::string_view path) const noexcept { return stat_op(h_, path); }
+
+    /* Every entry of the archive, in path order. */
+    entry_range entries() const noexcept { return entry_range(h_); }
+
+private:
+    explicit archive(tar_handle_t *h) noexcept : h_(h) {}
+
+    static tar_handle_t *open_handle(int fd, int flags, tar_cache_t *cache) {
+        tar_options_t opts = { cache, flags };
+        tar_handle_t *h = tar_open(fd, &opts);
+        if (!h) throw std::system_error(errno ? errno : EINVAL, std::generic_category(), "tar_open");
+        return h;
+    }
+
+    void reset() noexcept {
+        if (h_) tar_close(h_);
+        if (fd_ != -1) ::close(fd_);
+        h_ = nullptr;
+        fd_ = -1;
+    }
+
+    tar_handle_t *h_ = nullptr;
+    int fd_ = -1;                  /* owned descriptor, or -1 */
+};
+
+namespace detail {
+
+template <typename T>
+struct task_result {
+    std::optional<T> value;
+    void return_value(T v) { value.emplace(std::move(v)); }
+    T take() { return std::move(*value); }
+};
+
+template <>
+struct task_result<void> {
+    void return_void() noexcept {}
+    void take() noexcept {}
+};
+
+} // namespace detail
+
+/**
+ * A lazy coroutine: it starts when awaited, and resumes its awaiter when it
+ * completes. Exceptions are rethrown to the awaiter.
+ */
+template <typename T = void>
+class task {
+public:
+    struct promise_type : detail::task_result<T> {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr error;
+
+        task get_return_object() noexcept { return task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        auto final_suspend() noexcept {
+            struct resume_awaiter {
+                bool await_ready() noexcept { return false; }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                    std::coroutine_handle<> next = h.promise().continuation;
+                    return next ? next : std::noop_coroutine();
+                }
+                void await_resume() noexcept {}
+            };
+            return resume_awaiter{};
+        }
+
+        void unhandled_exception() noexcept { error = std::current_exception(); }
+    };
+
+    task(task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+    task &operator=(task &&other) noexcept {
+        if (this != &other) {
+            if (h_) h_.destroy();
+            h_ = std::exchange(other.h_, nullptr);
+        }
+        return *this;
+    }
+    ~task() {
+        if (h_) h_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+        h_.promise().continuation = awaiter;
+        return h_;
+    }
+
+    T await_resume() {
+        if (h_.promise().error) std::rethrow_exception(h_.promise().error);
+        return h_.promise().take();
+    }
+
+private:
+    explicit task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+    std::coroutine_handle<promise_type> h_;
+};
+
+/**
+ * A self-contained event loop: completions are posted through an eventfd
+ * watched by epoll, and resumed in batches on the thread calling run().
+ * Real servers implement executor on their own loop instead.
+ */
+class event_loop final : public executor {
+public:
+    /* Runs the blocking calls on `pool`. Throws std::system_error if the loop cannot be set up. */
+    explicit event_loop(io_pool &pool) : ctx_{this, &pool} {
+        efd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        if (efd_ == -1 || epfd_ == -1 || ::epoll_ctl(epfd_, EPOLL_CTL_ADD, efd_, &ev) == -1) {
+            int err = errno;
+            close_fds();
+            throw std::system_error(err, std::generic_category(), "event_loop");
+        }
+    }
+
+    event_loop(const event_loop &) = delete;
+    event_loop &operator=(const event_loop &) = delete;
+
+    ~event_loop() { close_fds(); }
+
+    void post(std::coroutine_handle<> h) override {
+        bool wake;
+        {
+            std::lock_guard lock(mutex_);
+            // A non-empty queue already has a wakeup pending.
+            wake = ready_.empty();
+            ready_.push_back(h);
+        }
+        if (wake) {
+            uint64_t one = 1;
+            (void) !::write(efd_, &one, sizeof(one));
+        }
+    }
+
+    /* Starts `t` on the calling thread, which must be the one calling run(). `t` must not throw. */
+    void spawn(task<> t) {
+        io_context *previous = io_context::install(&ctx_);
+        pending_++;
+        start(this, std::move(t));
+        io_context::install(previous);
+    }
+
+    /* Resumes the coroutines of completed operations until every spawned task has completed. */
+    void run() {
+        io_context *previous = io_context::install(&ctx_);
+        std::vector<std::coroutine_handle<>> batch;
+        while (pending_ > 0) {
+            epoll_event ev;
+            if (::epoll_wait(epfd_, &ev, 1, -1) == -1) {
+                if (errno == EINTR) continue;
+                io_context::install(previous);
+                throw std::system_error(errno, std::generic_category(), "epoll_wait");
+            }
+            uint64_t count;
+            (void) !::read(efd_, &count, sizeof(count));
+            {
+                std::lock_guard lock(mutex_);
+                batch.swap(ready_);
+            }
+            for (std::coroutine_handle<> h : batch) h.resume();
+            batch.clear();
+        }
+        io_context::install(previous);
+    }
+
+private:
+    /* Owns a spawned task until it completes. */
+    struct detached {
+        struct promise_type {
+            detached get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    static detached start(event_loop *loop, task<> t) {
+        co_await t;
+        loop->pending_--;
+    }
+
+    void close_fds() noexcept {
+        if (efd_ != -1) ::close(efd_);
+        if (epfd_ != -1) ::close(epfd_);
+    }
+
+    io_context ctx_;
+    int efd_ = -1;
+    int epfd_ = -1;
+    std::mutex mutex_;
+    std::vector<std::coroutine_handle<>> ready_;
+    std::size_t pending_ = 0;
+};
+
+} // namespace tar
+
+#endif
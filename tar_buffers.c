@@ -0,0 +1,65 @@
+#include "tar_internal.h"
+
+/*
+ * A pool hands out buffers by size class, the smallest power of two that
+ * holds the request. Every buffer of a class has the size of the class, so
+ * any free buffer of the class serves any request of it.
+ */
+
+/* Returns the class of `size`, or -1 for sizes the pool does not keep. */
+static int size_class(size_t size) {
+    size_t class_size = TAR_BUF_ALIGN;
+    for (int c = 0; c < TAR_BUF_CLASSES; c++, class_size <<= 1) {
+        if (size <= class_size) return c;
+    }
+    return -1;
+}
+
+tar_bufpool_t tar_global_buffers = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+void tar_bufpool_init(tar_bufpool_t *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+void tar_bufpool_destroy(tar_bufpool_t *pool) {
+    for (int c = 0; c < TAR_BUF_CLASSES; c++) {
+        for (size_t i = 0; i < pool->nfree[c]; i++) free(pool->free[c][i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void *tar_buf_get(tar_bufpool_t *pool, size_t size) {
+    int c = size_class(size);
+    void *buf = NULL;
+
+    if (c >= 0) {
+        pthread_mutex_lock(&pool->lock);
+        size = (size_t) TAR_BUF_ALIGN << c;
+        if (pool->nfree[c] > 0) {
+            buf = pool->free[c][--pool->nfree[c]];
+            pool->held -= size;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (buf) return buf;
+    }
+    if (posix_memalign(&buf, TAR_BUF_ALIGN, size ? size : 1) != 0) return NULL;
+    return buf;
+}
+
+void tar_buf_put(tar_bufpool_t *pool, void *buf, size_t size) {
+    int c = size_class(size);
+
+    if (!buf) return;
+    if (c >= 0) {
+        size_t class_size = (size_t) TAR_BUF_ALIGN << c;
+        pthread_mutex_lock(&pool->lock);
+        if (pool->nfree[c] < TAR_BUF_DEPTH && pool->held + class_size <= TAR_BUF_POOL_BYTES) {
+            pool->free[c][pool->nfree[c]++] = buf;
+            pool->held += class_size;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(buf);
+}
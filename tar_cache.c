@@ -0,0 +1,246 @@
+#include <pthread.h>
+
+#include "tar_internal.h"
+
+/*
+ * The cache is split into shards, each with its own lock, slab table and
+ * CLOCK hand. A block always lands in the same shard, so a reader only ever
+ * takes one lock per slab it touches.
+ */
+#define CACHE_SHARDS 16
+
+typedef struct cache_slot {
+    uint64_t archive_id;
+    uint64_t block;
+    uint8_t *data;                 /* TAR_CACHE_SLAB_SIZE bytes, NULL while unused */
+    size_t len;                    /* valid bytes, short for the last slab of a file */
+    int valid;
+    int referenced;                /* CLOCK bit */
+} cache_slot_t;
+
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_slot_t *slots;
+    size_t nslots;
+    size_t hand;                   /* CLOCK hand */
+    int32_t *table;                /* open addressing, slot index or -1 */
+    size_t table_mask;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    size_t bytes_used;
+} cache_shard_t;
+
+struct tar_cache {
+    cache_shard_t shards[CACHE_SHARDS];
+    size_t budget;
+};
+
+static uint64_t key_hash(uint64_t archive_id, uint64_t block) {
+    return tar_mix64(archive_id ^ tar_mix64(block));
+}
+
+int tar_archive_id(int fd, uint64_t *id) {
+    struct stat st;
+    if (fstat(fd, &st) < 0) return -1;
+    *id = tar_mix64((uint64_t) st.st_dev) ^ (uint64_t) st.st_ino;
+    return 0;
+}
+
+tar_cache_t *tar_cache_new(size_t budget) {
+    tar_cache_t *cache = calloc(1, sizeof(tar_cache_t));
+    if (!cache) return NULL;
+
+    size_t per_shard = budget / TAR_CACHE_SLAB_SIZE / CACHE_SHARDS;
+    if (per_shard == 0) per_shard = 1;
+    cache->budget = per_shard * CACHE_SHARDS * TAR_CACHE_SLAB_SIZE;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        size_t table_size = 4;
+        while (table_size < 2 * per_shard) table_size <<= 1;
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->nslots = per_shard;
+        shard->slots = calloc(per_shard, sizeof(cache_slot_t));
+        shard->table = malloc(table_size * sizeof(int32_t));
+        shard->table_mask = table_size - 1;
+        if (!shard->slots || !shard->table) {
+            tar_cache_free(cache);
+            return NULL;
+        }
+        memset(shard->table, 0xff, table_size * sizeof(int32_t));
+    }
+    return cache;
+}
+
+void tar_cache_free(tar_cache_t *cache) {
+    if (!cache) return;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        if (shard->slots) {
+            for (size_t j = 0; j < shard->nslots; j++) free(shard->slots[j].data);
+        }
+        free(shard->slots);
+        free(shard->table);
+        if (shard->nslots) pthread_mutex_destroy(&shard->lock);
+    }
+    free(cache);
+}
+
+void tar_cache_get_stats(tar_cache_t *cache, tar_cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->budget = cache->budget;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->bytes_used += shard->bytes_used;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/* Returns the table position holding the key, or the empty position to insert it at. */
+static size_t table_find(cache_shard_t *shard, uint64_t archive_id, uint64_t block, uint64_t hash) {
+    size_t pos = hash & shard->table_mask;
+    while (shard->table[pos] >= 0) {
+        cache_slot_t *slot = &shard->slots[shard->table[pos]];
+        if (slot->archive_id == archive_id && slot->block == block) break;
+        pos = (pos + 1) & shard->table_mask;
+    }
+    return pos;
+}
+
+/* Removes the entry at `pos`, shifting back the following entries of its cluster. */
+static void table_remove(cache_shard_t *shard, size_t pos) {
+    size_t next = pos;
+    shard->table[pos] = -1;
+    while (1) {
+        next = (next + 1) & shard->table_mask;
+        if (shard->table[next] < 0) return;
+
+        cache_slot_t *slot = &shard->slots[shard->table[next]];
+        size_t home = key_hash(slot->archive_id, slot->block) & shard->table_mask;
+        // Move the entry back if its home is not between the hole and its position.
+        if (((next - home) & shard->table_mask) >= ((next - pos) & shard->table_mask)) {
+            shard->table[pos] = shard->table[next];
+            shard->table[next] = -1;
+            pos = next;
+        }
+    }
+}
+
+/* Picks the slot to fill next, evicting its current block if needed. */
+static cache_slot_t *clock_victim(cache_shard_t *shard) {
+    while (1) {
+        cache_slot_t *slot = &shard->slots[shard->hand];
+        shard->hand = (shard->hand + 1) % shard->nslots;
+
+        if (!slot->valid) return slot;
+        if (slot->referenced) {
+            slot->referenced = 0;
+            continue;
+        }
+        size_t pos = table_find(shard, slot->archive_id, slot->block,
+                                key_hash(slot->archive_id, slot->block));
+        table_remove(shard, pos);
+        slot->valid = 0;
+        shard->evictions++;
+        return slot;
+    }
+}
+
+/**
+ * Copies up to `len` bytes of block `block` starting at `in_block` into `buf`.
+ * The shard lock is held across the read on a miss, so that two threads missing
+ * on the same block only read it once.
+ */
+static ssize_t cache_read_block(tar_cache_t *cache, uint64_t archive_id, int fd, uint64_t block,
+                                size_t in_block, uint8_t *buf, size_t len, tar_stats_t *stats) {
+    uint64_t hash = key_hash(archive_id, block);
+    cache_shard_t *shard = &cache->shards[(hash >> 32) % CACHE_SHARDS];
+    ssize_t ret;
+
+    pthread_mutex_lock(&shard->lock);
+    size_t pos = table_find(shard, archive_id, block, hash);
+    cache_slot_t *slot;
+    if (shard->table[pos] >= 0) {
+        slot = &shard->slots[shard->table[pos]];
+        shard->hits++;
+        TAR_STATS_ADD(stats, cache_hits, 1);
+    } else {
+        shard->misses++;
+        TAR_STATS_ADD(stats, cache_misses, 1);
+        TAR_PROBE2(cache_miss, archive_id, block);
+        slot = clock_victim(shard);
+        if (!slot->data) {
+            slot->data = malloc(TAR_CACHE_SLAB_SIZE);
+            if (!slot->data) {
+                pthread_mutex_unlock(&shard->lock);
+                return -1;
+            }
+            shard->bytes_used += TAR_CACHE_SLAB_SIZE;
+        }
+        // The slab stays cached: only the end of the archive may cut it short.
+        off_t off = (off_t) (block * TAR_CACHE_SLAB_SIZE);
+        size_t filled = 0;
+        while (filled < TAR_CACHE_SLAB_SIZE) {
+            TAR_PROBE3(io_submit, fd, off + filled, TAR_CACHE_SLAB_SIZE - filled);
+            ssize_t n = pread(fd, slot->data + filled, TAR_CACHE_SLAB_SIZE - filled, off + filled);
+            TAR_PROBE3(io_complete, fd, off + filled, n);
+            TAR_STATS_ADD(stats, syscalls, 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                pthread_mutex_unlock(&shard->lock);
+                return -1;
+            }
+            if (n == 0) break;
+            TAR_STATS_ADD(stats, bytes_read, n);
+            filled += n;
+        }
+        slot->archive_id = archive_id;
+        slot->block = block;
+        slot->len = filled;
+        slot->valid = 1;
+        // The eviction may have shifted the table, look the position up again.
+        pos = table_find(shard, archive_id, block, hash);
+        shard->table[pos] = (int32_t) (slot - shard->slots);
+    }
+    slot->referenced = 1;
+
+    if (in_block >= slot->len) {
+        ret = 0;
+    } else {
+        ret = slot->len - in_block < len ? slot->len - in_block : len;
+        memcpy(buf, slot->data + in_block, ret);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return ret;
+}
+
+ssize_t tar_cache_pread(tar_cache_t *cache, uint64_t archive_id, int fd, void *buf, size_t len, off_t offset) {
+    return tar_cache_read(cache, archive_id, fd, buf, len, offset, NULL);
+}
+
+ssize_t tar_cache_read(tar_cache_t *cache, uint64_t archive_id, int fd, void *buf, size_t len, off_t offset,
+                       tar_stats_t *stats) {
+    uint8_t *dest = buf;
+    size_t total = 0;
+
+    while (total < len) {
+        uint64_t pos = (uint64_t) offset + total;
+        uint64_t block = pos / TAR_CACHE_SLAB_SIZE;
+        size_t in_block = pos % TAR_CACHE_SLAB_SIZE;
+        size_t want = len - total;
+        if (want > TAR_CACHE_SLAB_SIZE - in_block) want = TAR_CACHE_SLAB_SIZE - in_block;
+
+        ssize_t n = cache_read_block(cache, archive_id, fd, block, in_block, dest + total, want, stats);
+        if (n < 0) return total ? (ssize_t) total : -1;
+        total += n;
+        // A short copy means the slab was the last one of the file.
+        if ((size_t) n < want) break;
+    }
+    return total;
+}
@@ -0,0 +1,139 @@
+#include "tar_internal.h"
+
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+
+// <linux/fs.h> has a BLOCK_SIZE of its own, of 1 KiB.
+#undef BLOCK_SIZE
+#define BLOCK_SIZE 512
+
+/*
+ * Members are contiguous in the archive, so copying one is a matter of
+ * asking the kernel to move a range of the archive to another descriptor:
+ * copy_file_range() between files, which may share the extents instead of
+ * copying them (reflink), splice() into pipes and sendfile() to anything
+ * else, sockets included. When the kernel refuses, the data go through
+ * userspace: straight from the mapping of a handle opened with
+ * TAR_OPEN_MMAP, or through a buffer.
+ *
+ * A member whose data line up with the destination on file system blocks is
+ * cloned instead (FICLONERANGE), which only touches metadata: the blocks in
+ * the middle are shared, the unaligned head and tail are copied. Archives
+ * written with TAR_WRITE_ALIGN line up with extracted files.
+ */
+#define COPY_BUF_SIZE (128 * 1024)
+
+typedef enum copy_method {
+    COPY_FILE_RANGE,
+    COPY_SPLICE,
+    COPY_SENDFILE
+} copy_method_t;
+
+/* Picks how to copy to `out`. `block` receives the block size of regular files, 0 otherwise. */
+static copy_method_t pick_method(int out, uint64_t *block) {
+    struct stat st;
+    *block = 0;
+    if (fstat(out, &st) < 0) return COPY_FILE_RANGE;
+    if (!S_ISREG(st.st_mode)) return S_ISFIFO(st.st_mode) ? COPY_SPLICE : COPY_SENDFILE;
+    *block = st.st_blksize;
+    return COPY_FILE_RANGE;
+}
+
+/* Writes all of `buf` at the position of `out`. Returns 0 on success, -1 on error. */
+static int write_all(int out, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(out, buf, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+/* Copies `len` bytes of the archive at `off` to the position of `out`, with `method` when the kernel accepts it. */
+static int copy_range(tar_handle_t *h, copy_method_t method, int out, off_t off, uint64_t len) {
+    loff_t in_off = off;
+    uint64_t done = 0;
+
+    while (done < len) {
+        // Single calls are capped by the kernel anyway (sendfile moves at most 2 GiB minus a page).
+        size_t want = len - done < (1 << 30) ? len - done : (1 << 30);
+        ssize_t n;
+        TAR_PROBE3(io_submit, h->fd, in_off, want);
+        if (method == COPY_FILE_RANGE) n = copy_file_range(h->fd, &in_off, out, NULL, want, 0);
+        else if (method == COPY_SPLICE) n = splice(h->fd, &in_off, out, NULL, want, SPLICE_F_MOVE);
+        else n = sendfile(out, h->fd, &in_off, want);
+        TAR_PROBE3(io_complete, h->fd, in_off, n);
+        TAR_STATS_ADD(h->stats, syscalls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        // Unsupported pairs of descriptors fail right away; the rest is copied below.
+        if (n <= 0) break;
+        TAR_STATS_ADD(h->stats, bytes_read, n);
+        done += n;
+    }
+    if (done == len) return 0;
+
+    if (h->map) {
+        if (off + len > h->map_len) return -1;
+        return write_all(out, h->map + off + done, len - done);
+    }
+    uint8_t buf[COPY_BUF_SIZE];
+    while (done < len) {
+        size_t want = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        ssize_t n = tar_pread(h, buf, want, off + done);
+        if (n <= 0 || write_all(out, buf, n) < 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+/* Shares `len` bytes of the archive at `off` with `out`, at `pos`. Returns 0 on success, -1 if nothing was cloned. */
+static int clone_range(tar_handle_t *h, int out, off_t off, uint64_t len, off_t pos) {
+    struct file_clone_range range = {
+        .src_fd = h->fd,
+        .src_offset = off,
+        .src_length = len,
+        .dest_offset = pos,
+    };
+    TAR_STATS_ADD(h->stats, syscalls, 1);
+    if (ioctl(out, FICLONERANGE, &range) < 0) return -1;
+    // Unlike the copies, the clone does not move the file offset.
+    return lseek(out, pos + len, SEEK_SET) < 0 ? -1 : 0;
+}
+
+int tar_copy_data(tar_handle_t *h, int out, off_t off, uint64_t len) {
+    uint64_t block;
+    copy_method_t method = pick_method(out, &block);
+    off_t pos = block ? lseek(out, 0, SEEK_CUR) : -1;
+
+    // Whole blocks can only be shared when both sides sit at the same place in their blocks.
+    if (pos >= 0 && (uint64_t) pos % block == (uint64_t) off % block) {
+        uint64_t head = (block - off % block) % block;
+        uint64_t bulk = len > head ? (len - head) / block * block : 0;
+        if (bulk > 0) {
+            if (copy_range(h, method, out, off, head) < 0) return -1;
+            off += head;
+            len -= head;
+            if (clone_range(h, out, off, bulk, pos + head) == 0) {
+                off += bulk;
+                len -= bulk;
+            }
+        }
+    }
+    return copy_range(h, method, out, off, len);
+}
+
+ssize_t tar_copy_to_fd(tar_handle_t *h, char *path, size_t offset, size_t len, int out_fd) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_COPY);
+
+    if (!tar_lookup_resolved(h, path, &entry)) return -1;
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return -1;
+    if (offset > entry.size) return -2;
+
+    if (len > entry.size - offset) len = entry.size - offset;
+    if (tar_copy_data(h, out_fd, entry.data_off + offset, len) < 0) return -3;
+    return len;
+}
@@ -0,0 +1,269 @@
+#include "tar_internal.h"
+
+/*
+ * The diff is a merge join of the two sorted indexes. Members present on both
+ * sides are compared by type, size and link target first. Regular files of
+ * equal size whose mtimes differ (or all of them with TAR_DIFF_CONTENT) have
+ * their data compared afterwards: by hash when both handles have hashed their
+ * members, byte for byte otherwise, in 1 MiB chunks spread over the worker
+ * pool so that a single large member is compared by every thread. With a
+ * scan mode on either side, the workers compare runs of members consecutive
+ * in `a` instead, each side of a run read by a single scan. Differences are
+ * reported once everything is compared, in path order.
+ */
+#define DIFF_CHUNK (1 << 20)
+
+typedef struct diff_rec {
+    tar_diff_kind_t kind;
+    size_t pos_a;                  /* SIZE_MAX when absent from `a` */
+    size_t pos_b;                  /* SIZE_MAX when absent from `b` */
+    int compare;                   /* data still to be compared */
+    int meta_changed;              /* mode or mtime differ */
+    int differ;                    /* set by the comparison */
+    off_t off_a, off_b;
+    uint64_t size;
+} diff_rec_t;
+
+typedef struct diff_item {
+    size_t rec;
+    uint64_t offset;
+} diff_item_t;
+
+typedef struct diff_job {
+    tar_handle_t *a, *b;
+    diff_rec_t *recs;
+    diff_item_t *items;
+    tar_scan_item_t *runs_items;   /* with a scan mode, the records to compare in the order of `a` */
+    size_t *runs;
+    int failures;
+} diff_job_t;
+
+static char normal_type(char typeflag) {
+    return typeflag == AREGTYPE ? REGTYPE : typeflag;
+}
+
+static int path_cmp(const tar_index_iter_t *x, const tar_index_iter_t *y) {
+    size_t len = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->path, y->path, len);
+    if (c) return c;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+static void to_stat(const tar_entry_t *entry, tar_stat_t *st) {
+    st->typeflag = entry->typeflag;
+    st->mode = entry->mode;
+    st->size = entry->size;
+    st->mtime = entry->mtime;
+    st->data_offset = entry->data_off;
+}
+
+static void compare_chunk(void *arg, size_t i) {
+    diff_job_t *job = arg;
+    diff_item_t *item = &job->items[i];
+    diff_rec_t *rec = &job->recs[item->rec];
+
+    if (__atomic_load_n(&rec->differ, __ATOMIC_RELAXED)) return;
+    size_t len = rec->size - item->offset < DIFF_CHUNK ? rec->size - item->offset : DIFF_CHUNK;
+    uint8_t *buf = tar_buf_get(&job->a->buffers, 2 * len);
+    if (!buf) {
+        __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (tar_scan_pread(job->a, buf, len, rec->off_a + item->offset) != (ssize_t) len
+        || tar_scan_pread(job->b, buf + len, len, rec->off_b + item->offset) != (ssize_t) len) {
+        __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+    } else if (memcmp(buf, buf + len, len) != 0) {
+        __atomic_store_n(&rec->differ, 1, __ATOMIC_RELAXED);
+    }
+    tar_buf_put(&job->a->buffers, buf, 2 * len);
+}
+
+/* Compares the records of run `k`, with one scan on each side. */
+static void compare_run(void *arg, size_t k) {
+    diff_job_t *job = arg;
+    tar_scan_item_t *first = &job->runs_items[job->runs[k]], *last = &job->runs_items[job->runs[k + 1] - 1];
+    uint8_t *buf = tar_buf_get(&job->a->buffers, 2 * DIFF_CHUNK);
+    tar_scan_t sa, sb;
+    int failures = 0;
+
+    if (!buf) {
+        __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    // The members of the run need not be in the same order in `b`: its scan spans all of them.
+    off_t b_start = job->recs[first->id].off_b, b_end = b_start;
+    for (tar_scan_item_t *item = first; item <= last; item++) {
+        diff_rec_t *rec = &job->recs[item->id];
+        if (rec->off_b < b_start) b_start = rec->off_b;
+        if (rec->off_b + (off_t) rec->size > b_end) b_end = rec->off_b + rec->size;
+    }
+    tar_scan_open_run(&sa, job->a, first, last);
+    tar_scan_open(&sb, job->b, b_start, b_end - b_start);
+    for (tar_scan_item_t *item = first; item <= last; item++) {
+        diff_rec_t *rec = &job->recs[item->id];
+        tar_scan_seek(&sa, rec->off_a);
+        tar_scan_seek(&sb, rec->off_b);
+        for (uint64_t offset = 0; offset < rec->size && !rec->differ; offset += DIFF_CHUNK) {
+            size_t len = rec->size - offset < DIFF_CHUNK ? rec->size - offset : DIFF_CHUNK;
+            if (tar_scan_read(&sa, buf, len) != (ssize_t) len || tar_scan_read(&sb, buf + len, len) != (ssize_t) len) {
+                failures++;
+                break;
+            }
+            rec->differ = memcmp(buf, buf + len, len) != 0;
+        }
+    }
+    tar_scan_close(&sa);
+    tar_scan_close(&sb);
+    tar_buf_put(&job->a->buffers, buf, 2 * DIFF_CHUNK);
+    if (failures) __atomic_add_fetch(&job->failures, failures, __ATOMIC_RELAXED);
+}
+
+/* Compares the records in `items` run by run. Returns 0 on success, -1 on error. */
+static int compare_runs(diff_job_t *job, tar_buf_t *items, int threads) {
+    job->runs_items = (tar_scan_item_t *) items->data;
+    size_t n = items->len / sizeof(tar_scan_item_t);
+    ssize_t nruns = tar_scan_plan(job->runs_items, n, threads, &job->runs);
+    if (nruns >= 0) tar_parallel_for(threads, nruns, compare_run, job);
+    free(job->runs);
+    return nruns < 0 || job->failures ? -1 : 0;
+}
+
+/* Compares the data of the records that need it. Returns 0 on success, -1 on error. */
+static int compare_data(diff_job_t *job, size_t nrecs, int threads) {
+    uint64_t *hashes_a = __atomic_load_n(&job->a->hashes, __ATOMIC_ACQUIRE);
+    uint64_t *hashes_b = __atomic_load_n(&job->b->hashes, __ATOMIC_ACQUIRE);
+    tar_buf_t items = { 0 };
+    int scan_runs = job->a->scanner || job->b->scanner;
+
+    for (size_t r = 0; r < nrecs; r++) {
+        diff_rec_t *rec = &job->recs[r];
+        if (!rec->compare) continue;
+        if (hashes_a && hashes_b) {
+            rec->differ = hashes_a[rec->pos_a] != hashes_b[rec->pos_b];
+            continue;
+        }
+        if (scan_runs) {
+            tar_scan_item_t item = { .off = rec->off_a, .size = rec->size, .id = r };
+            if (tar_buf_append(&items, &item, sizeof(item)) < 0) {
+                free(items.data);
+                return -1;
+            }
+            continue;
+        }
+        for (uint64_t offset = 0; offset < rec->size; offset += DIFF_CHUNK) {
+            diff_item_t item = { .rec = r, .offset = offset };
+            if (tar_buf_append(&items, &item, sizeof(item)) < 0) {
+                free(items.data);
+                return -1;
+            }
+        }
+    }
+    if (scan_runs) {
+        int ret = compare_runs(job, &items, threads);
+        free(items.data);
+        return ret;
+    }
+    job->items = (diff_item_t *) items.data;
+    tar_parallel_for(threads, items.len / sizeof(diff_item_t), compare_chunk, job);
+    free(items.data);
+    return job->failures ? -1 : 0;
+}
+
+/* Joins the two indexes into `recs`, one record per path that may differ. */
+static int join(tar_handle_t *a, tar_handle_t *b, int flags, tar_buf_t *recs) {
+    tar_index_iter_t ia, ib;
+    tar_entry_t ea, eb;
+    int more_a = tar_index_iter_seek(&ia, a->index, 0);
+    int more_b = tar_index_iter_seek(&ib, b->index, 0);
+
+    while (more_a || more_b) {
+        int c = !more_a ? 1 : !more_b ? -1 : path_cmp(&ia, &ib);
+        diff_rec_t rec = { .pos_a = SIZE_MAX, .pos_b = SIZE_MAX };
+
+        if (c < 0) {
+            rec.kind = TAR_DIFF_REMOVED;
+            rec.pos_a = ia.pos;
+            more_a = tar_index_iter_next(&ia);
+        } else if (c > 0) {
+            rec.kind = TAR_DIFF_ADDED;
+            rec.pos_b = ib.pos;
+            more_b = tar_index_iter_next(&ib);
+        } else {
+            rec.pos_a = ia.pos;
+            rec.pos_b = ib.pos;
+            more_a = tar_index_iter_next(&ia);
+            more_b = tar_index_iter_next(&ib);
+
+            tar_index_entry(a->index, rec.pos_a, &ea);
+            tar_index_entry(b->index, rec.pos_b, &eb);
+            char type = normal_type(ea.typeflag);
+            rec.meta_changed = ea.mode != eb.mode || ea.mtime != eb.mtime;
+            if (type != normal_type(eb.typeflag)) {
+                rec.kind = TAR_DIFF_TYPE_CHANGED;
+            } else if (type == REGTYPE && ea.size != eb.size) {
+                rec.kind = TAR_DIFF_CONTENT_CHANGED;
+            } else if ((type == SYMTYPE || type == LNKTYPE) && strcmp(ea.linkname, eb.linkname) != 0) {
+                rec.kind = TAR_DIFF_CONTENT_CHANGED;
+            } else if (type == REGTYPE && ea.size > 0 && (ea.mtime != eb.mtime || (flags & TAR_DIFF_CONTENT))) {
+                // Same size, the data decide.
+                rec.kind = TAR_DIFF_CONTENT_CHANGED;
+                rec.compare = 1;
+                rec.off_a = ea.data_off;
+                rec.off_b = eb.data_off;
+                rec.size = ea.size;
+            } else if (rec.meta_changed) {
+                rec.kind = TAR_DIFF_METADATA_CHANGED;
+            } else {
+                continue;
+            }
+        }
+        if (tar_buf_append(recs, &rec, sizeof(rec)) < 0) return -1;
+    }
+    return 0;
+}
+
+ssize_t tar_diff(tar_handle_t *a, tar_handle_t *b, const tar_diff_options_t *opts, tar_diff_cb_t cb, void *arg) {
+    TAR_STATS_TIME(b->stats, TAR_OP_DIFF);
+    int flags = opts ? opts->flags : 0;
+    tar_buf_t recs = { 0 };
+
+    if (!tar_index_get(a) || !tar_index_get(b)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (join(a, b, flags, &recs) < 0) {
+        free(recs.data);
+        return -1;
+    }
+
+    diff_job_t job = { .a = a, .b = b, .recs = (diff_rec_t *) recs.data };
+    size_t nrecs = recs.len / sizeof(diff_rec_t);
+    if (compare_data(&job, nrecs, opts ? opts->threads : 0) < 0) {
+        free(recs.data);
+        return -1;
+    }
+
+    ssize_t reported = 0;
+    tar_entry_t ea, eb;
+    tar_stat_t sa, sb;
+    for (size_t r = 0; r < nrecs; r++) {
+        diff_rec_t *rec = &job.recs[r];
+        if (rec->compare && !rec->differ) {
+            if (!rec->meta_changed) continue;
+            rec->kind = TAR_DIFF_METADATA_CHANGED;
+        }
+        if (rec->pos_a != SIZE_MAX) {
+            tar_index_entry(a->index, rec->pos_a, &ea);
+            to_stat(&ea, &sa);
+        }
+        if (rec->pos_b != SIZE_MAX) {
+            tar_index_entry(b->index, rec->pos_b, &eb);
+            to_stat(&eb, &sb);
+        }
+        reported++;
+        if (cb(arg, rec->kind, rec->pos_b != SIZE_MAX ? eb.path : ea.path,
+               rec->pos_a != SIZE_MAX ? &sa : NULL, rec->pos_b != SIZE_MAX ? &sb : NULL)) break;
+    }
+    free(recs.data);
+    return reported;
+}
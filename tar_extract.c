@@ -0,0 +1,195 @@
+#include "tar_internal.h"
+
+/*
+ * Extraction runs in three passes over the sorted index:
+ *  1. directories are created, parents first, which the sort order gives for free,
+ *  2. regular files are written in parallel, each with its mode and mtime,
+ *  3. hard links, then symlinks, then FIFOs, then the modes and mtimes of
+ *     directories, deepest first, since writing into a directory changes its mtime.
+ *
+ * Links are only created once every file exists, so a link in the archive can
+ * never redirect the write of a later member outside of the destination.
+ */
+#define EXTRACT_FALLOCATE_MIN (1 << 20)
+
+typedef struct extract_job {
+    tar_handle_t *h;
+    int dirfd;
+    uint64_t fallocate_min;
+    uint32_t mode_mask;            /* bits of the member modes applied */
+    size_t *files;                 /* index positions of the regular files */
+    int failures;
+} extract_job_t;
+
+/* Rejects paths that would land outside of the destination directory. */
+static int safe_path(const char *path) {
+    if (path[0] == '\0' || path[0] == '/') return 0;
+    for (const char *p = path; *p; ) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) return 0;
+        const char *slash = strchr(p, '/');
+        if (!slash) break;
+        p = slash + 1;
+    }
+    return 1;
+}
+
+/**
+ * Creates the directory `dir` (with a trailing slash) and its missing parents.
+ * `last` holds the last directory created, whose components are known to exist.
+ */
+static int ensure_dir(int dirfd, const char *dir, size_t len, char *last, size_t *last_len) {
+    char buf[TAR_PATH_MAX + 1];
+    size_t common = 0;
+
+    while (common < len && common < *last_len && dir[common] == last[common]) common++;
+    if (common == len && *last_len >= len) return 0;
+    // Back up to the last component both paths fully share.
+    while (common > 0 && dir[common - 1] != '/') common--;
+
+    memcpy(buf, dir, len);
+    for (size_t i = common; i < len; i++) {
+        if (buf[i] != '/') continue;
+        buf[i] = '\0';
+        if (mkdirat(dirfd, buf, 0777) < 0 && errno != EEXIST) return -1;
+        buf[i] = '/';
+    }
+    memcpy(last, dir, len);
+    *last_len = len;
+    return 0;
+}
+
+static void set_times(struct timespec times[2], int64_t mtime) {
+    times[0].tv_sec = mtime;
+    times[0].tv_nsec = 0;
+    times[1] = times[0];
+}
+
+static void extract_file(void *arg, size_t i) {
+    extract_job_t *job = arg;
+    tar_entry_t entry;
+    struct timespec times[2];
+
+    tar_index_entry(job->h->index, job->files[i], &entry);
+    int fd = openat(job->dirfd, entry.path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    // Reserving large files up front keeps their extents contiguous. Failure is harmless.
+    if (entry.size >= job->fallocate_min) fallocate(fd, 0, 0, entry.size);
+
+    int ret = tar_copy_data(job->h, fd, entry.data_off, entry.size);
+    set_times(times, entry.mtime);
+    if (ret == 0) ret = fchmod(fd, entry.mode & job->mode_mask);
+    if (ret == 0) ret = futimens(fd, times);
+    if (close(fd) < 0) ret = -1;
+    if (ret < 0) __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+}
+
+/* Creates a link, replacing whatever a previous member left at its path. */
+static int make_link(int dirfd, const tar_entry_t *entry) {
+    char target[TAR_PATH_MAX + 1];
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int ret;
+        if (entry->typeflag == SYMTYPE) {
+            ret = symlinkat(entry->linkname, dirfd, entry->path);
+        } else {
+            if (tar_resolve_link("", entry->linkname, target) < 0 || !safe_path(target)) return -1;
+            ret = linkat(dirfd, target, dirfd, entry->path, 0);
+        }
+        if (ret == 0) return 0;
+        if (errno != EEXIST || unlinkat(dirfd, entry->path, 0) < 0) return -1;
+    }
+    return -1;
+}
+
+int tar_extract(tar_handle_t *h, const char *dest_dir, const tar_extract_options_t *opts) {
+    extract_job_t job = { .h = h, .fallocate_min = EXTRACT_FALLOCATE_MIN };
+    int threads = opts ? opts->threads : 0;
+    int flags = opts ? opts->flags : 0;
+    if (opts && opts->fallocate_min) job.fallocate_min = opts->fallocate_min;
+    job.mode_mask = flags & TAR_EXTRACT_KEEP_SETID ? 07777 : 01777;
+    TAR_STATS_TIME(h->stats, TAR_OP_EXTRACT);
+
+    if (!tar_index_get(h)) {
+        errno = EINVAL;
+        return -1;
+    }
+    mkdir(dest_dir, 0777);
+    job.dirfd = open(dest_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (job.dirfd < 0) return -1;
+
+    size_t count = tar_index_count(h->index);
+    size_t *positions = malloc((count + 1) * sizeof(size_t));
+    if (!positions) {
+        close(job.dirfd);
+        return -1;
+    }
+    size_t nfiles = 0, nlinks = 0;
+    char last[TAR_PATH_MAX + 1];
+    size_t last_len = 0;
+    tar_entry_t entry;
+
+    // Pass 1: directories, including the parents of members that have no entry of their own.
+    // Files fill `positions` from the front, links and directories from the back.
+    for (size_t i = 0; i < count; i++) {
+        tar_index_entry(h->index, i, &entry);
+        char type = entry.typeflag;
+        if (!safe_path(entry.path)) {
+            job.failures++;
+            continue;
+        }
+        const char *slash = strrchr(entry.path, '/');
+        if (type == DIRTYPE) {
+            size_t len = strlen(entry.path);
+            if (entry.path[len - 1] != '/') entry.path[len++] = '/';
+            if (ensure_dir(job.dirfd, entry.path, len, last, &last_len) < 0) job.failures++;
+        } else if (slash && ensure_dir(job.dirfd, entry.path, slash - entry.path + 1, last, &last_len) < 0) {
+            job.failures++;
+            continue;
+        }
+
+        if (type == REGTYPE || type == AREGTYPE || type == CONTTYPE) positions[nfiles++] = i;
+        else if (type == DIRTYPE || type == SYMTYPE || type == LNKTYPE || type == FIFOTYPE) positions[count - ++nlinks] = i;
+        // Devices would need privileges and numbers the index does not keep.
+        else job.failures++;
+    }
+
+    // Pass 2: file data, on the worker pool.
+    job.files = positions;
+    tar_parallel_for(threads, nfiles, extract_file, &job);
+
+    // Pass 3: hard links (while links cannot redirect them yet), symlinks, FIFOs, then directories.
+    // The back of `positions` is in reverse index order, so directories come deepest first.
+    static const char passes[] = { LNKTYPE, SYMTYPE, FIFOTYPE, DIRTYPE };
+    struct timespec times[2];
+    for (size_t p = 0; p < sizeof(passes); p++) {
+        char pass = passes[p];
+        for (size_t k = count - nlinks; k < count; k++) {
+            tar_index_entry(h->index, positions[k], &entry);
+            if (entry.typeflag != pass) continue;
+            set_times(times, entry.mtime);
+            if (pass == DIRTYPE) {
+                if (fchmodat(job.dirfd, entry.path, entry.mode & job.mode_mask, 0) < 0
+                    || utimensat(job.dirfd, entry.path, times, 0) < 0) job.failures++;
+            } else if (pass == FIFOTYPE) {
+                // Replaces what an earlier extraction left at the path.
+                if ((mkfifoat(job.dirfd, entry.path, 0600) < 0
+                     && (errno != EEXIST || unlinkat(job.dirfd, entry.path, 0) < 0
+                         || mkfifoat(job.dirfd, entry.path, 0600) < 0))
+                    || fchmodat(job.dirfd, entry.path, entry.mode & job.mode_mask, 0) < 0
+                    || utimensat(job.dirfd, entry.path, times, 0) < 0) job.failures++;
+            } else if (make_link(job.dirfd, &entry) < 0) {
+                job.failures++;
+            } else if (pass == SYMTYPE) {
+                utimensat(job.dirfd, entry.path, times, AT_SYMLINK_NOFOLLOW);
+            }
+        }
+    }
+
+    if ((flags & TAR_EXTRACT_SYNC) && syncfs(job.dirfd) < 0) job.failures++;
+    free(positions);
+    close(job.dirfd);
+    return job.failures;
+}
@@ -0,0 +1,279 @@
+#include "tar_internal.h"
+
+/*
+ * Queries run over the range of the sorted index that starts with the literal
+ * prefix of the pattern. Glob patterns are compiled once into a list of
+ * components. While walking the range, a directory whose name cannot match its
+ * component, or that is deeper than the pattern, has its whole subtree skipped
+ * with a single lower_bound, as in tar_list.c.
+ */
+
+enum { TOKEN_LITERAL, TOKEN_ANY, TOKEN_STAR, TOKEN_CLASS };
+
+typedef struct glob_token {
+    uint8_t kind;
+    uint8_t literal;
+    uint8_t set[32];               /* TOKEN_CLASS: bitmap of the accepted bytes */
+} glob_token_t;
+
+/* A component of the pattern: the tokens between two slashes, or "**". */
+typedef struct glob_comp {
+    uint16_t first;
+    uint16_t count;
+    int globstar;
+} glob_comp_t;
+
+typedef struct matcher {
+    glob_token_t tokens[TAR_PATH_MAX + 1];
+    glob_comp_t comps[TAR_PATH_MAX / 2 + 1];
+    size_t ncomps;
+    int dir_only;                  /* the pattern ends with a slash */
+} matcher_t;
+
+static void set_add(glob_token_t *token, unsigned char c) {
+    token->set[c >> 3] |= 1 << (c & 7);
+}
+
+/**
+ * Parses the class starting at `p` ('['). Like fnmatch, a class without its
+ * closing bracket is a literal '['.
+ *
+ * @return the number of pattern bytes used, or 0 if there was no class.
+ */
+static size_t parse_class(glob_token_t *token, const char *p, const char *end) {
+    const char *q = p + 1;
+    int negate = 0;
+
+    memset(token->set, 0, sizeof(token->set));
+    if (q < end && (*q == '!' || *q == '^')) {
+        negate = 1;
+        q++;
+    }
+    // A ']' right after the opening bracket is part of the class.
+    for (int first = 1; q < end && (*q != ']' || first); first = 0) {
+        unsigned char lo = *q++, hi = lo;
+        if (q + 1 < end && q[0] == '-' && q[1] != ']') {
+            hi = q[1];
+            q += 2;
+        }
+        for (unsigned c = lo; c <= hi; c++) set_add(token, c);
+    }
+    if (q >= end) return 0;
+
+    if (negate) {
+        for (size_t i = 0; i < sizeof(token->set); i++) token->set[i] = ~token->set[i];
+    }
+    token->kind = TOKEN_CLASS;
+    return q + 1 - p;
+}
+
+/* Compiles `pattern`, of at most TAR_PATH_MAX bytes. */
+static void compile(matcher_t *m, const char *pattern, size_t len) {
+    size_t ntokens = 0, used;
+
+    m->ncomps = 0;
+    m->dir_only = len > 0 && pattern[len - 1] == '/';
+    const char *p = pattern, *end = pattern + len;
+    while (p < end) {
+        const char *slash = memchr(p, '/', end - p);
+        const char *comp_end = slash ? slash : end;
+        glob_comp_t *comp = &m->comps[m->ncomps];
+
+        if (comp_end == p) {
+            // Repeated slashes.
+            p = comp_end + 1;
+            continue;
+        }
+        m->ncomps++;
+        comp->first = ntokens;
+        comp->globstar = comp_end - p == 2 && p[0] == '*' && p[1] == '*';
+        while (!comp->globstar && p < comp_end) {
+            glob_token_t *token = &m->tokens[ntokens];
+            if (*p == '*') {
+                // Consecutive stars match the same thing as a single one.
+                if (ntokens == comp->first || token[-1].kind != TOKEN_STAR) {
+                    token->kind = TOKEN_STAR;
+                    ntokens++;
+                }
+                p++;
+                continue;
+            }
+            if (*p == '?') {
+                token->kind = TOKEN_ANY;
+                p++;
+            } else if (*p == '[' && (used = parse_class(token, p, comp_end))) {
+                p += used;
+            } else {
+                if (*p == '\\' && p + 1 < comp_end) p++;
+                token->kind = TOKEN_LITERAL;
+                token->literal = *p++;
+            }
+            ntokens++;
+        }
+        comp->count = ntokens - comp->first;
+        p = comp_end + 1;
+    }
+}
+
+static int token_accepts(const glob_token_t *token, unsigned char c) {
+    switch (token->kind) {
+    case TOKEN_LITERAL: return token->literal == c;
+    case TOKEN_CLASS: return (token->set[c >> 3] >> (c & 7)) & 1;
+    default: return 1;
+    }
+}
+
+/*
+ * Matches a single path component. Stars are the only tokens of variable
+ * length, so backtracking to the last star seen is enough.
+ */
+static int match_comp(const matcher_t *m, const glob_comp_t *comp, const char *s, size_t len) {
+    const glob_token_t *t = m->tokens + comp->first;
+    size_t nt = comp->count, ti = 0, si = 0;
+    size_t star = SIZE_MAX, star_si = 0;
+
+    while (si < len) {
+        if (ti < nt && t[ti].kind == TOKEN_STAR) {
+            star = ti++;
+            star_si = si;
+        } else if (ti < nt && token_accepts(&t[ti], s[si])) {
+            ti++;
+            si++;
+        } else if (star != SIZE_MAX) {
+            // Let the last star absorb one more byte.
+            ti = star + 1;
+            si = ++star_si;
+        } else {
+            return 0;
+        }
+    }
+    while (ti < nt && t[ti].kind == TOKEN_STAR) ti++;
+    return ti == nt;
+}
+
+/* Matches the components of `path` from the `ci`th component of the pattern on. */
+static int match_from(const matcher_t *m, size_t ci, const char *path, size_t len) {
+    if (ci == m->ncomps) return len == 0;
+
+    const glob_comp_t *comp = &m->comps[ci];
+    if (comp->globstar) {
+        // "**" stands for any number of components, none included.
+        for (;;) {
+            if (match_from(m, ci + 1, path, len)) return 1;
+            if (len == 0) return 0;
+            const char *slash = memchr(path, '/', len);
+            size_t skip = slash ? (size_t) (slash + 1 - path) : len;
+            path += skip;
+            len -= skip;
+        }
+    }
+    if (len == 0) return 0;
+    const char *slash = memchr(path, '/', len);
+    size_t comp_len = slash ? (size_t) (slash - path) : len;
+    if (!match_comp(m, comp, path, comp_len)) return 0;
+    return slash ? match_from(m, ci + 1, slash + 1, len - comp_len - 1) : match_from(m, ci + 1, path + len, 0);
+}
+
+/* Directories are matched without their trailing slash, which only they can match. */
+static int glob_match(const matcher_t *m, const char *path, size_t len) {
+    int is_dir = len > 0 && path[len - 1] == '/';
+    if (is_dir) len--;
+    if (m->dir_only && !is_dir) return 0;
+    return match_from(m, 0, path, len);
+}
+
+/**
+ * Finds the shallowest directory of `path` under which nothing can match.
+ *
+ * @return the length of that directory with its trailing slash, or 0 if every
+ *         directory of `path` may still lead to a match.
+ */
+static size_t prune_len(const matcher_t *m, const char *path, size_t len) {
+    size_t start = 0;
+
+    for (size_t ci = 0; ; ci++) {
+        const char *slash = memchr(path + start, '/', len - start);
+        // Only directories with something below them in `path` can be skipped.
+        if (!slash || (size_t) (slash - path) + 1 == len) return 0;
+        if (ci >= m->ncomps) return slash - path + 1;
+        if (m->comps[ci].globstar) return 0;
+
+        size_t comp_len = slash - path - start;
+        if (ci + 1 == m->ncomps || !match_comp(m, &m->comps[ci], path + start, comp_len)) {
+            return slash - path + 1;
+        }
+        start += comp_len + 1;
+    }
+}
+
+/* Returns the position of the first path that does not start with `prefix`. */
+static size_t prefix_end(const tar_index_t *index, const char *prefix, size_t len) {
+    char key[TAR_PATH_MAX + 1];
+
+    memcpy(key, prefix, len);
+    while (len > 0 && (unsigned char) key[len - 1] == 0xff) len--;
+    if (len == 0) return tar_index_count(index);
+    key[len - 1]++;
+    return tar_index_lower_bound(index, key, len);
+}
+
+ssize_t tar_find_iter(tar_handle_t *h, const char *pattern, int flags,
+                      int (*cb)(void *arg, const tar_index_iter_t *it), void *arg) {
+    size_t len = strlen(pattern);
+    matcher_t *m = NULL;
+    size_t prefix_len = len;
+
+    if (!tar_index_get(h) || len > TAR_PATH_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(flags & TAR_FIND_PREFIX)) {
+        m = malloc(sizeof(matcher_t));
+        if (!m) return -1;
+        compile(m, pattern, len);
+        prefix_len = strcspn(pattern, "*?[\\");
+    }
+
+    tar_index_iter_t it;
+    char key[TAR_PATH_MAX + 1];
+    ssize_t found = 0;
+    size_t end = prefix_end(h->index, pattern, prefix_len);
+    int more = tar_index_iter_seek(&it, h->index, tar_index_lower_bound(h->index, pattern, prefix_len));
+    while (more && it.pos < end) {
+        if (m) {
+            size_t skip = prune_len(m, it.path, it.len);
+            if (skip) {
+                // Every path below "dir/" sorts before "dir0".
+                memcpy(key, it.path, skip);
+                key[skip - 1] = '/' + 1;
+                more = tar_index_iter_seek(&it, h->index, tar_index_lower_bound(h->index, key, skip));
+                continue;
+            }
+            if (!glob_match(m, it.path, it.len)) {
+                more = tar_index_iter_next(&it);
+                continue;
+            }
+        }
+        found++;
+        if (cb(arg, &it)) break;
+        more = tar_index_iter_next(&it);
+    }
+    free(m);
+    return found;
+}
+
+typedef struct find_call {
+    tar_find_cb_t cb;
+    void *arg;
+} find_call_t;
+
+static int call_find_cb(void *arg, const tar_index_iter_t *it) {
+    find_call_t *call = arg;
+    return call->cb(call->arg, it->path, it->len);
+}
+
+ssize_t tar_find(tar_handle_t *h, const char *pattern, int flags, tar_find_cb_t cb, void *arg) {
+    TAR_STATS_TIME(h->stats, TAR_OP_FIND);
+    find_call_t call = { .cb = cb, .arg = arg };
+    return tar_find_iter(h, pattern, flags, call_find_cb, &call);
+}
@@ -0,0 +1,243 @@
+#include "tar_internal.h"
+
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Members are searched in parallel, one member per work item. Each member is
+ * scanned straight from the mapping of a handle opened with TAR_OPEN_MMAP, or
+ * streamed in large reads otherwise. Consecutive reads overlap by the length
+ * of the needle minus one, so that matches across two reads are found once.
+ * With a scan mode, a work item is a run of members consecutive in the
+ * archive instead, read by a single scan.
+ */
+#define GREP_CHUNK (1 << 20)
+
+typedef struct grep_job {
+    tar_handle_t *h;
+    const uint8_t *needle;
+    size_t needle_len;
+    int flags;
+    tar_grep_cb_t cb;
+    void *arg;
+    size_t *members;               /* index positions of the members to search */
+    size_t nmembers;
+    size_t cap;
+    tar_scan_item_t *items;        /* with a scan mode, the same members in archive order */
+    size_t *runs;
+    pthread_mutex_t lock;          /* serialises the callbacks */
+    ssize_t found;
+    int stop;
+    int failed;
+} grep_job_t;
+
+/*
+ * Finds `needle` in `hay`. With SSE2, 16 positions are tested at once against
+ * the first and last bytes of the needle, and only the positions passing both
+ * are compared in full.
+ */
+static const uint8_t *find_needle(const uint8_t *hay, size_t len, const uint8_t *needle, size_t n) {
+    if (n > len) return NULL;
+    if (n == 1) return memchr(hay, needle[0], len);
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8((char) needle[0]);
+    const __m128i last = _mm_set1_epi8((char) needle[n - 1]);
+    size_t i = 0;
+    for (; i + 16 + n - 1 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (hay + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, n - 2) == 0) return hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    hay += i;
+    len -= i;
+#endif
+    return memmem(hay, len, needle, n);
+}
+
+/* Reports a match. Returns 1 once the search must stop. */
+static int report(grep_job_t *job, const char *path, uint64_t offset) {
+    pthread_mutex_lock(&job->lock);
+    int stop = job->stop;
+    if (!stop) {
+        job->found++;
+        if (job->cb(job->arg, path, offset)) stop = job->stop = 1;
+    }
+    pthread_mutex_unlock(&job->lock);
+    return stop;
+}
+
+/**
+ * Searches `len` bytes of member data starting at offset `base` of the member.
+ *
+ * @return 1 if the member is done, because the search stopped or only its first match was wanted.
+ */
+static int scan(grep_job_t *job, const char *path, const uint8_t *data, size_t len, uint64_t base) {
+    const uint8_t *p = data, *end = data + len;
+    const uint8_t *match;
+
+    while ((match = find_needle(p, end - p, job->needle, job->needle_len))) {
+        if (report(job, path, base + (match - data)) || (job->flags & TAR_GREP_FIRST)) return 1;
+        p = match + 1;
+    }
+    return __atomic_load_n(&job->stop, __ATOMIC_RELAXED);
+}
+
+/* Searches the next `size` bytes of `s`, the data of the member at `path`, read through `buf`. */
+static void grep_scan(grep_job_t *job, tar_scan_t *s, const char *path, uint64_t size, uint8_t *buf, size_t chunk) {
+    uint64_t done = 0;
+    size_t have = 0, keep = job->needle_len - 1;
+
+    // `buf` starts with the `have` last bytes of the previous read.
+    while (done < size) {
+        ssize_t n = tar_scan_read(s, buf + have, size - done < chunk ? size - done : chunk);
+        if (n <= 0) {
+            __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (scan(job, path, buf, have + n, done - have)) break;
+        done += n;
+        size_t tail = have + n < keep ? have + n : keep;
+        memmove(buf, buf + have + n - tail, tail);
+        have = tail;
+    }
+}
+
+/* The size of the reads of a member, and the bytes kept from one to the next share the buffer. */
+static size_t grep_chunk(const grep_job_t *job, uint64_t size) {
+    size_t keep = job->needle_len - 1;
+    size_t chunk = keep < GREP_CHUNK / 2 ? GREP_CHUNK - keep : GREP_CHUNK;
+    return chunk < size ? chunk : size;
+}
+
+static void grep_member(void *arg, size_t i) {
+    grep_job_t *job = arg;
+    tar_entry_t entry;
+
+    if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) return;
+    tar_index_entry(job->h->index, job->members[i], &entry);
+    if (job->h->map && !job->h->scanner) {
+        if (entry.data_off + entry.size <= job->h->map_len) {
+            scan(job, entry.path, job->h->map + entry.data_off, entry.size, 0);
+            return;
+        }
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // The tail kept for matches across reads shares the buffer, which stays within a size class of the pool.
+    size_t chunk = grep_chunk(job, entry.size), keep = job->needle_len - 1;
+    uint8_t *buf = tar_buf_get(&job->h->buffers, chunk + keep);
+    if (!buf) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    tar_scan_t s;
+    tar_scan_open(&s, job->h, entry.data_off, entry.size);
+    grep_scan(job, &s, entry.path, entry.size, buf, chunk);
+    tar_scan_close(&s);
+    tar_buf_put(&job->h->buffers, buf, chunk + keep);
+}
+
+/* Searches the members of run `k`, through a single scan. */
+static void grep_run(void *arg, size_t k) {
+    grep_job_t *job = arg;
+    tar_scan_item_t *first = &job->items[job->runs[k]], *last = &job->items[job->runs[k + 1] - 1];
+    size_t chunk = grep_chunk(job, UINT64_MAX), keep = job->needle_len - 1;
+    tar_entry_t entry;
+    tar_scan_t s;
+
+    if (__atomic_load_n(&job->stop, __ATOMIC_RELAXED)) return;
+    uint8_t *buf = tar_buf_get(&job->h->buffers, chunk + keep);
+    if (!buf) {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    tar_scan_open_run(&s, job->h, first, last);
+    for (tar_scan_item_t *item = first; item <= last && !__atomic_load_n(&job->stop, __ATOMIC_RELAXED); item++) {
+        tar_index_entry(job->h->index, item->id, &entry);
+        tar_scan_seek(&s, item->off);
+        grep_scan(job, &s, entry.path, item->size, buf, chunk);
+    }
+    tar_scan_close(&s);
+    tar_buf_put(&job->h->buffers, buf, chunk + keep);
+}
+
+/* Searches the members run by run. Returns 0 on success, -1 if memory ran out. */
+static int grep_runs(grep_job_t *job, int threads) {
+    tar_entry_t entry;
+
+    job->items = malloc((job->nmembers ? job->nmembers : 1) * sizeof(tar_scan_item_t));
+    if (!job->items) return -1;
+    for (size_t i = 0; i < job->nmembers; i++) {
+        tar_index_entry(job->h->index, job->members[i], &entry);
+        job->items[i] = (tar_scan_item_t) { .off = entry.data_off, .size = entry.size, .id = job->members[i] };
+    }
+    ssize_t nruns = tar_scan_plan(job->items, job->nmembers, threads, &job->runs);
+    if (nruns >= 0) tar_parallel_for(threads, nruns, grep_run, job);
+    free(job->items);
+    free(job->runs);
+    return nruns < 0 ? -1 : 0;
+}
+
+/* Collects the regular files selected by the path filter. */
+static int add_member(void *arg, const tar_index_iter_t *it) {
+    grep_job_t *job = arg;
+    tar_entry_t entry;
+
+    tar_index_entry(job->h->index, it->pos, &entry);
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return 0;
+    if (job->nmembers == job->cap) {
+        size_t cap = job->cap ? 2 * job->cap : 256;
+        size_t *members = realloc(job->members, cap * sizeof(size_t));
+        if (!members) {
+            job->failed = 1;
+            return 1;
+        }
+        job->members = members;
+        job->cap = cap;
+    }
+    job->members[job->nmembers++] = it->pos;
+    return 0;
+}
+
+ssize_t tar_grep(tar_handle_t *h, const char *needle, size_t needle_len, const char *path_filter,
+                 const tar_grep_options_t *opts, tar_grep_cb_t cb, void *arg) {
+    TAR_STATS_TIME(h->stats, TAR_OP_GREP);
+    grep_job_t job = {
+        .h = h,
+        .needle = (const uint8_t *) needle,
+        .needle_len = needle_len,
+        .flags = opts ? opts->flags : 0,
+        .cb = cb,
+        .arg = arg,
+    };
+
+    if (!tar_index_get(h) || needle_len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Without a filter, every path starts with the empty prefix.
+    if (tar_find_iter(h, path_filter ? path_filter : "", path_filter ? 0 : TAR_FIND_PREFIX, add_member, &job) < 0
+        || job.failed) {
+        free(job.members);
+        return -1;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    int threads = opts ? opts->threads : 0;
+    if (h->scanner) {
+        if (grep_runs(&job, threads) < 0) job.failed = 1;
+    } else {
+        tar_parallel_for(threads, job.nmembers, grep_member, &job);
+    }
+    pthread_mutex_destroy(&job.lock);
+    free(job.members);
+    return job.failed && !job.stop ? -1 : job.found;
+}
@@ -0,0 +1,377 @@
+#include "tar_internal.h"
+
+int tar_block_is_zero(const void *block) {
+    const uint64_t *words = block;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+        if (words[i]) return 0;
+    }
+    return 1;
+}
+
+void tar_entry_from_header(tar_entry_t *entry, const tar_header_t *header, off_t header_off) {
+    size_t prefix_len = strnlen(header->prefix, sizeof(header->prefix));
+    size_t name_len = strnlen(header->name, sizeof(header->name));
+    size_t link_len = strnlen(header->linkname, sizeof(header->linkname));
+    char *p = entry->path;
+
+    // ustar splits long paths in two, the prefix does not carry the separator.
+    if (prefix_len && strncmp(header->magic, TMAGIC, 5) == 0) {
+        memcpy(p, header->prefix, prefix_len);
+        p += prefix_len;
+        *p++ = '/';
+    }
+    memcpy(p, header->name, name_len);
+    p[name_len] = '\0';
+    memcpy(entry->linkname, header->linkname, link_len);
+    entry->linkname[link_len] = '\0';
+
+    entry->header_off = header_off;
+    entry->data_off = header_off + BLOCK_SIZE;
+    entry->size = tar_parse_num(header->size, sizeof(header->size));
+    entry->mode = tar_parse_num(header->mode, sizeof(header->mode));
+    entry->mtime = tar_parse_num(header->mtime, sizeof(header->mtime));
+    entry->typeflag = header->typeflag;
+}
+
+int tar_resolve_link(const char *link_path, const char *target, char *out) {
+    char buf[2 * TAR_PATH_MAX + 2];
+    size_t len = 0;
+
+    if (target[0] != '/') {
+        // Relative targets start from the directory holding the link.
+        const char *slash = strrchr(link_path, '/');
+        if (slash && slash[1] == '\0') {
+            // The link itself has a trailing slash, skip it.
+            slash = memrchr(link_path, '/', slash - link_path);
+        }
+        if (slash) {
+            len = slash - link_path + 1;
+            memcpy(buf, link_path, len);
+        }
+    }
+    size_t target_len = strlen(target);
+    if (len + target_len >= sizeof(buf)) return -1;
+    memcpy(buf + len, target, target_len + 1);
+
+    // Normalise the path component by component, dropping "." and resolving "..".
+    size_t out_len = 0;
+    char *component = buf;
+    while (*component) {
+        char *end = strchr(component, '/');
+        size_t comp_len = end ? (size_t) (end - component) : strlen(component);
+
+        if (comp_len == 0 || (comp_len == 1 && component[0] == '.')) {
+            // Nothing to add.
+        } else if (comp_len == 2 && component[0] == '.' && component[1] == '.') {
+            if (out_len > 0) {
+                out_len--;
+                while (out_len > 0 && out[out_len - 1] != '/') out_len--;
+            }
+        } else {
+            if (out_len + comp_len + 1 > TAR_PATH_MAX) return -1;
+            memcpy(out + out_len, component, comp_len);
+            out_len += comp_len;
+            if (end) out[out_len++] = '/';
+        }
+        if (!end) break;
+        component = end + 1;
+    }
+    out[out_len] = '\0';
+    return 0;
+}
+
+static void free_readahead(tar_readahead_t *ra) {
+    if (!ra) return;
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
+
+/* Initialises a freshly allocated handle. */
+static int handle_init(tar_handle_t *h, int tar_fd, const tar_options_t *opts) {
+    TAR_STATS_TIME(h->stats, TAR_OP_OPEN);
+
+    h->fd = tar_fd;
+    tar_bufpool_init(&h->buffers);
+    // A made-up identifier could share the cache entries of another archive.
+    if (tar_archive_id(tar_fd, &h->archive_id) < 0) return -1;
+    if (opts) h->cache = opts->cache;
+
+    struct stat st;
+    if (opts && (opts->flags & TAR_OPEN_MMAP) && fstat(tar_fd, &st) == 0 && st.st_size > 0) {
+        // Archives that cannot be mapped are read as usual.
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, tar_fd, 0);
+        if (map != MAP_FAILED) {
+            h->map = map;
+            h->map_len = st.st_size;
+        }
+    }
+
+    if (!opts || !(opts->flags & TAR_OPEN_NO_READAHEAD)) {
+        h->readahead = calloc(1, sizeof(tar_readahead_t));
+        if (!h->readahead) return -1;
+        pthread_mutex_init(&h->readahead->lock, NULL);
+    }
+
+    if (tar_scanner_init(h, opts ? opts->flags : 0) < 0) return -1;
+
+    int lazy = opts ? opts->flags & (TAR_OPEN_LAZY_INDEX | TAR_OPEN_BACKGROUND_INDEX) : 0;
+    if (lazy && !(opts->flags & TAR_OPEN_NO_INDEX)) {
+        h->lazy = tar_lazy_new(h, opts->flags & TAR_OPEN_BACKGROUND_INDEX);
+        if (!h->lazy) return -1;
+    } else if (!opts || !(opts->flags & TAR_OPEN_NO_INDEX)) {
+        h->index = tar_index_build(h);
+        if (!h->index) return -1;
+    }
+    if (opts && (opts->flags & TAR_OPEN_HASH) && tar_hash_members(h, 0) < 0) return -1;
+    return 0;
+}
+
+tar_handle_t *tar_open(int tar_fd, const tar_options_t *opts) {
+    // Hashing at open would complete the index the flags put off.
+    if (opts && (opts->flags & TAR_OPEN_HASH) && (opts->flags & (TAR_OPEN_LAZY_INDEX | TAR_OPEN_BACKGROUND_INDEX))) {
+        errno = EINVAL;
+        return NULL;
+    }
+    tar_handle_t *h = calloc(1, sizeof(tar_handle_t));
+    if (!h) return NULL;
+
+#ifdef TAR_STATS
+    h->stats = calloc(1, sizeof(tar_stats_t));
+    if (!h->stats) {
+        free(h);
+        return NULL;
+    }
+#endif
+    if (handle_init(h, tar_fd, opts) < 0) {
+        // The background index publishes h->index: stop it first.
+        tar_lazy_free(h->lazy);
+        tar_index_free(h->index);
+        if (h->map) munmap((void *) h->map, h->map_len);
+        free(h->hashes);
+        free_readahead(h->readahead);
+        tar_scanner_free(h->scanner);
+        tar_bufpool_destroy(&h->buffers);
+        free(h->stats);
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+void tar_close(tar_handle_t *h) {
+    if (!h) return;
+    tar_lazy_free(h->lazy);
+    tar_index_free(h->index);
+    if (h->map) munmap((void *) h->map, h->map_len);
+    free(h->hashes);
+    free_readahead(h->readahead);
+    tar_scanner_free(h->scanner);
+    tar_bufpool_destroy(&h->buffers);
+    free(h->stats);
+    free(h);
+}
+
+ssize_t tar_pread(tar_handle_t *h, void *buf, size_t len, off_t offset) {
+    if (h->map) {
+        if (offset < 0) return -1;
+        if ((uint64_t) offset >= h->map_len) return 0;
+        if (len > h->map_len - offset) len = h->map_len - offset;
+        memcpy(buf, h->map + offset, len);
+        return len;
+    }
+    if (h->cache) return tar_cache_read(h->cache, h->archive_id, h->fd, buf, len, offset, h->stats);
+
+    size_t total = 0;
+    while (total < len) {
+        TAR_PROBE3(io_submit, h->fd, offset + total, len - total);
+        ssize_t n = pread(h->fd, (uint8_t *) buf + total, len - total, offset + total);
+        TAR_PROBE3(io_complete, h->fd, offset + total, n);
+        TAR_STATS_ADD(h->stats, syscalls, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return total ? (ssize_t) total : -1;
+        }
+        if (n == 0) break;
+        TAR_STATS_ADD(h->stats, bytes_read, n);
+        total += n;
+    }
+    return total;
+}
+
+static int lookup_index(tar_handle_t *h, const tar_index_t *index, const char *path, size_t len,
+                        tar_entry_t *entry) {
+    TAR_STATS_ADD(h->stats, index_probes, 1);
+    ssize_t pos = tar_index_find(index, path, len);
+    if (pos < 0) return 0;
+    tar_index_entry(index, pos, entry);
+    return 1;
+}
+
+static int lookup_scan(tar_handle_t *h, const char *path, size_t len, tar_entry_t *entry) {
+    tar_header_scan_t scan;
+    const tar_header_t *header;
+    off_t off;
+    int found = 0;
+
+    tar_header_scan_open(&scan, h, h->fd, 0);
+    while (!found && (header = tar_header_scan_next(&scan, &off))) {
+        tar_entry_from_header(entry, header, off);
+        found = strncmp(entry->path, path, len) == 0 && entry->path[len] == '\0'
+                && entry->typeflag != XHDTYPE && entry->typeflag != XGLTYPE;
+    }
+    tar_header_scan_close(&scan);
+    return found;
+}
+
+int tar_lookup(tar_handle_t *h, const char *path, size_t len, tar_entry_t *entry) {
+    tar_index_t *index = __atomic_load_n(&h->index, __ATOMIC_ACQUIRE);
+    int found = -1;
+
+    TAR_PROBE2(lookup_begin, path, len);
+    if (!index && h->lazy) {
+        TAR_STATS_ADD(h->stats, index_probes, 1);
+        found = tar_lazy_lookup(h, path, len, entry);
+        // The index was completed by another lookup, or could not be.
+        if (found < 0) index = __atomic_load_n(&h->index, __ATOMIC_ACQUIRE);
+    }
+    if (found < 0) found = index ? lookup_index(h, index, path, len, entry) : lookup_scan(h, path, len, entry);
+    TAR_PROBE2(lookup_end, path, found);
+    return found;
+}
+
+int tar_resolve(tar_lookup_fn_t lookup, void *ctx, const char *path, tar_entry_t *entry) {
+    char buf[TAR_PATH_MAX + 2];
+
+    if (!lookup(ctx, path, strlen(path), entry)) return 0;
+    for (int hops = 0; hops < TAR_MAX_LINK_HOPS; hops++) {
+        if (entry->typeflag == SYMTYPE) {
+            if (tar_resolve_link(entry->path, entry->linkname, buf) < 0) return 0;
+        } else if (entry->typeflag == LNKTYPE) {
+            // Hard link targets are archive paths.
+            if (tar_resolve_link("", entry->linkname, buf) < 0) return 0;
+        } else {
+            return 1;
+        }
+        size_t len = strlen(buf);
+        if (lookup(ctx, buf, len, entry)) continue;
+
+        // Directories are stored with a trailing slash, link targets rarely have one.
+        if (len == 0 || buf[len - 1] == '/') return 0;
+        buf[len] = '/';
+        if (!lookup(ctx, buf, len + 1, entry)) return 0;
+    }
+    return 0;
+}
+
+static int lookup_handle(void *ctx, const char *path, size_t len, tar_entry_t *entry) {
+    return tar_lookup(ctx, path, len, entry);
+}
+
+int tar_lookup_resolved(tar_handle_t *h, const char *path, tar_entry_t *entry) {
+    return tar_resolve(lookup_handle, h, path, entry);
+}
+
+int tar_exists(tar_handle_t *h, char *path) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_EXISTS);
+    return tar_lookup(h, path, strlen(path), &entry);
+}
+
+int tar_is_dir(tar_handle_t *h, char *path) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_IS_DIR);
+    return tar_lookup(h, path, strlen(path), &entry) && entry.typeflag == DIRTYPE;
+}
+
+int tar_is_file(tar_handle_t *h, char *path) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_IS_FILE);
+    return tar_lookup(h, path, strlen(path), &entry) && (entry.typeflag == REGTYPE || entry.typeflag == AREGTYPE);
+}
+
+int tar_is_symlink(tar_handle_t *h, char *path) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_IS_SYMLINK);
+    return tar_lookup(h, path, strlen(path), &entry) && entry.typeflag == SYMTYPE;
+}
+
+int tar_stat(tar_handle_t *h, char *path, tar_stat_t *st) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_STAT);
+
+    if (!tar_lookup(h, path, strlen(path), &entry)) return 0;
+    st->typeflag = entry.typeflag;
+    st->mode = entry.mode;
+    st->size = entry.size;
+    st->mtime = entry.mtime;
+    st->data_offset = entry.data_off;
+    return 1;
+}
+
+int tar_stat_resolved(tar_handle_t *h, char *path, tar_stat_t *st) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_STAT);
+
+    if (!tar_lookup_resolved(h, path, &entry)) return 0;
+    st->typeflag = entry.typeflag;
+    st->mode = entry.mode;
+    st->size = entry.size;
+    st->mtime = entry.mtime;
+    st->data_offset = entry.data_off;
+    return 1;
+}
+
+ssize_t tar_readlink(tar_handle_t *h, char *path, char *buf, size_t size) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_STAT);
+
+    if (!tar_lookup(h, path, strlen(path), &entry) || entry.typeflag != SYMTYPE) return -1;
+    size_t len = strlen(entry.linkname);
+    if (size > 0) {
+        size_t n = len < size - 1 ? len : size - 1;
+        memcpy(buf, entry.linkname, n);
+        buf[n] = '\0';
+    }
+    return len;
+}
+
+int tar_get_index_info(tar_handle_t *h, tar_index_info_t *info) {
+    tar_index_t *index = tar_index_get(h);
+    if (!index) return -1;
+    info->entries = tar_index_count(index);
+    info->index_bytes = tar_index_memory(index, &info->path_bytes, &info->arena_bytes);
+    return 0;
+}
+
+int tar_index_ready(tar_handle_t *h) {
+    return __atomic_load_n(&h->index, __ATOMIC_ACQUIRE) != NULL;
+}
+
+ssize_t tar_read_file(tar_handle_t *h, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_READ_FILE);
+
+    if (!tar_lookup_resolved(h, path, &entry)) return -1;
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return -1;
+    if (offset > entry.size) return -2;
+
+    size_t want = *len;
+    if (want > entry.size - offset) want = entry.size - offset;
+    tar_readahead(h, &entry, offset, want);
+    ssize_t n = tar_pread(h, dest, want, entry.data_off + offset);
+    if (n < 0) return -1;
+    *len = n;
+    return entry.size - offset - n;
+}
+
+int tar_view_file(tar_handle_t *h, char *path, const uint8_t **data, uint64_t *size) {
+    tar_entry_t entry;
+    TAR_STATS_TIME(h->stats, TAR_OP_READ_FILE);
+
+    if (!h->map || !tar_lookup_resolved(h, path, &entry)) return -1;
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return -1;
+    if (entry.data_off + entry.size > h->map_len) return -1;
+    *data = h->map + entry.data_off;
+    *size = entry.size;
+    return 0;
+}
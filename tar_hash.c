@@ -0,0 +1,317 @@
+#include "tar_internal.h"
+
+/*
+ * Members are hashed with xxh64: four independent accumulators consume 32
+ * bytes per round, which keeps the multipliers of a core busy and runs at
+ * several GB/s per thread. Members are spread over the worker pool, and read
+ * straight from the mapping of a handle opened with TAR_OPEN_MMAP. With a
+ * scan mode, the workers take runs of consecutive members instead, each run
+ * read by a single scan.
+ */
+#define HASH_CHUNK (1 << 20)
+
+#define PRIME1 11400714785074694791ULL
+#define PRIME2 14029467366897019727ULL
+#define PRIME3 1609587929392839161ULL
+#define PRIME4 9650029242287828579ULL
+#define PRIME5 2870177450012600261ULL
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME2;
+    return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+    acc ^= xxh_round(0, v);
+    return acc * PRIME1 + PRIME4;
+}
+
+void tar_xxh64_init(tar_xxh64_t *s, uint64_t seed) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = seed + PRIME1 + PRIME2;
+    s->v[1] = seed + PRIME2;
+    s->v[2] = seed;
+    s->v[3] = seed - PRIME1;
+    s->seed = seed;
+}
+
+/* Consumes whole 32-byte stripes, returns the number of bytes used. */
+static size_t consume(uint64_t v[4], const uint8_t *p, size_t len) {
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    size_t done = 0;
+
+    for (; done + 32 <= len; done += 32) {
+        v0 = xxh_round(v0, read64(p + done));
+        v1 = xxh_round(v1, read64(p + done + 8));
+        v2 = xxh_round(v2, read64(p + done + 16));
+        v3 = xxh_round(v3, read64(p + done + 24));
+    }
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    return done;
+}
+
+void tar_xxh64_update(tar_xxh64_t *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    s->total += len;
+    if (s->buffered) {
+        size_t fill = 32 - s->buffered < len ? 32 - s->buffered : len;
+        memcpy(s->buf + s->buffered, p, fill);
+        s->buffered += fill;
+        p += fill;
+        len -= fill;
+        if (s->buffered < 32) return;
+        consume(s->v, s->buf, 32);
+        s->buffered = 0;
+    }
+    size_t used = consume(s->v, p, len);
+    memcpy(s->buf, p + used, len - used);
+    s->buffered = len - used;
+}
+
+uint64_t tar_xxh64_digest(const tar_xxh64_t *s) {
+    uint64_t h;
+
+    if (s->total >= 32) {
+        h = rotl(s->v[0], 1) + rotl(s->v[1], 7) + rotl(s->v[2], 12) + rotl(s->v[3], 18);
+        for (int i = 0; i < 4; i++) h = xxh_merge(h, s->v[i]);
+    } else {
+        h = s->seed + PRIME5;
+    }
+    h += s->total;
+
+    const uint8_t *p = s->buf, *end = s->buf + s->buffered;
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ xxh_round(0, read64(p)), 27) * PRIME1 + PRIME4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (uint64_t) read32(p) * PRIME1, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ *p * PRIME5, 11) * PRIME1;
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Hashes the next `size` bytes of `scan`, read through `buf`. Returns 0 on success, -1 on error. */
+static int hash_scan(tar_scan_t *scan, uint64_t size, uint8_t *buf, size_t chunk, uint64_t *hash) {
+    tar_xxh64_t s;
+
+    tar_xxh64_init(&s, 0);
+    for (uint64_t done = 0; done < size; ) {
+        ssize_t n = tar_scan_read(scan, buf, size - done < chunk ? size - done : chunk);
+        if (n <= 0) return -1;
+        tar_xxh64_update(&s, buf, n);
+        done += n;
+    }
+    *hash = tar_xxh64_digest(&s);
+    return 0;
+}
+
+int tar_hash_entry(tar_handle_t *h, const tar_entry_t *entry, uint64_t *hash) {
+    tar_xxh64_t s;
+
+    tar_xxh64_init(&s, 0);
+    // A scan mode keeps the data out of the page cache, the mapping would bring them in.
+    if (h->map && !h->scanner) {
+        if (entry->data_off + entry->size > h->map_len) return -1;
+        tar_xxh64_update(&s, h->map + entry->data_off, entry->size);
+        *hash = tar_xxh64_digest(&s);
+        return 0;
+    }
+
+    size_t chunk = entry->size < HASH_CHUNK ? entry->size : HASH_CHUNK;
+    uint8_t *buf = tar_buf_get(&h->buffers, chunk);
+    if (!buf) return -1;
+    tar_scan_t scan;
+    tar_scan_open(&scan, h, entry->data_off, entry->size);
+    int ret = hash_scan(&scan, entry->size, buf, chunk, hash);
+    tar_scan_close(&scan);
+    tar_buf_put(&h->buffers, buf, chunk);
+    return ret;
+}
+
+typedef struct hash_job {
+    tar_handle_t *h;
+    uint64_t *hashes;
+    tar_scan_item_t *items;        /* with a scan mode, the regular files in archive order */
+    size_t *runs;
+    int failures;
+} hash_job_t;
+
+static void hash_member(void *arg, size_t i) {
+    hash_job_t *job = arg;
+    tar_entry_t entry;
+
+    tar_index_entry(job->h->index, i, &entry);
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return;
+    if (tar_hash_entry(job->h, &entry, &job->hashes[i]) < 0) __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+}
+
+/* Hashes the members of run `k`, through a single scan. */
+static void hash_run(void *arg, size_t k) {
+    hash_job_t *job = arg;
+    tar_scan_item_t *first = &job->items[job->runs[k]], *last = &job->items[job->runs[k + 1] - 1];
+    uint8_t *buf = tar_buf_get(&job->h->buffers, HASH_CHUNK);
+    tar_scan_t scan;
+    int failures = 0;
+
+    if (!buf) {
+        __atomic_add_fetch(&job->failures, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    tar_scan_open_run(&scan, job->h, first, last);
+    for (tar_scan_item_t *item = first; item <= last; item++) {
+        tar_scan_seek(&scan, item->off);
+        if (hash_scan(&scan, item->size, buf, HASH_CHUNK, &job->hashes[item->id]) < 0) failures++;
+    }
+    tar_scan_close(&scan);
+    tar_buf_put(&job->h->buffers, buf, HASH_CHUNK);
+    if (failures) __atomic_add_fetch(&job->failures, failures, __ATOMIC_RELAXED);
+}
+
+/* Hashes the regular files run by run. Returns 0 on success, -1 on error. */
+static int hash_runs(hash_job_t *job, size_t count, int threads) {
+    tar_entry_t entry;
+    size_t n = 0;
+
+    job->items = malloc((count ? count : 1) * sizeof(tar_scan_item_t));
+    if (!job->items) return -1;
+    for (size_t i = 0; i < count; i++) {
+        tar_index_entry(job->h->index, i, &entry);
+        if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) continue;
+        job->items[n++] = (tar_scan_item_t) { .off = entry.data_off, .size = entry.size, .id = i };
+    }
+    ssize_t nruns = tar_scan_plan(job->items, n, threads, &job->runs);
+    if (nruns >= 0) tar_parallel_for(threads, nruns, hash_run, job);
+    free(job->items);
+    free(job->runs);
+    return nruns < 0 ? -1 : 0;
+}
+
+int tar_hash_members(tar_handle_t *h, int threads) {
+    if (__atomic_load_n(&h->hashes, __ATOMIC_ACQUIRE)) return 0;
+    if (!tar_index_get(h)) return -1;
+
+    size_t count = tar_index_count(h->index);
+    hash_job_t job = { .h = h, .hashes = calloc(count ? count : 1, sizeof(uint64_t)) };
+    if (!job.hashes) return -1;
+    if (h->scanner) {
+        if (hash_runs(&job, count, threads) < 0) job.failures++;
+    } else {
+        tar_parallel_for(threads, count, hash_member, &job);
+    }
+    if (job.failures) {
+        free(job.hashes);
+        return -1;
+    }
+    // Another thread may have hashed the members meanwhile, keep a single table.
+    uint64_t *expected = NULL;
+    if (!__atomic_compare_exchange_n(&h->hashes, &expected, job.hashes, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+        free(job.hashes);
+    }
+    return 0;
+}
+
+int tar_member_hash(tar_handle_t *h, char *path, uint64_t *hash) {
+    TAR_STATS_TIME(h->stats, TAR_OP_HASH);
+    tar_entry_t entry;
+
+    if (!tar_lookup_resolved(h, path, &entry)) return -1;
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return -1;
+
+    uint64_t *hashes = __atomic_load_n(&h->hashes, __ATOMIC_ACQUIRE);
+    if (hashes) {
+        // The entry came from the index, find its position again.
+        ssize_t pos = tar_index_find(h->index, entry.path, strlen(entry.path));
+        if (pos >= 0) {
+            *hash = hashes[pos];
+            return 0;
+        }
+    }
+    return tar_hash_entry(h, &entry, hash);
+}
+
+typedef struct dup_key {
+    uint64_t size;
+    uint64_t hash;
+    size_t pos;
+} dup_key_t;
+
+static int dup_key_cmp(const void *a, const void *b) {
+    const dup_key_t *x = a, *y = b;
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+ssize_t tar_find_duplicates(tar_handle_t *h, int threads, tar_dup_cb_t cb, void *arg) {
+    TAR_STATS_TIME(h->stats, TAR_OP_FIND_DUPLICATES);
+    if (tar_hash_members(h, threads) < 0) return -1;
+
+    size_t count = tar_index_count(h->index), nkeys = 0;
+    dup_key_t *keys = malloc((count ? count : 1) * sizeof(dup_key_t));
+    if (!keys) return -1;
+
+    // Empty files are all alike, they are not reported.
+    tar_entry_t entry;
+    for (size_t i = 0; i < count; i++) {
+        tar_index_entry(h->index, i, &entry);
+        if ((entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) || entry.size == 0) continue;
+        keys[nkeys++] = (dup_key_t) { .size = entry.size, .hash = h->hashes[i], .pos = i };
+    }
+    qsort(keys, nkeys, sizeof(dup_key_t), dup_key_cmp);
+
+    // The views and paths of a group, reused from one group to the next.
+    tar_buf_t views = { 0 }, paths = { 0 };
+    ssize_t groups = 0;
+    for (size_t first = 0, last; first < nkeys; first = last) {
+        for (last = first + 1; last < nkeys && keys[last].size == keys[first].size
+                               && keys[last].hash == keys[first].hash; last++) {
+        }
+        size_t n = last - first;
+        if (n < 2) continue;
+
+        views.len = paths.len = 0;
+        if (tar_buf_reserve(&views, n * sizeof(tar_strview_t)) < 0
+            || tar_buf_reserve(&paths, n * (TAR_PATH_MAX + 1)) < 0) {
+            groups = -1;
+            break;
+        }
+        tar_strview_t *view = (tar_strview_t *) views.data;
+        for (size_t k = first; k < last; k++, view++) {
+            tar_index_entry(h->index, keys[k].pos, &entry);
+            view->len = strlen(entry.path);
+            view->data = memcpy(paths.data + paths.len, entry.path, view->len + 1);
+            paths.len += view->len + 1;
+        }
+        groups++;
+        if (cb(arg, keys[first].hash, keys[first].size, (tar_strview_t *) views.data, n)) break;
+    }
+    free(keys);
+    free(views.data);
+    free(paths.data);
+    return groups;
+}
@@ -0,0 +1,84 @@
+#include "tar_internal.h"
+
+void tar_header_scan_open(tar_header_scan_t *s, tar_handle_t *h, int fd, off_t start) {
+    memset(s, 0, sizeof(*s));
+    s->h = h;
+    s->fd = h ? h->fd : fd;
+    s->pool = h ? &h->buffers : &tar_global_buffers;
+#ifdef TAR_STATS
+    s->stats = h ? h->stats : &tar_global_stats;
+#endif
+    s->next = start;
+    s->win_size = TAR_WINDOW_MIN;
+    if (h && h->map) {
+        // The whole archive is one window.
+        s->window = h->map;
+        s->win_len = h->map_len;
+    }
+}
+
+/* Reads `len` bytes at `off` without a handle. Returns the bytes read, -1 on error. */
+static ssize_t read_fd(tar_header_scan_t *s, uint8_t *buf, size_t len, off_t off) {
+    size_t total = 0;
+
+    while (total < len) {
+        TAR_PROBE3(io_submit, s->fd, off + total, len - total);
+        ssize_t n = pread(s->fd, buf + total, len - total, off + total);
+        TAR_PROBE3(io_complete, s->fd, off + total, n);
+        TAR_STATS_ADD(s->stats, syscalls, 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return total ? (ssize_t) total : -1;
+        if (n == 0) break;
+        TAR_STATS_ADD(s->stats, bytes_read, n);
+        total += n;
+    }
+    return total;
+}
+
+/* Reads the window starting at the next header. Returns 0 on success, -1 at the end of the archive or on error. */
+static int refill(tar_header_scan_t *s) {
+    if (s->h && s->h->map) return -1;
+    if (!s->buf) {
+        s->buf = tar_buf_get(s->pool, TAR_WINDOW_MAX);
+        if (!s->buf) {
+            s->error = 1;
+            return -1;
+        }
+        s->window = s->buf;
+    } else if (s->headers > 1 || s->next - (off_t) (s->win_off + s->win_len) < (off_t) s->win_size) {
+        // Less than a window of member data was skipped: reading ahead pays.
+        s->win_size = s->win_size < TAR_WINDOW_MIN ? TAR_WINDOW_MIN : s->win_size * 2;
+        if (s->win_size > TAR_WINDOW_MAX) s->win_size = TAR_WINDOW_MAX;
+    } else {
+        // The member data skipped more than the window: only read the header of large members.
+        s->win_size = BLOCK_SIZE;
+    }
+
+    ssize_t n = s->h ? tar_pread(s->h, s->buf, s->win_size, s->next) : read_fd(s, s->buf, s->win_size, s->next);
+    if (n < 0) s->error = 1;
+    s->win_off = s->next;
+    s->win_len = n > 0 ? n : 0;
+    s->headers = 0;
+    return s->win_len >= BLOCK_SIZE ? 0 : -1;
+}
+
+const tar_header_t *tar_header_scan_next(tar_header_scan_t *s, off_t *off) {
+    // The next header may be past the window, or cut by its end.
+    if (s->next < s->win_off || (uint64_t) (s->next - s->win_off) + BLOCK_SIZE > s->win_len) {
+        if (refill(s) < 0) return NULL;
+    }
+    const tar_header_t *header = (const tar_header_t *) (s->window + (s->next - s->win_off));
+    if (tar_block_is_zero(header)) return NULL;
+
+    *off = s->next;
+    s->headers++;
+    s->next += BLOCK_SIZE + tar_padded(tar_parse_num(header->size, sizeof(header->size)));
+    TAR_STATS_ADD(s->stats, headers_parsed, 1);
+    TAR_PROBE3(header_parsed, s->fd, *off, header->name);
+    return header;
+}
+
+void tar_header_scan_close(tar_header_scan_t *s) {
+    tar_buf_put(s->pool, s->buf, TAR_WINDOW_MAX);
+    s->buf = NULL;
+}
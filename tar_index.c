@@ -0,0 +1,768 @@
+#include "tar_internal.h"
+
+/*
+ * The index maps every path of the archive to the fields of its header, in a
+ * layout meant to stay small for archives of tens of millions of entries.
+ *
+ * Entries are sorted by path and stored as parallel arrays:
+ *  - paths are front-coded (length shared with the previous path, then the
+ *    new suffix) in a single arena, with a restart every GROUP_SIZE entries
+ *    so that any entry can be decoded from at most GROUP_SIZE paths,
+ *  - header offsets are 40-bit block numbers (512 TiB of archive),
+ *  - sizes are varints, also with a restart every GROUP_SIZE entries,
+ *  - type flags take one byte, permission bits two and mtimes four,
+ *  - the few link names live in a side table searched by position.
+ *
+ * Lookups first go through a split block Bloom filter: each path sets one bit
+ * in each of the 8 words of a 64-byte block, so a query touches a single cache
+ * line and rejects most absent paths without probing the hash table. The hash
+ * table stores positions and an 8-bit tag of the hash, so that a probe only
+ * decodes a path when the tags match.
+ */
+#define GROUP_SIZE 16
+#define OFFSET_BYTES 5
+#define BLOOM_BITS_PER_ENTRY 16
+#define BLOOM_BLOCK_WORDS 8
+
+struct tar_index {
+    size_t count;
+    size_t path_bytes;             /* sum of the lengths of the paths */
+    uint8_t *paths;
+    size_t paths_len;
+    uint64_t *path_groups;         /* where each group of paths starts in `paths` */
+    uint8_t *offsets;
+    uint8_t *sizes;
+    uint64_t *size_groups;         /* where each group of sizes starts in `sizes` */
+    uint8_t *types;
+    uint16_t *modes;
+    uint32_t *mtimes;
+    size_t nlinks;
+    uint32_t *link_entries;        /* sorted positions of the entries with a link name */
+    uint64_t *link_offsets;        /* offsets of their NUL-terminated names in `links` */
+    char *links;
+    uint32_t *table;               /* position + 1, 0 when empty */
+    uint8_t *tags;
+    size_t table_size;
+    uint64_t *bloom;
+    size_t bloom_blocks;
+    size_t memory;
+};
+
+/* A header collected during the scan, before the index is sorted and packed. */
+typedef struct staged {
+    uint64_t path_off;             /* in the staging arena */
+    uint64_t link_off;
+    uint64_t header_off;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t path_len;
+    uint32_t link_len;
+    uint32_t mode;
+    char typeflag;
+} staged_t;
+
+uint64_t tar_hash_path(const char *path, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (len * 0xff51afd7ed558ccdULL);
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, path, 8);
+        h = (h ^ (word * 0x87c37b91114253d5ULL)) * 0x4cf5ad432745937fULL;
+        h = (h << 31) | (h >> 33);
+        path += 8;
+        len -= 8;
+    }
+    word = 0;
+    memcpy(&word, path, len);
+    h ^= word * 0x87c37b91114253d5ULL;
+    return tar_mix64(h);
+}
+
+/* Maps a hash to [0, n) without a division. */
+static size_t reduce(uint64_t hash, size_t n) {
+    return (size_t) (((unsigned __int128) hash * n) >> 64);
+}
+
+static size_t varint_put(uint8_t *out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
+    return n;
+}
+
+static uint64_t varint_get(const uint8_t *in, size_t *pos) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (in[*pos] & 0x80) {
+        value |= (uint64_t) (in[(*pos)++] & 0x7f) << shift;
+        shift += 7;
+    }
+    return value | (uint64_t) in[(*pos)++] << shift;
+}
+
+static int path_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static void bloom_add(tar_index_t *index, uint64_t hash) {
+    uint64_t *block = index->bloom + reduce(hash, index->bloom_blocks) * BLOOM_BLOCK_WORDS;
+    uint64_t bits = tar_mix64(hash);
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) block[i] |= 1ULL << ((bits >> (6 * i)) & 63);
+}
+
+static int bloom_may_contain(const tar_index_t *index, uint64_t hash) {
+    const uint64_t *block = index->bloom + reduce(hash, index->bloom_blocks) * BLOOM_BLOCK_WORDS;
+    uint64_t bits = tar_mix64(hash);
+    uint64_t missing = 0;
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) missing |= ~block[i] & (1ULL << ((bits >> (6 * i)) & 63));
+    return missing == 0;
+}
+
+static void iter_decode(tar_index_iter_t *it) {
+    const uint8_t *paths = it->index->paths;
+    size_t shared = varint_get(paths, &it->next_byte);
+    size_t suffix = varint_get(paths, &it->next_byte);
+
+    memcpy(it->path + shared, paths + it->next_byte, suffix);
+    it->next_byte += suffix;
+    it->len = shared + suffix;
+    it->path[it->len] = '\0';
+}
+
+int tar_index_iter_seek(tar_index_iter_t *it, const tar_index_t *index, size_t pos) {
+    it->index = index;
+    if (pos >= index->count) {
+        it->pos = index->count;
+        return 0;
+    }
+    size_t first = pos - pos % GROUP_SIZE;
+    it->next_byte = index->path_groups[first / GROUP_SIZE];
+    for (size_t i = first; i <= pos; i++) iter_decode(it);
+    it->pos = pos;
+    return 1;
+}
+
+int tar_index_iter_next(tar_index_iter_t *it) {
+    if (it->pos + 1 >= it->index->count) {
+        it->pos = it->index->count;
+        return 0;
+    }
+    iter_decode(it);
+    it->pos++;
+    return 1;
+}
+
+static int staged_cmp(const void *a, const void *b, void *arena) {
+    const staged_t *x = a, *y = b;
+    int c = path_cmp((char *) arena + x->path_off, x->path_len, (char *) arena + y->path_off, y->path_len);
+    if (c) return c;
+    // Like the linear scan, the first header of a path wins.
+    return (x->header_off > y->header_off) - (x->header_off < y->header_off);
+}
+
+/* Stages the header at `off` into `staged` and its path arena. Returns 1 if staged, 0 if skipped, -1 on error. */
+static int stage(tar_buf_t *staged, tar_buf_t *arena, const tar_header_t *header, off_t off) {
+    tar_entry_t entry;
+
+    tar_entry_from_header(&entry, header, off);
+    // Pax headers describe the member after them, they are not members.
+    if (entry.typeflag == XHDTYPE || entry.typeflag == XGLTYPE) return 0;
+
+    staged_t s = {
+        .path_off = arena->len,
+        .path_len = strlen(entry.path),
+        .link_len = strlen(entry.linkname),
+        .header_off = off,
+        .size = entry.size,
+        .mode = entry.mode,
+        .mtime = entry.mtime,
+        .typeflag = entry.typeflag,
+    };
+    if (tar_buf_append(arena, entry.path, s.path_len) < 0) return -1;
+    s.link_off = arena->len;
+    if (tar_buf_append(arena, entry.linkname, s.link_len) < 0) return -1;
+    if (tar_buf_append(staged, &s, sizeof(s)) < 0) return -1;
+    return 1;
+}
+
+/* Scans every header of the archive into `staged` and its path arena. */
+static int collect(tar_handle_t *h, tar_buf_t *staged, tar_buf_t *arena) {
+    tar_header_scan_t scan;
+    const tar_header_t *header;
+    off_t off;
+    int ret = 0;
+
+    tar_header_scan_open(&scan, h, h->fd, 0);
+    while (ret >= 0 && (header = tar_header_scan_next(&scan, &off))) ret = stage(staged, arena, header, off);
+    // A failed read is not the end of the archive: the index would miss what follows.
+    if (scan.error) ret = -1;
+    tar_header_scan_close(&scan);
+    return ret < 0 ? -1 : 0;
+}
+
+/* Packs the sorted, deduplicated headers into the compact layout. */
+static int pack(tar_index_t *index, const staged_t *staged, const char *arena) {
+    size_t n = index->count;
+    size_t ngroups = (n + GROUP_SIZE - 1) / GROUP_SIZE;
+    tar_buf_t paths = {0}, sizes = {0}, links = {0};
+    uint8_t varint[20];
+
+    index->path_groups = malloc((ngroups + 1) * sizeof(uint64_t));
+    index->size_groups = malloc((ngroups + 1) * sizeof(uint64_t));
+    index->offsets = malloc(n * OFFSET_BYTES + 1);
+    index->types = malloc(n + 1);
+    index->modes = malloc(n * sizeof(uint16_t) + 1);
+    index->mtimes = malloc(n * sizeof(uint32_t) + 1);
+    if (!index->path_groups || !index->size_groups || !index->offsets || !index->types || !index->modes
+        || !index->mtimes) goto error;
+
+    for (size_t i = 0; i < n; i++) {
+        const staged_t *s = &staged[i];
+        const char *path = arena + s->path_off;
+        size_t shared = 0;
+
+        if (i % GROUP_SIZE == 0) {
+            index->path_groups[i / GROUP_SIZE] = paths.len;
+            index->size_groups[i / GROUP_SIZE] = sizes.len;
+        } else {
+            const staged_t *prev = &staged[i - 1];
+            const char *prev_path = arena + prev->path_off;
+            size_t max = s->path_len < prev->path_len ? s->path_len : prev->path_len;
+            while (shared < max && path[shared] == prev_path[shared]) shared++;
+        }
+        size_t vlen = varint_put(varint, shared);
+        vlen += varint_put(varint + vlen, s->path_len - shared);
+        if (tar_buf_append(&paths, varint, vlen) < 0) goto error;
+        if (tar_buf_append(&paths, path + shared, s->path_len - shared) < 0) goto error;
+        if (tar_buf_append(&sizes, varint, varint_put(varint, s->size)) < 0) goto error;
+
+        uint64_t block = s->header_off / BLOCK_SIZE;
+        for (int b = 0; b < OFFSET_BYTES; b++) index->offsets[i * OFFSET_BYTES + b] = block >> (8 * b);
+        index->types[i] = s->typeflag;
+        index->modes[i] = s->mode & 07777;
+        // Unsigned 32-bit seconds last until 2106.
+        index->mtimes[i] = s->mtime < 0 ? 0 : s->mtime > UINT32_MAX ? UINT32_MAX : s->mtime;
+        index->path_bytes += s->path_len;
+        if (s->link_len) index->nlinks++;
+    }
+
+    index->link_entries = malloc(index->nlinks * sizeof(uint32_t) + 1);
+    index->link_offsets = malloc(index->nlinks * sizeof(uint64_t) + 1);
+    if (!index->link_entries || !index->link_offsets) goto error;
+    for (size_t i = 0, l = 0; i < n; i++) {
+        if (!staged[i].link_len) continue;
+        index->link_entries[l] = i;
+        index->link_offsets[l++] = links.len;
+        if (tar_buf_append(&links, arena + staged[i].link_off, staged[i].link_len) < 0) goto error;
+        if (tar_buf_append(&links, "", 1) < 0) goto error;
+    }
+
+    // Give the arenas back their slack, they are never appended to again.
+    // A failed shrink keeps the larger buffer.
+    void *shrunk = paths.len ? realloc(paths.data, paths.len) : NULL;
+    index->paths = shrunk ? shrunk : paths.data;
+    index->paths_len = paths.len;
+    shrunk = sizes.len ? realloc(sizes.data, sizes.len) : NULL;
+    index->sizes = shrunk ? shrunk : sizes.data;
+    shrunk = links.len ? realloc(links.data, links.len) : NULL;
+    index->links = shrunk ? shrunk : (char *) links.data;
+    index->memory = sizeof(tar_index_t) + paths.len + sizes.len + links.len
+                    + 2 * (ngroups + 1) * sizeof(uint64_t) + n * (OFFSET_BYTES + 1 + sizeof(uint16_t) + sizeof(uint32_t))
+                    + index->nlinks * (sizeof(uint32_t) + sizeof(uint64_t));
+    return 0;
+
+error:
+    free(paths.data);
+    free(sizes.data);
+    free(links.data);
+    return -1;
+}
+
+/* Sizes the hash table and the Bloom filter for the packed entries and fills them. */
+static int seal(tar_index_t *index) {
+    index->table_size = index->count + index->count / 2 + 1;
+    index->bloom_blocks = (index->count * BLOOM_BITS_PER_ENTRY) / (BLOOM_BLOCK_WORDS * 64) + 1;
+    index->table = calloc(index->table_size, sizeof(uint32_t));
+    index->tags = malloc(index->table_size);
+    index->bloom = calloc(index->bloom_blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+    if (!index->table || !index->tags || !index->bloom) return -1;
+    index->memory += index->table_size * (sizeof(uint32_t) + 1)
+                     + index->bloom_blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+
+    tar_index_iter_t it;
+    for (int more = tar_index_iter_seek(&it, index, 0); more; more = tar_index_iter_next(&it)) {
+        uint64_t hash = tar_hash_path(it.path, it.len);
+        size_t pos = reduce(hash, index->table_size);
+
+        while (index->table[pos]) pos = pos + 1 == index->table_size ? 0 : pos + 1;
+        index->table[pos] = it.pos + 1;
+        index->tags[pos] = (uint8_t) hash;
+        bloom_add(index, hash);
+    }
+    return 0;
+}
+
+/* Sorts, deduplicates and packs the `n` staged headers, which are reordered in place. */
+static tar_index_t *build(staged_t *staged, size_t n, const char *arena) {
+    tar_index_t *index = calloc(1, sizeof(tar_index_t));
+    if (!index) return NULL;
+
+    qsort_r(staged, n, sizeof(staged_t), staged_cmp, (void *) arena);
+
+    // Keep the first header of every path.
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        const staged_t *s = &staged[i];
+        if (count > 0) {
+            const staged_t *last = &staged[count - 1];
+            if (path_cmp(arena + s->path_off, s->path_len, arena + last->path_off, last->path_len) == 0) continue;
+        }
+        staged[count++] = *s;
+    }
+    index->count = count;
+
+    if (pack(index, staged, arena) < 0 || seal(index) < 0) {
+        tar_index_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+tar_index_t *tar_index_build(tar_handle_t *h) {
+    tar_buf_t staging = {0}, arena = {0};
+    tar_index_t *index = NULL;
+
+    if (collect(h, &staging, &arena) == 0) {
+        index = build((staged_t *) staging.data, staging.len / sizeof(staged_t), (char *) arena.data);
+    }
+    free(staging.data);
+    free(arena.data);
+    return index;
+}
+
+void tar_index_free(tar_index_t *index) {
+    if (!index) return;
+    free(index->paths);
+    free(index->path_groups);
+    free(index->offsets);
+    free(index->sizes);
+    free(index->size_groups);
+    free(index->types);
+    free(index->modes);
+    free(index->mtimes);
+    free(index->link_entries);
+    free(index->link_offsets);
+    free(index->links);
+    free(index->table);
+    free(index->tags);
+    free(index->bloom);
+    free(index);
+}
+
+size_t tar_index_count(const tar_index_t *index) {
+    return index->count;
+}
+
+size_t tar_index_memory(const tar_index_t *index, size_t *path_bytes, size_t *arena_bytes) {
+    if (path_bytes) *path_bytes = index->path_bytes;
+    if (arena_bytes) *arena_bytes = index->paths_len;
+    return index->memory;
+}
+
+ssize_t tar_index_find(const tar_index_t *index, const char *path, size_t len) {
+    uint64_t hash = tar_hash_path(path, len);
+    tar_index_iter_t it;
+
+    if (!bloom_may_contain(index, hash)) return -1;
+    size_t pos = reduce(hash, index->table_size);
+    while (index->table[pos]) {
+        if (index->tags[pos] == (uint8_t) hash) {
+            size_t i = index->table[pos] - 1;
+            tar_index_iter_seek(&it, index, i);
+            if (it.len == len && memcmp(it.path, path, len) == 0) return i;
+        }
+        pos = pos + 1 == index->table_size ? 0 : pos + 1;
+    }
+    return -1;
+}
+
+void tar_index_entry(const tar_index_t *index, size_t i, tar_entry_t *entry) {
+    tar_index_iter_t it;
+    tar_index_iter_seek(&it, index, i);
+    memcpy(entry->path, it.path, it.len + 1);
+
+    uint64_t block = 0;
+    for (int b = 0; b < OFFSET_BYTES; b++) block |= (uint64_t) index->offsets[i * OFFSET_BYTES + b] << (8 * b);
+    entry->header_off = block * BLOCK_SIZE;
+    entry->data_off = entry->header_off + BLOCK_SIZE;
+
+    size_t pos = index->size_groups[i / GROUP_SIZE];
+    for (size_t j = i - i % GROUP_SIZE; j < i; j++) varint_get(index->sizes, &pos);
+    entry->size = varint_get(index->sizes, &pos);
+
+    entry->typeflag = index->types[i];
+    entry->mode = index->modes[i];
+    entry->mtime = index->mtimes[i];
+    entry->linkname[0] = '\0';
+
+    size_t lo = 0, hi = index->nlinks;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (index->link_entries[mid] < i) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo < index->nlinks && index->link_entries[lo] == i) {
+        strcpy(entry->linkname, index->links + index->link_offsets[lo]);
+    }
+}
+
+size_t tar_index_lower_bound(const tar_index_t *index, const char *key, size_t len) {
+    size_t ngroups = (index->count + GROUP_SIZE - 1) / GROUP_SIZE;
+    tar_index_iter_t it;
+
+    // Find the first group whose first path is not smaller than the key...
+    size_t lo = 0, hi = ngroups;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        tar_index_iter_seek(&it, index, mid * GROUP_SIZE);
+        if (path_cmp(it.path, it.len, key, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    // ... the answer is in the group before it, or is that group's first path.
+    size_t end = lo * GROUP_SIZE < index->count ? lo * GROUP_SIZE : index->count;
+    for (int more = tar_index_iter_seek(&it, index, (lo - 1) * GROUP_SIZE); more && it.pos < end;
+         more = tar_index_iter_next(&it)) {
+        if (path_cmp(it.path, it.len, key, len) >= 0) return it.pos;
+    }
+    return end;
+}
+
+/*
+ * A lazy index stages headers as lookups need them, in the same form as the
+ * full build, and finds them through an open-addressing table over the
+ * staged positions. A miss resumes the scan where the last one stopped, so
+ * no part of the archive is read twice. Once the scan reaches the end of the
+ * archive, the staged headers are packed into the usual index, which serves
+ * every lookup from then on.
+ *
+ * A background index is the same table, filled by a thread of its own that
+ * scans the whole archive. It parses a batch of headers without the lock and
+ * only takes it to append the batch, so lookups of the paths behind its
+ * frontier are answered at once; lookups past the frontier wait for the next
+ * batch. Batches start small, so that the first members come early. Packing
+ * works on a copy of the staged headers, and the table keeps answering until
+ * the index is published. A failed read ends the thread without an index:
+ * the waiters see the failure, and lookups fall back to scans.
+ */
+#define LAZY_TABLE_MIN 1024
+#define LAZY_BATCH_MIN 64
+#define LAZY_BATCH_MAX 1024
+
+struct tar_lazy {
+    pthread_mutex_t lock;
+    pthread_cond_t progress;       /* signalled when headers are staged or the index is published */
+    tar_handle_t *h;
+    tar_header_scan_t scan;        /* stopped after the last staged header */
+    tar_buf_t staging;             /* headers staged so far, in archive order */
+    tar_buf_t arena;
+    uint32_t *table;               /* staged position + 1, 0 when empty */
+    size_t table_size;             /* a power of two */
+    size_t count;                  /* paths in the table */
+    int done;                      /* the scan reached the end of the archive */
+    int building;                  /* the index is being packed, without the lock */
+    int background;                /* the scan belongs to `thread` */
+    int stop;                      /* the handle is closing */
+    pthread_t thread;
+};
+
+static void *lazy_thread(void *arg);
+
+tar_lazy_t *tar_lazy_new(tar_handle_t *h, int background) {
+    tar_lazy_t *lazy = calloc(1, sizeof(tar_lazy_t));
+    if (!lazy) return NULL;
+    lazy->table_size = LAZY_TABLE_MIN;
+    lazy->table = calloc(lazy->table_size, sizeof(uint32_t));
+    if (!lazy->table) {
+        free(lazy);
+        return NULL;
+    }
+    pthread_mutex_init(&lazy->lock, NULL);
+    pthread_cond_init(&lazy->progress, NULL);
+    lazy->h = h;
+    tar_header_scan_open(&lazy->scan, h, h->fd, 0);
+    if (background) {
+        if (pthread_create(&lazy->thread, NULL, lazy_thread, lazy) != 0) {
+            tar_lazy_free(lazy);
+            return NULL;
+        }
+        lazy->background = 1;
+    }
+    return lazy;
+}
+
+void tar_lazy_free(tar_lazy_t *lazy) {
+    if (!lazy) return;
+    if (lazy->background) {
+        pthread_mutex_lock(&lazy->lock);
+        lazy->stop = 1;
+        pthread_mutex_unlock(&lazy->lock);
+        pthread_join(lazy->thread, NULL);
+    }
+    tar_header_scan_close(&lazy->scan);
+    free(lazy->staging.data);
+    free(lazy->arena.data);
+    free(lazy->table);
+    pthread_cond_destroy(&lazy->progress);
+    pthread_mutex_destroy(&lazy->lock);
+    free(lazy);
+}
+
+static const staged_t *lazy_staged(const tar_lazy_t *lazy, size_t i) {
+    return (const staged_t *) lazy->staging.data + i;
+}
+
+/* Returns the slot holding `path`, or the empty slot where it would go. */
+static size_t lazy_slot(const tar_lazy_t *lazy, const uint32_t *table, size_t size, const char *path, size_t len) {
+    size_t pos = tar_hash_path(path, len) & (size - 1);
+    while (table[pos]) {
+        const staged_t *s = lazy_staged(lazy, table[pos] - 1);
+        if (path_cmp((char *) lazy->arena.data + s->path_off, s->path_len, path, len) == 0) break;
+        pos = (pos + 1) & (size - 1);
+    }
+    return pos;
+}
+
+/* Adds the last staged header to the table, unless its path is there already. Returns 0 on success, -1 on error. */
+static int lazy_insert(tar_lazy_t *lazy) {
+    if ((lazy->count + 1) * 2 > lazy->table_size) {
+        size_t size = lazy->table_size * 2;
+        uint32_t *table = calloc(size, sizeof(uint32_t));
+        if (!table) return -1;
+        for (size_t i = 0; i < lazy->table_size; i++) {
+            if (!lazy->table[i]) continue;
+            const staged_t *s = lazy_staged(lazy, lazy->table[i] - 1);
+            table[lazy_slot(lazy, table, size, (char *) lazy->arena.data + s->path_off, s->path_len)] = lazy->table[i];
+        }
+        free(lazy->table);
+        lazy->table = table;
+        lazy->table_size = size;
+    }
+
+    size_t i = lazy->staging.len / sizeof(staged_t) - 1;
+    const staged_t *s = lazy_staged(lazy, i);
+    size_t pos = lazy_slot(lazy, lazy->table, lazy->table_size, (char *) lazy->arena.data + s->path_off, s->path_len);
+    // Like the full build, the first header of a path wins.
+    if (!lazy->table[pos]) {
+        lazy->table[pos] = i + 1;
+        lazy->count++;
+    }
+    return 0;
+}
+
+/* Fills `entry` the way tar_index_entry() would. */
+static void lazy_entry(const tar_lazy_t *lazy, size_t i, tar_entry_t *entry) {
+    const staged_t *s = lazy_staged(lazy, i);
+
+    memcpy(entry->path, lazy->arena.data + s->path_off, s->path_len);
+    entry->path[s->path_len] = '\0';
+    memcpy(entry->linkname, lazy->arena.data + s->link_off, s->link_len);
+    entry->linkname[s->link_len] = '\0';
+    entry->header_off = s->header_off;
+    entry->data_off = s->header_off + BLOCK_SIZE;
+    entry->size = s->size;
+    entry->typeflag = s->typeflag;
+    entry->mode = s->mode & 07777;
+    entry->mtime = s->mtime < 0 ? 0 : s->mtime > UINT32_MAX ? UINT32_MAX : s->mtime;
+}
+
+/*
+ * Stages the next member. Returns 1 if a member was staged, 0 if not (pax
+ * header, end), -1 on error. A failed read leaves the scan where it was, for
+ * a later lookup to try again.
+ */
+static int lazy_step(tar_lazy_t *lazy) {
+    const tar_header_t *header;
+    off_t off;
+
+    header = tar_header_scan_next(&lazy->scan, &off);
+    if (!header && lazy->scan.error) {
+        lazy->scan.error = 0;
+        return -1;
+    }
+    if (!header) {
+        lazy->done = 1;
+        tar_header_scan_close(&lazy->scan);
+        return 0;
+    }
+    int staged = stage(&lazy->staging, &lazy->arena, header, off);
+    if (staged == 1 && lazy_insert(lazy) < 0) return -1;
+    return staged;
+}
+
+/* Drops the staged headers once the index is published, or cannot be. Called with the lock held. */
+static void lazy_release(tar_lazy_t *lazy) {
+    free(lazy->staging.data);
+    free(lazy->arena.data);
+    free(lazy->table);
+    memset(&lazy->staging, 0, sizeof(lazy->staging));
+    memset(&lazy->arena, 0, sizeof(lazy->arena));
+    lazy->table = NULL;
+    pthread_cond_broadcast(&lazy->progress);
+}
+
+/**
+ * Indexes the rest of the archive and publishes the index. Called with the
+ * lock held, which is released while the index is packed.
+ */
+static int lazy_finish(tar_handle_t *h, tar_lazy_t *lazy) {
+    while (lazy->building) pthread_cond_wait(&lazy->progress, &lazy->lock);
+    if (__atomic_load_n(&h->index, __ATOMIC_RELAXED)) return 0;
+    // A failed completion has freed the staged headers.
+    if (!lazy->table) return -1;
+    while (!lazy->done) {
+        if (lazy_step(lazy) < 0) {
+            lazy_release(lazy);
+            return -1;
+        }
+    }
+
+    // Packing sorts the headers, while lookups keep probing the table over them.
+    size_t n = lazy->staging.len / sizeof(staged_t);
+    staged_t *staged = malloc(n ? n * sizeof(staged_t) : 1);
+    if (!staged) {
+        lazy_release(lazy);
+        return -1;
+    }
+    memcpy(staged, lazy->staging.data, n * sizeof(staged_t));
+    lazy->building = 1;
+    pthread_mutex_unlock(&lazy->lock);
+    // Nothing appends to the arena once the scan is done.
+    tar_index_t *index = build(staged, n, (char *) lazy->arena.data);
+    free(staged);
+    pthread_mutex_lock(&lazy->lock);
+    lazy->building = 0;
+    if (index) __atomic_store_n(&h->index, index, __ATOMIC_RELEASE);
+    lazy_release(lazy);
+    return index ? 0 : -1;
+}
+
+/* Appends a batch staged by the background thread. Called with the lock held. Returns 0 on success, -1 on error. */
+static int lazy_append(tar_lazy_t *lazy, const tar_buf_t *staging, const tar_buf_t *arena) {
+    const staged_t *batch = (const staged_t *) staging->data;
+    size_t n = staging->len / sizeof(staged_t);
+    size_t base = lazy->arena.len;
+
+    if (n == 0) return 0;
+    if (tar_buf_append(&lazy->arena, arena->data, arena->len) < 0) return -1;
+    if (tar_buf_reserve(&lazy->staging, staging->len) < 0) return -1;
+    for (size_t i = 0; i < n; i++) {
+        staged_t s = batch[i];
+        s.path_off += base;
+        s.link_off += base;
+        tar_buf_append(&lazy->staging, &s, sizeof(s));
+        if (lazy_insert(lazy) < 0) return -1;
+    }
+    return 0;
+}
+
+static void *lazy_thread(void *arg) {
+    tar_lazy_t *lazy = arg;
+    tar_buf_t staging = {0}, arena = {0};
+    const tar_header_t *header = NULL;
+    off_t off;
+    int ret = 0, stop = 0;
+    size_t batch = LAZY_BATCH_MIN;
+
+    do {
+        staging.len = arena.len = 0;
+        for (size_t i = 0; ret >= 0 && i < batch && (header = tar_header_scan_next(&lazy->scan, &off)); i++) {
+            ret = stage(&staging, &arena, header, off);
+        }
+
+        // A failed read is not the end of the archive.
+        if (!header && lazy->scan.error) ret = -1;
+        pthread_mutex_lock(&lazy->lock);
+        if (ret >= 0) ret = lazy_append(lazy, &staging, &arena);
+        if (!header && ret >= 0) lazy->done = 1;
+        stop = lazy->stop;
+        pthread_cond_broadcast(&lazy->progress);
+        pthread_mutex_unlock(&lazy->lock);
+        if (batch < LAZY_BATCH_MAX) batch *= 2;
+    } while (ret >= 0 && header && !stop);
+    tar_header_scan_close(&lazy->scan);
+    free(staging.data);
+    free(arena.data);
+
+    pthread_mutex_lock(&lazy->lock);
+    if (ret < 0) lazy_release(lazy);
+    else if (!lazy->stop) lazy_finish(lazy->h, lazy);
+    pthread_mutex_unlock(&lazy->lock);
+    return NULL;
+}
+
+/* Looks `path` up in the table. Called with the lock held. Returns 1 and fills `entry` if found, 0 if not. */
+static int lazy_probe(const tar_lazy_t *lazy, const char *path, size_t len, tar_entry_t *entry) {
+    size_t pos = lazy_slot(lazy, lazy->table, lazy->table_size, path, len);
+    if (!lazy->table[pos]) return 0;
+    lazy_entry(lazy, lazy->table[pos] - 1, entry);
+    return 1;
+}
+
+int tar_lazy_lookup(tar_handle_t *h, const char *path, size_t len, tar_entry_t *entry) {
+    tar_lazy_t *lazy = h->lazy;
+    int found = 0;
+
+    pthread_mutex_lock(&lazy->lock);
+    if (lazy->background) {
+        // Paths past the frontier wait for the thread to stage them.
+        while (lazy->table && !(found = lazy_probe(lazy, path, len, entry)) && !lazy->done) {
+            pthread_cond_wait(&lazy->progress, &lazy->lock);
+        }
+        // The index was published meanwhile, or could not be.
+        if (!lazy->table) found = -1;
+    } else if (!lazy->table) {
+        // The index was completed meanwhile, or could not be.
+        found = -1;
+    } else {
+        found = lazy_probe(lazy, path, len, entry);
+        while (!found && !lazy->done) {
+            int staged = lazy_step(lazy);
+            if (staged < 0) {
+                found = -1;
+            } else if (staged == 1) {
+                size_t i = lazy->staging.len / sizeof(staged_t) - 1;
+                const staged_t *s = lazy_staged(lazy, i);
+                if (path_cmp((char *) lazy->arena.data + s->path_off, s->path_len, path, len) == 0) {
+                    lazy_entry(lazy, i, entry);
+                    found = 1;
+                }
+            }
+        }
+        // Only the whole archive can tell that a path is absent: the index is complete now.
+        if (found == 0 && lazy_finish(h, lazy) < 0) found = -1;
+    }
+    pthread_mutex_unlock(&lazy->lock);
+    return found;
+}
+
+tar_index_t *tar_index_get(tar_handle_t *h) {
+    tar_index_t *index = __atomic_load_n(&h->index, __ATOMIC_ACQUIRE);
+    tar_lazy_t *lazy = h->lazy;
+    if (index || !lazy) return index;
+
+    pthread_mutex_lock(&lazy->lock);
+    if (lazy->background) {
+        while (lazy->table) pthread_cond_wait(&lazy->progress, &lazy->lock);
+    } else {
+        lazy_finish(h, lazy);
+    }
+    pthread_mutex_unlock(&lazy->lock);
+    return __atomic_load_n(&h->index, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,549 @@
+#ifndef TAR_INTERNAL_H
+#define TAR_INTERNAL_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <aio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "lib_tar.h"
+
+/* Longest path a ustar header can describe: prefix (155) + '/' + name (100). */
+#define TAR_PATH_MAX 256
+
+/* Maximum number of symlinks followed when resolving a path. */
+#define TAR_MAX_LINK_HOPS 8
+
+/**
+ * A decoded header: everything the handle API needs to know about a member
+ * without keeping the 512-byte header around.
+ */
+typedef struct tar_entry {
+    off_t header_off;              /* offset of the header block */
+    off_t data_off;                /* offset of the first data byte */
+    uint64_t size;                 /* size of the member data */
+    uint32_t mode;
+    int64_t mtime;
+    char typeflag;
+    char path[TAR_PATH_MAX + 1];
+    char linkname[101];
+} tar_entry_t;
+
+typedef struct tar_index tar_index_t;
+typedef struct tar_lazy tar_lazy_t;
+
+/* Members whose access pattern a handle follows at once. */
+#define TAR_RA_STREAMS 8
+
+/* Readahead window: the first hint covers TAR_RA_MIN bytes, then doubles up to TAR_RA_MAX. */
+#define TAR_RA_MIN (128 * 1024)
+#define TAR_RA_MAX (8 * 1024 * 1024)
+
+/* Access pattern of one member, as seen by tar_read_file(). */
+typedef struct tar_ra_stream {
+    off_t data_off;                /* identifies the member, 0 for a free slot */
+    uint64_t next;                 /* offset where a sequential read would start */
+    uint64_t ahead;                /* end of the range already hinted to the kernel */
+    uint64_t window;               /* 0 while the reads do not look sequential */
+    uint64_t last_use;             /* for recycling the least recently used stream */
+} tar_ra_stream_t;
+
+typedef struct tar_readahead {
+    pthread_mutex_t lock;
+    uint64_t clock;
+    tar_ra_stream_t streams[TAR_RA_STREAMS];
+} tar_readahead_t;
+
+/* Buffers of a pool are aligned for O_DIRECT; 4 KiB covers the logical blocks of common devices. */
+#define TAR_BUF_ALIGN 4096
+
+/* Size classes of a pool, powers of two from TAR_BUF_ALIGN to 4 MiB. Larger buffers are not kept. */
+#define TAR_BUF_CLASSES 11
+
+/* Free buffers a pool keeps per size class, beyond which they are freed. */
+#define TAR_BUF_DEPTH 16
+
+/* Bytes of free buffers a pool keeps in all, enough for a scan and its hash or search buffer. */
+#define TAR_BUF_POOL_BYTES (16 * 1024 * 1024)
+
+/**
+ * Scratch buffers of a handle: chunks of scans, list results. Buffers given
+ * back are kept for the next request of the same size class, so that a
+ * handle in use stops allocating once every class it needs is warm. A pool
+ * keeps TAR_BUF_POOL_BYTES at most: the buffers of a burst of parallel work
+ * beyond that are freed as they come back.
+ */
+typedef struct tar_bufpool tar_bufpool_t;
+
+struct tar_bufpool {
+    pthread_mutex_t lock;
+    void *free[TAR_BUF_CLASSES][TAR_BUF_DEPTH];
+    size_t nfree[TAR_BUF_CLASSES];
+    size_t held;                   /* bytes of the free buffers, at most TAR_BUF_POOL_BYTES */
+};
+
+void tar_bufpool_init(tar_bufpool_t *pool);
+
+/* Frees the buffers kept by `pool`. Buffers still out must not be given back afterwards. */
+void tar_bufpool_destroy(tar_bufpool_t *pool);
+
+/**
+ * Takes a buffer of at least `size` bytes from the pool, aligned on
+ * TAR_BUF_ALIGN. `size` bytes are allocated when no buffer of its class is free.
+ *
+ * @return the buffer, or NULL if memory ran out.
+ */
+void *tar_buf_get(tar_bufpool_t *pool, size_t size);
+
+/* Gives back a buffer of tar_buf_get(), with the `size` it was taken with. NULL is ignored. */
+void tar_buf_put(tar_bufpool_t *pool, void *buf, size_t size);
+
+/* Scratch buffers of the file descriptor API. */
+extern tar_bufpool_t tar_global_buffers;
+
+/*
+ * Windows of a header scan start at TAR_WINDOW_MIN bytes and double up to
+ * TAR_WINDOW_MAX, or are a single block while members outsize them.
+ */
+#define TAR_WINDOW_MIN (64 * 1024)
+#define TAR_WINDOW_MAX (1024 * 1024)
+
+/**
+ * A front to back walk over the headers of an archive. The archive is read
+ * a window at a time and headers are decoded in place, so that archives of
+ * small members take one read per window instead of a read and a seek per
+ * member. Windows grow while they hold several headers each, and shrink
+ * to a block when members are large enough for each header to need its own
+ * read, so that the data of large members is not read along.
+ */
+typedef struct tar_header_scan {
+    tar_handle_t *h;               /* reads through the handle, or NULL */
+    int fd;                        /* read directly when there is no handle */
+    tar_bufpool_t *pool;
+    tar_stats_t *stats;
+    const uint8_t *window;         /* the buffer, or the mapping of the handle */
+    uint8_t *buf;                  /* window buffer taken from `pool` */
+    off_t win_off;
+    size_t win_len;                /* bytes in the window */
+    size_t win_size;               /* bytes the next window read asks for */
+    size_t headers;                /* headers decoded from the current window */
+    off_t next;                    /* offset of the next header */
+    int error;                     /* a read failed */
+} tar_header_scan_t;
+
+/* Starts a header scan at `start`, through `h` if not NULL, on `fd` otherwise. */
+void tar_header_scan_open(tar_header_scan_t *s, tar_handle_t *h, int fd, off_t start);
+
+/**
+ * Moves to the next header and skips the data of its member.
+ *
+ * @return the header, valid until the next call, with its offset in `off`.
+ *         NULL at the end of the archive (a null block or the end of the file)
+ *         or on error, which sets `s->error`.
+ */
+const tar_header_t *tar_header_scan_next(tar_header_scan_t *s, off_t *off);
+
+void tar_header_scan_close(tar_header_scan_t *s);
+
+/* Bytes read at once by the scans of handles with a scan mode. */
+#define TAR_SCAN_CHUNK (4 * 1024 * 1024)
+
+/* Scan mode of a handle, see TAR_OPEN_SCAN_DIRECT and TAR_OPEN_SCAN_DONTNEED. */
+typedef struct tar_scanner {
+    int fd;                        /* the archive opened with O_DIRECT, or the descriptor of the handle */
+    int direct;
+} tar_scanner_t;
+
+struct tar_handle {
+    int fd;
+    uint64_t archive_id;           /* key of this archive in the block cache */
+    tar_cache_t *cache;            /* optional, shared between handles */
+    tar_index_t *index;            /* NULL with TAR_OPEN_NO_INDEX, or until a lazy index is complete */
+    tar_lazy_t *lazy;              /* with TAR_OPEN_LAZY_INDEX or TAR_OPEN_BACKGROUND_INDEX, or NULL */
+    tar_stats_t *stats;            /* NULL unless built with TAR_STATS */
+    const uint8_t *map;            /* the whole archive with TAR_OPEN_MMAP, or NULL */
+    size_t map_len;
+    uint64_t *hashes;              /* xxh64 of each regular file by index position, once computed */
+    tar_readahead_t *readahead;    /* NULL with TAR_OPEN_NO_READAHEAD */
+    tar_scanner_t *scanner;        /* NULL without a scan mode */
+    tar_bufpool_t buffers;
+};
+
+#ifdef TAR_STATS
+/* Statistics of the file descriptor API. */
+extern tar_stats_t tar_global_stats;
+
+/* Times a public call, see TAR_STATS_TIME(). */
+typedef struct tar_timer {
+    tar_stats_t *stats;            /* NULL for nested calls, which are not recorded */
+    int op;
+    uint64_t start_ns;
+} tar_timer_t;
+
+void tar_timer_start(tar_timer_t *timer, tar_stats_t *stats, int op);
+void tar_timer_stop(tar_timer_t *timer);
+
+/* Adds `n` to a counter of `stats`, which may be NULL. */
+#define TAR_STATS_ADD(stats, field, n) do { \
+        tar_stats_t *tar_stats_ = (stats); \
+        if (tar_stats_) __atomic_add_fetch(&tar_stats_->field, (n), __ATOMIC_RELAXED); \
+    } while (0)
+
+/* Records the latency of the enclosing function, whichever way it returns. */
+#define TAR_STATS_TIME(stats, op) \
+    tar_timer_t tar_timer_ __attribute__((cleanup(tar_timer_stop))); \
+    tar_timer_start(&tar_timer_, (stats), (op))
+#else
+#define TAR_STATS_ADD(stats, field, n) ((void) 0)
+#define TAR_STATS_TIME(stats, op) ((void) 0)
+#endif
+
+/*
+ * USDT probes of the "lib_tar" provider, for perf and bpftrace. They are built
+ * with -DTAR_USDT (make USDT=1), which needs <sys/sdt.h> from systemtap, and
+ * are a single nop each until a tracer attaches. See scripts/lib_tar.bt.
+ *
+ *  header_parsed(fd, offset, path)    a header was decoded while scanning
+ *  lookup_begin(path, len)            a path lookup starts
+ *  lookup_end(path, found)            and ends
+ *  io_submit(fd, offset, len)         a read is issued on the archive
+ *  io_complete(fd, offset, result)    and returns
+ *  cache_miss(archive_id, block)      a slab is missing from the block cache
+ *
+ * The offset is -1 for reads at the current file offset of the descriptor.
+ */
+#ifdef TAR_USDT
+#include <sys/sdt.h>
+#define TAR_PROBE2(name, a, b) DTRACE_PROBE2(lib_tar, name, a, b)
+#define TAR_PROBE3(name, a, b, c) DTRACE_PROBE3(lib_tar, name, a, b, c)
+#else
+#define TAR_PROBE2(name, a, b) ((void) 0)
+#define TAR_PROBE3(name, a, b, c) ((void) 0)
+#endif
+
+/**
+ * Parses a numeric header field. Handles both the usual NUL/space terminated
+ * octal form and the GNU base-256 form used for values that do not fit.
+ */
+static inline uint64_t tar_parse_num(const char *field, size_t len) {
+    const unsigned char *p = (const unsigned char *) field;
+    uint64_t value = 0;
+
+    if (len > 0 && (p[0] & 0x80)) {
+        // Base-256: the remaining bits of the first byte are the top bits.
+        value = p[0] & 0x3f;
+        for (size_t i = 1; i < len; i++) value = (value << 8) | p[i];
+        return value;
+    }
+    size_t i = 0;
+    while (i < len && (p[i] == ' ' || p[i] == '\0')) i++;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) value = (value << 3) | (p[i] - '0');
+    return value;
+}
+
+/* Finalizer of MurmurHash3, spreads the bits of `x` over the whole word. */
+static inline uint64_t tar_mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/* Rounds a member size up to the number of bytes it occupies in the archive. */
+static inline uint64_t tar_padded(uint64_t size) {
+    return (size + BLOCK_SIZE - 1) & ~(uint64_t) (BLOCK_SIZE - 1);
+}
+
+/* A growable byte buffer, used for the arenas of the index. */
+typedef struct tar_buf {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} tar_buf_t;
+
+/* Makes room for `extra` more bytes. Returns 0 on success, -1 if memory ran out. */
+static inline int tar_buf_reserve(tar_buf_t *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) return 0;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra) cap *= 2;
+    uint8_t *data = realloc(buf->data, cap);
+    if (!data) return -1;
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static inline int tar_buf_append(tar_buf_t *buf, const void *bytes, size_t len) {
+    if (tar_buf_reserve(buf, len) < 0) return -1;
+    memcpy(buf->data + buf->len, bytes, len);
+    buf->len += len;
+    return 0;
+}
+
+/* Returns 1 if the 512-byte block only contains zero bytes. */
+int tar_block_is_zero(const void *block);
+
+/**
+ * Fills `entry` from the header found at `header_off`.
+ * The full path is rebuilt from the ustar prefix and name fields.
+ */
+void tar_entry_from_header(tar_entry_t *entry, const tar_header_t *header, off_t header_off);
+
+/**
+ * Resolves the target of a link stored at `link_path` into an archive path.
+ * Relative targets are interpreted from the directory containing the link.
+ *
+ * @return 0 on success, -1 if the result does not fit in TAR_PATH_MAX.
+ */
+int tar_resolve_link(const char *link_path, const char *target, char *out);
+
+/* Same as tar_cache_pread(), accounting hits, misses and reads in `stats` (which may be NULL). */
+ssize_t tar_cache_read(tar_cache_t *cache, uint64_t archive_id, int fd, void *buf, size_t len, off_t offset,
+                       tar_stats_t *stats);
+
+/* Reads from the archive, through the block cache when the handle has one. */
+ssize_t tar_pread(tar_handle_t *h, void *buf, size_t len, off_t offset);
+
+/**
+ * Copies `len` bytes of the archive at `off` to the current position of
+ * `out`, letting the kernel move them when it can, see tar_copy_to_fd().
+ *
+ * @return 0 on success, -1 on error.
+ */
+int tar_copy_data(tar_handle_t *h, int out, off_t off, uint64_t len);
+
+/* Sets up the scan mode selected by the TAR_OPEN_SCAN_* flags, if any. Returns 0 on success, -1 on error. */
+int tar_scanner_init(tar_handle_t *h, int flags);
+
+void tar_scanner_free(tar_scanner_t *sc);
+
+typedef enum tar_scan_state {
+    SCAN_IDLE,                     /* the buffer holds no chunk to read */
+    SCAN_SYNC,                     /* its chunk is read when needed */
+    SCAN_AIO                       /* its chunk is being read in the background */
+} tar_scan_state_t;
+
+/**
+ * A sequential read of a range of the archive, for scans that consume each
+ * byte once. Without a scan mode, it reads through tar_pread(). With one,
+ * it reads TAR_SCAN_CHUNK bytes at a time, the next chunk in the background.
+ */
+typedef struct tar_scan {
+    tar_handle_t *h;
+    off_t pos;                     /* next byte handed out */
+    off_t end;
+    off_t next_read;               /* start of the next chunk to read */
+    off_t read_end;                /* `end`, aligned up for O_DIRECT */
+    int cur;                       /* buffer holding `pos` */
+    uint8_t *buf[2];
+    off_t chunk_off[2];
+    size_t chunk_len[2];
+    size_t chunk_valid[2];         /* bytes actually read */
+    tar_scan_state_t state[2];
+    struct aiocb cb;
+} tar_scan_t;
+
+void tar_scan_open(tar_scan_t *s, tar_handle_t *h, off_t off, uint64_t len);
+
+/**
+ * Copies the next (at most) `len` bytes of the range into `dest`.
+ *
+ * @return the number of bytes copied, 0 at the end of the range, -1 on error.
+ */
+ssize_t tar_scan_read(tar_scan_t *s, void *dest, size_t len);
+
+/**
+ * Moves the scan to `off`, within its range. The chunks already read, or
+ * being read, are kept when `off` falls among them; elsewhere the scan
+ * starts over from `off`.
+ */
+void tar_scan_seek(tar_scan_t *s, off_t off);
+
+void tar_scan_close(tar_scan_t *s);
+
+/* A member to scan, one of the items of a plan. */
+typedef struct tar_scan_item {
+    off_t off;                     /* start of its data in the archive */
+    uint64_t size;
+    size_t id;                     /* what the caller knows it by */
+} tar_scan_item_t;
+
+/**
+ * Plans the scan of `n` members by `threads` workers: sorts the items by
+ * offset and splits them into runs of consecutive members, each to be read
+ * by a single scan (see tar_scan_open_run()). Run `k` holds the items from
+ * `(*runs)[k]` to `(*runs)[k + 1]` excluded; `*runs` is to be freed.
+ *
+ * @return the number of runs, -1 if memory ran out.
+ */
+ssize_t tar_scan_plan(tar_scan_item_t *items, size_t n, int threads, size_t **runs);
+
+/* Opens a scan over the members of a run, from `first` to `last` included. */
+void tar_scan_open_run(tar_scan_t *s, tar_handle_t *h, const tar_scan_item_t *first, const tar_scan_item_t *last);
+
+/* Same as tar_pread(), for a one-off read that is part of a scan. */
+ssize_t tar_scan_pread(tar_handle_t *h, void *buf, size_t len, off_t off);
+
+/**
+ * Records a read of `len` bytes at `offset` in the data of `entry`. Once the
+ * reads of a member look sequential, the kernel is asked to read the next
+ * window of it in the background, and the window widens while they stay so.
+ * A read elsewhere in the member closes the window.
+ */
+void tar_readahead(tar_handle_t *h, const tar_entry_t *entry, uint64_t offset, size_t len);
+
+/**
+ * Looks the `len` first bytes of `path` up in the archive, through the index
+ * when the handle has one.
+ *
+ * @return 1 and fills `entry` if found, 0 otherwise.
+ */
+int tar_lookup(tar_handle_t *h, const char *path, size_t len, tar_entry_t *entry);
+
+/**
+ * Same as tar_lookup(), but follows symlinks and hard links until an entry
+ * that is not a link. A link to a directory may omit the trailing slash.
+ *
+ * @return 1 and fills `entry` with the final entry if found, 0 otherwise.
+ */
+int tar_lookup_resolved(tar_handle_t *h, const char *path, tar_entry_t *entry);
+
+/* A lookup in some view of archives: returns 1 and fills `entry` if `path` is found. */
+typedef int (*tar_lookup_fn_t)(void *ctx, const char *path, size_t len, tar_entry_t *entry);
+
+/* Same as tar_lookup_resolved(), through any lookup function. */
+int tar_resolve(tar_lookup_fn_t lookup, void *ctx, const char *path, tar_entry_t *entry);
+
+/* Hashes a path for the index tables. */
+uint64_t tar_hash_path(const char *path, size_t len);
+
+/**
+ * Scans the whole archive and indexes every header.
+ *
+ * @return the index, or NULL if the archive could not be read or memory ran out.
+ */
+tar_index_t *tar_index_build(tar_handle_t *h);
+
+void tar_index_free(tar_index_t *index);
+
+/**
+ * Starts the lazy index of a handle opened with TAR_OPEN_LAZY_INDEX, or with
+ * TAR_OPEN_BACKGROUND_INDEX when `background` is set.
+ *
+ * @return the lazy index, or NULL if memory ran out or the thread could not be started.
+ */
+tar_lazy_t *tar_lazy_new(tar_handle_t *h, int background);
+
+void tar_lazy_free(tar_lazy_t *lazy);
+
+/**
+ * Looks a path up in the lazy index, indexing further headers until it is
+ * found, or waiting for the background thread to index them. A path that
+ * is absent completes the index.
+ *
+ * @return 1 and fills `entry` if found, 0 if absent,
+ *         -1 if the index is complete (or could not be), h->index then answers.
+ */
+int tar_lazy_lookup(tar_handle_t *h, const char *path, size_t len, tar_entry_t *entry);
+
+/**
+ * Returns the index of a handle, completing a lazy index first. Everything
+ * that needs the whole index goes through this rather than `h->index`.
+ *
+ * @return the index, or NULL without one (TAR_OPEN_NO_INDEX, or memory ran out).
+ */
+tar_index_t *tar_index_get(tar_handle_t *h);
+
+/* Returns the number of distinct paths in the index. */
+size_t tar_index_count(const tar_index_t *index);
+
+/**
+ * Returns the heap memory held by the index. `path_bytes` receives the sum of
+ * the path lengths and `arena_bytes` the size of the front-coded path arena.
+ */
+size_t tar_index_memory(const tar_index_t *index, size_t *path_bytes, size_t *arena_bytes);
+
+/**
+ * Looks a path up in the index.
+ *
+ * @return the position of the path in the sorted index, or -1 if it is absent.
+ */
+ssize_t tar_index_find(const tar_index_t *index, const char *path, size_t len);
+
+/* Decodes the entry at position `i` of the sorted index. */
+void tar_index_entry(const tar_index_t *index, size_t i, tar_entry_t *entry);
+
+/**
+ * Returns the position of the first path that is not smaller than `key`,
+ * comparing bytes as unsigned values. Paths sharing a prefix are contiguous.
+ */
+size_t tar_index_lower_bound(const tar_index_t *index, const char *key, size_t len);
+
+/**
+ * Walks the sorted paths of an index. Paths are front-coded, so decoding them
+ * one after the other is much cheaper than decoding each position separately.
+ * This is the public tar_walk_t; `next_byte` is where the next path is encoded.
+ */
+typedef tar_walk_t tar_index_iter_t;
+
+/**
+ * Positions the iterator on entry `pos`.
+ *
+ * @return 1 if there is an entry at `pos`, 0 past the end.
+ */
+int tar_index_iter_seek(tar_index_iter_t *it, const tar_index_t *index, size_t pos);
+
+/**
+ * Moves the iterator to the next entry.
+ *
+ * @return 1 if there is one, 0 past the end.
+ */
+int tar_index_iter_next(tar_index_iter_t *it);
+
+/**
+ * Same as tar_find(), but hands `cb` the iterator positioned on each match,
+ * which gives the position of the match in the index.
+ */
+ssize_t tar_find_iter(tar_handle_t *h, const char *pattern, int flags,
+                      int (*cb)(void *arg, const tar_index_iter_t *it), void *arg);
+
+/* Streaming state of xxh64. */
+typedef struct tar_xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    uint64_t seed;
+    uint8_t buf[32];               /* bytes waiting for a full stripe */
+    size_t buffered;
+} tar_xxh64_t;
+
+void tar_xxh64_init(tar_xxh64_t *s, uint64_t seed);
+void tar_xxh64_update(tar_xxh64_t *s, const void *data, size_t len);
+uint64_t tar_xxh64_digest(const tar_xxh64_t *s);
+
+/* Hashes the data of `entry`. Returns 0 on success, -1 if it could not be read. */
+int tar_hash_entry(tar_handle_t *h, const tar_entry_t *entry, uint64_t *hash);
+
+/**
+ * Hashes every regular file of the index into `h->hashes`, unless already
+ * done, on `threads` threads.
+ *
+ * @return 0 on success, -1 if the handle has no index or a member could not be read.
+ */
+int tar_hash_members(tar_handle_t *h, int threads);
+
+/* Returns `threads`, or the number of online CPUs when it is zero or negative. */
+int tar_pool_threads(int threads);
+
+/**
+ * Calls fn(arg, i) for every i in [0, n) on `threads` threads (0 for one per
+ * CPU), the calling thread included. Items are handed out one at a time, so
+ * uneven items balance themselves. Returns once every item is done.
+ */
+void tar_parallel_for(int threads, size_t n, void (*fn)(void *arg, size_t i), void *arg);
+
+#endif
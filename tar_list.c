@@ -0,0 +1,178 @@
+#include "tar_internal.h"
+
+/*
+ * Listing walks the range of the sorted index holding the paths that start
+ * with the directory. Each grandchild subtree is skipped with a single
+ * lower_bound, so a listing costs O(children * log n) whatever the size of the
+ * subtrees below the children.
+ */
+
+/**
+ * Moves the cursor to the next child of its directory and copies that child
+ * into `child`.
+ *
+ * @return the length of the child, or 0 when the directory is exhausted.
+ */
+static size_t next_child(const tar_index_t *index, tar_list_cursor_t *cursor, tar_index_iter_t *it, char *child) {
+    char key[TAR_PATH_MAX + 1];
+
+    while (cursor->pos < cursor->end) {
+        // Consecutive children are decoded incrementally, jumps need a seek.
+        if (it->index != index || it->pos + 1 != cursor->pos || !tar_index_iter_next(it)) {
+            if (!tar_index_iter_seek(it, index, cursor->pos)) break;
+        }
+        if (it->len <= cursor->dir_len) {
+            // The directory entry itself.
+            cursor->pos++;
+            continue;
+        }
+        const char *rest = it->path + cursor->dir_len;
+        const char *slash = memchr(rest, '/', it->len - cursor->dir_len);
+        if (!slash) {
+            cursor->pos++;
+            memcpy(child, it->path, it->len + 1);
+            return it->len;
+        }
+
+        // A directory, listed once whether or not it has its own entry.
+        size_t len = slash - it->path + 1;
+        memcpy(child, it->path, len);
+        child[len] = '\0';
+
+        // Skip its subtree: every path starting with "child/" sorts before "child0".
+        memcpy(key, child, len);
+        key[len - 1] = '/' + 1;
+        cursor->pos = tar_index_lower_bound(index, key, len);
+        return len;
+    }
+    return 0;
+}
+
+/* Returns 1 if some path starts with `dir`, a directory with its trailing slash. */
+static int implied_dir(const tar_index_t *index, const char *dir, size_t len) {
+    tar_index_iter_t it;
+    size_t pos = tar_index_lower_bound(index, dir, len);
+    return tar_index_iter_seek(&it, index, pos) && it.len > len && memcmp(it.path, dir, len) == 0;
+}
+
+int tar_list_open(tar_handle_t *h, char *path, tar_list_cursor_t *cursor) {
+    tar_entry_t entry;
+    char buf[TAR_PATH_MAX + 1];
+    const char *dir = entry.path;
+    TAR_STATS_TIME(h->stats, TAR_OP_LIST);
+
+    memset(cursor, 0, sizeof(*cursor));
+    if (!tar_index_get(h)) return 0;
+    size_t len = strlen(path);
+    if (len == 0) {
+        // The root, which has no entry of its own.
+        cursor->end = tar_index_count(h->index);
+        return 1;
+    }
+    if (!tar_lookup_resolved(h, path, &entry)) {
+        // Accept directories given without their trailing slash, and directories
+        // that only exist through deeper entries.
+        if (len >= TAR_PATH_MAX) return 0;
+        memcpy(buf, path, len);
+        if (buf[len - 1] != '/') buf[len++] = '/';
+        buf[len] = '\0';
+        if (!tar_lookup_resolved(h, buf, &entry)) {
+            if (!implied_dir(h->index, buf, len)) return 0;
+            dir = buf;
+            entry.typeflag = DIRTYPE;
+        }
+    }
+    if (entry.typeflag != DIRTYPE) return 0;
+
+    cursor->dir_len = strlen(dir);
+    memcpy(cursor->dir, dir, cursor->dir_len + 1);
+
+    char key[TAR_PATH_MAX + 1];
+    memcpy(key, cursor->dir, cursor->dir_len);
+    key[cursor->dir_len - 1] = '/' + 1;
+    cursor->pos = tar_index_lower_bound(h->index, cursor->dir, cursor->dir_len);
+    cursor->end = tar_index_lower_bound(h->index, key, cursor->dir_len);
+    return 1;
+}
+
+ssize_t tar_list_next(tar_handle_t *h, tar_list_cursor_t *cursor, size_t max, tar_list_t *out) {
+    char child[TAR_PATH_MAX + 1];
+    size_t count = 0, bytes = 0;
+    TAR_STATS_TIME(h->stats, TAR_OP_LIST);
+
+    memset(out, 0, sizeof(*out));
+    if (!tar_index_get(h)) return 0;
+
+    // First pass on a copy of the cursor, to size the single buffer.
+    tar_list_cursor_t probe = *cursor;
+    tar_index_iter_t it = { .index = NULL };
+    size_t len;
+    while (count < max && (len = next_child(h->index, &probe, &it, child))) {
+        count++;
+        bytes += len + 1;
+    }
+    if (count == 0) {
+        *cursor = probe;
+        return 0;
+    }
+
+    out->capacity = count * sizeof(tar_strview_t) + bytes;
+    out->memory = tar_buf_get(&h->buffers, out->capacity);
+    if (!out->memory) {
+        // The cursor did not move: the batch can be asked for again.
+        out->capacity = 0;
+        errno = ENOMEM;
+        return -1;
+    }
+    out->pool = &h->buffers;
+    out->entries = out->memory;
+    char *strings = (char *) (out->entries + count);
+
+    it.index = NULL;
+    for (size_t i = 0; i < count; i++) {
+        len = next_child(h->index, cursor, &it, strings);
+        out->entries[i].data = strings;
+        out->entries[i].len = len;
+        strings += len + 1;
+    }
+    out->count = count;
+    return count;
+}
+
+int tar_list_arena(tar_handle_t *h, char *path, tar_list_t *out) {
+    tar_list_cursor_t cursor;
+    TAR_STATS_TIME(h->stats, TAR_OP_LIST);
+
+    memset(out, 0, sizeof(*out));
+    if (!tar_list_open(h, path, &cursor)) return 0;
+    return tar_list_next(h, &cursor, SIZE_MAX, out) < 0 ? -1 : 1;
+}
+
+void tar_list_free(tar_list_t *list) {
+    if (list->pool) tar_buf_put(list->pool, list->memory, list->capacity);
+    else free(list->memory);
+    memset(list, 0, sizeof(*list));
+}
+
+int tar_walk_first(tar_handle_t *h, tar_walk_t *w) {
+    if (!tar_index_get(h)) {
+        memset(w, 0, sizeof(*w));
+        return 0;
+    }
+    return tar_index_iter_seek(w, h->index, 0);
+}
+
+int tar_walk_next(tar_walk_t *w) {
+    return w->index && tar_index_iter_next(w);
+}
+
+void tar_walk_stat(const tar_walk_t *w, tar_stat_t *st) {
+    tar_entry_t entry;
+
+    tar_index_entry(w->index, w->pos, &entry);
+    st->typeflag = entry.typeflag;
+    st->mode = entry.mode;
+    st->size = entry.size;
+    st->mtime = entry.mtime;
+    st->data_offset = entry.data_off;
+}
@@ -0,0 +1,369 @@
+#include "tar_internal.h"
+
+/*
+ * The merged index is a sorted array of (layer, position) references into the
+ * indexes of the layers, with a hash table on top for point lookups. Adding a
+ * layer merges its sorted paths with the current array in a single pass. The
+ * earlier layers are never rescanned: whether an older path survives is
+ * decided by a few probes of the new layer's index, whose Bloom filter
+ * rejects most of them outright.
+ *
+ * An older path is hidden by the new layer when the layer has
+ *  - the same path, or the same path with or without a trailing slash,
+ *  - a non-directory where the path has a parent directory,
+ *  - a whiteout ".wh.name" for the path or one of its parents,
+ *  - an opaque whiteout ".wh..wh..opq" in one of its parent directories.
+ * Whiteouts themselves are not part of the view.
+ */
+#define WHITEOUT ".wh."
+#define WHITEOUT_LEN 4
+#define OPAQUE ".wh..wh..opq"
+#define OPAQUE_LEN 12
+
+typedef struct merged {
+    uint64_t hash;
+    uint32_t layer;
+    uint32_t pos;
+} merged_t;
+
+struct tar_overlay {
+    tar_handle_t **layers;         /* bottom first */
+    size_t nlayers;
+    merged_t *entries;             /* sorted by path */
+    size_t count;
+    uint32_t *table;               /* open addressing, entry + 1 or 0 */
+    uint8_t *tags;                 /* low byte of the hash of each table slot */
+    size_t table_mask;
+};
+
+/* Decodes the path of merged entries, reusing one iterator per layer. */
+typedef struct decoder {
+    tar_overlay_t *ov;
+    tar_index_iter_t *iters;
+} decoder_t;
+
+static const tar_index_iter_t *decode(decoder_t *d, const merged_t *m) {
+    tar_index_iter_t *it = &d->iters[m->layer];
+    const tar_index_t *index = d->ov->layers[m->layer]->index;
+
+    if (it->index == index && it->pos == m->pos) return it;
+    if (it->index != index || it->pos + 1 != m->pos || !tar_index_iter_next(it)) tar_index_iter_seek(it, index, m->pos);
+    return it;
+}
+
+static int path_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c) return c;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+static int is_whiteout(const char *path, size_t len) {
+    const char *name = memrchr(path, '/', len);
+    name = name ? name + 1 : path;
+    return (size_t) (path + len - name) >= WHITEOUT_LEN && memcmp(name, WHITEOUT, WHITEOUT_LEN) == 0;
+}
+
+static int layer_has(const tar_handle_t *layer, const char *path, size_t len) {
+    return tar_index_find(layer->index, path, len) >= 0;
+}
+
+/* Returns 1 if `layer` hides `path`, see the top of the file. */
+static int hidden_by(const tar_handle_t *layer, const char *path, size_t len) {
+    char buf[TAR_PATH_MAX + OPAQUE_LEN + 2];
+    size_t name_len = len > 0 && path[len - 1] == '/' ? len - 1 : len;
+
+    // The path itself, as a directory or not.
+    memcpy(buf, path, name_len);
+    buf[name_len] = '/';
+    if (layer_has(layer, buf, name_len) || layer_has(layer, buf, name_len + 1)) return 1;
+
+    // Walk the path and its parents: "a", "a/b", ... up to the path itself.
+    size_t start = 0;
+    while (start < name_len) {
+        const char *slash = memchr(path + start, '/', name_len - start);
+        size_t end = slash ? (size_t) (slash - path) : name_len;
+
+        // A whiteout of this component.
+        memcpy(buf, path, start);
+        memcpy(buf + start, WHITEOUT, WHITEOUT_LEN);
+        memcpy(buf + start + WHITEOUT_LEN, path + start, end - start);
+        if (layer_has(layer, buf, end + WHITEOUT_LEN)) return 1;
+        if (!slash) break;
+
+        // A parent directory that became something else, or was made opaque.
+        if (layer_has(layer, path, end)) return 1;
+        memcpy(buf, path, end + 1);
+        memcpy(buf + end + 1, OPAQUE, OPAQUE_LEN);
+        if (layer_has(layer, buf, end + 1 + OPAQUE_LEN)) return 1;
+        start = end + 1;
+    }
+    return 0;
+}
+
+static int build_table(tar_overlay_t *ov) {
+    size_t size = 4;
+    while (size < ov->count + ov->count / 2 + 1) size <<= 1;
+
+    uint32_t *table = calloc(size, sizeof(uint32_t));
+    uint8_t *tags = malloc(size);
+    if (!table || !tags) {
+        free(table);
+        free(tags);
+        return -1;
+    }
+    for (size_t i = 0; i < ov->count; i++) {
+        size_t pos = ov->entries[i].hash & (size - 1);
+        while (table[pos]) pos = (pos + 1) & (size - 1);
+        table[pos] = i + 1;
+        tags[pos] = (uint8_t) (ov->entries[i].hash >> 56);
+    }
+    free(ov->table);
+    free(ov->tags);
+    ov->table = table;
+    ov->tags = tags;
+    ov->table_mask = size - 1;
+    return 0;
+}
+
+tar_overlay_t *tar_overlay_new(void) {
+    return calloc(1, sizeof(tar_overlay_t));
+}
+
+void tar_overlay_free(tar_overlay_t *ov) {
+    if (!ov) return;
+    free(ov->layers);
+    free(ov->entries);
+    free(ov->table);
+    free(ov->tags);
+    free(ov);
+}
+
+int tar_overlay_add(tar_overlay_t *ov, tar_handle_t *layer) {
+    if (!tar_index_get(layer) || ov->nlayers >= UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    tar_handle_t **layers = realloc(ov->layers, (ov->nlayers + 1) * sizeof(tar_handle_t *));
+    if (!layers) return -1;
+    ov->layers = layers;
+    layers[ov->nlayers] = layer;
+
+    size_t added = tar_index_count(layer->index);
+    merged_t *out = malloc((ov->count + added + 1) * sizeof(merged_t));
+    decoder_t d = { .ov = ov, .iters = calloc(ov->nlayers + 1, sizeof(tar_index_iter_t)) };
+    if (!out || !d.iters) {
+        free(out);
+        free(d.iters);
+        return -1;
+    }
+
+    // Merge the current view, minus what the layer hides, with the layer.
+    tar_index_iter_t it;
+    size_t i = 0, n = 0;
+    int more = tar_index_iter_seek(&it, layer->index, 0);
+    while (i < ov->count || more) {
+        const tar_index_iter_t *old = i < ov->count ? decode(&d, &ov->entries[i]) : NULL;
+        if (old && hidden_by(layer, old->path, old->len)) {
+            i++;
+            continue;
+        }
+        if (more && is_whiteout(it.path, it.len)) {
+            more = tar_index_iter_next(&it);
+            continue;
+        }
+        if (old && (!more || path_cmp(old->path, old->len, it.path, it.len) < 0)) {
+            out[n++] = ov->entries[i++];
+        } else {
+            out[n++] = (merged_t) {
+                .hash = tar_hash_path(it.path, it.len),
+                .layer = ov->nlayers,
+                .pos = it.pos,
+            };
+            more = tar_index_iter_next(&it);
+        }
+    }
+    free(d.iters);
+
+    merged_t *previous = ov->entries;
+    size_t previous_count = ov->count;
+    ov->entries = out;
+    ov->count = n;
+    if (build_table(ov) < 0) {
+        ov->entries = previous;
+        ov->count = previous_count;
+        free(out);
+        return -1;
+    }
+    free(previous);
+    ov->nlayers++;
+    return 0;
+}
+
+/* Looks a path up in the merged view. Returns the merged entry, or NULL. */
+static const merged_t *overlay_find(tar_overlay_t *ov, const char *path, size_t len) {
+    uint64_t hash = tar_hash_path(path, len);
+    tar_index_iter_t it;
+
+    if (!ov->table) return NULL;
+    for (size_t pos = hash & ov->table_mask; ov->table[pos]; pos = (pos + 1) & ov->table_mask) {
+        if (ov->tags[pos] != (uint8_t) (hash >> 56)) continue;
+        const merged_t *m = &ov->entries[ov->table[pos] - 1];
+        if (m->hash != hash) continue;
+        tar_index_iter_seek(&it, ov->layers[m->layer]->index, m->pos);
+        if (it.len == len && memcmp(it.path, path, len) == 0) return m;
+    }
+    return NULL;
+}
+
+/* The context of lookups through the overlay, which remembers the layer of the last entry found. */
+typedef struct overlay_lookup {
+    tar_overlay_t *ov;
+    uint32_t layer;
+} overlay_lookup_t;
+
+static int lookup(void *ctx, const char *path, size_t len, tar_entry_t *entry) {
+    overlay_lookup_t *l = ctx;
+    const merged_t *m = overlay_find(l->ov, path, len);
+
+    if (!m) return 0;
+    tar_index_entry(l->ov->layers[m->layer]->index, m->pos, entry);
+    l->layer = m->layer;
+    return 1;
+}
+
+int tar_overlay_exists(tar_overlay_t *ov, char *path) {
+    return overlay_find(ov, path, strlen(path)) != NULL;
+}
+
+static char overlay_type(tar_overlay_t *ov, const char *path) {
+    overlay_lookup_t l = { .ov = ov };
+    tar_entry_t entry;
+    return lookup(&l, path, strlen(path), &entry) ? entry.typeflag : -1;
+}
+
+int tar_overlay_is_dir(tar_overlay_t *ov, char *path) {
+    return overlay_type(ov, path) == DIRTYPE;
+}
+
+int tar_overlay_is_file(tar_overlay_t *ov, char *path) {
+    char type = overlay_type(ov, path);
+    return type == REGTYPE || type == AREGTYPE;
+}
+
+int tar_overlay_is_symlink(tar_overlay_t *ov, char *path) {
+    return overlay_type(ov, path) == SYMTYPE;
+}
+
+int tar_overlay_stat(tar_overlay_t *ov, char *path, tar_stat_t *st) {
+    overlay_lookup_t l = { .ov = ov };
+    tar_entry_t entry;
+
+    if (!lookup(&l, path, strlen(path), &entry)) return 0;
+    st->typeflag = entry.typeflag;
+    st->mode = entry.mode;
+    st->size = entry.size;
+    st->mtime = entry.mtime;
+    st->data_offset = entry.data_off;
+    return 1;
+}
+
+ssize_t tar_overlay_read_file(tar_overlay_t *ov, char *path, size_t offset, uint8_t *dest, size_t *len) {
+    overlay_lookup_t l = { .ov = ov };
+    tar_entry_t entry;
+
+    if (!tar_resolve(lookup, &l, path, &entry)) return -1;
+    if (entry.typeflag != REGTYPE && entry.typeflag != AREGTYPE) return -1;
+    if (offset > entry.size) return -2;
+
+    size_t want = *len;
+    if (want > entry.size - offset) want = entry.size - offset;
+    ssize_t n = tar_pread(ov->layers[l.layer], dest, want, entry.data_off + offset);
+    if (n < 0) return -1;
+    *len = n;
+    return entry.size - offset - n;
+}
+
+/* Returns the first merged entry whose path is not smaller than `key`. */
+static size_t lower_bound(decoder_t *d, const char *key, size_t len) {
+    size_t lo = 0, hi = d->ov->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const tar_index_iter_t *it = decode(d, &d->ov->entries[mid]);
+        if (path_cmp(it->path, it->len, key, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int tar_overlay_list(tar_overlay_t *ov, char *path, tar_list_t *out) {
+    overlay_lookup_t l = { .ov = ov };
+    tar_entry_t entry;
+    char key[TAR_PATH_MAX + 1];
+
+    memset(out, 0, sizeof(*out));
+    if (path[0] == '\0') {
+        // The root, which has no entry of its own.
+        entry.path[0] = '\0';
+        entry.typeflag = DIRTYPE;
+    } else if (!tar_resolve(lookup, &l, path, &entry)) {
+        // Accept directories given without their trailing slash.
+        size_t len = strlen(path);
+        if (len >= TAR_PATH_MAX || path[len - 1] == '/') return 0;
+        memcpy(key, path, len);
+        key[len] = '/';
+        key[len + 1] = '\0';
+        if (!tar_resolve(lookup, &l, key, &entry)) return 0;
+    }
+    if (entry.typeflag != DIRTYPE) return 0;
+
+    decoder_t d = { .ov = ov, .iters = calloc(ov->nlayers, sizeof(tar_index_iter_t)) };
+    if (!d.iters) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t dir_len = strlen(entry.path);
+    tar_buf_t names = { 0 };
+    size_t count = 0;
+    int ok = 1;
+
+    // Same walk as tar_list.c, over the merged entries.
+    size_t pos = lower_bound(&d, entry.path, dir_len);
+    while (ok && pos < ov->count) {
+        const tar_index_iter_t *it = decode(&d, &ov->entries[pos]);
+        if (it->len < dir_len || memcmp(it->path, entry.path, dir_len) != 0) break;
+        if (it->len == dir_len) {
+            pos++;
+            continue;
+        }
+        const char *slash = memchr(it->path + dir_len, '/', it->len - dir_len);
+        size_t len = slash ? (size_t) (slash - it->path) + 1 : it->len;
+        memcpy(key, it->path, len);
+        ok = tar_buf_append(&names, key, len) == 0 && tar_buf_append(&names, "", 1) == 0;
+        count++;
+        if (slash) {
+            key[len - 1] = '/' + 1;
+            pos = lower_bound(&d, key, len);
+        } else {
+            pos++;
+        }
+    }
+    free(d.iters);
+
+    out->memory = ok ? malloc(count * sizeof(tar_strview_t) + names.len + 1) : NULL;
+    if (!out->memory) {
+        free(names.data);
+        errno = ENOMEM;
+        return -1;
+    }
+    out->entries = out->memory;
+    char *strings = (char *) (out->entries + count);
+    if (names.len) memcpy(strings, names.data, names.len);
+    for (size_t i = 0; i < count; i++) {
+        out->entries[i].data = strings;
+        out->entries[i].len = strlen(strings);
+        strings += out->entries[i].len + 1;
+    }
+    out->count = count;
+    free(names.data);
+    return 1;
+}
@@ -0,0 +1,40 @@
+#include <pthread.h>
+
+#include "tar_internal.h"
+
+typedef struct pool_job {
+    void (*fn)(void *arg, size_t i);
+    void *arg;
+    size_t n;
+    size_t next;                   /* next item to hand out, shared by the workers */
+} pool_job_t;
+
+static void *pool_worker(void *data) {
+    pool_job_t *job = data;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) job->fn(job->arg, i);
+    return NULL;
+}
+
+int tar_pool_threads(int threads) {
+    if (threads > 0) return threads;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int) cpus : 1;
+}
+
+void tar_parallel_for(int threads, size_t n, void (*fn)(void *arg, size_t i), void *arg) {
+    pool_job_t job = { .fn = fn, .arg = arg, .n = n, .next = 0 };
+    threads = tar_pool_threads(threads);
+    if ((size_t) threads > n) threads = n ? n : 1;
+
+    pthread_t *tids = threads > 1 ? malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    int started = 0;
+    if (tids) {
+        while (started < threads - 1 && pthread_create(&tids[started], NULL, pool_worker, &job) == 0) started++;
+    }
+    // The calling thread works too, so the job completes even if no thread started.
+    pool_worker(&job);
+    for (int i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+}
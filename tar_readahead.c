@@ -0,0 +1,74 @@
+#include "tar_internal.h"
+
+/*
+ * The kernel reads ahead of each open file on its own, but it sees a single
+ * stream of offsets per descriptor: members read in turn, or by several
+ * threads sharing a handle, look random to it. Here each member has its own
+ * stream, and the hints are issued for the member being read.
+ */
+
+/* Sequential reads may start a little before or after where the last one ended. */
+#define SLACK (64 * 1024)
+
+/* Asks the kernel to read `len` bytes of the archive from `offset`, without waiting for them. */
+static void hint(tar_handle_t *h, off_t offset, uint64_t len) {
+    if (h->map) {
+        long page = sysconf(_SC_PAGESIZE);
+        off_t start = offset & ~(off_t) (page - 1);
+        // A truncated archive may claim more data than was mapped.
+        if ((uint64_t) offset >= h->map_len) return;
+        if (len > h->map_len - offset) len = h->map_len - offset;
+        madvise((void *) (h->map + start), len + (offset - start), MADV_WILLNEED);
+    } else {
+        posix_fadvise(h->fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+    TAR_STATS_ADD(h->stats, syscalls, 1);
+    TAR_STATS_ADD(h->stats, readahead_bytes, len);
+}
+
+/* Returns the stream of the member at `data_off`, recycling the least recently used one if it has none. */
+static tar_ra_stream_t *get_stream(tar_readahead_t *ra, off_t data_off) {
+    tar_ra_stream_t *victim = &ra->streams[0];
+
+    for (size_t i = 0; i < TAR_RA_STREAMS; i++) {
+        tar_ra_stream_t *s = &ra->streams[i];
+        if (s->data_off == data_off) return s;
+        if (s->last_use < victim->last_use) victim = s;
+    }
+    *victim = (tar_ra_stream_t) { .data_off = data_off, .next = UINT64_MAX };
+    return victim;
+}
+
+void tar_readahead(tar_handle_t *h, const tar_entry_t *entry, uint64_t offset, size_t len) {
+    tar_readahead_t *ra = h->readahead;
+    uint64_t end = offset + len;
+
+    // Members that fit in the first window are read in a call or two anyway.
+    if (!ra || entry->size <= TAR_RA_MIN) return;
+
+    pthread_mutex_lock(&ra->lock);
+    tar_ra_stream_t *s = get_stream(ra, entry->data_off);
+    s->last_use = ++ra->clock;
+    int sequential = s->next != UINT64_MAX && offset + SLACK >= s->next && offset <= s->next + SLACK;
+    s->next = end;
+    if (!sequential) {
+        s->window = 0;
+        s->ahead = 0;
+        pthread_mutex_unlock(&ra->lock);
+        return;
+    }
+
+    // The next window is hinted once half of the current one has been read.
+    if (s->ahead < end) s->ahead = end;
+    uint64_t from = s->ahead, to = from;
+    if (s->ahead < entry->size && (s->window == 0 || s->ahead - end < s->window / 2)) {
+        s->window = s->window ? s->window * 2 : TAR_RA_MIN;
+        if (s->window > TAR_RA_MAX) s->window = TAR_RA_MAX;
+        to = end + s->window < entry->size ? end + s->window : entry->size;
+        if (to < from) to = from;
+        s->ahead = to;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    if (to > from) hint(h, entry->data_off + from, to - from);
+}
@@ -0,0 +1,258 @@
+#include "tar_internal.h"
+
+/*
+ * Scans read whole members once, front to back. Through the page cache,
+ * hashing or searching a large archive evicts everything else the machine
+ * had cached, for data that will not be read again. Handles opened with a
+ * scan mode read them in large chunks instead, either with O_DIRECT, which
+ * bypasses the page cache, or buffered and dropped from the cache once
+ * consumed (POSIX_FADV_DONTNEED). The block cache of the handle is bypassed
+ * too.
+ *
+ * The next chunk is read in the background (POSIX AIO) while the current
+ * one is consumed. Chunks come from a pool of aligned buffers kept by the
+ * handle, so that scanning many members does not allocate for each.
+ *
+ * Members are scanned in runs: members consecutive in the archive share one
+ * scan, which moves from one to the next with tar_scan_seek(), so that the
+ * many small members of an archive are read in a few large chunks rather
+ * than with a synchronous read each.
+ */
+
+/* Runs of a plan hold at least this many bytes of data, unless the whole scan is smaller. */
+#define RUN_MIN_BYTES TAR_SCAN_CHUNK
+
+/* Runs per worker thread, for the work to even out when members differ in size. */
+#define RUNS_PER_THREAD 4
+
+int tar_scanner_init(tar_handle_t *h, int flags) {
+    if (!(flags & (TAR_OPEN_SCAN_DIRECT | TAR_OPEN_SCAN_DONTNEED))) return 0;
+    tar_scanner_t *sc = calloc(1, sizeof(tar_scanner_t));
+    if (!sc) return -1;
+    sc->fd = h->fd;
+
+    if (flags & TAR_OPEN_SCAN_DIRECT) {
+        // O_DIRECT is a property of the open file, the descriptor of the handle must stay as it is.
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", h->fd);
+        int fd = open(proc_path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+        // File systems without O_DIRECT (tmpfs) get the buffered mode.
+        if (fd != -1) {
+            sc->fd = fd;
+            sc->direct = 1;
+        }
+    }
+    h->scanner = sc;
+    return 0;
+}
+
+void tar_scanner_free(tar_scanner_t *sc) {
+    if (!sc) return;
+    if (sc->direct) close(sc->fd);
+    free(sc);
+}
+
+void tar_scan_open(tar_scan_t *s, tar_handle_t *h, off_t off, uint64_t len) {
+    int direct = h->scanner && h->scanner->direct;
+
+    memset(s, 0, sizeof(*s));
+    s->h = h;
+    s->pos = off;
+    s->end = off + len;
+    s->next_read = direct ? off & ~(off_t) (TAR_BUF_ALIGN - 1) : off;
+    s->read_end = direct ? (s->end + TAR_BUF_ALIGN - 1) & ~(off_t) (TAR_BUF_ALIGN - 1) : s->end;
+}
+
+/* Assigns the next chunk of the range to buffer `i`, and starts reading it in the background if `async`. */
+static void start_read(tar_scan_t *s, int i, int async) {
+    tar_scanner_t *sc = s->h->scanner;
+
+    s->chunk_off[i] = s->next_read;
+    s->chunk_len[i] = s->read_end - s->next_read < TAR_SCAN_CHUNK ? s->read_end - s->next_read : TAR_SCAN_CHUNK;
+    s->chunk_valid[i] = 0;
+    s->next_read += s->chunk_len[i];
+    s->state[i] = SCAN_SYNC;
+    if (!async) return;
+
+    // A single aiocb: at most one read is in flight, the one of the chunk after the current one.
+    memset(&s->cb, 0, sizeof(s->cb));
+    s->cb.aio_fildes = sc->fd;
+    s->cb.aio_buf = s->buf[i];
+    s->cb.aio_nbytes = s->chunk_len[i];
+    s->cb.aio_offset = s->chunk_off[i];
+    s->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+    TAR_PROBE3(io_submit, sc->fd, s->chunk_off[i], s->chunk_len[i]);
+    // Otherwise it is read when needed.
+    if (aio_read(&s->cb) == 0) s->state[i] = SCAN_AIO;
+}
+
+/* Completes the read into buffer `i`. Returns the bytes read, or -1 on error. */
+static ssize_t finish_read(tar_scan_t *s, int i) {
+    tar_scanner_t *sc = s->h->scanner;
+    ssize_t n;
+
+    if (s->state[i] == SCAN_AIO) {
+        const struct aiocb *list[1] = { &s->cb };
+        int err;
+        while ((err = aio_error(&s->cb)) == EINPROGRESS) aio_suspend(list, 1, NULL);
+        n = aio_return(&s->cb);
+        if (err) errno = err;
+    } else {
+        TAR_PROBE3(io_submit, sc->fd, s->chunk_off[i], s->chunk_len[i]);
+        do n = pread(sc->fd, s->buf[i], s->chunk_len[i], s->chunk_off[i]);
+        while (n < 0 && errno == EINTR);
+    }
+    s->state[i] = SCAN_IDLE;
+    TAR_PROBE3(io_complete, sc->fd, s->chunk_off[i], n);
+    TAR_STATS_ADD(s->h->stats, syscalls, 1);
+    if (n > 0) TAR_STATS_ADD(s->h->stats, bytes_read, n);
+    return n;
+}
+
+/* Makes the chunk holding `s->pos` current. Returns 0 on success, -1 on error. */
+static int next_chunk(tar_scan_t *s) {
+    tar_scanner_t *sc = s->h->scanner;
+
+    if (!s->buf[s->cur]) {
+        s->buf[s->cur] = tar_buf_get(&s->h->buffers, TAR_SCAN_CHUNK);
+        if (!s->buf[s->cur]) return -1;
+        start_read(s, s->cur, 0);
+    } else if (s->state[s->cur] == SCAN_IDLE) {
+        // Done with the current chunk.
+        if (!sc->direct) posix_fadvise(sc->fd, s->chunk_off[s->cur], s->chunk_len[s->cur], POSIX_FADV_DONTNEED);
+        s->cur = 1 - s->cur;
+        if (s->state[s->cur] == SCAN_IDLE) return -1;
+    }
+
+    ssize_t n = finish_read(s, s->cur);
+    if (n <= 0 || s->chunk_off[s->cur] + n <= s->pos) return -1;
+    s->chunk_valid[s->cur] = n;
+
+    // The chunk after this one is read in the background while this one is consumed.
+    int other = 1 - s->cur;
+    if (s->next_read < s->read_end) {
+        if (!s->buf[other]) s->buf[other] = tar_buf_get(&s->h->buffers, TAR_SCAN_CHUNK);
+        if (!s->buf[other]) return -1;
+        start_read(s, other, 1);
+    }
+    return 0;
+}
+
+ssize_t tar_scan_read(tar_scan_t *s, void *dest, size_t len) {
+    if (len > (uint64_t) (s->end - s->pos)) len = s->end - s->pos;
+    if (len == 0) return 0;
+    if (!s->h->scanner) {
+        ssize_t n = tar_pread(s->h, dest, len, s->pos);
+        if (n > 0) s->pos += n;
+        return n;
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        int i = s->cur;
+        if (!s->buf[i] || s->pos >= s->chunk_off[i] + (off_t) s->chunk_valid[i]) {
+            if (next_chunk(s) < 0) return done ? (ssize_t) done : -1;
+            i = s->cur;
+        }
+        size_t avail = s->chunk_off[i] + s->chunk_valid[i] - s->pos;
+        size_t n = len - done < avail ? len - done : avail;
+        memcpy((uint8_t *) dest + done, s->buf[i] + (s->pos - s->chunk_off[i]), n);
+        s->pos += n;
+        done += n;
+    }
+    return done;
+}
+
+/* Returns 1 if `off` is in the current chunk, or in a chunk still to be read. */
+static int holds(const tar_scan_t *s, off_t off) {
+    for (int i = 0; i < 2; i++) {
+        if (!s->buf[i] || off < s->chunk_off[i]) continue;
+        if (s->state[i] != SCAN_IDLE && off < s->chunk_off[i] + (off_t) s->chunk_len[i]) return 1;
+        if (i == s->cur && off < s->chunk_off[i] + (off_t) s->chunk_valid[i]) return 1;
+    }
+    return 0;
+}
+
+void tar_scan_seek(tar_scan_t *s, off_t off) {
+    tar_scanner_t *sc = s->h->scanner;
+
+    // Data already read, or being read, stay: the next member is often among them.
+    if (!sc || holds(s, off)) {
+        s->pos = off;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (s->state[i] == SCAN_AIO) finish_read(s, i);
+        s->state[i] = SCAN_IDLE;
+    }
+    if (!sc->direct && s->buf[s->cur]) {
+        off_t from = s->chunk_off[s->cur];
+        posix_fadvise(sc->fd, from, s->next_read - from, POSIX_FADV_DONTNEED);
+    }
+    s->pos = off;
+    s->next_read = sc->direct ? off & ~(off_t) (TAR_BUF_ALIGN - 1) : off;
+    // The current buffer, if any, starts over from there, read when needed.
+    if (s->buf[s->cur]) start_read(s, s->cur, 0);
+}
+
+void tar_scan_close(tar_scan_t *s) {
+    tar_scanner_t *sc = s->h->scanner;
+    if (!sc) return;
+
+    for (int i = 0; i < 2; i++) {
+        // A read still in flight owns its buffer until it completes.
+        if (s->state[i] == SCAN_AIO) finish_read(s, i);
+        tar_buf_put(&s->h->buffers, s->buf[i], TAR_SCAN_CHUNK);
+    }
+    // What was read ahead but not consumed is dropped as well.
+    if (!sc->direct && s->buf[0]) {
+        off_t from = s->chunk_off[s->cur];
+        posix_fadvise(sc->fd, from, s->next_read - from, POSIX_FADV_DONTNEED);
+    }
+}
+
+static int scan_item_cmp(const void *a, const void *b) {
+    const tar_scan_item_t *x = a, *y = b;
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+ssize_t tar_scan_plan(tar_scan_item_t *items, size_t n, int threads, size_t **runs) {
+    uint64_t total = 0;
+
+    qsort(items, n, sizeof(tar_scan_item_t), scan_item_cmp);
+    for (size_t i = 0; i < n; i++) total += items[i].size;
+    uint64_t target = total / ((uint64_t) tar_pool_threads(threads) * RUNS_PER_THREAD);
+    if (target < RUN_MIN_BYTES) target = RUN_MIN_BYTES;
+
+    *runs = malloc((n + 1) * sizeof(size_t));
+    if (!*runs) return -1;
+    size_t nruns = 0;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || bytes >= target) {
+            (*runs)[nruns++] = i;
+            bytes = 0;
+        }
+        bytes += items[i].size;
+    }
+    (*runs)[nruns] = n;
+    return nruns;
+}
+
+void tar_scan_open_run(tar_scan_t *s, tar_handle_t *h, const tar_scan_item_t *first, const tar_scan_item_t *last) {
+    tar_scan_open(s, h, first->off, last->off + last->size - first->off);
+}
+
+ssize_t tar_scan_pread(tar_handle_t *h, void *buf, size_t len, off_t off) {
+    tar_scan_t s;
+    size_t done = 0;
+
+    tar_scan_open(&s, h, off, len);
+    while (done < len) {
+        ssize_t n = tar_scan_read(&s, (uint8_t *) buf + done, len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    tar_scan_close(&s);
+    return done ? (ssize_t) done : -1;
+}
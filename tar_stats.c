@@ -0,0 +1,120 @@
+#include <time.h>
+
+#include "tar_internal.h"
+
+static const char *op_names[TAR_OP_COUNT] = {
+    [TAR_OP_CHECK_ARCHIVE] = "check_archive",
+    [TAR_OP_EXISTS] = "exists",
+    [TAR_OP_IS_DIR] = "is_dir",
+    [TAR_OP_IS_FILE] = "is_file",
+    [TAR_OP_IS_SYMLINK] = "is_symlink",
+    [TAR_OP_LIST] = "list",
+    [TAR_OP_READ_FILE] = "read_file",
+    [TAR_OP_OPEN] = "open",
+    [TAR_OP_STAT] = "stat",
+    [TAR_OP_EXTRACT] = "extract",
+    [TAR_OP_FIND] = "find",
+    [TAR_OP_GREP] = "grep",
+    [TAR_OP_HASH] = "member_hash",
+    [TAR_OP_FIND_DUPLICATES] = "find_duplicates",
+    [TAR_OP_DIFF] = "diff",
+    [TAR_OP_COPY] = "copy_to_fd",
+};
+
+const char *tar_op_name(int op) {
+    return op >= 0 && op < TAR_OP_COUNT ? op_names[op] : "unknown";
+}
+
+/* Smallest value that lands in bucket `i`. */
+static uint64_t bucket_low(size_t i) {
+    size_t sub = (size_t) 1 << TAR_HIST_SUB_BITS;
+    if (i < sub) return i;
+    int shift = (int) (i >> TAR_HIST_SUB_BITS) - 1;
+    return (uint64_t) (sub + (i & (sub - 1))) << shift;
+}
+
+uint64_t tar_hist_quantile(const tar_hist_t *hist, double q) {
+    if (hist->count == 0) return 0;
+    if (q < 0) q = 0;
+    if (q > 1) q = 1;
+
+    // The rank of the quantile, counted from 1.
+    uint64_t rank = (uint64_t) (q * hist->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < TAR_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen < rank) continue;
+        uint64_t high = i + 1 < TAR_HIST_BUCKETS ? bucket_low(i + 1) - 1 : hist->max_ns;
+        return high < hist->max_ns ? high : hist->max_ns;
+    }
+    return hist->max_ns;
+}
+
+#ifdef TAR_STATS
+tar_stats_t tar_global_stats;
+
+/* Depth of the public calls in progress on this thread, only the outermost is recorded. */
+static __thread int call_depth;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t bucket_of(uint64_t ns) {
+    size_t sub = (size_t) 1 << TAR_HIST_SUB_BITS;
+    if (ns < sub) return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    if (msb >= TAR_HIST_MAX_BITS) return TAR_HIST_BUCKETS - 1;
+    // The power of two picks the bucket group, the next bits below the top one the bucket.
+    int shift = msb - TAR_HIST_SUB_BITS;
+    return ((size_t) (shift + 1) << TAR_HIST_SUB_BITS) + ((ns >> shift) & (sub - 1));
+}
+
+static void hist_record(tar_hist_t *hist, uint64_t ns) {
+    __atomic_add_fetch(&hist->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void tar_timer_start(tar_timer_t *timer, tar_stats_t *stats, int op) {
+    timer->stats = call_depth++ == 0 ? stats : NULL;
+    timer->op = op;
+    timer->start_ns = timer->stats ? now_ns() : 0;
+}
+
+void tar_timer_stop(tar_timer_t *timer) {
+    call_depth--;
+    if (timer->stats) hist_record(&timer->stats->latency[timer->op], now_ns() - timer->start_ns);
+}
+
+/* Copies field by field, so that concurrent updates never tear a counter. */
+static void stats_copy(tar_stats_t *dest, tar_stats_t *src) {
+    const uint64_t *from = (const uint64_t *) src;
+    uint64_t *to = (uint64_t *) dest;
+    for (size_t i = 0; i < sizeof(tar_stats_t) / sizeof(uint64_t); i++) to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+int tar_get_stats(tar_handle_t *h, tar_stats_t *stats) {
+    stats_copy(stats, h ? h->stats : &tar_global_stats);
+    return 0;
+}
+
+void tar_reset_stats(tar_handle_t *h) {
+    memset(h ? h->stats : &tar_global_stats, 0, sizeof(tar_stats_t));
+}
+#else
+int tar_get_stats(tar_handle_t *h, tar_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    return -1;
+}
+
+void tar_reset_stats(tar_handle_t *h) {
+}
+#endif
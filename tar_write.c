@@ -0,0 +1,166 @@
+#include "tar_internal.h"
+
+/*
+ * The writer emits ustar headers. With TAR_WRITE_ALIGN, the data of every
+ * non-empty regular file starts on a TAR_WRITE_ALIGNMENT boundary of the
+ * archive, so that file systems with reflinks can later share the extents of
+ * members with extracted files instead of copying them (see tar_copy_data()).
+ *
+ * The gap in front of a member is filled with a pax extended header holding
+ * a single "comment" record, which pax readers ignore. GNU tar and lib_tar
+ * both skip it, so the archive reads the same as an unaligned one.
+ */
+#define WRITE_BUF_SIZE (128 * 1024)
+#define PAX_NAME "././@PaxHeader"
+
+struct tar_writer {
+    int fd;
+    int flags;
+    off_t start;                   /* where the archive starts in `fd` */
+    off_t pos;                     /* where the next header goes, relative to `start` */
+};
+
+tar_writer_t *tar_writer_new(int fd, int flags) {
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (start < 0) return NULL;
+    tar_writer_t *w = malloc(sizeof(tar_writer_t));
+    if (!w) return NULL;
+    *w = (tar_writer_t) { .fd = fd, .flags = flags, .start = start };
+    return w;
+}
+
+/* Writes all of `buf` at `pos`. Returns 0 on success, -1 on error. */
+static int write_at(tar_writer_t *w, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(w->fd, p, len, w->start + w->pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+        w->pos += n;
+    }
+    return 0;
+}
+
+/* Pads the archive with zeros up to the next block boundary. */
+static int pad_block(tar_writer_t *w) {
+    static const uint8_t zeros[BLOCK_SIZE];
+    size_t rem = w->pos % BLOCK_SIZE;
+    return rem ? write_at(w, zeros, BLOCK_SIZE - rem) : 0;
+}
+
+/* Fills a ustar header. Returns 0 on success, -1 if `path` or `linkname` does not fit. */
+static int fill_header(tar_header_t *header, const char *path, char typeflag, uint32_t mode, uint64_t size,
+                       int64_t mtime, const char *linkname) {
+    size_t len = strlen(path);
+
+    memset(header, 0, sizeof(*header));
+    if (len <= sizeof(header->name)) {
+        memcpy(header->name, path, len);
+    } else {
+        // Split at the first slash that leaves at most 100 bytes for the name.
+        if (len > TAR_PATH_MAX) return -1;
+        const char *split = strchr(path + len - sizeof(header->name) - 1, '/');
+        if (!split || split == path || (size_t) (split - path) > sizeof(header->prefix)) return -1;
+        memcpy(header->prefix, path, split - path);
+        memcpy(header->name, split + 1, len - (split - path) - 1);
+    }
+    if (linkname) {
+        if (strlen(linkname) > sizeof(header->linkname)) return -1;
+        memcpy(header->linkname, linkname, strlen(linkname));
+    }
+    // Sizes of 8 GiB and more take the GNU base-256 form, which tar_parse_num() reads.
+    if (size < (1ULL << 33)) {
+        snprintf(header->size, sizeof(header->size), "%011llo", (unsigned long long) size);
+    } else {
+        header->size[0] = (char) 0x80;
+        for (size_t i = sizeof(header->size) - 1; i > 0; i--, size >>= 8) header->size[i] = size & 0xff;
+    }
+    snprintf(header->mode, sizeof(header->mode), "%07o", mode & 07777);
+    snprintf(header->uid, sizeof(header->uid), "%07o", 0);
+    snprintf(header->gid, sizeof(header->gid), "%07o", 0);
+    uint64_t max = 077777777777;
+    snprintf(header->mtime, sizeof(header->mtime), "%011llo",
+             (unsigned long long) (mtime < 0 ? 0 : (uint64_t) mtime > max ? max : (uint64_t) mtime));
+    header->typeflag = typeflag;
+    memcpy(header->magic, TMAGIC, TMAGLEN);
+    memcpy(header->version, TVERSION, TVERSLEN);
+
+    unsigned int sum = 0;
+    memset(header->chksum, ' ', sizeof(header->chksum));
+    for (size_t i = 0; i < sizeof(*header); i++) sum += ((unsigned char *) header)[i];
+    snprintf(header->chksum, sizeof(header->chksum), "%06o", sum);
+    return 0;
+}
+
+/* Writes a pax header of `gap` bytes (a multiple of BLOCK_SIZE, at least two blocks) that readers ignore. */
+static int write_pad(tar_writer_t *w, size_t gap) {
+    tar_header_t header;
+    char record[TAR_WRITE_ALIGNMENT + BLOCK_SIZE];
+    size_t len = gap - BLOCK_SIZE;
+
+    // A record is "<length> comment=<text>\n", its length counting its own digits.
+    int n = snprintf(record, sizeof(record), "%zu comment=", len);
+    memset(record + n, 'x', len - n - 1);
+    record[len - 1] = '\n';
+    if (fill_header(&header, PAX_NAME, XHDTYPE, 0644, len, 0, NULL) < 0) return -1;
+    if (write_at(w, &header, sizeof(header)) < 0) return -1;
+    return write_at(w, record, len);
+}
+
+/* Pads the archive so that the data of the next member start on an alignment boundary. */
+static int align_data(tar_writer_t *w) {
+    size_t need = (TAR_WRITE_ALIGNMENT - (w->pos + BLOCK_SIZE) % TAR_WRITE_ALIGNMENT) % TAR_WRITE_ALIGNMENT;
+    if (need == 0) return 0;
+    // A pax header takes two blocks at least: a one-block gap grows by a whole alignment.
+    return write_pad(w, need == BLOCK_SIZE ? need + TAR_WRITE_ALIGNMENT : need);
+}
+
+/* Copies `size` bytes from the start of `data_fd` to the archive. */
+static int copy_in(tar_writer_t *w, int data_fd, uint64_t size) {
+    loff_t in_off = 0, out_off = w->start + w->pos;
+    uint64_t done = 0;
+
+    // The kernel may share the extents when both sides line up, and copies otherwise.
+    while (done < size) {
+        ssize_t n = copy_file_range(data_fd, &in_off, w->fd, &out_off, size - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    w->pos += done;
+
+    uint8_t *buf = done < size ? malloc(WRITE_BUF_SIZE) : NULL;
+    if (done < size && !buf) return -1;
+    while (done < size) {
+        size_t want = size - done < WRITE_BUF_SIZE ? size - done : WRITE_BUF_SIZE;
+        ssize_t n = pread(data_fd, buf, want, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || write_at(w, buf, n) < 0) break;
+        done += n;
+    }
+    free(buf);
+    return done == size ? 0 : -1;
+}
+
+int tar_writer_add(tar_writer_t *w, const char *path, const tar_stat_t *st, const char *linkname, int data_fd) {
+    tar_header_t header;
+    int has_data = (st->typeflag == REGTYPE || st->typeflag == AREGTYPE) && st->size > 0;
+
+    if (fill_header(&header, path, st->typeflag, st->mode, has_data ? st->size : 0, st->mtime, linkname) < 0) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (has_data && (w->flags & TAR_WRITE_ALIGN) && align_data(w) < 0) return -1;
+    if (write_at(w, &header, sizeof(header)) < 0) return -1;
+    if (has_data && (copy_in(w, data_fd, st->size) < 0 || pad_block(w) < 0)) return -1;
+    return 0;
+}
+
+int tar_writer_close(tar_writer_t *w) {
+    static const uint8_t end[2 * BLOCK_SIZE];
+    int ret = write_at(w, end, sizeof(end));
+    free(w);
+    return ret;
+}
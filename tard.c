@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lib_tar.h"
+#include "tard.h"
+
+/**
+ * tard keeps indexed handles on archives, and a block cache shared by all of
+ * them, for the processes that would otherwise each open and scan the same
+ * archives. See tard.h for the protocol.
+ *
+ * Each connection is served by its own thread. Archives are opened on first
+ * use and stay open until the daemon exits; a path that fails to open is
+ * retried by the next request on it.
+ *
+ * Usage: ./tard [-c cache_mib] socket_path
+ */
+
+#define DEFAULT_CACHE_MIB 256
+#define MAX_ARCHIVES 1024
+
+typedef struct archive {
+    char *path;
+    int fd;
+    tar_handle_t *h;              /* NULL until opened, or after a failed open */
+    int opening;                  /* a thread is opening it, outside archives_lock */
+    int waiters;                  /* threads waiting for that open */
+} archive_t;
+
+static tar_cache_t *cache;
+static archive_t archives[MAX_ARCHIVES];
+static size_t narchives;
+static pthread_mutex_t archives_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t archive_opened = PTHREAD_COND_INITIALIZER;
+
+/* Returns the slot for `path`: its own, a slot left by a failed open, or a new one. Called with archives_lock held. */
+static archive_t *find_slot(const char *path) {
+    archive_t *unused = NULL;
+
+    for (size_t i = 0; i < narchives; i++) {
+        archive_t *a = &archives[i];
+        if (strcmp(a->path, path) == 0) return a;
+        if (!unused && !a->h && !a->opening && !a->waiters) unused = a;
+    }
+    if (!unused && narchives == MAX_ARCHIVES) {
+        errno = EMFILE;
+        return NULL;
+    }
+    char *copy = strdup(path);
+    if (!copy) return NULL;
+    if (!unused) unused = &archives[narchives++];
+    free(unused->path);
+    *unused = (archive_t) { .path = copy, .fd = -1 };
+    return unused;
+}
+
+/**
+ * Finds the archive at `path`, opening it on first use. The open runs
+ * outside archives_lock, so that indexing a large archive does not stall the
+ * requests on the others; the requests on the same archive wait for it.
+ *
+ * @return the archive, or NULL with errno set.
+ */
+static archive_t *get_archive(const char *path) {
+    pthread_mutex_lock(&archives_lock);
+    archive_t *a = find_slot(path);
+    if (a) {
+        a->waiters++;
+        while (a->opening) pthread_cond_wait(&archive_opened, &archives_lock);
+        a->waiters--;
+    }
+    if (a && !a->h) {
+        a->opening = 1;
+        pthread_mutex_unlock(&archives_lock);
+
+        tar_options_t opts = { .cache = cache };
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        tar_handle_t *h = fd == -1 ? NULL : tar_open(fd, &opts);
+        int err = fd == -1 ? errno : EINVAL;
+        if (!h && fd != -1) close(fd);
+
+        pthread_mutex_lock(&archives_lock);
+        a->fd = h ? fd : -1;
+        a->h = h;
+        a->opening = 0;
+        pthread_cond_broadcast(&archive_opened);
+        if (!h) errno = err;
+    }
+    if (a && !a->h) a = NULL;
+    pthread_mutex_unlock(&archives_lock);
+    return a;
+}
+
+/* Sends one response, with `fd` attached when it is not -1. Returns 0 on success, -1 on error. */
+static int send_response(int sock, tard_response_t *resp, const void *payload, int fd) {
+    struct iovec iov[2] = {
+        { .iov_base = resp, .iov_len = sizeof(*resp) },
+        { .iov_base = (void *) payload, .iov_len = payload ? resp->length : 0 },
+    };
+    union {
+        struct cmsghdr header;
+        char bytes[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    if (fd != -1) {
+        msg.msg_control = control.bytes;
+        msg.msg_controllen = sizeof(control.bytes);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+static void fill_stat(tard_response_t *resp, const tar_stat_t *st) {
+    resp->size = st->size;
+    resp->data_offset = st->data_offset;
+    resp->mtime = st->mtime;
+    resp->mode = st->mode;
+    resp->typeflag = st->typeflag;
+}
+
+/* Sends the entries of a directory, as many per response as fit. */
+static int serve_list(int sock, archive_t *a, char *path, uint8_t *payload) {
+    tard_response_t resp = { 0 };
+    tar_list_cursor_t cursor;
+    tar_list_t batch;
+
+    if (!tar_list_open(a->h, path, &cursor)) {
+        resp.status = -ENOENT;
+        return send_response(sock, &resp, NULL, -1);
+    }
+    ssize_t n;
+    while ((n = tar_list_next(a->h, &cursor, 256, &batch)) > 0) {
+        for (size_t i = 0; i < batch.count; i++) {
+            size_t len = batch.entries[i].len + 1;
+            if (resp.length + len > TARD_MAX_PAYLOAD) {
+                resp.flags = TARD_MORE;
+                if (send_response(sock, &resp, payload, -1) < 0) {
+                    tar_list_free(&batch);
+                    return -1;
+                }
+                resp.length = 0;
+            }
+            memcpy(payload + resp.length, batch.entries[i].data, len);
+            resp.length += len;
+        }
+        tar_list_free(&batch);
+    }
+    resp.flags = 0;
+    if (n < 0) {
+        resp.status = -errno;
+        resp.length = 0;
+    }
+    return send_response(sock, &resp, payload, -1);
+}
+
+/* Serves one request. Returns 0 on success, -1 if the connection must be closed. */
+static int serve_request(int sock, const uint8_t *msg, size_t len, uint8_t *payload) {
+    tard_request_t req;
+    char archive_path[TARD_MAX_ARCHIVE + 1], path[TARD_MAX_PATH + 1];
+    tard_response_t resp = { 0 };
+    tar_stat_t st;
+
+    if (len < sizeof(req)) return -1;
+    memcpy(&req, msg, sizeof(req));
+    if (req.archive_len > TARD_MAX_ARCHIVE || req.path_len > TARD_MAX_PATH
+        || len != sizeof(req) + req.archive_len + req.path_len) return -1;
+    memcpy(archive_path, msg + sizeof(req), req.archive_len);
+    archive_path[req.archive_len] = '\0';
+    memcpy(path, msg + sizeof(req) + req.archive_len, req.path_len);
+    path[req.path_len] = '\0';
+
+    archive_t *a = get_archive(archive_path);
+    if (!a) {
+        resp.status = -errno;
+        return send_response(sock, &resp, NULL, -1);
+    }
+
+    switch (req.op) {
+    case TARD_STAT:
+        if (tar_stat(a->h, path, &st)) fill_stat(&resp, &st);
+        else resp.status = -ENOENT;
+        return send_response(sock, &resp, NULL, -1);
+
+    case TARD_LIST:
+        return serve_list(sock, a, path, payload);
+
+    case TARD_READ: {
+        size_t want = req.length < TARD_MAX_PAYLOAD ? req.length : TARD_MAX_PAYLOAD;
+        ssize_t rem = tar_read_file(a->h, path, req.offset, payload, &want);
+        if (rem >= 0) {
+            resp.length = want;
+            resp.size = req.offset + want + rem;
+        } else {
+            resp.status = rem == -2 ? -EINVAL : -ENOENT;
+        }
+        return send_response(sock, &resp, payload, -1);
+    }
+
+    case TARD_READ_FD:
+        // The member is contiguous in the archive: the client reads its slice from our descriptor.
+        if (!tar_stat_resolved(a->h, path, &st) || (st.typeflag != REGTYPE && st.typeflag != AREGTYPE)) {
+            resp.status = -ENOENT;
+        } else if (req.offset > st.size) {
+            resp.status = -EINVAL;
+        } else {
+            fill_stat(&resp, &st);
+            resp.data_offset = st.data_offset + req.offset;
+            resp.length = st.size - req.offset < req.length ? st.size - req.offset : req.length;
+            return send_response(sock, &resp, NULL, a->fd);
+        }
+        return send_response(sock, &resp, NULL, -1);
+
+    default:
+        resp.status = -EINVAL;
+        return send_response(sock, &resp, NULL, -1);
+    }
+}
+
+static void *serve_connection(void *arg) {
+    int sock = (int) (intptr_t) arg;
+    uint8_t msg[sizeof(tard_request_t) + TARD_MAX_ARCHIVE + TARD_MAX_PATH];
+    uint8_t *payload = malloc(TARD_MAX_PAYLOAD);
+    ssize_t n;
+
+    while (payload && (n = recv(sock, msg, sizeof(msg), 0)) > 0) {
+        if (serve_request(sock, msg, n, payload) < 0) break;
+    }
+    free(payload);
+    close(sock);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    size_t cache_mib = DEFAULT_CACHE_MIB;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        if (opt == 'c') cache_mib = strtoul(optarg, NULL, 10);
+        else break;
+    }
+    if (optind + 1 != argc) {
+        printf("Usage: %s [-c cache_mib] socket_path\n", argv[0]);
+        return -1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(argv[optind]) >= sizeof(addr.sun_path)) {
+        printf("%s: socket path too long\n", argv[0]);
+        return -1;
+    }
+    strcpy(addr.sun_path, argv[optind]);
+
+    cache = tar_cache_new(cache_mib << 20);
+    if (!cache) {
+        perror("tar_cache_new");
+        return -1;
+    }
+
+    // Only our user may connect: requests name any archive we can read.
+    umask(077);
+    unlink(addr.sun_path);
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listener == -1 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listener, 128) == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    for (;;) {
+        int sock = accept(listener, NULL, NULL);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("accept");
+            return -1;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_connection, (void *) (intptr_t) sock) != 0) {
+            close(sock);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
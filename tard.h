@@ -0,0 +1,53 @@
+#ifndef TARD_H
+#define TARD_H
+
+#include <stdint.h>
+
+/*
+ * Protocol of tard, the archive-serving daemon.
+ *
+ * Clients connect to a SOCK_SEQPACKET Unix socket, so that every request and
+ * every response is a single message. A request is a tard_request_t followed
+ * by the path of the archive and the path of the member, neither terminated.
+ * The daemon answers with one tard_response_t followed by `length` bytes of
+ * payload, or with several of them for TARD_LIST, all but the last one
+ * flagged TARD_MORE.
+ *
+ * Both sides run on the same host, the structures travel in native layout.
+ */
+
+#define TARD_MAX_PAYLOAD (64 * 1024) /* payload bytes of one response */
+#define TARD_MAX_ARCHIVE 4096        /* length of an archive path */
+#define TARD_MAX_PATH 256            /* length of a member path */
+
+typedef enum tard_op {
+    TARD_STAT = 1,                /* the metadata of a member, links not followed */
+    TARD_LIST,                    /* the entries of a directory, NUL-separated */
+    TARD_READ,                    /* at most `length` bytes of a file from `offset`, copied */
+    TARD_READ_FD                  /* the same slice of the archive, passed as a descriptor */
+} tard_op_t;
+
+typedef struct tard_request {
+    uint16_t op;                  /* a tard_op_t */
+    uint16_t archive_len;
+    uint16_t path_len;
+    uint16_t reserved;
+    uint64_t offset;              /* TARD_READ*: first byte of the member to read */
+    uint64_t length;              /* TARD_READ*: bytes to read */
+} tard_request_t;
+
+/* Flags of tard_response_t. */
+#define TARD_MORE 0x1             /* another response follows for the same request */
+
+typedef struct tard_response {
+    int32_t status;               /* 0, or a negated errno value */
+    uint32_t flags;               /* TARD_* flags */
+    uint64_t length;              /* payload bytes following, or the length of the slice for TARD_READ_FD */
+    uint64_t size;                /* size of the member */
+    uint64_t data_offset;         /* TARD_READ_FD: where the slice starts in the passed descriptor */
+    int64_t mtime;
+    uint32_t mode;
+    char typeflag;
+} tard_response_t;
+
+#endif
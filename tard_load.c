@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "lib_tar.h"
+#include "tard.h"
+
+/**
+ * Load generator for tard. Each thread keeps its own connection and sends
+ * requests on random members of the archive back to back, for each kind of
+ * request in turn. Results are printed as a JSON array like bench.c, with
+ * the throughput and latency quantiles of each kind.
+ *
+ * The members are picked from a local index of the archive, built once
+ * before the load starts.
+ *
+ * Usage: ./tard_load socket_path archive [threads [seconds]]
+ */
+
+#define READ_BUF (1 << 20)
+
+typedef struct load {
+    const char *socket_path;
+    const char *archive;
+    tard_op_t op;
+    double seconds;
+    char **files;                  /* regular files of the archive */
+    size_t nfiles;
+    char **dirs;
+    size_t ndirs;
+} load_t;
+
+typedef struct worker {
+    load_t *load;
+    pthread_t thread;
+    uint64_t seed;
+    uint64_t *latencies;           /* in ns, one per request */
+    size_t count;
+    size_t cap;
+    uint64_t bytes;
+    int failed;
+} worker_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+static int connect_daemon(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock != -1 && connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int send_request(int sock, tard_op_t op, const char *archive, const char *path, uint64_t offset, uint64_t length) {
+    tard_request_t req = {
+        .op = op,
+        .archive_len = strlen(archive),
+        .path_len = strlen(path),
+        .offset = offset,
+        .length = length,
+    };
+    struct iovec iov[3] = {
+        { .iov_base = &req, .iov_len = sizeof(req) },
+        { .iov_base = (void *) archive, .iov_len = req.archive_len },
+        { .iov_base = (void *) path, .iov_len = req.path_len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 3 };
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+/* Receives one response and its payload, and the descriptor passed along if any. */
+static int recv_response(int sock, tard_response_t *resp, uint8_t *payload, int *fd) {
+    struct iovec iov[2] = {
+        { .iov_base = resp, .iov_len = sizeof(*resp) },
+        { .iov_base = payload, .iov_len = TARD_MAX_PAYLOAD },
+    };
+    union {
+        struct cmsghdr header;
+        char bytes[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2, .msg_control = control.bytes,
+                          .msg_controllen = sizeof(control.bytes) };
+
+    *fd = -1;
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) < (ssize_t) sizeof(*resp)) return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+/* Sends one request and consumes its responses. Returns the payload bytes received, or -1. */
+static ssize_t call(worker_t *w, int sock, uint8_t *payload, uint8_t *buf) {
+    load_t *load = w->load;
+    uint64_t r = next_random(&w->seed);
+    const char *path = load->op == TARD_LIST ? load->dirs[r % load->ndirs] : load->files[r % load->nfiles];
+    tard_response_t resp;
+    ssize_t bytes = 0;
+    int fd;
+
+    if (send_request(sock, load->op, load->archive, path, 0, READ_BUF) < 0) return -1;
+    do {
+        if (recv_response(sock, &resp, payload, &fd) < 0 || resp.status != 0) {
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        bytes += resp.length;
+    } while (resp.flags & TARD_MORE);
+
+    if (load->op == TARD_READ_FD) {
+        if (fd == -1) return -1;
+        ssize_t n = pread(fd, buf, resp.length, resp.data_offset);
+        close(fd);
+        if (n != (ssize_t) resp.length) return -1;
+    }
+    return bytes;
+}
+
+static void *run_worker(void *arg) {
+    worker_t *w = arg;
+    uint8_t *payload = malloc(TARD_MAX_PAYLOAD), *buf = malloc(READ_BUF);
+    int sock = connect_daemon(w->load->socket_path);
+    uint64_t end = now_ns() + w->load->seconds * 1e9;
+
+    w->failed = !payload || !buf || sock == -1;
+    while (!w->failed && now_ns() < end) {
+        if (w->count == w->cap) {
+            size_t cap = w->cap ? 2 * w->cap : 4096;
+            uint64_t *latencies = realloc(w->latencies, cap * sizeof(uint64_t));
+            if (!latencies) {
+                w->failed = 1;
+                break;
+            }
+            w->latencies = latencies;
+            w->cap = cap;
+        }
+        uint64_t start = now_ns();
+        ssize_t n = call(w, sock, payload, buf);
+        w->latencies[w->count++] = now_ns() - start;
+        if (n < 0) w->failed = 1;
+        else w->bytes += n;
+    }
+    if (sock != -1) close(sock);
+    free(payload);
+    free(buf);
+    return NULL;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static const char *op_name(tard_op_t op) {
+    switch (op) {
+    case TARD_STAT: return "stat";
+    case TARD_LIST: return "list";
+    case TARD_READ: return "read";
+    case TARD_READ_FD: return "read_fd";
+    }
+    return "unknown";
+}
+
+static void run_load(load_t *load, int threads, int first) {
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    size_t total = 0;
+    uint64_t bytes = 0;
+    int failed = 0;
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (worker_t) { .load = load, .seed = 0x9e3779b97f4a7c15ULL * (i + 1) };
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].count;
+        bytes += workers[i].bytes;
+        failed |= workers[i].failed;
+    }
+
+    // Every latency of every thread, sorted for the quantiles.
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    size_t n = 0;
+    for (int i = 0; i < threads; i++) {
+        memcpy(all + n, workers[i].latencies, workers[i].count * sizeof(uint64_t));
+        n += workers[i].count;
+        free(workers[i].latencies);
+    }
+    qsort(all, n, sizeof(uint64_t), u64_cmp);
+    double p50 = n ? all[n / 2] / 1e3 : 0, p99 = n ? all[n * 99 / 100] / 1e3 : 0;
+
+    printf("%s\n  {\"bench\": \"tard_%s\", \"threads\": %d, \"ops\": %zu, \"ops_per_sec\": %.1f, "
+           "\"mib_per_sec\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"failed\": %d}",
+           first ? "[" : ",", op_name(load->op), threads, n, n / load->seconds,
+           bytes / load->seconds / (1 << 20), p50, p99, failed);
+    fflush(stdout);
+    free(all);
+    free(workers);
+}
+
+/* Collects the paths of the files and directories of the archive. */
+static int collect(load_t *load) {
+    int fd = open(load->archive, O_RDONLY);
+    tar_handle_t *h = fd == -1 ? NULL : tar_open(fd, NULL);
+    tar_index_info_t info;
+    tar_walk_t w;
+
+    if (!h || tar_get_index_info(h, &info) < 0) return -1;
+    load->files = malloc((info.entries + 1) * sizeof(char *));
+    load->dirs = malloc((info.entries + 1) * sizeof(char *));
+    for (int more = tar_walk_first(h, &w); more; more = tar_walk_next(&w)) {
+        tar_stat_t st;
+        tar_walk_stat(&w, &st);
+        if (st.typeflag == REGTYPE || st.typeflag == AREGTYPE) load->files[load->nfiles++] = strdup(w.path);
+        else if (st.typeflag == DIRTYPE) load->dirs[load->ndirs++] = strdup(w.path);
+    }
+    tar_close(h);
+    close(fd);
+    return load->nfiles ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        printf("Usage: %s socket_path archive [threads [seconds]]\n", argv[0]);
+        return -1;
+    }
+    load_t load = { .socket_path = argv[1], .seconds = argc > 4 ? atof(argv[4]) : 2 };
+    int threads = argc > 3 ? atoi(argv[3]) : 4;
+
+    // The daemon resolves paths from its own working directory.
+    char archive[TARD_MAX_ARCHIVE + 1];
+    if (!realpath(argv[2], archive)) {
+        perror("realpath(archive)");
+        return -1;
+    }
+    load.archive = archive;
+    if (collect(&load) < 0) {
+        printf("%s: no regular file in %s\n", argv[0], archive);
+        return -1;
+    }
+
+    const tard_op_t ops[] = { TARD_STAT, TARD_LIST, TARD_READ, TARD_READ_FD };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        load.op = ops[i];
+        if (load.op == TARD_LIST && load.ndirs == 0) continue;
+        run_load(&load, threads, i == 0);
+    }
+    printf("\n]\n");
+    return 0;
+}
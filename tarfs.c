@@ -0,0 +1,92 @@
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+
+#include "tarfs.h"
+
+/**
+ * Mounts an archive read-only with FUSE. The work is done by tarfs_ops (see
+ * tarfs.h); this file only adapts it to libfuse.
+ *
+ * Reads go through a block cache, and the kernel is told the files never
+ * change, so that it keeps their pages and reads ahead of them. The mount is
+ * multithreaded unless -s is given: the handle and its cache are thread-safe.
+ *
+ * Usage: ./tarfs archive mountpoint [fuse options]
+ */
+
+#define CACHE_MIB 256
+#define MAX_READAHEAD (1 << 20)
+
+static tarfs_t *get_fs(void) {
+    return fuse_get_context()->private_data;
+}
+
+static void *fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    cfg->kernel_cache = 1;
+    cfg->use_ino = 0;
+    conn->max_readahead = MAX_READAHEAD;
+    return get_fs();
+}
+
+static int fs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    return tarfs_ops.getattr(get_fs(), path, st);
+}
+
+static int fs_readlink(const char *path, char *buf, size_t size) {
+    return tarfs_ops.readlink(get_fs(), path, buf, size);
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi) {
+    int err = tarfs_ops.open(get_fs(), path, fi->flags);
+    fi->keep_cache = 1;
+    return err;
+}
+
+static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    return tarfs_ops.read(get_fs(), path, buf, size, offset);
+}
+
+typedef struct fill_ctx {
+    fuse_fill_dir_t filler;
+    void *buf;
+} fill_ctx_t;
+
+static int fill(void *arg, const char *name, const struct stat *st) {
+    fill_ctx_t *ctx = arg;
+    return ctx->filler(ctx->buf, name, st, 0, 0);
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    fill_ctx_t ctx = { .filler = filler, .buf = buf };
+    return tarfs_ops.readdir(get_fs(), path, &ctx, fill);
+}
+
+static const struct fuse_operations operations = {
+    .init = fs_init,
+    .getattr = fs_getattr,
+    .readlink = fs_readlink,
+    .open = fs_open,
+    .read = fs_read,
+    .readdir = fs_readdir,
+};
+
+int main(int argc, char **argv) {
+    tarfs_t fs;
+
+    if (argc < 3) {
+        printf("Usage: %s archive mountpoint [fuse options]\n", argv[0]);
+        return -1;
+    }
+    int err = tarfs_open(&fs, argv[1], (size_t) CACHE_MIB << 20);
+    if (err) {
+        printf("%s: %s: %s\n", argv[0], argv[1], strerror(-err));
+        return -1;
+    }
+
+    // FUSE gets our arguments without the archive.
+    argv[1] = argv[0];
+    int ret = fuse_main(argc - 1, argv + 1, &operations, &fs);
+    tarfs_close(&fs);
+    return ret;
+}
@@ -0,0 +1,50 @@
+#ifndef TARFS_H
+#define TARFS_H
+
+#include <sys/stat.h>
+
+#include "lib_tar.h"
+
+/*
+ * tarfs mounts an archive read-only. The operations below hold the logic and
+ * do not depend on FUSE: tarfs.c only adapts them to libfuse, and the tests
+ * call them directly where /dev/fuse is unavailable.
+ *
+ * Paths are those of FUSE, absolute ("/dir/file"). Operations return 0 or a
+ * negated errno value, like FUSE operations.
+ */
+
+typedef struct tarfs {
+    int fd;
+    tar_cache_t *cache;
+    tar_handle_t *h;
+    uid_t uid;                    /* owner reported for every entry */
+    gid_t gid;
+} tarfs_t;
+
+/* Called by readdir for each entry of a directory. Returns nonzero to stop. */
+typedef int (*tarfs_fill_t)(void *buf, const char *name, const struct stat *st);
+
+typedef struct tarfs_ops {
+    int (*getattr)(tarfs_t *fs, const char *path, struct stat *st);
+    int (*readlink)(tarfs_t *fs, const char *path, char *buf, size_t size);
+    int (*open)(tarfs_t *fs, const char *path, int flags);
+    /* Returns the number of bytes read, short only at the end of the file. */
+    int (*read)(tarfs_t *fs, const char *path, char *buf, size_t size, off_t offset);
+    int (*readdir)(tarfs_t *fs, const char *path, void *buf, tarfs_fill_t fill);
+} tarfs_ops_t;
+
+extern const tarfs_ops_t tarfs_ops;
+
+/**
+ * Opens the archive at `archive` for mounting, reading through a block cache
+ * of `cache_budget` bytes.
+ *
+ * @return 0 on success, a negated errno value otherwise.
+ */
+int tarfs_open(tarfs_t *fs, const char *archive, size_t cache_budget);
+
+/* Closes what tarfs_open() opened. */
+void tarfs_close(tarfs_t *fs);
+
+#endif
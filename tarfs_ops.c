@@ -0,0 +1,203 @@
+#include "tarfs.h"
+
+/*
+ * Directories are stored with a trailing slash, and some only exist through
+ * the paths below them. A FUSE path is looked up as given first, then as a
+ * directory: the listing cursor knows about implied directories.
+ */
+
+/* Converts a FUSE path into an archive path. Returns -ENAMETOOLONG if it cannot be one. */
+static int to_archive_path(const char *path, char *out) {
+    while (*path == '/') path++;
+    size_t len = strlen(path);
+    if (len > 256) return -ENAMETOOLONG;
+    memcpy(out, path, len + 1);
+    return 0;
+}
+
+static void fill_stat(tarfs_t *fs, const tar_stat_t *ts, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = ts->mode & 07777;
+    st->st_nlink = 1;
+    st->st_uid = fs->uid;
+    st->st_gid = fs->gid;
+    st->st_size = ts->size;
+    st->st_blksize = BLOCK_SIZE;
+    st->st_blocks = (ts->size + 511) / 512;
+    st->st_mtime = ts->mtime;
+    st->st_atime = ts->mtime;
+    st->st_ctime = ts->mtime;
+
+    switch (ts->typeflag) {
+    case DIRTYPE:
+        st->st_mode |= S_IFDIR;
+        st->st_nlink = 2;
+        st->st_size = 0;
+        break;
+    case SYMTYPE:
+        st->st_mode |= S_IFLNK;
+        break;
+    case FIFOTYPE:
+        st->st_mode |= S_IFIFO;
+        st->st_size = 0;
+        break;
+    case CHRTYPE:
+        st->st_mode |= S_IFCHR;
+        st->st_size = 0;
+        break;
+    case BLKTYPE:
+        st->st_mode |= S_IFBLK;
+        st->st_size = 0;
+        break;
+    default:
+        st->st_mode |= S_IFREG;
+        break;
+    }
+}
+
+static void fill_implied_dir(tarfs_t *fs, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFDIR | 0555;
+    st->st_nlink = 2;
+    st->st_uid = fs->uid;
+    st->st_gid = fs->gid;
+}
+
+/* Returns the S_IF* type of a listed entry, as getattr reports it. */
+static mode_t entry_type(tarfs_t *fs, char *entry, size_t len) {
+    tar_stat_t ts;
+    struct stat st;
+
+    // Only implied directories have no header of their own.
+    if (!tar_stat(fs->h, entry, &ts)) return entry[len - 1] == '/' ? S_IFDIR : S_IFREG;
+    if (ts.typeflag == LNKTYPE && !tar_stat_resolved(fs->h, entry, &ts)) return S_IFREG;
+    fill_stat(fs, &ts, &st);
+    return st.st_mode & S_IFMT;
+}
+
+static int op_getattr(tarfs_t *fs, const char *path, struct stat *st) {
+    char name[258];
+    tar_stat_t ts;
+    tar_list_cursor_t cursor;
+
+    int err = to_archive_path(path, name);
+    if (err) return err;
+    if (name[0] == '\0') {
+        fill_implied_dir(fs, st);
+        return 0;
+    }
+    if (tar_stat(fs->h, name, &ts)) {
+        // Hard links share the data of their target.
+        if (ts.typeflag == LNKTYPE && !tar_stat_resolved(fs->h, name, &ts)) return -ENOENT;
+        fill_stat(fs, &ts, st);
+        return 0;
+    }
+    size_t len = strlen(name);
+    if (name[len - 1] != '/') {
+        name[len] = '/';
+        name[len + 1] = '\0';
+        if (tar_stat(fs->h, name, &ts)) {
+            fill_stat(fs, &ts, st);
+            return 0;
+        }
+    }
+    if (!tar_list_open(fs->h, name, &cursor)) return -ENOENT;
+    fill_implied_dir(fs, st);
+    return 0;
+}
+
+static int op_readlink(tarfs_t *fs, const char *path, char *buf, size_t size) {
+    char name[258];
+
+    int err = to_archive_path(path, name);
+    if (err) return err;
+    return tar_readlink(fs->h, name, buf, size) < 0 ? -EINVAL : 0;
+}
+
+static int op_open(tarfs_t *fs, const char *path, int flags) {
+    struct stat st;
+
+    if ((flags & O_ACCMODE) != O_RDONLY) return -EROFS;
+    int err = op_getattr(fs, path, &st);
+    if (err) return err;
+    return S_ISDIR(st.st_mode) ? -EISDIR : 0;
+}
+
+static int op_read(tarfs_t *fs, const char *path, char *buf, size_t size, off_t offset) {
+    char name[258];
+
+    int err = to_archive_path(path, name);
+    if (err) return err;
+    if (size > INT32_MAX) size = INT32_MAX;
+    ssize_t rem = tar_read_file(fs->h, name, offset, (uint8_t *) buf, &size);
+    if (rem == -2) return 0;                     // past the end of the file
+    if (rem < 0) return -ENOENT;
+    return size;
+}
+
+static int op_readdir(tarfs_t *fs, const char *path, void *buf, tarfs_fill_t fill) {
+    char name[258], child[258];
+    tar_list_cursor_t cursor;
+    tar_list_t batch;
+    struct stat st;
+
+    int err = to_archive_path(path, name);
+    if (err) return err;
+    if (!tar_list_open(fs->h, name, &cursor)) return -ENOTDIR;
+    if (fill(buf, ".", NULL) || fill(buf, "..", NULL)) return 0;
+
+    int stop = 0;
+    ssize_t n = 0;
+    while (!stop && (n = tar_list_next(fs->h, &cursor, 256, &batch)) > 0) {
+        for (size_t i = 0; i < batch.count && !stop; i++) {
+            // Children are full archive paths: keep the last component, without its slash.
+            const char *entry = batch.entries[i].data;
+            size_t len = batch.entries[i].len;
+            if (len > cursor.dir_len && entry[len - 1] == '/') len--;
+            size_t child_len = len - cursor.dir_len;
+            memcpy(child, entry + cursor.dir_len, child_len);
+            child[child_len] = '\0';
+
+            // Only the type bits are used by readdir.
+            memset(&st, 0, sizeof(st));
+            st.st_mode = entry_type(fs, (char *) entry, batch.entries[i].len);
+            stop = fill(buf, child, &st);
+        }
+        tar_list_free(&batch);
+    }
+    return n < 0 ? -errno : 0;
+}
+
+const tarfs_ops_t tarfs_ops = {
+    .getattr = op_getattr,
+    .readlink = op_readlink,
+    .open = op_open,
+    .read = op_read,
+    .readdir = op_readdir,
+};
+
+int tarfs_open(tarfs_t *fs, const char *archive, size_t cache_budget) {
+    memset(fs, 0, sizeof(*fs));
+    fs->uid = getuid();
+    fs->gid = getgid();
+    fs->fd = open(archive, O_RDONLY | O_CLOEXEC);
+    if (fs->fd == -1) return -errno;
+
+    fs->cache = tar_cache_new(cache_budget);
+    tar_options_t opts = { .cache = fs->cache };
+    fs->h = fs->cache ? tar_open(fs->fd, &opts) : NULL;
+    if (!fs->h) {
+        int err = errno ? -errno : -EINVAL;
+        tarfs_close(fs);
+        return err;
+    }
+    return 0;
+}
+
+void tarfs_close(tarfs_t *fs) {
+    if (fs->h) tar_close(fs->h);
+    if (fs->cache) tar_cache_free(fs->cache);
+    if (fs->fd != -1) close(fs->fd);
+    memset(fs, 0, sizeof(*fs));
+    fs->fd = -1;
+}
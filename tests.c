@@ -1,14 +1,28 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <string.h>
+#include <unistd.h>
+
 #include "lib_tar.h"
 
 /**
  * You are free to use this file to write tests for your implementation
  */
 
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int failures;
+
 void debug_dump(const uint8_t *bytes, size_t len) {
     for (int i = 0; i < len;) {
         printf("%04x:  ", (int) i);
@@ -24,9 +38,52 @@ void debug_dump(const uint8_t *bytes, size_t len) {
     }
 }
 
+/* Runs check_archive() on `len` bytes of `archive`, with the header at `at` changed by `patch` (if not NULL). */
+static int check_patched(const uint8_t *archive, size_t len, off_t at, void (*patch)(tar_header_t *)) {
+    FILE *copy = tmpfile();
+    uint8_t *bytes = malloc(len);
+    int ret = -4;
+
+    if (copy && bytes) {
+        memcpy(bytes, archive, len);
+        if (patch) patch((tar_header_t *) (bytes + at));
+        fwrite(bytes, 1, len, copy);
+        fflush(copy);
+        lseek(fileno(copy), 0, SEEK_SET);
+        ret = check_archive(fileno(copy));
+    }
+    if (copy) fclose(copy);
+    free(bytes);
+    return ret;
+}
+
+static void bad_magic(tar_header_t *header) { header->magic[0] = 'x'; }
+static void bad_version(tar_header_t *header) { header->version[1] = '1'; }
+static void bad_checksum(tar_header_t *header) { header->name[0] ^= 1; }
+
+/* check_archive() walks the headers only, and tells each kind of damage from the others. */
+static void check_archive_errors(int fd, int headers) {
+    static uint8_t archive[1 << 20];
+    ssize_t len = pread(fd, archive, sizeof(archive) - 4 * BLOCK_SIZE, 0);
+    CHECK(len > 0 && len < (ssize_t) sizeof(archive) - 4 * BLOCK_SIZE);
+    if (len <= 0) return;
+
+    // The second header, past the data of the first member.
+    const tar_header_t *first = (const tar_header_t *) archive;
+    off_t second = BLOCK_SIZE + (strtoull(first->size, NULL, 8) + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+    CHECK(check_patched(archive, len, 0, NULL) == headers);
+    if (headers < 2) return;
+    CHECK(check_patched(archive, len, second, bad_magic) == -1);
+    CHECK(check_patched(archive, len, second, bad_version) == -2);
+    CHECK(check_patched(archive, len, second, bad_checksum) == -3);
+    // Whatever follows the null blocks is not part of the archive.
+    memset(archive + len, 'x', 4 * BLOCK_SIZE);
+    CHECK(check_patched(archive, len + 4 * BLOCK_SIZE, 0, NULL) == headers);
+}
+
 int main(int argc, char **argv) {
     if (argc < 2) {
-        printf("Usage: %s tar_file\n", argv[0]);
+        printf("Usage: %s tar_file [member]\n", argv[0]);
         return -1;
     }
 
@@ -38,6 +95,67 @@ int main(int argc, char **argv) {
 
     int ret = check_archive(fd);
     printf("check_archive returned %d\n", ret);
+    check_archive_errors(fd, ret);
 
-    return 0;
-}
\ No newline at end of file
+    // Two descriptors on the same file share their identifier, a closed one has none.
+    uint64_t id, other_id;
+    int other = open(argv[1], O_RDONLY);
+    CHECK(tar_archive_id(fd, &id) == 0);
+    CHECK(tar_archive_id(other, &other_id) == 0 && other_id == id);
+    close(other);
+    CHECK(tar_archive_id(other, &other_id) == -1);
+
+    if (argc > 2) {
+        tar_cache_t *cache = tar_cache_new(1 << 20);
+        tar_options_t opts = { .cache = cache };
+        tar_handle_t *h = tar_open(fd, &opts);
+        uint8_t buf[2][64];
+        size_t lens[2];
+        ssize_t rems[2];
+
+        CHECK(h);
+        if (!h) return 1;
+        // The second read must be served by the cache.
+        for (int i = 0; i < 2; i++) {
+            lens[i] = sizeof(buf[i]);
+            rems[i] = tar_read_file(h, argv[2], 0, buf[i], &lens[i]);
+            printf("tar_read_file(%s) returned %zd, read %zu bytes\n", argv[2], rems[i], lens[i]);
+        }
+        debug_dump(buf[1], 16);
+        CHECK(rems[0] >= 0 && rems[1] == rems[0]);
+        CHECK(lens[1] == lens[0] && memcmp(buf[0], buf[1], lens[0]) == 0);
+
+        tar_cache_stats_t stats;
+        tar_cache_get_stats(cache, &stats);
+        printf("cache: %lu hits, %lu misses, %zu bytes used\n",
+               (unsigned long) stats.hits, (unsigned long) stats.misses, stats.bytes_used);
+        CHECK(stats.misses >= 1 && stats.hits >= 1 && stats.bytes_used > 0);
+
+        // A second handle on the same archive shares the cached slabs.
+        tar_handle_t *h2 = tar_open(fd, &opts);
+        uint64_t misses = stats.misses;
+        lens[1] = sizeof(buf[1]);
+        CHECK(h2 && tar_read_file(h2, argv[2], 0, buf[1], &lens[1]) == rems[0]);
+        tar_cache_get_stats(cache, &stats);
+        CHECK(stats.misses == misses);
+        tar_close(h2);
+
+        // Only filled in when lib_tar is built with STATS=1.
+        tar_stats_t *hs = malloc(sizeof(tar_stats_t));
+        if (hs && tar_get_stats(h, hs) == 0) {
+            tar_hist_t *reads = &hs->latency[TAR_OP_READ_FILE];
+            printf("handle: %lu headers parsed, %lu syscalls, %lu cache hits, %lu index probes\n",
+                   (unsigned long) hs->headers_parsed, (unsigned long) hs->syscalls,
+                   (unsigned long) hs->cache_hits, (unsigned long) hs->index_probes);
+            printf("tar_read_file: %lu calls, p50 %lu ns, p99 %lu ns\n", (unsigned long) reads->count,
+                   (unsigned long) tar_hist_quantile(reads, 0.5), (unsigned long) tar_hist_quantile(reads, 0.99));
+            CHECK(reads->count == 2 && hs->cache_hits >= 1);
+        }
+        free(hs);
+        tar_close(h);
+        tar_cache_free(cache);
+    }
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,68 @@
+#ifndef TESTS_H
+#define TESTS_H
+
+#include "lib_tar.h"
+
+/*
+ * The fixtures shared by the test programs: archives written with the
+ * writer of lib_tar from a table of members.
+ */
+
+typedef struct test_member {
+    const char *path;
+    char typeflag;
+    const char *data;             /* the data of a regular file (NULL to take them from `fill`), or the target of a link */
+    int64_t mtime;                /* 0 for 1700000000 */
+    uint64_t size;                /* for a regular file without `data`, the size of the data `fill` gives */
+    uint32_t mode;                /* 0 for 0644 */
+} test_member_t;
+
+/* Returns the `size` bytes of data of `members[m]`, which has no `data`. */
+typedef const uint8_t *(*test_fill_fn_t)(const test_member_t *member, size_t m);
+
+/* Returns the size of the data of a regular file. */
+static inline uint64_t test_member_size(const test_member_t *member) {
+    return member->data ? strlen(member->data) : member->size;
+}
+
+/**
+ * Writes the `count` members to a new archive at `path`, with the
+ * TAR_WRITE_* `flags`. The data of each regular file come from a temporary
+ * file of their own, as they would from the file being archived.
+ *
+ * @return zero on success, -1 otherwise.
+ */
+static inline int test_write_archive(const char *path, int flags, const test_member_t *members, size_t count,
+                                     test_fill_fn_t fill) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *w = fd == -1 ? NULL : tar_writer_new(fd, flags);
+    if (!w) {
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t m = 0; m < count && ret == 0; m++) {
+        const test_member_t *member = &members[m];
+        int regular = member->typeflag == REGTYPE || member->typeflag == AREGTYPE;
+        tar_stat_t st = {
+            .typeflag = member->typeflag,
+            .mode = member->mode ? member->mode : 0644,
+            .mtime = member->mtime ? member->mtime : 1700000000,
+        };
+        FILE *src = NULL;
+        if (regular) {
+            st.size = test_member_size(member);
+            const uint8_t *data = member->data ? (const uint8_t *) member->data : fill(member, m);
+            src = tmpfile();
+            if (!src || fwrite(data, 1, st.size, src) != st.size || fflush(src) != 0) ret = -1;
+        }
+        if (ret == 0) ret = tar_writer_add(w, member->path, &st, regular ? NULL : member->data, src ? fileno(src) : -1);
+        if (src) fclose(src);
+    }
+    if (tar_writer_close(w) < 0) ret = -1;
+    close(fd);
+    return ret;
+}
+
+#endif
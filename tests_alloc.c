@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <malloc.h>
+
+#include "tests.h"
+
+/**
+ * Counts the heap allocations of lib_tar. Every call it makes to malloc(),
+ * calloc(), realloc() and posix_memalign() goes through the wrappers below
+ * (see ALLOC_WRAP in the Makefile). Once a handle is warm, lookups, reads,
+ * listings and hashes must not allocate at all. The bytes allocated and not
+ * freed yet are tracked too, to bound what handles keep. Its reads can be
+ * cut short, interrupted or failed too.
+ *
+ * Usage: ./tests_alloc
+ */
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int failures;
+static size_t allocations;
+static size_t live_bytes;               /* usable bytes allocated and not freed yet */
+static int fail_allocations;            /* make every allocation fail, to test out-of-memory paths */
+static int fail_shrinks;                /* make every realloc() that shrinks a buffer fail */
+static int cut_reads;                   /* interrupt every other pread(), cut the others short */
+static off_t fail_reads_at = -1;        /* make every pread() fail with EIO from this offset, -1 never */
+
+void __real_free(void *ptr);
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+ssize_t __real_pread(int fd, void *buf, size_t count, off_t offset);
+
+/* Returns `ptr`, once its bytes are counted as live. */
+static void *count_live(void *ptr) {
+    if (ptr) __atomic_add_fetch(&live_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    return ptr;
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr) __atomic_sub_fetch(&live_bytes, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    if (fail_allocations) return NULL;
+    return count_live(__real_malloc(size));
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    if (fail_allocations) return NULL;
+    return count_live(__real_calloc(n, size));
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    if (fail_allocations) return NULL;
+    size_t old = ptr ? malloc_usable_size(ptr) : 0;
+    if (fail_shrinks && size < old) return NULL;
+    void *moved = __real_realloc(ptr, size);
+    if (moved) __atomic_sub_fetch(&live_bytes, old, __ATOMIC_RELAXED);
+    return count_live(moved);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+    if (fail_allocations) return ENOMEM;
+    int err = __real_posix_memalign(ptr, align, size);
+    if (!err) count_live(*ptr);
+    return err;
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t count, off_t offset) {
+    static __thread unsigned calls;
+    if (cut_reads && calls++ % 2 == 0) {
+        errno = EINTR;
+        return -1;
+    }
+    if (cut_reads && count > 1000) count = 1000;
+    off_t fail_at = __atomic_load_n(&fail_reads_at, __ATOMIC_RELAXED);
+    if (fail_at >= 0 && offset >= fail_at) {
+        errno = EIO;
+        return -1;
+    }
+    if (fail_at >= 0 && (off_t) (offset + count) > fail_at) count = fail_at - offset;
+    return __real_pread(fd, buf, count, offset);
+}
+
+#define ARCHIVE "tests_alloc.tar"
+#define NFILES 40
+#define LARGE_SIZE (3 * 1024 * 1024)
+#define BURST_MEMBERS 8
+#define BURST_SIZE (4 * 1024 * 1024)
+
+/* The data of every file: byte i is i % 251. */
+static const uint8_t *pattern(const test_member_t *member, size_t m) {
+    static uint8_t data[LARGE_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = i % 251;
+    return data;
+}
+
+/* Writes dir/, dir/file<i> for each i, dir/sub/large and dir/link. */
+static int write_archive(void) {
+    static char paths[NFILES][64];
+    test_member_t members[NFILES + 3] = {
+        { "dir/", DIRTYPE, NULL, 0, 0, 0755 },
+    };
+    for (int i = 0; i < NFILES; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "dir/file%d", i);
+        members[1 + i] = (test_member_t) { paths[i], REGTYPE, NULL, 0, 100 + i };
+    }
+    members[NFILES + 1] = (test_member_t) { "dir/sub/large", REGTYPE, NULL, 0, LARGE_SIZE };
+    members[NFILES + 2] = (test_member_t) { "dir/link", SYMTYPE, "sub/large", 0, 0, 0777 };
+    return test_write_archive(ARCHIVE, 0, members, NFILES + 3, pattern);
+}
+
+/* One round of the calls that must not allocate once the handle is warm. */
+static void handle_round(tar_handle_t *h) {
+    static uint8_t buf[256 * 1024];
+    tar_stat_t st;
+    uint64_t hash;
+
+    CHECK(tar_exists(h, "dir/file7"));
+    CHECK(!tar_exists(h, "dir/missing"));
+    CHECK(tar_stat(h, "dir/sub/large", &st) && st.size == LARGE_SIZE);
+
+    // Sequential reads through the link, which the readahead follows.
+    for (size_t off = 0; off < LARGE_SIZE; off += sizeof(buf)) {
+        size_t len = sizeof(buf);
+        CHECK(tar_read_file(h, "dir/link", off, buf, &len) >= 0 && len == sizeof(buf));
+    }
+
+    tar_list_t list;
+    CHECK(tar_list_arena(h, "dir/", &list) && list.count == NFILES + 2);
+    tar_list_free(&list);
+
+    tar_list_cursor_t cursor;
+    CHECK(tar_list_open(h, "dir", &cursor));
+    while (tar_list_next(h, &cursor, 8, &list) > 0) tar_list_free(&list);
+
+    CHECK(tar_member_hash(h, "dir/sub/large", &hash) == 0);
+}
+
+/* Checks that rounds of calls on a handle opened with `opts` allocate nothing after the first one. */
+static void check_handle(int fd, const tar_options_t *opts, const char *name) {
+    tar_handle_t *h = tar_open(fd, opts);
+    CHECK(h);
+    if (!h) return;
+
+    handle_round(h);
+    size_t before = allocations;
+    for (int i = 0; i < 10; i++) handle_round(h);
+    size_t count = allocations - before;
+    if (count) printf("%s: %zu allocations once warm\n", name, count);
+    CHECK(count == 0);
+    tar_close(h);
+}
+
+/* One round of the file descriptor API. */
+static void fd_round(int fd) {
+    static char storage[NFILES + 2][256];
+    char *entries[NFILES + 2];
+    size_t no_entries = NFILES + 2;
+    uint8_t buf[256];
+    size_t len = sizeof(buf);
+
+    for (int i = 0; i < NFILES + 2; i++) entries[i] = storage[i];
+    lseek(fd, 0, SEEK_SET);
+    CHECK(check_archive(fd) == NFILES + 3);
+    CHECK(exists(fd, "dir/file3"));
+    CHECK(is_dir(fd, "dir/") && is_file(fd, "dir/sub/large") && is_symlink(fd, "dir/link"));
+    CHECK(list(fd, "dir/", entries, &no_entries) && no_entries > 0);
+    CHECK(read_file(fd, "dir/file3", 0, buf, &len) == 0 && len == 103);
+}
+
+/* The file descriptor API keeps no state between calls, but its scans take their windows from a pool. */
+static void check_fd_api(int fd) {
+    fd_round(fd);
+    size_t before = allocations;
+    for (int i = 0; i < 10; i++) fd_round(fd);
+    size_t count = allocations - before;
+    if (count) printf("fd: %zu allocations once warm\n", count);
+    CHECK(count == 0);
+}
+
+static const uint8_t *zeros(const test_member_t *member, size_t m) {
+    static uint8_t data[BURST_SIZE];
+    return data;
+}
+
+/*
+ * A burst of parallel scans takes many chunk buffers at once: the handle
+ * keeps 16 MiB of them at most once they come back, not all of them.
+ */
+static void check_pool_bound(void) {
+    static char paths[BURST_MEMBERS][64];
+    test_member_t members[BURST_MEMBERS];
+    for (int i = 0; i < BURST_MEMBERS; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "member%d", i);
+        members[i] = (test_member_t) { paths[i], REGTYPE, NULL, 0, BURST_SIZE };
+    }
+    CHECK(test_write_archive("tests_alloc_burst.tar", 0, members, BURST_MEMBERS, zeros) == 0);
+    int fd = open("tests_alloc_burst.tar", O_RDONLY);
+
+    tar_options_t opts = { .flags = TAR_OPEN_SCAN_DONTNEED };
+    tar_handle_t *h = tar_open(fd, &opts);
+    CHECK(h);
+    if (h) {
+        tar_grep_options_t one = { .threads = 1 }, all = { .threads = BURST_MEMBERS };
+        CHECK(tar_grep(h, "needle", 6, NULL, &one, NULL, NULL) == 0);
+        size_t before = live_bytes;
+        CHECK(tar_grep(h, "needle", 6, NULL, &all, NULL, NULL) == 0);
+        size_t kept = live_bytes - before;
+        if (kept > (16 << 20)) printf("burst: %zu bytes kept\n", kept);
+        CHECK(kept <= (16 << 20));
+        tar_close(h);
+    }
+    close(fd);
+    unlink("tests_alloc_burst.tar");
+}
+
+/* Listings that run out of memory say so, rather than looking like empty directories. */
+static void check_list_oom(int fd) {
+    tar_handle_t *h = tar_open(fd, NULL);
+    tar_list_t list;
+    tar_list_cursor_t cursor;
+
+    CHECK(h);
+    if (!h) return;
+    fail_allocations = 1;
+    errno = 0;
+    CHECK(tar_list_arena(h, "dir/", &list) == -1 && errno == ENOMEM);
+    tar_list_free(&list);
+    CHECK(tar_list_open(h, "dir", &cursor));
+    CHECK(tar_list_next(h, &cursor, 8, &list) == -1 && errno == ENOMEM);
+    fail_allocations = 0;
+    // The cursor did not move.
+    CHECK(tar_list_next(h, &cursor, 8, &list) == 8 && strcmp(list.entries[0].data, "dir/file0") == 0);
+    tar_list_free(&list);
+
+    tar_overlay_t *ov = tar_overlay_new();
+    CHECK(ov && tar_overlay_add(ov, h) == 0);
+    fail_allocations = 1;
+    errno = 0;
+    CHECK(ov && tar_overlay_list(ov, "dir", &list) == -1 && errno == ENOMEM);
+    fail_allocations = 0;
+    CHECK(ov && tar_overlay_list(ov, "dir", &list) == 1 && list.count == NFILES + 2);
+    tar_list_free(&list);
+    tar_overlay_free(ov);
+    tar_close(h);
+}
+
+/* An index whose arenas cannot be shrunk keeps them as they are. */
+static void check_shrink_oom(int fd) {
+    size_t before = live_bytes;
+    fail_shrinks = 1;
+    tar_handle_t *h = tar_open(fd, NULL);
+    fail_shrinks = 0;
+    CHECK(h);
+    if (!h) return;
+    handle_round(h);
+    tar_close(h);
+    CHECK(live_bytes == before);
+}
+
+/* Slabs of the block cache are read whole, however their reads are cut. */
+static void check_cut_reads(int fd) {
+    static uint8_t buf[LARGE_SIZE];
+    tar_cache_t *cache = tar_cache_new(16 << 20);
+    tar_options_t cached = { .cache = cache };
+
+    cut_reads = 1;
+    tar_handle_t *h = tar_open(fd, &cached);
+    CHECK(h);
+    for (int pass = 0; h && pass < 2; pass++) {
+        // The second pass is served from the slabs of the first.
+        size_t len = sizeof(buf);
+        CHECK(tar_read_file(h, "dir/sub/large", 0, buf, &len) == 0 && len == LARGE_SIZE);
+        size_t bad = 0;
+        for (size_t i = 0; i < len; i++) bad += buf[i] != i % 251;
+        CHECK(bad == 0);
+        cut_reads = 0;
+    }
+    cut_reads = 0;
+    tar_close(h);
+    tar_cache_free(cache);
+}
+
+/*
+ * An archive that cannot be read past the data of dir/sub/large: the index
+ * must not pass for complete without dir/link, lazy indexes try again and
+ * background ones fail.
+ */
+static void check_failed_reads(int fd) {
+    tar_index_info_t info;
+
+    __atomic_store_n(&fail_reads_at, LARGE_SIZE, __ATOMIC_RELAXED);
+    CHECK(tar_open(fd, NULL) == NULL);
+
+    tar_options_t lazy = { .flags = TAR_OPEN_LAZY_INDEX };
+    tar_handle_t *h = tar_open(fd, &lazy);
+    CHECK(h && tar_exists(h, "dir/file3") && !tar_exists(h, "dir/link"));
+    __atomic_store_n(&fail_reads_at, -1, __ATOMIC_RELAXED);
+    CHECK(h && tar_exists(h, "dir/link"));
+    CHECK(h && tar_get_index_info(h, &info) == 0 && info.entries == NFILES + 3);
+    tar_close(h);
+
+    // The background thread gives up, and the waiters see it.
+    __atomic_store_n(&fail_reads_at, LARGE_SIZE, __ATOMIC_RELAXED);
+    tar_options_t background = { .flags = TAR_OPEN_BACKGROUND_INDEX };
+    h = tar_open(fd, &background);
+    CHECK(h && tar_get_index_info(h, &info) == -1 && !tar_index_ready(h));
+    __atomic_store_n(&fail_reads_at, -1, __ATOMIC_RELAXED);
+    // Lookups fall back to scans.
+    CHECK(h && tar_exists(h, "dir/link"));
+    tar_close(h);
+}
+
+int main(void) {
+    CHECK(write_archive() == 0);
+    int fd = open(ARCHIVE, O_RDONLY);
+
+    check_handle(fd, NULL, "default");
+    tar_cache_t *cache = tar_cache_new(16 << 20);
+    tar_options_t cached = { .cache = cache };
+    check_handle(fd, &cached, "cache");
+    tar_cache_free(cache);
+    tar_options_t mapped = { .flags = TAR_OPEN_MMAP };
+    check_handle(fd, &mapped, "mmap");
+    tar_options_t scan = { .flags = TAR_OPEN_SCAN_DONTNEED };
+    check_handle(fd, &scan, "scan");
+    check_fd_api(fd);
+    check_list_oom(fd);
+    check_shrink_oom(fd);
+    check_cut_reads(fd);
+    check_failed_reads(fd);
+    check_pool_bound();
+
+    close(fd);
+    unlink(ARCHIVE);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "lib_tar.hpp"
+
+/**
+ * Tests of lib_tar.hpp. Run with `make tests_hpp`.
+ *
+ * Usage: ./tests_hpp tar_file
+ */
+
+static_assert(std::ranges::input_range<tar::entry_range>);
+static_assert(std::ranges::view<tar::entry_range>);
+static_assert(std::is_nothrow_move_constructible_v<tar::archive>);
+static_assert(!std::is_copy_constructible_v<tar::archive>);
+
+/* Allocations made through operator new, to check that lookups make none. */
+static std::atomic<size_t> allocations;
+
+void *operator new(std::size_t size) {
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept {
+    std::free(p);
+}
+
+static int failures;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+/* Checks every entry against the point lookups, and returns the paths of the regular files. */
+static std::vector<std::string> check_entries(const tar::archive &ar) {
+    std::vector<std::string> files;
+    std::string previous;
+    size_t count = 0;
+
+    for (const tar::entry &e : ar.entries()) {
+        CHECK(count == 0 || previous < e.path());
+        CHECK(ar.exists(e.path()));
+        auto st = ar.stat(e.path());
+        CHECK(st && st->typeflag == e.stat().typeflag && st->size == e.stat().size);
+        if (ar.is_file(e.path())) files.emplace_back(e.path());
+        previous = e.path();
+        count++;
+    }
+    CHECK(count > 0);
+    CHECK(std::ranges::distance(ar.entries()) == (std::ptrdiff_t) count);
+    return files;
+}
+
+static void check_lookups(const tar::archive &ar, const std::vector<std::string> &files) {
+    std::byte buf[4096];
+    std::string long_path(300, 'x');
+    std::vector<std::string> padded;
+    for (const std::string &path : files) padded.push_back("#" + path + "#");
+
+    size_t before = allocations;
+    for (size_t i = 0; i < files.size(); i++) {
+        const std::string &path = files[i];
+        std::string_view view = path;
+        auto st = ar.stat(view);
+        CHECK(st);
+        auto n = ar.read(view, buf);
+        CHECK(n && *n == (st->size < sizeof(buf) ? st->size : sizeof(buf)));
+        if (st->size > 1) {
+            auto tail = ar.read(view, std::span(buf).first(1), st->size - 1);
+            CHECK(tail && *tail == 1);
+        }
+        CHECK(!ar.read(view, buf, st->size + 1));
+        // A path without its NUL terminator, in the middle of a longer string.
+        CHECK(ar.exists(std::string_view(padded[i]).substr(1, path.size())));
+    }
+    CHECK(!ar.exists("no/such/entry"));
+    CHECK(!ar.stat("no/such/entry"));
+    CHECK(!ar.read("no/such/entry", buf));
+    CHECK(!ar.exists(long_path));
+    CHECK(allocations == before);
+}
+
+static void check_view(const char *archive_path, const std::vector<std::string> &files) {
+    tar::archive mapped(archive_path, TAR_OPEN_MMAP);
+    tar::archive plain(archive_path);
+    std::vector<std::byte> buf;
+
+    for (const std::string &path : files) {
+        auto data = mapped.view(path);
+        CHECK(data);
+        CHECK(!plain.view(path));
+        buf.resize(data->size());
+        auto n = plain.read(path, buf);
+        CHECK(n && *n == data->size());
+        CHECK(std::ranges::equal(buf, *data));
+    }
+}
+
+static void check_ownership(const char *archive_path) {
+    bool threw = false;
+    try {
+        tar::archive missing("no/such/archive.tar");
+    } catch (const std::system_error &e) {
+        threw = e.code().value() == ENOENT;
+    }
+    CHECK(threw);
+
+    tar::archive a(archive_path);
+    tar_handle_t *h = a.handle();
+    tar::archive b = std::move(a);
+    CHECK(b.handle() == h && a.handle() == nullptr);
+    a = std::move(b);
+    CHECK(a.handle() == h && b.handle() == nullptr);
+
+    int fd = open(archive_path, O_RDONLY);
+    {
+        tar::archive borrowed = tar::archive::from_fd(fd);
+        CHECK(borrowed.entries().begin() != std::default_sentinel);
+    }
+    // The descriptor is still the caller's.
+    CHECK(close(fd) == 0);
+}
+
+static tar::task<size_t> read_twice(const tar::archive &ar, const std::string &path, std::vector<std::byte> &buf) {
+    auto st = co_await ar.stat_async(path);
+    CHECK(st);
+    buf.resize(st->size);
+    auto n = co_await ar.read_async(path, buf);
+    CHECK(n && *n == st->size);
+    // Awaiting a nested task, which completes on another resumption.
+    auto again = co_await [&]() -> tar::task<std::optional<size_t>> { co_return co_await ar.read_async(path, buf); }();
+    co_return again ? *again : 0;
+}
+
+/* Thousands of reads in flight from a single loop thread. */
+static void check_async(const char *archive_path, const std::vector<std::string> &files) {
+    const size_t tasks = 2000;
+    tar::archive ar(archive_path);
+    tar::io_pool pool(4);
+    tar::event_loop loop(pool);
+    std::vector<std::vector<std::byte>> bufs(tasks);
+    size_t done = 0, bytes = 0, expected = 0;
+
+    for (size_t i = 0; i < tasks; i++) {
+        const std::string &path = files[i % files.size()];
+        expected += ar.stat(path)->size;
+        loop.spawn([](const tar::archive &ar, const std::string &path, std::vector<std::byte> &buf, size_t &done,
+                      size_t &bytes) -> tar::task<> {
+            bytes += co_await read_twice(ar, path, buf);
+            CHECK(!co_await ar.read_async("no/such/entry", buf));
+            CHECK(!co_await ar.stat_async("no/such/entry"));
+            done++;
+        }(ar, path, bufs[i], done, bytes));
+    }
+    CHECK(done == 0 || done == tasks);
+    loop.run();
+    CHECK(done == tasks);
+    CHECK(bytes == expected);
+
+    // Without an io_context on the thread, the operations complete inline.
+    std::vector<std::byte> buf;
+    loop.spawn([&]() -> tar::task<> {
+        tar::io_context *ctx = tar::io_context::install(nullptr);
+        size_t n = co_await read_twice(ar, files[0], buf);
+        CHECK(n == ar.stat(files[0])->size);
+        tar::io_context::install(ctx);
+    }());
+    loop.run();
+}
+
+/* Bytes this process read so far, from /proc/self/io. */
+static unsigned long bytes_read() {
+    char line[64];
+    unsigned long rchar = 0;
+    FILE *io = std::fopen("/proc/self/io", "r");
+    while (io && std::fgets(line, sizeof(line), io)) {
+        if (std::sscanf(line, "rchar: %lu", &rchar) == 1) break;
+    }
+    if (io) std::fclose(io);
+    return rchar;
+}
+
+#define LAZY_ARCHIVE "tests_hpp_lazy.tar"
+#define LAZY_MEMBERS 8000
+
+/* Writes first.txt, then LAZY_MEMBERS empty files: about 4 MB of headers. */
+static bool write_lazy_archive() {
+    int fd = ::open(LAZY_ARCHIVE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *w = fd == -1 ? nullptr : tar_writer_new(fd, 0);
+    FILE *data = std::tmpfile();
+    bool ok = w && data && std::fputs("first\n", data) >= 0 && std::fflush(data) == 0;
+
+    tar_stat_t st = {};
+    st.typeflag = REGTYPE;
+    st.mode = 0644;
+    st.size = 6;
+    ok = ok && tar_writer_add(w, "first.txt", &st, nullptr, fileno(data)) == 0;
+    st.size = 0;
+    char path[32];
+    for (int m = 0; ok && m < LAZY_MEMBERS; m++) {
+        std::snprintf(path, sizeof(path), "empty%04d", m);
+        ok = tar_writer_add(w, path, &st, nullptr, -1) == 0;
+    }
+    if (w && tar_writer_close(w) < 0) ok = false;
+    if (data) std::fclose(data);
+    if (fd != -1) ::close(fd);
+    return ok;
+}
+
+/*
+ * An early stat_async() on a lazy handle is looked up on the pool, which
+ * reads a prefix of the archive only. On a background handle, it does not
+ * wait for the thread on the loop either.
+ */
+static void check_lazy_async(int flags) {
+    tar::archive ar(LAZY_ARCHIVE, flags);
+    tar::io_pool pool(1);
+    tar::event_loop loop(pool);
+    std::optional<tar::file_stat> st;
+
+    unsigned long before = bytes_read();
+    loop.spawn([](const tar::archive &ar, std::optional<tar::file_stat> &st) -> tar::task<> {
+        st = co_await ar.stat_async("first.txt");
+    }(ar, st));
+    loop.run();
+    CHECK(st && st->size == 6);
+    if (flags & TAR_OPEN_LAZY_INDEX) {
+        CHECK(bytes_read() - before < (1 << 20));
+        CHECK(!tar_index_ready(ar.handle()));
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::printf("Usage: %s tar_file\n", argv[0]);
+        return -1;
+    }
+
+    tar::archive ar(argv[1]);
+    std::vector<std::string> files = check_entries(ar);
+    check_lookups(ar, files);
+    check_view(argv[1], files);
+    check_ownership(argv[1]);
+    check_async(argv[1], files);
+
+    CHECK(write_lazy_archive());
+    check_lazy_async(TAR_OPEN_LAZY_INDEX);
+    check_lazy_async(TAR_OPEN_BACKGROUND_INDEX);
+    ::unlink(LAZY_ARCHIVE);
+
+    std::printf("%s: %zu files, %d failures\n", argv[0], files.size(), failures);
+    return failures != 0;
+}
@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "tests.h"
+
+/**
+ * Tests of the queries over indexed handles: tar_find(), tar_grep(), the
+ * member hashes, tar_diff(), overlays and tar_copy_to_fd(), on fixture
+ * archives written with tar_writer_add(). Hashes, searches and diffs are run
+ * in the scan modes as well.
+ *
+ * Usage: ./tests_query
+ */
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int failures;
+
+#define ARCHIVE "tests_query.tar"
+
+/*
+ * big.bin spans several reads of tar_grep() (1 MiB) and of the scan modes
+ * (4 MiB), with needles across their boundaries.
+ */
+#define BIG_SIZE ((5 << 20) + 5)
+static const size_t big_needles[] = { 0, (1 << 20) - 8, (2 << 20) - 3, (4 << 20) - 3, BIG_SIZE - 6 };
+
+static const test_member_t members[] = {
+    { "big.bin", REGTYPE, NULL, 0, BIG_SIZE },
+    { "docs/", DIRTYPE, NULL },
+    { "docs/abc.txt", REGTYPE, "abc" },
+    { "docs/copy.txt", REGTYPE, "the needle is in the haystack, needle\n" },
+    { "docs/empty.txt", REGTYPE, "" },
+    { "docs/overlap.txt", REGTYPE, "aaaa" },
+    { "docs/readme.txt", REGTYPE, "the needle is in the haystack, needle\n" },
+    { "docs/spam.txt", REGTYPE, "Nobody inspects the spammish repetition" },
+    { "link", SYMTYPE, "src/main.c" },
+    { "src/", DIRTYPE, NULL },
+    { "src/include/", DIRTYPE, NULL },
+    { "src/include/util.h", REGTYPE, "int needle(void);\n" },
+    { "src/main.c", REGTYPE, "int main(void) { return needle(); }\n" },
+    { "src/util.c", REGTYPE, "int needle(void) { return 42; }\n" },
+    { "src/[x].c", REGTYPE, "" },
+};
+#define NMEMBERS (sizeof(members) / sizeof(members[0]))
+
+/* Returns the data of big.bin, the only member without `data`. */
+static const uint8_t *big_data(const test_member_t *member, size_t m) {
+    static uint8_t big[BIG_SIZE];
+    memset(big, 'x', sizeof(big));
+    for (size_t i = 0; i < sizeof(big_needles) / sizeof(big_needles[0]); i++) memcpy(big + big_needles[i], "needle", 6);
+    return big;
+}
+
+/* Returns the data of a regular file. */
+static const uint8_t *member_data(const test_member_t *m, size_t *len) {
+    *len = test_member_size(m);
+    return m->data ? (const uint8_t *) m->data : big_data(m, 0);
+}
+
+/* Writes `members` to `path`. */
+static int write_archive(const char *path, const test_member_t *list, size_t count) {
+    return test_write_archive(path, 0, list, count, big_data);
+}
+
+/* The matches of a query, joined with spaces. */
+typedef struct matches {
+    char joined[1024];
+    size_t len;
+    int stop_after;               /* stop the query after this many matches, 0 never */
+    int count;
+} matches_t;
+
+static int collect(void *arg, const char *path, size_t len) {
+    matches_t *m = arg;
+    m->len += snprintf(m->joined + m->len, sizeof(m->joined) - m->len, "%s%s", m->len ? " " : "", path);
+    return ++m->count == m->stop_after;
+}
+
+/* Checks that `pattern` matches exactly `expected`, in that order. */
+static void check_find(tar_handle_t *h, const char *pattern, int flags, const char *expected, int line) {
+    matches_t m = { .len = 0 };
+    ssize_t n = tar_find(h, pattern, flags, collect, &m);
+    if (n != m.count || strcmp(m.joined, expected) != 0) {
+        printf("%s:%d: tar_find(\"%s\") returned %zd: \"%s\", expected \"%s\"\n",
+               __FILE__, line, pattern, n, m.joined, expected);
+        failures++;
+    }
+}
+
+#define CHECK_FIND(h, pattern, flags, expected) check_find(h, pattern, flags, expected, __LINE__)
+
+static void test_find(tar_handle_t *h, int fd) {
+    CHECK_FIND(h, "src/*.c", 0, "src/[x].c src/main.c src/util.c");
+    CHECK_FIND(h, "src/?ain.c", 0, "src/main.c");
+    CHECK_FIND(h, "src/[!m]*.c", 0, "src/[x].c src/util.c");
+    CHECK_FIND(h, "src/\\[x].c", 0, "src/[x].c");
+    CHECK_FIND(h, "**/*.h", 0, "src/include/util.h");
+    CHECK_FIND(h, "**/util.*", 0, "src/include/util.h src/util.c");
+    // Directories match without their slash, and are reported with it.
+    CHECK_FIND(h, "*", 0, "big.bin docs/ link src/");
+    CHECK_FIND(h, "*/", 0, "docs/ src/");
+    CHECK_FIND(h, "src/*/", 0, "src/include/");
+    CHECK_FIND(h, "*.txt", 0, "");
+    CHECK_FIND(h, "docs/r", TAR_FIND_PREFIX, "docs/readme.txt");
+    CHECK_FIND(h, "src/[", TAR_FIND_PREFIX, "src/[x].c");
+    CHECK_FIND(h, "missing/", TAR_FIND_PREFIX, "");
+
+    // The callback stops the query.
+    matches_t m = { .stop_after = 2 };
+    CHECK(tar_find(h, "**", 0, collect, &m) == 2 && m.count == 2);
+
+    // No index, no query.
+    tar_options_t opts = { .flags = TAR_OPEN_NO_INDEX };
+    tar_handle_t *unindexed = tar_open(fd, &opts);
+    CHECK(unindexed && tar_find(unindexed, "*", 0, collect, &m) == -1);
+    tar_close(unindexed);
+}
+
+/* The matches of a search, as "path@offset" lines, sorted since members come in any order. */
+typedef struct grep_matches {
+    char lines[64][300];
+    int count;
+    int stop_after;               /* stop the search after this many matches, 0 never */
+} grep_matches_t;
+
+static int grep_collect(void *arg, const char *path, uint64_t offset) {
+    grep_matches_t *g = arg;
+    if (g->count < 64) snprintf(g->lines[g->count], sizeof(g->lines[0]), "%s@%llu", path, (unsigned long long) offset);
+    return ++g->count == g->stop_after;
+}
+
+static int line_cmp(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+/* The matches tar_grep() must find, from the data of the fixture. */
+static void expected_grep(const char *needle, const char *prefix, int first_only, grep_matches_t *g) {
+    size_t n = strlen(needle);
+
+    memset(g, 0, sizeof(*g));
+    for (size_t m = 0; m < NMEMBERS; m++) {
+        if (members[m].typeflag != REGTYPE || strncmp(members[m].path, prefix, strlen(prefix)) != 0) continue;
+        size_t len;
+        const uint8_t *data = member_data(&members[m], &len);
+        // Overlapping matches count.
+        for (size_t i = 0; i + n <= len; i++) {
+            if (memcmp(data + i, needle, n) != 0) continue;
+            grep_collect(g, members[m].path, i);
+            if (first_only) break;
+        }
+    }
+    qsort(g->lines, g->count, sizeof(g->lines[0]), line_cmp);
+}
+
+/* Checks that searching `needle` in the members under `filter` finds exactly the matches of the data. */
+static void check_grep(tar_handle_t *h, const char *needle, const char *filter, const char *prefix, int flags,
+                       int threads, int line) {
+    static grep_matches_t got, want;
+    tar_grep_options_t opts = { .threads = threads, .flags = flags };
+
+    memset(&got, 0, sizeof(got));
+    ssize_t n = tar_grep(h, needle, strlen(needle), filter, &opts, grep_collect, &got);
+    qsort(got.lines, got.count < 64 ? got.count : 64, sizeof(got.lines[0]), line_cmp);
+    expected_grep(needle, prefix, flags & TAR_GREP_FIRST, &want);
+    int same = n == want.count && got.count == want.count;
+    for (int i = 0; same && i < want.count; i++) same = strcmp(got.lines[i], want.lines[i]) == 0;
+    if (!same) {
+        printf("%s:%d: tar_grep(\"%s\", %s) returned %zd, %d matches expected\n",
+               __FILE__, line, needle, filter ? filter : "NULL", n, want.count);
+        failures++;
+    }
+}
+
+#define CHECK_GREP(h, needle, filter, prefix, flags, threads) \
+    check_grep(h, needle, filter, prefix, flags, threads, __LINE__)
+
+static void test_grep(tar_handle_t *h, int fd) {
+    for (int threads = 1; threads <= 4; threads += 3) {
+        CHECK_GREP(h, "needle", NULL, "", 0, threads);
+        CHECK_GREP(h, "needle", NULL, "", TAR_GREP_FIRST, threads);
+        CHECK_GREP(h, "needle", "src/**", "src/", 0, threads);
+        CHECK_GREP(h, "aa", NULL, "", 0, threads);
+        CHECK_GREP(h, "n", "docs/*", "docs/", 0, threads);
+        CHECK_GREP(h, "absent", NULL, "", 0, threads);
+    }
+
+    // The callback stops the search.
+    static grep_matches_t g = { .stop_after = 3 };
+    CHECK(tar_grep(h, "needle", 6, NULL, NULL, grep_collect, &g) == 3 && g.count == 3);
+    CHECK(tar_grep(h, "", 0, NULL, NULL, grep_collect, &g) == -1);
+
+    // Straight from the mapping.
+    tar_options_t opts = { .flags = TAR_OPEN_MMAP };
+    tar_handle_t *mapped = tar_open(fd, &opts);
+    CHECK(mapped);
+    CHECK_GREP(mapped, "needle", NULL, "", 0, 2);
+    tar_close(mapped);
+}
+
+/* Collects the groups of tar_find_duplicates(), as "path path..." lines. */
+static int dup_collect(void *arg, uint64_t hash, uint64_t size, const tar_strview_t *paths, size_t count) {
+    grep_matches_t *g = arg;
+    char *line = g->lines[g->count++];
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) len += snprintf(line + len, 300 - len, "%s%s", i ? " " : "", paths[i].data);
+    return 0;
+}
+
+static void test_hash(tar_handle_t *h, int fd) {
+    uint64_t hash, other;
+
+    // Reference values of xxh64 with seed 0, short and longer than a stripe.
+    CHECK(tar_member_hash(h, "docs/empty.txt", &hash) == 0 && hash == 0xef46db3751d8e999ULL);
+    CHECK(tar_member_hash(h, "docs/abc.txt", &hash) == 0 && hash == 0x44bc2cf5ad770999ULL);
+    CHECK(tar_member_hash(h, "docs/spam.txt", &hash) == 0 && hash == 0xfbcea83c8a378bf1ULL);
+
+    // Links are followed, identical data hash the same.
+    CHECK(tar_member_hash(h, "link", &hash) == 0 && tar_member_hash(h, "src/main.c", &other) == 0 && hash == other);
+    CHECK(tar_member_hash(h, "docs/copy.txt", &hash) == 0 && tar_member_hash(h, "docs/readme.txt", &other) == 0);
+    CHECK(hash == other);
+    CHECK(tar_member_hash(h, "src/util.c", &other) == 0 && hash != other);
+    CHECK(tar_member_hash(h, "src/", &hash) == -1 && tar_member_hash(h, "absent", &hash) == -1);
+
+    uint64_t big;
+    CHECK(tar_member_hash(h, "big.bin", &big) == 0);
+    // Empty files are not duplicates.
+    static grep_matches_t groups;
+    CHECK(tar_find_duplicates(h, 2, dup_collect, &groups) == 1 && groups.count == 1);
+    CHECK(strcmp(groups.lines[0], "docs/copy.txt docs/readme.txt") == 0);
+
+    // The hashes kept by the handle, and those computed at open, are the same.
+    CHECK(tar_member_hash(h, "big.bin", &hash) == 0 && hash == big);
+    tar_options_t opts = { .flags = TAR_OPEN_HASH | TAR_OPEN_MMAP };
+    tar_handle_t *hashed = tar_open(fd, &opts);
+    CHECK(hashed && tar_member_hash(hashed, "big.bin", &hash) == 0 && hash == big);
+    CHECK(tar_member_hash(hashed, "docs/spam.txt", &hash) == 0 && hash == 0xfbcea83c8a378bf1ULL);
+    tar_close(hashed);
+}
+
+/* The fixture, changed in every way tar_diff() tells apart. */
+static const test_member_t changed[] = {
+    { "big.bin", REGTYPE, NULL, 0, BIG_SIZE },
+    { "docs/", DIRTYPE, NULL },
+    { "docs/copy.txt", REGTYPE, "the needle is in the haystack, needle\n" },
+    { "docs/empty.txt", REGTYPE, "" },
+    { "docs/new.txt", REGTYPE, "added" },
+    { "docs/overlap.txt", REGTYPE, "aaaa" },
+    { "docs/readme.txt", REGTYPE, "the needle is in the haystack, needle\n" },
+    { "docs/spam.txt", REGTYPE, "Nobody inspects the spammish repetition", 1700000001 },
+    { "link", REGTYPE, "no longer a link" },
+    { "src/", DIRTYPE, NULL },
+    { "src/include/", DIRTYPE, NULL },
+    { "src/include/util.h", REGTYPE, "int needle(void);\n" },
+    { "src/main.c", REGTYPE, "int main(void) { return needle() + 1; }\n" },
+    { "src/util.c", REGTYPE, "int needle(void) { return 43; }\n" },
+    { "src/[x].c", REGTYPE, "" },
+};
+#define NCHANGED (sizeof(changed) / sizeof(changed[0]))
+
+static int diff_collect(void *arg, tar_diff_kind_t kind, const char *path, const tar_stat_t *before,
+                        const tar_stat_t *after) {
+    static const char *kinds[] = { "added", "removed", "type", "content", "metadata" };
+    matches_t *m = arg;
+    // Each side is described where the member exists.
+    if ((kind == TAR_DIFF_ADDED) != !before || (kind == TAR_DIFF_REMOVED) != !after) return 1;
+    m->len += snprintf(m->joined + m->len, sizeof(m->joined) - m->len, "%s%s:%s", m->len ? " " : "", kinds[kind], path);
+    return ++m->count == m->stop_after;
+}
+
+/* Checks that diffing `a` and `b` reports exactly `expected`, in path order. */
+static void check_diff(tar_handle_t *a, tar_handle_t *b, int flags, const char *expected, int line) {
+    matches_t m = { .len = 0 };
+    tar_diff_options_t opts = { .threads = 2, .flags = flags };
+    ssize_t n = tar_diff(a, b, &opts, diff_collect, &m);
+    if (n != m.count || strcmp(m.joined, expected) != 0) {
+        printf("%s:%d: tar_diff() returned %zd: \"%s\", expected \"%s\"\n", __FILE__, line, n, m.joined, expected);
+        failures++;
+    }
+}
+
+#define CHECK_DIFF(a, b, flags, expected) check_diff(a, b, flags, expected, __LINE__)
+
+static void test_diff(tar_handle_t *h, int fd) {
+    CHECK(write_archive("tests_query_changed.tar", changed, NCHANGED) == 0);
+    int changed_fd = open("tests_query_changed.tar", O_RDONLY);
+    tar_handle_t *b = tar_open(changed_fd, NULL);
+    CHECK(b);
+    if (!b) return;
+
+    CHECK_DIFF(h, h, TAR_DIFF_CONTENT, "");
+    // A file of the same size and mtime is taken as identical, unless the data are compared.
+    CHECK_DIFF(h, b, 0, "removed:docs/abc.txt added:docs/new.txt metadata:docs/spam.txt type:link content:src/main.c");
+    CHECK_DIFF(h, b, TAR_DIFF_CONTENT, "removed:docs/abc.txt added:docs/new.txt metadata:docs/spam.txt type:link "
+                                       "content:src/main.c content:src/util.c");
+    CHECK_DIFF(b, h, 0, "added:docs/abc.txt removed:docs/new.txt metadata:docs/spam.txt type:link content:src/main.c");
+
+    // By hash, when both handles have them.
+    tar_options_t opts = { .flags = TAR_OPEN_HASH };
+    tar_handle_t *ha = tar_open(fd, &opts), *hb = tar_open(changed_fd, &opts);
+    CHECK(ha && hb);
+    CHECK_DIFF(ha, hb, TAR_DIFF_CONTENT, "removed:docs/abc.txt added:docs/new.txt metadata:docs/spam.txt type:link "
+                                         "content:src/main.c content:src/util.c");
+    tar_close(ha);
+    tar_close(hb);
+
+    // The callback stops the diff.
+    matches_t m = { .stop_after = 2 };
+    CHECK(tar_diff(h, b, NULL, diff_collect, &m) == 2 && m.count == 2);
+
+    tar_close(b);
+    close(changed_fd);
+    unlink("tests_query_changed.tar");
+}
+
+/*
+ * The scan modes read members differently (O_DIRECT, dropped from the page
+ * cache, runs of members through one scan), for the same results as the
+ * default mode.
+ */
+static void test_scan_modes(tar_handle_t *h, int fd) {
+    static const int modes[] = { TAR_OPEN_SCAN_DIRECT, TAR_OPEN_SCAN_DONTNEED };
+    // The fixture shuffled around big.bin, so that scans in the order of the fixture seek both ways past it.
+    static const size_t order[NMEMBERS] = { 1, 3, 0, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 2 };
+    test_member_t shuffled[NMEMBERS];
+    for (size_t m = 0; m < NMEMBERS; m++) shuffled[m] = members[order[m]];
+    CHECK(write_archive("tests_query_shuffled.tar", shuffled, NMEMBERS) == 0);
+    CHECK(write_archive("tests_query_changed.tar", changed, NCHANGED) == 0);
+    int shuffled_fd = open("tests_query_shuffled.tar", O_RDONLY), changed_fd = open("tests_query_changed.tar", O_RDONLY);
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        tar_options_t opts = { .flags = modes[i] };
+        tar_handle_t *s = tar_open(fd, &opts), *shuf = tar_open(shuffled_fd, &opts), *b = tar_open(changed_fd, &opts);
+        CHECK(s && shuf && b);
+        if (!s || !shuf || !b) continue;
+
+        for (int threads = 1; threads <= 3; threads += 2) {
+            CHECK_GREP(s, "needle", NULL, "", 0, threads);
+            CHECK_GREP(s, "needle", NULL, "", TAR_GREP_FIRST, threads);
+            CHECK_GREP(s, "needle", "src/**", "src/", 0, threads);
+            CHECK_GREP(s, "aa", NULL, "", 0, threads);
+            CHECK_GREP(shuf, "needle", NULL, "", 0, threads);
+            CHECK_GREP(shuf, "e", "docs/*", "docs/", 0, threads);
+        }
+
+        // Member by member, then all at once by the runs of tar_find_duplicates().
+        uint64_t want, got;
+        for (size_t m = 0; m < NMEMBERS; m++) {
+            if (members[m].typeflag != REGTYPE) continue;
+            CHECK(tar_member_hash(h, (char *) members[m].path, &want) == 0);
+            CHECK(tar_member_hash(s, (char *) members[m].path, &got) == 0 && got == want);
+        }
+        static grep_matches_t groups;
+        memset(&groups, 0, sizeof(groups));
+        CHECK(tar_find_duplicates(shuf, 2, dup_collect, &groups) == 1 && groups.count == 1);
+        CHECK(strcmp(groups.lines[0], "docs/copy.txt docs/readme.txt") == 0);
+        for (size_t m = 0; m < NMEMBERS; m++) {
+            if (members[m].typeflag != REGTYPE) continue;
+            CHECK(tar_member_hash(h, (char *) members[m].path, &want) == 0);
+            CHECK(tar_member_hash(shuf, (char *) members[m].path, &got) == 0 && got == want);
+        }
+
+        // Both sides in scan mode, one only, and members in opposite orders.
+        CHECK_DIFF(s, b, TAR_DIFF_CONTENT, "removed:docs/abc.txt added:docs/new.txt metadata:docs/spam.txt type:link "
+                                           "content:src/main.c content:src/util.c");
+        CHECK_DIFF(h, b, TAR_DIFF_CONTENT, "removed:docs/abc.txt added:docs/new.txt metadata:docs/spam.txt type:link "
+                                           "content:src/main.c content:src/util.c");
+        CHECK_DIFF(s, shuf, TAR_DIFF_CONTENT, "");
+        CHECK_DIFF(shuf, h, TAR_DIFF_CONTENT, "");
+        tar_close(s);
+        tar_close(shuf);
+        tar_close(b);
+    }
+    close(shuffled_fd);
+    close(changed_fd);
+    unlink("tests_query_shuffled.tar");
+    unlink("tests_query_changed.tar");
+}
+
+/* A layer over the fixture: whiteouts, an opaque directory, a replaced file and a link into the layer below. */
+static const test_member_t upper[] = {
+    { "docs/", DIRTYPE, NULL },
+    { "docs/.wh.abc.txt", REGTYPE, "" },
+    { "docs/readme.txt", REGTYPE, "upper readme" },
+    { "src/", DIRTYPE, NULL },
+    { "src/.wh..wh..opq", REGTYPE, "" },
+    { "src/new.c", REGTYPE, "new" },
+    { "uplink", SYMTYPE, "docs/copy.txt" },
+};
+#define NUPPER (sizeof(upper) / sizeof(upper[0]))
+
+/* Checks that the overlay lists exactly `expected` in `dir`. */
+static void check_overlay_list(tar_overlay_t *ov, char *dir, const char *expected, int line) {
+    tar_list_t list;
+    matches_t m = { .len = 0 };
+    int ret = tar_overlay_list(ov, dir, &list);
+    for (size_t i = 0; ret == 1 && i < list.count; i++) collect(&m, list.entries[i].data, list.entries[i].len);
+    tar_list_free(&list);
+    if (ret != 1 || strcmp(m.joined, expected) != 0) {
+        printf("%s:%d: tar_overlay_list(\"%s\") returned %d: \"%s\", expected \"%s\"\n",
+               __FILE__, line, dir, ret, m.joined, expected);
+        failures++;
+    }
+}
+
+#define CHECK_OVERLAY_LIST(ov, dir, expected) check_overlay_list(ov, dir, expected, __LINE__)
+
+static void test_overlay(tar_handle_t *h) {
+    CHECK(write_archive("tests_query_upper.tar", upper, NUPPER) == 0);
+    int upper_fd = open("tests_query_upper.tar", O_RDONLY);
+    tar_handle_t *top = tar_open(upper_fd, NULL);
+    tar_overlay_t *ov = tar_overlay_new();
+    CHECK(top && ov && tar_overlay_add(ov, h) == 0 && tar_overlay_add(ov, top) == 0);
+
+    // Whiteouts delete, and are not part of the view.
+    CHECK(!tar_overlay_exists(ov, "docs/abc.txt") && !tar_overlay_exists(ov, "docs/.wh.abc.txt"));
+    CHECK(tar_overlay_is_file(ov, "docs/copy.txt") && tar_overlay_is_dir(ov, "docs/"));
+    // The opaque directory hides everything below it.
+    CHECK(!tar_overlay_exists(ov, "src/main.c") && !tar_overlay_exists(ov, "src/include/util.h"));
+    CHECK(tar_overlay_is_file(ov, "src/new.c") && !tar_overlay_exists(ov, "src/.wh..wh..opq"));
+    CHECK(tar_overlay_is_symlink(ov, "uplink") && tar_overlay_is_file(ov, "big.bin"));
+
+    // The topmost layer wins, and links resolve across layers.
+    uint8_t buf[64];
+    size_t len = sizeof(buf);
+    CHECK(tar_overlay_read_file(ov, "docs/readme.txt", 0, buf, &len) == 0 && len == 12);
+    CHECK(memcmp(buf, "upper readme", 12) == 0);
+    len = sizeof(buf);
+    CHECK(tar_overlay_read_file(ov, "uplink", 4, buf, &len) == 0 && len == 34 && memcmp(buf, "needle", 6) == 0);
+    tar_stat_t st;
+    CHECK(tar_overlay_stat(ov, "docs/readme.txt", &st) == 1 && st.size == 12);
+
+    CHECK_OVERLAY_LIST(ov, "docs", "docs/copy.txt docs/empty.txt docs/overlap.txt docs/readme.txt docs/spam.txt");
+    CHECK_OVERLAY_LIST(ov, "src/", "src/new.c");
+    CHECK_OVERLAY_LIST(ov, "", "big.bin docs/ link src/ uplink");
+    tar_list_t list;
+    CHECK(tar_overlay_list(ov, "src/main.c", &list) == 0 && tar_overlay_list(ov, "absent", &list) == 0);
+
+    tar_overlay_free(ov);
+    tar_close(top);
+    close(upper_fd);
+    unlink("tests_query_upper.tar");
+}
+
+/* Checks that `fd`, from `pos` to its end, holds `len` bytes of the data of `path` from `offset`. */
+static int holds_data(int fd, off_t pos, const char *path, size_t offset, size_t len) {
+    static uint8_t buf[BIG_SIZE];
+    size_t size;
+    const uint8_t *data = NULL;
+
+    for (size_t m = 0; m < NMEMBERS; m++) {
+        if (strcmp(members[m].path, path) == 0) data = member_data(&members[m], &size);
+    }
+    ssize_t n = pread(fd, buf, sizeof(buf), pos);
+    return data && offset + len <= size && n == (ssize_t) len && memcmp(buf, data + offset, len) == 0;
+}
+
+static void test_copy(tar_handle_t *h) {
+    uint8_t buf[256];
+    int fds[2];
+
+    // To a regular file, after what it already holds.
+    FILE *out = tmpfile();
+    int out_fd = fileno(out);
+    CHECK(write(out_fd, "head", 4) == 4);
+    CHECK(tar_copy_to_fd(h, "big.bin", 1000, 3 << 20, out_fd) == 3 << 20);
+    CHECK(holds_data(out_fd, 4, "big.bin", 1000, 3 << 20));
+    CHECK(lseek(out_fd, 0, SEEK_CUR) == 4 + (3 << 20));
+    fclose(out);
+
+    // The length is clamped to the end of the file, and links are resolved.
+    out = tmpfile();
+    out_fd = fileno(out);
+    CHECK(tar_copy_to_fd(h, "big.bin", BIG_SIZE - 10, 100, out_fd) == 10);
+    CHECK(holds_data(out_fd, 0, "big.bin", BIG_SIZE - 10, 10));
+    CHECK(ftruncate(out_fd, 0) == 0 && lseek(out_fd, 0, SEEK_SET) == 0);
+    CHECK(tar_copy_to_fd(h, "link", 4, SIZE_MAX, out_fd) == 32);
+    CHECK(holds_data(out_fd, 0, "src/main.c", 4, 32));
+    fclose(out);
+
+    // Appending files are refused by copy_file_range(): the data go through userspace.
+    out_fd = open("tests_query.out", O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    CHECK(out_fd != -1 && tar_copy_to_fd(h, "big.bin", 7, BIG_SIZE, out_fd) == BIG_SIZE - 7);
+    int in_fd = open("tests_query.out", O_RDONLY);
+    CHECK(holds_data(in_fd, 0, "big.bin", 7, BIG_SIZE - 7));
+    close(in_fd);
+    close(out_fd);
+    unlink("tests_query.out");
+
+    // To a pipe (splice) and to a socket (sendfile).
+    CHECK(pipe(fds) == 0);
+    CHECK(tar_copy_to_fd(h, "docs/readme.txt", 4, SIZE_MAX, fds[1]) == 34);
+    CHECK(read(fds[0], buf, sizeof(buf)) == 34 && memcmp(buf, "needle is in the haystack, needle\n", 34) == 0);
+    close(fds[0]);
+    close(fds[1]);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CHECK(tar_copy_to_fd(h, "src/util.c", 0, 10, fds[0]) == 10);
+    CHECK(read(fds[1], buf, sizeof(buf)) == 10 && memcmp(buf, "int needle", 10) == 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    // Errors: no regular file, an offset past the end, a descriptor that cannot be written.
+    int ro = open(ARCHIVE, O_RDONLY);
+    CHECK(tar_copy_to_fd(h, "missing", 0, 10, ro) == -1);
+    CHECK(tar_copy_to_fd(h, "docs/", 0, 10, ro) == -1);
+    CHECK(tar_copy_to_fd(h, "docs/abc.txt", 4, 10, ro) == -2);
+    CHECK(tar_copy_to_fd(h, "docs/abc.txt", 3, 10, ro) == 0);
+    CHECK(tar_copy_to_fd(h, "docs/abc.txt", 0, 10, ro) == -3);
+    close(ro);
+}
+
+/* Bytes this process read so far, from /proc/self/io. */
+static uint64_t bytes_read(void) {
+    char line[64];
+    uint64_t rchar = 0;
+    FILE *io = fopen("/proc/self/io", "r");
+    while (io && fgets(line, sizeof(line), io)) {
+        if (sscanf(line, "rchar: %lu", &rchar) == 1) break;
+    }
+    if (io) fclose(io);
+    return rchar;
+}
+
+#define LARGE_MEMBERS 200
+#define LARGE_SIZE (200 * 1024)
+
+/* Indexing an archive of large members reads their headers, not their data. */
+static void test_large_members(void) {
+    FILE *data = tmpfile();
+    int fd = open(ARCHIVE ".large", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    tar_writer_t *w = fd == -1 ? NULL : tar_writer_new(fd, 0);
+    CHECK(data && w);
+    if (!data || !w) return;
+
+    tar_stat_t st = { .typeflag = REGTYPE, .mode = 0644, .mtime = 1700000000, .size = LARGE_SIZE };
+    CHECK(ftruncate(fileno(data), LARGE_SIZE) == 0);
+    char path[32];
+    for (int m = 0; m < LARGE_MEMBERS; m++) {
+        snprintf(path, sizeof(path), "large%03d.bin", m);
+        CHECK(tar_writer_add(w, path, &st, NULL, fileno(data)) == 0);
+    }
+    // Small members after the large ones are still read many to a window.
+    st.size = 0;
+    for (int m = 0; m < LARGE_MEMBERS; m++) {
+        snprintf(path, sizeof(path), "small%03d.txt", m);
+        CHECK(tar_writer_add(w, path, &st, NULL, -1) == 0);
+    }
+    CHECK(tar_writer_close(w) == 0);
+    fclose(data);
+
+    uint64_t before = bytes_read();
+    tar_handle_t *h = tar_open(fd, NULL);
+    uint64_t read = bytes_read() - before;
+    CHECK(h && tar_exists(h, "large199.bin") && tar_exists(h, "small199.txt"));
+    // A block per large member, and a first window. Reading 64 KiB windows would read 12.8 MB.
+    CHECK(read <= LARGE_MEMBERS * BLOCK_SIZE + (1 << 20));
+    if (h) tar_close(h);
+    close(fd);
+    unlink(ARCHIVE ".large");
+}
+
+int main(void) {
+    CHECK(write_archive(ARCHIVE, members, NMEMBERS) == 0);
+    int fd = open(ARCHIVE, O_RDONLY);
+    tar_handle_t *h = tar_open(fd, NULL);
+    CHECK(h);
+    if (!h) return 1;
+
+    test_find(h, fd);
+    test_grep(h, fd);
+    test_hash(h, fd);
+    test_diff(h, fd);
+    test_overlay(h);
+    test_scan_modes(h, fd);
+    test_copy(h);
+    test_large_members();
+
+    // Hashing at open would complete a lazy or background index there.
+    tar_options_t hash_opts = { .flags = TAR_OPEN_HASH | TAR_OPEN_LAZY_INDEX };
+    errno = 0;
+    CHECK(!tar_open(fd, &hash_opts) && errno == EINVAL);
+    hash_opts.flags = TAR_OPEN_HASH | TAR_OPEN_BACKGROUND_INDEX;
+    errno = 0;
+    CHECK(!tar_open(fd, &hash_opts) && errno == EINVAL);
+
+    // The same copies from the mapping of the archive.
+    tar_options_t opts = { .flags = TAR_OPEN_MMAP };
+    tar_handle_t *mh = tar_open(fd, &opts);
+    CHECK(mh);
+    if (mh) {
+        test_copy(mh);
+        tar_close(mh);
+    }
+
+    tar_close(h);
+    close(fd);
+    unlink(ARCHIVE);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "lib_tar.h"
+#include "tard.h"
+
+/**
+ * Tests of tard, through its socket: a daemon is started on the archive
+ * given, asked for each kind of request, from several clients at once on
+ * first use, and then loaded by tard_load for a moment.
+ *
+ * The archive must hold testing.txt and alpha.txt, like tester.tar, and the
+ * test runs from the directory of these files.
+ *
+ * Usage: ./tests_tard archive
+ */
+
+#define SOCKET_PATH "tests_tard.sock"
+#define CLIENTS 8
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int failures;
+static char archive[TARD_MAX_ARCHIVE + 1];
+
+static int connect_daemon(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = SOCKET_PATH };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock != -1 && connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* Sends one request and receives its first response, and the descriptor passed along if any. */
+static int call(int sock, tard_op_t op, const char *archive_path, const char *path, uint64_t offset,
+                tard_response_t *resp, uint8_t *payload, int *fd) {
+    tard_request_t req = {
+        .op = op,
+        .archive_len = strlen(archive_path),
+        .path_len = strlen(path),
+        .offset = offset,
+        .length = TARD_MAX_PAYLOAD,
+    };
+    struct iovec out[3] = {
+        { .iov_base = &req, .iov_len = sizeof(req) },
+        { .iov_base = (void *) archive_path, .iov_len = req.archive_len },
+        { .iov_base = (void *) path, .iov_len = req.path_len },
+    };
+    struct msghdr msg = { .msg_iov = out, .msg_iovlen = 3 };
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) return -1;
+
+    struct iovec in[2] = {
+        { .iov_base = resp, .iov_len = sizeof(*resp) },
+        { .iov_base = payload, .iov_len = TARD_MAX_PAYLOAD },
+    };
+    union {
+        struct cmsghdr header;
+        char bytes[CMSG_SPACE(sizeof(int))];
+    } control;
+    msg = (struct msghdr) { .msg_iov = in, .msg_iovlen = 2, .msg_control = control.bytes,
+                            .msg_controllen = sizeof(control.bytes) };
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) < (ssize_t) sizeof(*resp)) return -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (fd) *fd = -1;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        int passed;
+        memcpy(&passed, CMSG_DATA(cmsg), sizeof(int));
+        if (fd) *fd = passed;
+        else close(passed);
+    }
+    return 0;
+}
+
+/* Reads a whole file of the working directory. Returns its size, or -1. */
+static ssize_t read_local(const char *path, uint8_t *buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size);
+    close(fd);
+    return n;
+}
+
+/* One of the clients that find the archive not yet open. */
+static void *stat_first(void *arg) {
+    int *ok = arg;
+    uint8_t *payload = malloc(TARD_MAX_PAYLOAD);
+    int sock = connect_daemon();
+    tard_response_t resp;
+
+    *ok = payload && sock != -1 && call(sock, TARD_STAT, archive, "testing.txt", 0, &resp, payload, NULL) == 0
+          && resp.status == 0 && resp.typeflag == REGTYPE && resp.size == 1855;
+    if (sock != -1) close(sock);
+    free(payload);
+    return NULL;
+}
+
+static void test_first_use(void) {
+    pthread_t threads[CLIENTS];
+    int ok[CLIENTS];
+
+    for (int i = 0; i < CLIENTS; i++) pthread_create(&threads[i], NULL, stat_first, &ok[i]);
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(ok[i]);
+    }
+}
+
+static void test_requests(void) {
+    uint8_t *payload = malloc(TARD_MAX_PAYLOAD), expected[4096];
+    int sock = connect_daemon(), fd;
+    tard_response_t resp;
+
+    CHECK(sock != -1);
+    if (sock == -1) {
+        free(payload);
+        return;
+    }
+
+    // A missing archive, twice: its failed open does not stick.
+    CHECK(call(sock, TARD_STAT, "/nonexistent/archive.tar", "testing.txt", 0, &resp, payload, NULL) == 0);
+    CHECK(resp.status == -ENOENT);
+    CHECK(call(sock, TARD_STAT, "/nonexistent/archive.tar", "testing.txt", 0, &resp, payload, NULL) == 0);
+    CHECK(resp.status == -ENOENT);
+
+    CHECK(call(sock, TARD_STAT, archive, "missing.txt", 0, &resp, payload, NULL) == 0);
+    CHECK(resp.status == -ENOENT);
+
+    ssize_t len = read_local("alpha.txt", expected, sizeof(expected));
+    CHECK(call(sock, TARD_READ, archive, "alpha.txt", 0, &resp, payload, NULL) == 0);
+    CHECK(resp.status == 0 && (ssize_t) resp.length == len && resp.size == (uint64_t) len);
+    CHECK(len > 0 && memcmp(payload, expected, len) == 0);
+    CHECK(call(sock, TARD_READ, archive, "alpha.txt", 10, &resp, payload, NULL) == 0);
+    CHECK(resp.status == 0 && (ssize_t) resp.length == len - 10);
+    CHECK(memcmp(payload, expected + 10, len - 10) == 0);
+
+    len = read_local("testing.txt", expected, sizeof(expected));
+    CHECK(call(sock, TARD_READ_FD, archive, "testing.txt", 5, &resp, payload, &fd) == 0);
+    CHECK(resp.status == 0 && fd != -1 && (ssize_t) resp.length == len - 5);
+    if (fd != -1) {
+        CHECK(pread(fd, payload, resp.length, resp.data_offset) == (ssize_t) resp.length);
+        CHECK(memcmp(payload, expected + 5, len - 5) == 0);
+        close(fd);
+    }
+    CHECK(call(sock, TARD_READ_FD, archive, "testing.txt", len + 1, &resp, payload, &fd) == 0);
+    CHECK(resp.status == -EINVAL && fd == -1);
+
+    CHECK(call(sock, TARD_LIST, archive, "testing.txt", 0, &resp, payload, NULL) == 0);
+    CHECK(resp.status == -ENOENT);
+
+    close(sock);
+    free(payload);
+}
+
+/* Runs tard_load for a moment, which must see no failed request. */
+static void test_load(void) {
+    char command[TARD_MAX_ARCHIVE + 128], line[1024];
+
+    snprintf(command, sizeof(command), "./tard_load %s %s 2 0.2", SOCKET_PATH, archive);
+    FILE *out = popen(command, "r");
+    int lines = 0;
+    CHECK(out != NULL);
+    while (out && fgets(line, sizeof(line), out)) {
+        if (!strstr(line, "\"bench\"")) continue;
+        lines++;
+        CHECK(strstr(line, "\"failed\": 0") != NULL);
+    }
+    CHECK(out && pclose(out) == 0);
+    CHECK(lines == 3); // stat, read and read_fd: the archive holds no directory
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf("Usage: %s archive\n", argv[0]);
+        return -1;
+    }
+    if (!realpath(argv[1], archive)) {
+        perror("realpath(archive)");
+        return -1;
+    }
+
+    unlink(SOCKET_PATH);
+    pid_t daemon = fork();
+    if (daemon == 0) {
+        execl("./tard", "./tard", "-c", "16", SOCKET_PATH, (char *) NULL);
+        _exit(127);
+    }
+    int sock = -1;
+    for (int tries = 0; daemon > 0 && sock == -1 && tries < 200; tries++) {
+        sock = connect_daemon();
+        if (sock == -1) usleep(10000);
+    }
+    if (sock == -1) {
+        printf("%s: tard did not start\n", argv[0]);
+        if (daemon > 0) kill(daemon, SIGTERM);
+        return -1;
+    }
+    close(sock);
+
+    test_first_use();
+    test_requests();
+    test_load();
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+    unlink(SOCKET_PATH);
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+
+#include "tarfs.h"
+
+/**
+ * Tests of the tarfs operations. They are called through the table that
+ * tarfs.c hands to FUSE, so no mount (and no /dev/fuse) is needed.
+ *
+ * The archive is generated: it holds a directory with and without a header,
+ * links of both kinds, an empty file and a file larger than one cache slab.
+ *
+ * Usage: ./tests_tarfs
+ */
+
+#define ARCHIVE "tests_tarfs.tar"
+#define BIG_SIZE (3 * TAR_CACHE_SLAB_SIZE + 100)
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int failures;
+
+static void write_member(int fd, const char *path, char typeflag, size_t size, const char *linkname) {
+    tar_header_t header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.name, path, strlen(path));
+    if (linkname) snprintf(header.linkname, sizeof(header.linkname), "%s", linkname);
+    snprintf(header.mode, sizeof(header.mode), "%07o", typeflag == DIRTYPE ? 0755 : 0644);
+    snprintf(header.uid, sizeof(header.uid), "%07o", 0);
+    snprintf(header.gid, sizeof(header.gid), "%07o", 0);
+    snprintf(header.size, sizeof(header.size), "%011lo", (unsigned long) size);
+    snprintf(header.mtime, sizeof(header.mtime), "%011o", 1700000000);
+    header.typeflag = typeflag;
+    memcpy(header.magic, TMAGIC, TMAGLEN);
+    memcpy(header.version, TVERSION, TVERSLEN);
+
+    unsigned int sum = 0;
+    memset(header.chksum, ' ', sizeof(header.chksum));
+    for (size_t i = 0; i < sizeof(header); i++) sum += ((unsigned char *) &header)[i];
+    snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+    write(fd, &header, sizeof(header));
+
+    // The content of byte i is i % 251, so that any misplaced read shows.
+    uint8_t block[BLOCK_SIZE];
+    for (size_t done = 0; done < size; done += BLOCK_SIZE) {
+        for (size_t i = 0; i < BLOCK_SIZE; i++) block[i] = (done + i) % 251;
+        size_t len = size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE;
+        memset(block + len, 0, BLOCK_SIZE - len);
+        write(fd, block, BLOCK_SIZE);
+    }
+}
+
+static int make_archive(void) {
+    int fd = open(ARCHIVE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) return -1;
+    write_member(fd, "dir/", DIRTYPE, 0, NULL);
+    write_member(fd, "dir/a.txt", REGTYPE, 1000, NULL);
+    write_member(fd, "dir/sub/b.txt", REGTYPE, 10, NULL);      // dir/sub/ has no header
+    write_member(fd, "dir/link", SYMTYPE, 0, "a.txt");
+    write_member(fd, "hard", LNKTYPE, 0, "dir/a.txt");
+    write_member(fd, "empty", REGTYPE, 0, NULL);
+    write_member(fd, "big.bin", REGTYPE, BIG_SIZE, NULL);
+    write_member(fd, "fifo", FIFOTYPE, 0, NULL);
+    write_member(fd, "dirhard", LNKTYPE, 0, "dir/");
+
+    uint8_t end[2 * BLOCK_SIZE] = { 0 };
+    write(fd, end, sizeof(end));
+    close(fd);
+    return 0;
+}
+
+/* Collects the names passed to the readdir callback, one per line, marked with their type like `ls -F`. */
+typedef struct names {
+    char text[1024];
+    size_t len;
+    size_t limit;                 /* names to accept before asking to stop, 0 for all */
+    size_t count;
+} names_t;
+
+static int collect(void *buf, const char *name, const struct stat *st) {
+    names_t *names = buf;
+    const char *mark = !st ? "" : S_ISDIR(st->st_mode) ? "/" : S_ISLNK(st->st_mode) ? "@" : S_ISFIFO(st->st_mode) ? "|" : "";
+    names->len += snprintf(names->text + names->len, sizeof(names->text) - names->len, "%s%s\n", name, mark);
+    names->count++;
+    return names->limit && names->count == names->limit;
+}
+
+static void check_getattr(tarfs_t *fs) {
+    struct stat st;
+
+    CHECK(tarfs_ops.getattr(fs, "/", &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(tarfs_ops.getattr(fs, "/dir", &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0755);
+    CHECK(tarfs_ops.getattr(fs, "/dir/sub", &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(tarfs_ops.getattr(fs, "/dir/a.txt", &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 1000);
+    CHECK(st.st_mtime == 1700000000 && st.st_uid == getuid());
+    CHECK(tarfs_ops.getattr(fs, "/dir/link", &st) == 0 && S_ISLNK(st.st_mode));
+    CHECK(tarfs_ops.getattr(fs, "/hard", &st) == 0 && S_ISREG(st.st_mode) && st.st_size == 1000);
+    CHECK(tarfs_ops.getattr(fs, "/empty", &st) == 0 && st.st_size == 0);
+    CHECK(tarfs_ops.getattr(fs, "/fifo", &st) == 0 && S_ISFIFO(st.st_mode));
+    CHECK(tarfs_ops.getattr(fs, "/dirhard", &st) == 0 && S_ISDIR(st.st_mode));
+    CHECK(tarfs_ops.getattr(fs, "/missing", &st) == -ENOENT);
+    CHECK(tarfs_ops.getattr(fs, "/dir/su", &st) == -ENOENT);
+}
+
+static void check_readdir(tarfs_t *fs) {
+    names_t names = { 0 };
+    CHECK(tarfs_ops.readdir(fs, "/", &names, collect) == 0);
+    CHECK(strcmp(names.text, ".\n..\nbig.bin\ndir/\ndirhard/\nempty\nfifo|\nhard\n") == 0);
+
+    names = (names_t) { 0 };
+    CHECK(tarfs_ops.readdir(fs, "/dir", &names, collect) == 0);
+    CHECK(strcmp(names.text, ".\n..\na.txt\nlink@\nsub/\n") == 0);
+
+    names = (names_t) { 0 };
+    CHECK(tarfs_ops.readdir(fs, "/dir/sub", &names, collect) == 0);
+    CHECK(strcmp(names.text, ".\n..\nb.txt\n") == 0);
+
+    // A full FUSE buffer stops the listing.
+    names = (names_t) { .limit = 3 };
+    CHECK(tarfs_ops.readdir(fs, "/dir", &names, collect) == 0 && names.count == 3);
+
+    names = (names_t) { 0 };
+    CHECK(tarfs_ops.readdir(fs, "/missing", &names, collect) == -ENOTDIR && names.count == 0);
+}
+
+static void check_read(tarfs_t *fs) {
+    static char buf[BIG_SIZE + 10];
+
+    CHECK(tarfs_ops.open(fs, "/big.bin", O_RDONLY) == 0);
+    CHECK(tarfs_ops.open(fs, "/big.bin", O_RDWR) == -EROFS);
+    CHECK(tarfs_ops.open(fs, "/dir", O_RDONLY) == -EISDIR);
+    CHECK(tarfs_ops.open(fs, "/missing", O_RDONLY) == -ENOENT);
+
+    // The kernel reads by pages, across the slabs of the cache.
+    int ok = 1;
+    for (off_t offset = 0; offset < BIG_SIZE; offset += 4096) {
+        int n = tarfs_ops.read(fs, "/big.bin", buf, 4096, offset);
+        ok &= n == (BIG_SIZE - offset < 4096 ? BIG_SIZE - offset : 4096);
+        for (int i = 0; i < n; i++) ok &= (uint8_t) buf[i] == (offset + i) % 251;
+    }
+    CHECK(ok);
+    CHECK(tarfs_ops.read(fs, "/big.bin", buf, sizeof(buf), 0) == BIG_SIZE);
+    CHECK(tarfs_ops.read(fs, "/big.bin", buf, 10, BIG_SIZE) == 0);
+    CHECK(tarfs_ops.read(fs, "/big.bin", buf, 10, BIG_SIZE + 4096) == 0);
+
+    CHECK(tarfs_ops.read(fs, "/hard", buf, 100, 995) == 5 && (uint8_t) buf[0] == 995 % 251);
+    CHECK(tarfs_ops.read(fs, "/dir/link", buf, 100, 0) == 100);
+    CHECK(tarfs_ops.read(fs, "/empty", buf, 100, 0) == 0);
+    CHECK(tarfs_ops.read(fs, "/missing", buf, 100, 0) == -ENOENT);
+}
+
+static void check_readlink(tarfs_t *fs) {
+    char buf[16];
+
+    CHECK(tarfs_ops.readlink(fs, "/dir/link", buf, sizeof(buf)) == 0 && strcmp(buf, "a.txt") == 0);
+    CHECK(tarfs_ops.readlink(fs, "/dir/link", buf, 3) == 0 && strcmp(buf, "a.") == 0);
+    CHECK(tarfs_ops.readlink(fs, "/dir/a.txt", buf, sizeof(buf)) == -EINVAL);
+}
+
+int main(int argc, char **argv) {
+    tarfs_t fs;
+
+    if (make_archive() < 0 || tarfs_open(&fs, ARCHIVE, 1 << 20) != 0) {
+        perror(ARCHIVE);
+        return -1;
+    }
+    check_getattr(&fs);
+    check_readdir(&fs);
+    check_read(&fs);
+    check_readlink(&fs);
+    tarfs_close(&fs);
+    unlink(ARCHIVE);
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}
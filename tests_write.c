@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+// <linux/fs.h> has a BLOCK_SIZE of its own, lib_tar.h defines the one of tar.
+#undef BLOCK_SIZE
+
+#include "tests.h"
+
+/**
+ * Tests of the writer and of copies out of aligned archives.
+ *
+ * Archives are written in `dir` (the current directory by default), read
+ * back with lib_tar and listed with GNU tar. When `dir` is on a file system
+ * with reflinks, extracted files must share their blocks with the archive:
+ * `make tests_reflink` runs this on a loopback XFS image (as root).
+ *
+ * Usage: ./tests_write [dir]
+ */
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static int failures;
+
+/* Each member has an mtime of its own, so that mixed up entries show. */
+#define MTIME(m) (1700000000 + (int64_t) (m) * 3600)
+
+static const test_member_t members[] = {
+    { "dir/", DIRTYPE, NULL, MTIME(0) },
+    { "dir/one", REGTYPE, NULL, MTIME(1), 1 },
+    { "dir/small", REGTYPE, NULL, MTIME(2), 5000 },
+    { "dir/blocks", REGTYPE, NULL, MTIME(3), 3 * 4096 },
+    { "dir/large", REGTYPE, NULL, MTIME(4), 1000 * 1000 },
+    { "dir/empty", REGTYPE, NULL, MTIME(5), 0 },
+    { "dir/link", SYMTYPE, "large", MTIME(6) },
+    { "hard", LNKTYPE, "dir/large", MTIME(7) },
+    { "a-directory-name-long-enough-to-need-the-prefix-field-of-ustar-headers/"
+      "and-a-file-name-that-is-long-enough-too-for-the-total-to-exceed-one-hundred", REGTYPE, NULL, MTIME(8), 700 },
+};
+#define NMEMBERS (sizeof(members) / sizeof(members[0]))
+
+/* The content of member `m`: byte i is (i + m) % 251. */
+static void fill(uint8_t *buf, size_t m, uint64_t from, size_t len) {
+    for (size_t i = 0; i < len; i++) buf[i] = (from + i + m) % 251;
+}
+
+static const uint8_t *member_data(const test_member_t *member, size_t m) {
+    static uint8_t data[1000 * 1000];
+    fill(data, m, 0, member->size);
+    return data;
+}
+
+static int write_archive(const char *path, int flags) {
+    return test_write_archive(path, flags, members, NMEMBERS, member_data);
+}
+
+/* Checks that `fd` holds the data of member `m` from `offset`. */
+static int same_data(int fd, off_t at, size_t m, uint64_t offset, size_t len) {
+    static uint8_t got[1000 * 1000], want[1000 * 1000];
+    fill(want, m, offset, len);
+    return pread(fd, got, len, at) == (ssize_t) len && memcmp(got, want, len) == 0;
+}
+
+static void check_archive_contents(const char *path, int aligned, int flags) {
+    int fd = open(path, O_RDONLY);
+    tar_options_t opts = { .flags = flags };
+    tar_handle_t *h = tar_open(fd, &opts);
+    CHECK(h);
+    if (!h) return;
+
+    // From the last member to the first, a lazy index serves all but the first lookup from memory.
+    for (size_t m = NMEMBERS; m-- > 0; ) {
+        tar_stat_t st;
+        CHECK(tar_stat(h, (char *) members[m].path, &st) && st.typeflag == members[m].typeflag);
+        if (members[m].typeflag != REGTYPE) continue;
+        CHECK(st.size == members[m].size && st.mode == 0644 && st.mtime == MTIME(m));
+        if (aligned && st.size) CHECK(st.data_offset % TAR_WRITE_ALIGNMENT == 0);
+        CHECK(same_data(fd, st.data_offset, m, 0, st.size));
+    }
+    CHECK(!tar_exists(h, "dir/absent"));
+
+    // The packed index keeps the metadata of every entry, in path order.
+    tar_walk_t w;
+    size_t walked = 0;
+    for (int more = tar_walk_first(h, &w); more; more = tar_walk_next(&w), walked++) {
+        tar_stat_t st;
+        tar_walk_stat(&w, &st);
+        for (size_t m = 0; m < NMEMBERS; m++) {
+            if (strcmp(members[m].path, w.path) == 0) CHECK(st.typeflag == members[m].typeflag && st.mtime == MTIME(m));
+        }
+    }
+    CHECK(walked == NMEMBERS);
+    // The padding does not show.
+    tar_index_info_t info;
+    CHECK(tar_get_index_info(h, &info) == 0 && info.entries == NMEMBERS);
+    tar_close(h);
+    close(fd);
+
+    // Neither for GNU tar.
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "tar -tf %s | wc -l", path);
+    FILE *out = popen(cmd, "r");
+    size_t lines = 0;
+    CHECK(out && fscanf(out, "%zu", &lines) == 1 && lines == NMEMBERS);
+    if (out) pclose(out);
+}
+
+/* Reads `path` back through the functions on file descriptors, which skip the padding too. */
+static void check_fd_api(const char *path) {
+    char names[NMEMBERS][101] = { 0 }, *entries[NMEMBERS];
+    size_t count = NMEMBERS;
+    uint8_t buf[5000], want[5000];
+    size_t len = sizeof(buf);
+    int fd = open(path, O_RDONLY);
+
+    CHECK(check_archive(fd) == NMEMBERS);
+    CHECK(!exists(fd, "././@PaxHeader") && exists(fd, "dir/small") && is_file(fd, "dir/blocks"));
+    CHECK(is_dir(fd, "dir/") && is_symlink(fd, "dir/link"));
+    for (size_t i = 0; i < NMEMBERS; i++) entries[i] = names[i];
+    CHECK(list(fd, "dir/", entries, &count) == 1 && count == 6);
+    CHECK(strcmp(names[0], "dir/one") == 0 && strcmp(names[5], "dir/link") == 0);
+    CHECK(read_file(fd, "dir/small", 0, buf, &len) == 0 && len == 5000);
+    fill(want, 2, 0, sizeof(want));
+    CHECK(memcmp(buf, want, sizeof(want)) == 0);
+    close(fd);
+}
+
+/* Returns 1 if `dir` is on a file system with reflinks, where files can share their blocks. */
+static int has_reflinks(const char *dir) {
+    char src_path[512], dst_path[512];
+    uint8_t block[4096] = { 0 };
+
+    snprintf(src_path, sizeof(src_path), "%s/tests_write_probe", dir);
+    snprintf(dst_path, sizeof(dst_path), "%s/tests_write_probe.clone", dir);
+    int src = open(src_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int dst = open(dst_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    int ok = src != -1 && dst != -1 && write(src, block, sizeof(block)) == sizeof(block) && fsync(src) == 0
+             && ioctl(dst, FICLONE, src) == 0;
+    if (src != -1) close(src);
+    if (dst != -1) close(dst);
+    unlink(src_path);
+    unlink(dst_path);
+    return ok;
+}
+
+/* Returns 1 if the first block of `fd` is shared with another file. Unaligned tails are copied. */
+static int first_block_shared(int fd) {
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extents[1];
+    } f = { .map = { .fm_length = 1, .fm_flags = FIEMAP_FLAG_SYNC, .fm_extent_count = 1 } };
+
+    if (ioctl(fd, FS_IOC_FIEMAP, &f.map) < 0 || f.map.fm_mapped_extents == 0) return 0;
+    return (f.extents[0].fe_flags & FIEMAP_EXTENT_SHARED) != 0;
+}
+
+/* Copies members out of the aligned archive, at aligned and unaligned positions. */
+static void check_copies(const char *archive, const char *dir, int reflinks) {
+    char path[512];
+    int fd = open(archive, O_RDONLY);
+    tar_handle_t *h = tar_open(fd, NULL);
+    size_t large = 4, blocks = 3;
+
+    snprintf(path, sizeof(path), "%s/copy", dir);
+    int out = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(tar_copy_to_fd(h, "dir/blocks", 0, SIZE_MAX, out) == 3 * 4096);
+    CHECK(same_data(out, 0, blocks, 0, 3 * 4096));
+    CHECK(first_block_shared(out) == reflinks);
+
+    // A head and a tail around the blocks that line up.
+    CHECK(ftruncate(out, 0) == 0 && lseek(out, 100, SEEK_SET) == 100);
+    CHECK(tar_copy_to_fd(h, "dir/large", 100, 900000, out) == 900000);
+    CHECK(same_data(out, 100, large, 100, 900000));
+    CHECK(lseek(out, 0, SEEK_CUR) == 900100);
+
+    // Positions that never line up are copied.
+    CHECK(ftruncate(out, 0) == 0 && lseek(out, 7, SEEK_SET) == 7);
+    CHECK(tar_copy_to_fd(h, "dir/large", 0, SIZE_MAX, out) == 1000 * 1000);
+    CHECK(same_data(out, 7, large, 0, 1000 * 1000));
+    close(out);
+    unlink(path);
+
+    snprintf(path, sizeof(path), "%s/extracted", dir);
+    CHECK(tar_extract(h, path, NULL) == 0);
+    snprintf(path, sizeof(path), "%s/extracted/dir/large", dir);
+    out = open(path, O_RDONLY);
+    CHECK(same_data(out, 0, large, 0, 1000 * 1000));
+    CHECK(first_block_shared(out) == reflinks);
+    close(out);
+
+    snprintf(path, sizeof(path), "rm -rf %s/extracted", dir);
+    system(path);
+    tar_close(h);
+    close(fd);
+}
+
+/* Extracts `archive` under `dir` and compares every member with what landed on disk. */
+static void check_extract(const char *archive, const char *dir) {
+    char path[512], target[512];
+    int fd = open(archive, O_RDONLY);
+    tar_handle_t *h = tar_open(fd, NULL);
+    struct stat st, large;
+
+    snprintf(path, sizeof(path), "%s/extracted", dir);
+    tar_extract_options_t opts = { .threads = 2 };
+    CHECK(tar_extract(h, path, &opts) == 0);
+    tar_close(h);
+    close(fd);
+
+    snprintf(path, sizeof(path), "%s/extracted/dir/large", dir);
+    CHECK(lstat(path, &large) == 0);
+    for (size_t m = 0; m < NMEMBERS; m++) {
+        snprintf(path, sizeof(path), "%s/extracted/%s", dir, members[m].path);
+        CHECK(lstat(path, &st) == 0);
+        switch (members[m].typeflag) {
+        case DIRTYPE:
+            CHECK(S_ISDIR(st.st_mode) && st.st_mtime == MTIME(m));
+            break;
+        case REGTYPE:
+            CHECK(S_ISREG(st.st_mode) && (uint64_t) st.st_size == members[m].size);
+            CHECK((st.st_mode & 07777) == 0644 && st.st_mtime == MTIME(m));
+            int out = open(path, O_RDONLY);
+            CHECK(same_data(out, 0, m, 0, members[m].size));
+            close(out);
+            break;
+        case SYMTYPE:
+            CHECK(S_ISLNK(st.st_mode) && st.st_mtime == MTIME(m));
+            ssize_t n = readlink(path, target, sizeof(target));
+            CHECK(n == (ssize_t) strlen(members[m].data) && memcmp(target, members[m].data, n) == 0);
+            break;
+        case LNKTYPE:
+            CHECK(st.st_ino == large.st_ino && st.st_nlink == 2);
+            break;
+        }
+    }
+    // Nothing else: the members, and the directory implied by the long path.
+    snprintf(path, sizeof(path), "find %s/extracted -mindepth 1 | wc -l", dir);
+    FILE *out = popen(path, "r");
+    size_t lines = 0;
+    CHECK(out && fscanf(out, "%zu", &lines) == 1 && lines == NMEMBERS + 1);
+    if (out) pclose(out);
+    snprintf(path, sizeof(path), "rm -rf %s/extracted", dir);
+    system(path);
+
+    // A duplicate path, a FIFO, setuid and setgid members, and a device, which is reported and not created.
+    snprintf(path, sizeof(path), "%s/tests_write_types.tar", dir);
+    static const test_member_t types[] = {
+        { "dup", REGTYPE, "first version" },
+        { "fifo", FIFOTYPE, NULL, MTIME(0), 0, 0640 },
+        { "dev", CHRTYPE, NULL, 0, 0, 0600 },
+        { "dup", REGTYPE, "first version, then the second" },
+        { "setuid", REGTYPE, "first", 0, 0, 04755 },
+        { "setgid/", DIRTYPE, NULL, 0, 0, 02775 },
+    };
+    CHECK(test_write_archive(path, 0, types, sizeof(types) / sizeof(types[0]), NULL) == 0);
+    fd = open(path, O_RDONLY);
+
+    h = tar_open(fd, NULL);
+    snprintf(target, sizeof(target), "%s/extracted", dir);
+    CHECK(tar_extract(h, target, NULL) == 1);
+    snprintf(path, sizeof(path), "%s/extracted/setuid", dir);
+    CHECK(lstat(path, &st) == 0 && (st.st_mode & 07777) == 0755);
+    snprintf(path, sizeof(path), "%s/extracted/setgid", dir);
+    CHECK(lstat(path, &st) == 0 && (st.st_mode & 07777) == 0775);
+    // Unless asked to keep them.
+    tar_extract_options_t keep = { .flags = TAR_EXTRACT_KEEP_SETID };
+    CHECK(tar_extract(h, target, &keep) == 1);
+    snprintf(path, sizeof(path), "%s/extracted/setuid", dir);
+    CHECK(lstat(path, &st) == 0 && (st.st_mode & 07777) == 04755);
+    snprintf(path, sizeof(path), "%s/extracted/setgid", dir);
+    CHECK(lstat(path, &st) == 0 && (st.st_mode & 07777) == 02775);
+    tar_close(h);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/tests_write_types.tar", dir);
+    unlink(path);
+
+    // The first member of a path wins, as for lookups.
+    snprintf(path, sizeof(path), "%s/extracted/dup", dir);
+    CHECK(lstat(path, &st) == 0 && st.st_size == 13);
+    snprintf(path, sizeof(path), "%s/extracted/fifo", dir);
+    CHECK(lstat(path, &st) == 0 && S_ISFIFO(st.st_mode) && (st.st_mode & 07777) == 0640 && st.st_mtime == MTIME(0));
+    snprintf(path, sizeof(path), "%s/extracted/dev", dir);
+    CHECK(lstat(path, &st) == -1 && errno == ENOENT);
+    snprintf(path, sizeof(path), "rm -rf %s/extracted", dir);
+    system(path);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = argc > 1 ? argv[1] : ".";
+    char plain[512], aligned[512];
+
+    snprintf(plain, sizeof(plain), "%s/tests_write.tar", dir);
+    snprintf(aligned, sizeof(aligned), "%s/tests_write_aligned.tar", dir);
+    CHECK(write_archive(plain, 0) == 0);
+    CHECK(write_archive(aligned, TAR_WRITE_ALIGN) == 0);
+    check_archive_contents(plain, 0, 0);
+    check_archive_contents(aligned, 1, 0);
+    check_archive_contents(aligned, 1, TAR_OPEN_LAZY_INDEX);
+    check_archive_contents(aligned, 1, TAR_OPEN_BACKGROUND_INDEX);
+    check_fd_api(aligned);
+
+    check_extract(plain, dir);
+
+    // Copies share blocks where the file system allows it, and only there.
+    int reflinks = has_reflinks(dir);
+    if (!reflinks) printf("%s: no reflinks, copies must not share blocks\n", dir);
+    check_copies(aligned, dir, reflinks);
+    unlink(plain);
+    unlink(aligned);
+
+    printf("%d failures\n", failures);
+    return failures != 0;
+}